@@ -8,9 +8,22 @@
 #define VERSION_PATCH	41
 #define LOGFILE			"quantica.log"
 
-#define CACHE_SLOTS	23
-#define DBCACHE_SLOTS	25
-#define DBCACHE_DENSITY	75
+#define BUFPOOL_SIZE	1024 // Frames in buffer pool
+#define HEAP_BIN_FIT	2 // Larger size classes tried before the heap grows
+#define REBUILD_FILL	90 // Percentage of table slots used on vacuum
+#define WAL_CHECKPOINT_SIZE	16777216 // Log size before changes are written in place
+#define MEMTABLE_SIZE	0 // Keys buffered before merge into the tree, 0 disables
+#define COMPRESS_THRESHOLD	0 // Minimum data block size to compress, 0 disables
+#define VALUE_INLINE_SIZE	0 // Largest data kept in shared value pages, 0 disables
+#define OBJECT_CHUNK_SIZE	262144 // Largest chunk of a large object, at most a quarter page
+#define HISTORY_MAX_VERSIONS	256 // Versions kept per record, 0 keeps all
+#define HISTORY_MAX_AGE	0 // Seconds a replaced version is kept, 0 keeps all
+#define COMPACT_INTERVAL	0 // Seconds between background compaction runs, 0 disables
+#define COMPACT_THRESHOLD	25 // Percentage of a page free before it is compacted
+#define COMPACT_BUDGET	1048576 // Bytes moved per compaction step
+#define COMPACT_DELAY	50 // Milliseconds between compaction steps
+#define SNAPSHOT_SCAN_BATCH	256 // Keys read per lock hold when scanning a snapshot
+#define BACKUP_CHUNK_SIZE	1048576 // Archive bytes read per lock hold during a backup
 
 #ifdef DEBUG
 #define DEFAULT_PAGE_SIZE	2 // 16 Kb
@@ -18,7 +31,19 @@
 #define DEFAULT_PAGE_SIZE	10 // 4 Mb
 #endif
 
+#define PAGER_MMAP	1 // Map pages into memory
+#define PAGE_CRC_BLOCK	65536 // Bytes per page checksum block
+
 #define API_PORT	4017
+#define API_WORKERS	4 // Request worker threads
+#define API_KEEPALIVE_TIMEOUT	5 // Idle seconds before connection is closed
+#define API_KEEPALIVE_MAX	1000 // Requests per connection
+#define API_STREAM_SIZE	65536 // Response body size from which a record is streamed
+#define API_ARENA_SIZE	65536 // Initial request arena per worker
+#define API_KEYS_PAGE	100 // Default keys per page
+#define API_KEYS_PAGE_MAX	1000 // Maximum keys per page
+#define API_MGET_MAX	1000 // Maximum keys per multi-get
+#define API_UPLOAD_BUFFER	1048576 // Upload bytes buffered per read
 #define LICENSE		"BSD 3-clause"
 
 #endif // CONFIG_H_INCLUDED
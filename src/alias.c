@@ -11,6 +11,7 @@
 #include "jenhash.h"
 #include "quid.h"
 #include "pager.h"
+#include "bufpool.h"
 #include "alias.h"
 
 #define ALIAS_LIST_SIZE	128
@@ -28,39 +29,22 @@ struct _alias_list {
 
 /* Read list structure from offset */
 static struct _alias_list *get_alias_list(base_t *base, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+	return (struct _alias_list *)bufpool_pin(base, offset, sizeof(struct _alias_list));
+}
 
-	struct _alias_list *list = (struct _alias_list *)zcalloc(1, sizeof(struct _alias_list));
-	if (!list) {
-		zfree(list);
-		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-		return NULL;
-	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	if (read(fd, list, sizeof(struct _alias_list)) != sizeof(struct _alias_list)) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	return list;
+/* Pin a zeroed list structure for a newly allocated chunk */
+static struct _alias_list *get_alias_list_new(base_t *base, uint64_t offset) {
+	return (struct _alias_list *)bufpool_pin_new(base, offset, sizeof(struct _alias_list));
 }
 
-static void flush_alias_list(base_t *base, struct _alias_list *list, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+/* Release list structure without changes */
+static void put_alias_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, FALSE);
+}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	if (write(fd, list, sizeof(struct _alias_list)) != sizeof(struct _alias_list)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	zfree(list);
+/* Release list structure and schedule it for write back */
+static void flush_alias_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, TRUE);
 }
 
 int alias_add(base_t *base, const quid_t *c_quid, const char *c_name, size_t len) {
@@ -86,29 +70,24 @@ int alias_add(base_t *base, const quid_t *c_quid, const char *c_name, size_t len
 
 		/* Check if we need to add a new table*/
 		if (from_be16(list->size) >= ALIAS_LIST_SIZE) {
-			flush_alias_list(base, list, base->offset.alias);
+			flush_alias_list(base, base->offset.alias);
 
-			struct _alias_list *new_list = (struct _alias_list *)zcalloc(1, sizeof(struct _alias_list));
-			if (!new_list) {
-				zfree(new_list);
-				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+			uint64_t new_list_offset = zpalloc(base, sizeof(struct _alias_list));
+			struct _alias_list *new_list = get_alias_list_new(base, new_list_offset);
+			if (!new_list)
 				return -1;
-			}
 
 			new_list->link = to_be64(base->offset.alias);
-			uint64_t new_list_offset = zpalloc(base, sizeof(struct _alias_list));
-			flush_alias_list(base, new_list, new_list_offset);
+			flush_alias_list(base, new_list_offset);
 			base->offset.alias = new_list_offset;
 		} else {
-			flush_alias_list(base, list, base->offset.alias);
+			flush_alias_list(base, base->offset.alias);
 		}
 	} else {
-		struct _alias_list *new_list = (struct _alias_list *)zcalloc(1, sizeof(struct _alias_list));
-		if (!new_list) {
-			zfree(new_list);
-			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		uint64_t new_list_offset = zpalloc(base, sizeof(struct _alias_list));
+		struct _alias_list *new_list = get_alias_list_new(base, new_list_offset);
+		if (!new_list)
 			return -1;
-		}
 
 		new_list->size = to_be16(1);
 		memcpy(&new_list->items[0].quid, c_quid, sizeof(quid_t));
@@ -116,8 +95,7 @@ int alias_add(base_t *base, const quid_t *c_quid, const char *c_name, size_t len
 		new_list->items[0].len = to_be32(len);
 		new_list->items[0].hash = to_be32(hash);
 
-		uint64_t new_list_offset = zpalloc(base, sizeof(struct _alias_list));
-		flush_alias_list(base, new_list, new_list_offset);
+		flush_alias_list(base, new_list_offset);
 
 		base->offset.alias = new_list_offset;
 		base->stats.alias_size = 1;
@@ -134,7 +112,7 @@ int alias_add(base_t *base, const quid_t *c_quid, const char *c_name, size_t len
 char *alias_get_val(base_t *base, const quid_t *c_quid) {
 	uint64_t offset = base->offset.alias;
 	while (offset) {
-		struct _alias_list *list = get_alias_list(base, offset);
+		const struct _alias_list *list = get_alias_list(base, offset);
 		zassert(from_be16(list->size) <= ALIAS_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -147,12 +125,13 @@ char *alias_get_val(base_t *base, const quid_t *c_quid) {
 				char *name = (char *)zmalloc(len + 1);
 				name[len] = '\0';
 				memcpy(name, list->items[i].name, len);
-				zfree(list);
+				put_alias_list(base, offset);
 				return name;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("2836444cd009", "Alias not found");
@@ -163,7 +142,7 @@ int alias_get_key(base_t *base, quid_t *key, const char *name, size_t len) {
 	unsigned int hash = jen_hash((unsigned char *)name, len);
 	uint64_t offset = base->offset.alias;
 	while (offset) {
-		struct _alias_list *list = get_alias_list(base, offset);
+		const struct _alias_list *list = get_alias_list(base, offset);
 		zassert(from_be16(list->size) <= ALIAS_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -172,12 +151,13 @@ int alias_get_key(base_t *base, quid_t *key, const char *name, size_t len) {
 
 			if (from_be32(list->items[i].hash) == hash) {
 				memcpy(key, &list->items[i].quid, sizeof(quid_t));
-				zfree(list);
+				put_alias_list(base, offset);
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("2836444cd009", "Alias not found");
@@ -200,12 +180,13 @@ int alias_update(base_t *base, const quid_t *c_quid, const char *name, size_t le
 				memcpy(&list->items[i].name, name, len);
 				list->items[i].len = to_be32(len);
 				list->items[i].hash = to_be32(hash);
-				flush_alias_list(base, list, offset);
+				flush_alias_list(base, offset);
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("2836444cd009", "Alias not found");
@@ -226,13 +207,14 @@ int alias_delete(base_t *base, const quid_t *c_quid) {
 			if (cmp == 0) {
 				memset(&list->items[i].quid, 0, sizeof(quid_t));
 				list->items[i].len = 0;
-				flush_alias_list(base, list, offset);
+				flush_alias_list(base, offset);
 				base->stats.alias_size--;
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("2836444cd009", "Alias not found");
@@ -263,18 +245,17 @@ marshall_t *alias_all(base_t *base) {
 			if (list->items[i].name[0] == '_')
 				continue;
 
-			list->items[i].name[len] = '\0';
-
 			marshall->child[marshall->size] = tree_zcalloc(1, sizeof(marshall_t), marshall);
 			marshall->child[marshall->size]->type = MTYPE_QUID;
 			marshall->child[marshall->size]->name = tree_zstrdup(squid, marshall);
 			marshall->child[marshall->size]->name_len = QUID_LENGTH;
-			marshall->child[marshall->size]->data = tree_zstrdup(list->items[i].name, marshall);
+			marshall->child[marshall->size]->data = tree_zstrndup(list->items[i].name, len, marshall);
 			marshall->child[marshall->size]->data_len = len;
 			marshall->size++;
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 
 	return marshall;
@@ -283,7 +264,7 @@ marshall_t *alias_all(base_t *base) {
 void alias_rebuild(base_t *base, base_t *new_base) {
 	uint64_t offset = base->offset.alias;
 	while (offset) {
-		struct _alias_list *list = get_alias_list(base, base->offset.alias);
+		const struct _alias_list *list = get_alias_list(base, offset);
 		zassert(from_be16(list->size) <= ALIAS_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -294,11 +275,10 @@ void alias_rebuild(base_t *base, base_t *new_base) {
 			if (list->items[i].name[0] == '_')
 				continue;
 
-			list->items[i].name[len] = '\0';
-
 			alias_add(new_base, &list->items[i].quid, list->items[i].name, len);
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		uint64_t link = list->link ? from_be64(list->link) : 0;
+		put_alias_list(base, offset);
+		offset = link;
 	}
 }
@@ -3,6 +3,7 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
@@ -22,6 +23,7 @@ typedef struct {
 static arc4_stream_t rs;
 static int rs_initialized;
 static int rs_stired;
+static pthread_mutex_t rs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static inline uint8_t arc4_getbyte(arc4_stream_t *);
 static void arc4_stir(arc4_stream_t *);
@@ -112,22 +114,28 @@ static void arc4_check_stir() {
 }
 
 void arc4random_stir() {
+	pthread_mutex_lock(&rs_lock);
 	arc4_check_init();
 	arc4_stir(&rs);
+	pthread_mutex_unlock(&rs_lock);
 }
 
 void arc4random_addrandom(uint8_t *dat, int datlen) {
+	pthread_mutex_lock(&rs_lock);
 	arc4_check_init();
 	arc4_check_stir();
 	arc4_addrandom(&rs, dat, datlen);
+	pthread_mutex_unlock(&rs_lock);
 }
 
 uint32_t arc4random() {
 	uint32_t rnd;
 
+	pthread_mutex_lock(&rs_lock);
 	arc4_check_init();
 	arc4_check_stir();
 	rnd = arc4_getword(&rs);
+	pthread_mutex_unlock(&rs_lock);
 
 	return rnd;
 }
@@ -135,9 +143,11 @@ uint32_t arc4random() {
 uint32_t arc4random_uniform(uint32_t range) {
 	uint32_t rnd;
 
+	pthread_mutex_lock(&rs_lock);
 	arc4_check_init();
 	arc4_check_stir();
 	rnd = arc4_getword(&rs);
+	pthread_mutex_unlock(&rs_lock);
 	rnd %= range;
 
 	return rnd;
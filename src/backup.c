@@ -0,0 +1,189 @@
+#include <stdver.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <config.h>
+#include <common.h>
+#include <log.h>
+#include <error.h>
+#include "zmalloc.h"
+#include "crc64.h"
+#include "pager.h"
+#include "wal.h"
+#include "backup.h"
+
+/*
+ * Select the file of the next entry. Pages are taken as long as new ones
+ * show up, once all are copied the backup must be sealed before the base
+ * control and the log follow.
+ */
+static bool next_entry(base_t *base, backup_t *backup) {
+	backup->offset = 0;
+	backup->crc_sum = 0;
+	backup->fd = -1;
+
+	switch (backup->type) {
+		case BACKUP_PAGE: {
+			unsigned int count = backup->sealed ? backup->page_count : base->core->count;
+			if (backup->page < count) {
+				page_t *page = base->core->pages[backup->page++];
+				quid_shorttostr(backup->name, &page->page_key);
+				backup->fd = page->fd;
+				backup->size = file_size(page->fd);
+				return TRUE;
+			}
+
+			if (!backup->sealed) {
+				backup->state = BACKUP_STATE_SEAL;
+				return FALSE;
+			}
+
+			backup->type = BACKUP_BASE;
+			strlcpy(backup->name, BASECONTROL, BACKUP_NAME_LENGTH);
+			backup->size = backup->control_len;
+			return TRUE;
+		}
+		case BACKUP_BASE:
+			backup->type = BACKUP_LOG;
+			strlcpy(backup->name, WALFILE, BACKUP_NAME_LENGTH);
+			backup->fd = base->wal->fd;
+			backup->size = backup->log_size;
+			return TRUE;
+		case BACKUP_LOG:
+			backup->type = BACKUP_END;
+			nullify(backup->name, BACKUP_NAME_LENGTH);
+			backup->size = 0;
+			return TRUE;
+		default:
+			backup->state = BACKUP_STATE_DONE;
+			return FALSE;
+	}
+}
+
+backup_t *backup_begin(base_t *base) {
+	backup_t *backup = (backup_t *)zcalloc(1, sizeof(backup_t));
+	if (!backup) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	backup->state = BACKUP_STATE_HEAD;
+	backup->type = BACKUP_PAGE;
+	backup->fd = -1;
+	wal_backup_begin(base);
+	return backup;
+}
+
+void *backup_read(base_t *base, backup_t *backup, size_t *len) {
+	*len = 0;
+	if (backup->state == BACKUP_STATE_SEAL || backup->state == BACKUP_STATE_DONE)
+		return NULL;
+
+	char *buffer = (char *)zmalloc(BACKUP_CHUNK_SIZE);
+	if (!buffer) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	size_t pos = 0;
+	while (pos < BACKUP_CHUNK_SIZE) {
+		size_t space = BACKUP_CHUNK_SIZE - pos;
+		if (backup->state == BACKUP_STATE_HEAD) {
+			struct _backup head;
+			nullify(&head, sizeof(struct _backup));
+			strlcpy((char *)head.magic, BACKUP_MAGIC, MAGIC_LENGTH);
+			head.version = to_be16(BACKUP_VERSION);
+
+			memcpy(buffer + pos, &head, sizeof(struct _backup));
+			pos += sizeof(struct _backup);
+			backup->state = BACKUP_STATE_ENTRY;
+		} else if (backup->state == BACKUP_STATE_ENTRY) {
+			if (space < sizeof(struct _backup_entry))
+				break;
+			if (!next_entry(base, backup))
+				break;
+
+			struct _backup_entry entry;
+			nullify(&entry, sizeof(struct _backup_entry));
+			entry.type = backup->type;
+			entry.size = to_be64(backup->size);
+			memcpy(entry.name, backup->name, BACKUP_NAME_LENGTH);
+
+			memcpy(buffer + pos, &entry, sizeof(struct _backup_entry));
+			pos += sizeof(struct _backup_entry);
+			backup->state = BACKUP_STATE_DATA;
+		} else if (backup->state == BACKUP_STATE_DATA) {
+			size_t count = backup->size - backup->offset;
+			if (count > space)
+				count = space;
+
+			if (!count) {
+				/* Empty entry */
+			} else if (backup->fd < 0) {
+				memcpy(buffer + pos, backup->control + backup->offset, count);
+			} else if (pread(backup->fd, buffer + pos, count, backup->offset) != (ssize_t)count) {
+				zfree(buffer);
+				error_throw_fatal("a7df40ba3075", "Failed to read disk");
+				return NULL;
+			}
+
+			backup->crc_sum = crc64(backup->crc_sum, buffer + pos, count);
+			backup->offset += count;
+			pos += count;
+			if (backup->offset == backup->size)
+				backup->state = BACKUP_STATE_CRC;
+		} else if (backup->state == BACKUP_STATE_CRC) {
+			if (space < sizeof(__be64))
+				break;
+
+			__be64 crc_sum = to_be64(backup->crc_sum);
+			memcpy(buffer + pos, &crc_sum, sizeof(__be64));
+			pos += sizeof(__be64);
+			backup->state = BACKUP_STATE_ENTRY;
+		} else {
+			break;
+		}
+	}
+
+	if (!pos) {
+		zfree(buffer);
+		return NULL;
+	}
+
+	*len = pos;
+	return buffer;
+}
+
+void backup_seal(base_t *base, backup_t *backup) {
+	if (backup->state != BACKUP_STATE_SEAL)
+		return;
+
+	/* Everything up to here is in the log */
+	backup->log_size = wal_backup_sync(base);
+	backup->page_count = base->core->count;
+
+	/* Page list is written in place */
+	backup->control_len = file_size(base->fd);
+	backup->control = (char *)zmalloc(backup->control_len);
+	if (!backup->control) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	if (pread(base->fd, backup->control, backup->control_len, 0) != (ssize_t)backup->control_len) {
+		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+		return;
+	}
+
+	backup->sealed = TRUE;
+	backup->state = BACKUP_STATE_ENTRY;
+}
+
+void backup_end(base_t *base, backup_t *backup) {
+	if (!backup)
+		return;
+
+	wal_backup_end(base);
+	zfree(backup->control);
+	zfree(backup);
+}
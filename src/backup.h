@@ -0,0 +1,93 @@
+#ifndef BACKUP_H_INCLUDED
+#define BACKUP_H_INCLUDED
+
+#include <config.h>
+#include <common.h>
+#include "endian.h"
+#include "quid.h"
+#include "base.h"
+
+#define BACKUP_MAGIC		"$QBACKUP$"
+#define BACKUP_VERSION		1
+#define BACKUP_NAME_LENGTH	(SHORT_QUID_LENGTH + 1)
+
+typedef struct base base_t;
+
+/*
+ * The archive is a header followed by one entry per file and a closing
+ * entry. The data of each entry is followed by the CRC64 of the data.
+ */
+enum backup_type {
+	BACKUP_PAGE = 1,
+	BACKUP_BASE,
+	BACKUP_LOG,
+	BACKUP_END
+};
+
+struct _backup {
+	__be8 magic[MAGIC_LENGTH];
+	__be16 version;
+} __attribute__((packed));
+
+struct _backup_entry {
+	__be8 type;
+	char name[BACKUP_NAME_LENGTH];
+	__be64 size;
+} __attribute__((packed));
+
+enum backup_state {
+	BACKUP_STATE_HEAD,
+	BACKUP_STATE_ENTRY,			/* Next entry header */
+	BACKUP_STATE_DATA,
+	BACKUP_STATE_CRC,
+	BACKUP_STATE_SEAL,			/* Waiting for backup_seal() */
+	BACKUP_STATE_DONE
+};
+
+/*
+ * Backup in progress. Pages are copied while the database changes, the
+ * log kept since backup_begin() is appended last and brings the copy to
+ * the state at backup_seal() on restore.
+ */
+typedef struct backup {
+	enum backup_state state;
+	enum backup_type type;		/* Type of the current entry */
+	unsigned int page;			/* Next page to copy */
+	unsigned int page_count;	/* Pages to copy, known once sealed */
+	bool sealed;
+	int fd;						/* File of the current entry */
+	char name[BACKUP_NAME_LENGTH];
+	uint64_t offset;
+	uint64_t size;
+	uint64_t crc_sum;
+	char *control;				/* Copy of the base control taken on seal */
+	size_t control_len;
+	uint64_t log_size;			/* Log covering all changes up to the seal */
+} backup_t;
+
+/*
+ * Start a backup, the log is kept from here on. Caller holds the engine
+ * exclusively.
+ */
+backup_t *backup_begin(base_t *base);
+
+/*
+ * Return the next part of the archive, at most BACKUP_CHUNK_SIZE bytes.
+ * Returns NULL once the archive is complete, or when the state changes
+ * to BACKUP_STATE_SEAL and backup_seal() must be called first. Caller
+ * holds the engine shared.
+ */
+void *backup_read(base_t *base, backup_t *backup, size_t *len);
+
+/*
+ * Fix the point in time the archive restores to. Caller holds the engine
+ * exclusively.
+ */
+void backup_seal(base_t *base, backup_t *backup);
+
+/*
+ * Release the backup and the log it holds on to.
+ */
+void backup_end(base_t *base, backup_t *backup);
+
+#endif // BACKUP_H_INCLUDED
@@ -13,7 +13,6 @@
 #include "pager.h"
 #include "base.h"
 
-#define BASECONTROL		"base"
 #define BASECONTROLTMP	"~" BASECONTROL
 #define INSTANCE_RANDOM	5
 #define BASE_MAGIC		"$EOBCTRL$"
@@ -189,30 +188,59 @@ write_page:
 	}
 }
 
+void base_pack(const base_t *base, struct _base *super) {
+	nullify(super, sizeof(struct _base));
+
+	super->instance_key = base->instance_key;
+	super->lock = base->lock;
+	super->version = to_be16(VERSION_MAJOR);
+	super->exitstatus = exit_status;
+	super->page_list_count = to_be16(base->page_list_count);
+	super->pager.size = base->pager.size;
+	super->pager.sequence = to_be32(base->pager.sequence);
+	super->pager.offset = to_be64(base->pager.offset);
+	super->offset.alias = to_be64(base->offset.alias);
+	super->offset.history = to_be64(base->offset.history);
+	super->offset.zero = to_be64(base->offset.zero);
+	super->offset.heap = to_be64(base->offset.heap);
+	super->offset.index_list = to_be64(base->offset.index_list);
+	super->stats.zero_size = to_be64(base->stats.zero_size);
+	super->stats.zero_free_size = to_be64(base->stats.zero_free_size);
+	super->stats.heap_free_size = to_be64(base->stats.heap_free_size);
+	super->stats.alias_size = to_be64(base->stats.alias_size);
+	super->stats.index_list_size = to_be64(base->stats.index_list_size);
+	strlcpy((char *)super->instance_name, base->instance_name, INSTANCE_LENGTH);
+	strlcpy((char *)super->magic, BASE_MAGIC, MAGIC_LENGTH);
+}
+
+void base_unpack(base_t *base, const struct _base *super) {
+	base->instance_key = super->instance_key;
+	base->lock = super->lock;
+	base->page_list_count = from_be16(super->page_list_count);
+	base->pager.size = super->pager.size;
+	base->pager.sequence = from_be32(super->pager.sequence);
+	base->pager.offset = from_be64(super->pager.offset);
+	base->offset.alias = from_be64(super->offset.alias);
+	base->offset.history = from_be64(super->offset.history);
+	base->offset.zero = from_be64(super->offset.zero);
+	base->offset.heap = from_be64(super->offset.heap);
+	base->offset.index_list = from_be64(super->offset.index_list);
+	base->stats.zero_size = from_be64(super->stats.zero_size);
+	base->stats.zero_free_size = from_be64(super->stats.zero_free_size);
+	base->stats.heap_free_size = from_be64(super->stats.heap_free_size);
+	base->stats.alias_size = from_be64(super->stats.alias_size);
+	base->stats.index_list_size = from_be64(super->stats.index_list_size);
+	strlcpy(base->instance_name, (char *)super->instance_name, INSTANCE_LENGTH);
+	base->instance_name[INSTANCE_LENGTH - 1] = '\0';
+}
+
 void base_sync(base_t *base) {
+	/* Control is logged on commit */
+	if (base->wal)
+		return;
+
 	struct _base super;
-	nullify(&super, sizeof(struct _base));
-
-	super.instance_key = base->instance_key;
-	super.lock = base->lock;
-	super.version = to_be16(VERSION_MAJOR);
-	super.exitstatus = exit_status;
-	super.page_list_count = to_be16(base->page_list_count);
-	super.pager.size = base->pager.size;
-	super.pager.sequence = to_be32(base->pager.sequence);
-	super.pager.offset = to_be64(base->pager.offset);
-	super.offset.alias = to_be64(base->offset.alias);
-	super.offset.history = to_be64(base->offset.history);
-	super.offset.zero = to_be64(base->offset.zero);
-	super.offset.heap = to_be64(base->offset.heap);
-	super.offset.index_list = to_be64(base->offset.index_list);
-	super.stats.zero_size = to_be64(base->stats.zero_size);
-	super.stats.zero_free_size = to_be64(base->stats.zero_free_size);
-	super.stats.heap_free_size = to_be64(base->stats.heap_free_size);
-	super.stats.alias_size = to_be64(base->stats.alias_size);
-	super.stats.index_list_size = to_be64(base->stats.index_list_size);
-	strlcpy((char *)super.instance_name, base->instance_name, INSTANCE_LENGTH);
-	strlcpy((char *)super.magic, BASE_MAGIC, MAGIC_LENGTH);
+	base_pack(base, &super);
 
 	if (lseek(base->fd, 0, SEEK_SET) < 0) {
 		lprint("[erro] Failed to read " BASECONTROL "\n");
@@ -250,24 +278,8 @@ void base_init(base_t *base, engine_t *engine) {
 			return;
 		}
 
-		base->instance_key = super.instance_key;
-		base->lock = super.lock;
-		base->page_list_count = from_be16(super.page_list_count);
-		base->pager.size = super.pager.size;
-		base->pager.sequence = from_be32(super.pager.sequence);
-		base->pager.offset = from_be64(super.pager.offset);
-		base->offset.alias = from_be64(super.offset.alias);
-		base->offset.history = from_be64(super.offset.history);
-		base->offset.zero = from_be64(super.offset.zero);
-		base->offset.heap = from_be64(super.offset.heap);
-		base->offset.index_list = from_be64(super.offset.index_list);
-		base->stats.zero_size = from_be64(super.stats.zero_size);
-		base->stats.zero_free_size = from_be64(super.stats.zero_free_size);
-		base->stats.heap_free_size = from_be64(super.stats.heap_free_size);
-		base->stats.alias_size = from_be64(super.stats.alias_size);
-		base->stats.index_list_size = from_be64(super.stats.index_list_size);
 		super.instance_name[INSTANCE_LENGTH - 1] = '\0';
-		strlcpy(base->instance_name, (char *)super.instance_name, INSTANCE_LENGTH);
+		base_unpack(base, &super);
 
 		zassert(from_be16(super.version) == VERSION_MAJOR);
 		zassert(!strcmp((char *)super.magic, BASE_MAGIC));
@@ -11,6 +11,7 @@
 #define INSTANCE_LENGTH	32
 #define PAGE_LIST_SIZE	10
 #define MAGIC_LENGTH	10
+#define BASECONTROL		"base"
 
 #define BASE_PAGE_SIZE		4096 // 4 kb
 #define MIN_PAGE_SIZE		0
@@ -36,12 +37,16 @@ struct _page_list {
 
 typedef struct engine engine_t;
 typedef struct pager pager_t;
+typedef struct bufpool bufpool_t;
+typedef struct wal wal_t;
 
 typedef struct base {
 	char instance_name[INSTANCE_LENGTH];
 	quid_t instance_key;
 	pager_t *core;		/* Pager */
 	engine_t *engine;	/* Core engine */
+	bufpool_t *pool;	/* Buffer pool */
+	wal_t *wal;			/* Write-ahead log */
 	bool lock;
 	unsigned short version;
 	int fd;
@@ -102,6 +107,8 @@ void base_list_set_crc_sum(base_t *base, quid_short_t *key, unsigned long long s
 void base_list_add(base_t *base, quid_short_t *key);
 void base_list_delete(base_t *base, quid_short_t *key);
 
+void base_pack(const base_t *base, struct _base *super);
+void base_unpack(base_t *base, const struct _base *super);
 void base_sync(base_t *base);
 void base_lock(base_t *base);
 void base_init(base_t *base, engine_t *engine);
@@ -121,6 +121,9 @@ void bootstrap(base_t *base) {
 	if (register_error(base, E_FATAL, "ef4b4df470a1", "Storage damaged beyond autorecovery") < 0)
 		lprint("[erro] bootstrap: Insert error failed\n");
 
+	if (register_error(base, E_FATAL, "6e2b0a4e7da1", "Buffer pool exhausted") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
 	if (register_error(base, E_FATAL, "5e6f0673908d", "Core not initialized") < 0)
 		lprint("[erro] bootstrap: Insert error failed\n");
 
@@ -190,6 +193,39 @@ void bootstrap(base_t *base) {
 	if (register_error(base, E_WARN, "6b4f4d9c00fc", "Cannot separate structures") < 0)
 		lprint("[erro] bootstrap: Insert error failed\n");
 
+	if (register_error(base, E_WARN, "9c3e5bd0a427", "Batch expects an array of records") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "3b1f8a9c2d64", "Vacuum required for time range") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "bc6e0b2f1efd", "Invalid timestamp") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "5d2a7e61c0b8", "Mget expects an array of keys") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "c84e0f3a9b17", "Too many keys in request") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "d3a5e0c71f28", "Data block corrupt") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "0b6f3d92a1e5", "Record too large, store as large object") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "c59e07b2d4a3", "Large object must be streamed") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "7a2e9d04c6b1", "Not a large object") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "41c53d0a8e17", "Large object changed during read") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
+	if (register_error(base, E_WARN, "8c2e51f07a3d", "Snapshot in use") < 0)
+		lprint("[erro] bootstrap: Insert error failed\n");
+
 	/* Clear any failed operations */
 	error_clear();
 }
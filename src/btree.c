@@ -1,3 +1,4 @@
+#include <stdver.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 #include <log.h>
 #include <error.h>
 #include "btree.h"
+#include "bufpool.h"
 #include "vector.h"
 #include "index.h"
 #include "zmalloc.h"
@@ -24,30 +26,24 @@ static void get_node(base_t *base, btree_t *index, uint64_t offset, node_t *pnod
 		return;
 	}
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+	const node_t *node = bufpool_pin(base, offset, sizeof(node_t));
+	if (!node)
 		return;
-	}
-	if (read(fd, pnode, sizeof(node_t)) != sizeof(node_t)) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return;
-	}
+
+	*pnode = *node;
+	bufpool_unpin(base, offset, FALSE);
 }
 
 static void flush_node(base_t *base, btree_t *index, uint64_t offset, node_t *pnode) {
 	if ((long long)offset == index->root)
 		index->rootnode = *pnode;
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+	node_t *node = bufpool_pin_new(base, offset, sizeof(node_t));
+	if (!node)
 		return;
-	}
-	if (write(fd, pnode, sizeof(node_t)) != sizeof(node_t)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
+
+	*node = *pnode;
+	bufpool_unpin(base, offset, TRUE);
 }
 
 static long long alloc_node(base_t *base, btree_t *index) {
@@ -81,16 +77,12 @@ static void storage_read(base_t *base, btree_t *index) {
 	struct _root_super super;
 	nullify(&super, sizeof(struct _root_super));
 
-	uint64_t offset = index->offset;
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+	const struct _root_super *psuper = bufpool_pin(base, index->offset, sizeof(struct _root_super));
+	if (!psuper)
 		return;
-	}
-	if (read(fd, &super, sizeof(struct _root_super)) != sizeof(struct _root_super)) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return;
-	}
+
+	super = *psuper;
+	bufpool_unpin(base, index->offset, FALSE);
 
 	get_node(base, index, from_be64(super.root), &index->rootnode);
 	index->root = from_be64(super.root);
@@ -106,16 +98,13 @@ static void storage_write(base_t *base, btree_t *index) {
 	super.freelist = to_be64(index->freelist);
 	super.unique_keys = index->unique_keys;
 
-	uint64_t offset = index->offset;
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+	/* Root super goes through the pool so it is logged with the nodes */
+	struct _root_super *psuper = bufpool_pin_new(base, index->offset, sizeof(struct _root_super));
+	if (!psuper)
 		return;
-	}
-	if (write(fd, &super, sizeof(struct _root_super)) != sizeof(struct _root_super)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
+
+	*psuper = super;
+	bufpool_unpin(base, index->offset, TRUE);
 
 	/* If present flush root node to disk, this is ignored on index creation */
 	if (index->root != -1) {
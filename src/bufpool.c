@@ -0,0 +1,322 @@
+#include <stdver.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <config.h>
+#include <common.h>
+#include <log.h>
+#include <error.h>
+#include "zmalloc.h"
+#include "pager.h"
+#include "bufpool.h"
+#include "wal.h"
+
+#define BUFPOOL_MIN_SIZE	32
+
+static unsigned int hash_offset(const bufpool_t *pool, uint64_t offset) {
+	return offset % pool->bucket_count;
+}
+
+static int find_frame(const bufpool_t *pool, uint64_t offset) {
+	int i = pool->buckets[hash_offset(pool, offset)];
+	while (i >= 0) {
+		if (pool->frames[i].offset == offset)
+			return i;
+		i = pool->frames[i].next;
+	}
+	return -1;
+}
+
+static void link_frame(bufpool_t *pool, int i) {
+	unsigned int bucket = hash_offset(pool, pool->frames[i].offset);
+	pool->frames[i].next = pool->buckets[bucket];
+	pool->buckets[bucket] = i;
+}
+
+static void unlink_frame(bufpool_t *pool, int i) {
+	int *prev = &pool->buckets[hash_offset(pool, pool->frames[i].offset)];
+	while (*prev >= 0) {
+		if (*prev == i) {
+			*prev = pool->frames[i].next;
+			break;
+		}
+		prev = &pool->frames[*prev].next;
+	}
+	pool->frames[i].next = -1;
+}
+
+static void read_frame(const base_t *base, struct bufpool_frame *frame) {
+	uint64_t offset = frame->offset;
+
+	const void *map = pager_get_map(base, offset, frame->size);
+	if (map) {
+		memcpy(frame->data, map, frame->size);
+		return;
+	}
+
+	int fd = pager_get_fd(base, &offset);
+	if (pread(fd, frame->data, frame->size, offset) != (ssize_t)frame->size) {
+		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+		return;
+	}
+}
+
+static void write_frame(const base_t *base, struct bufpool_frame *frame) {
+	uint64_t offset = frame->offset;
+
+	/* Log must be on disk before the page */
+	if (base->wal && frame->lsn)
+		wal_sync(base->wal, frame->lsn);
+
+	int fd = pager_get_fd(base, &offset);
+	if (pwrite(fd, frame->data, frame->size, offset) != (ssize_t)frame->size) {
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+		return;
+	}
+	pager_dirty(base, frame->offset, frame->size);
+
+	frame->dirty = FALSE;
+	base->pool->stats.writeback++;
+}
+
+/* Make room for more frames when every frame is held by the open group */
+static bool grow_pool(bufpool_t *pool) {
+	unsigned int size = pool->size * 2;
+	struct bufpool_frame *frames = (struct bufpool_frame *)zrealloc(pool->frames, size * sizeof(struct bufpool_frame));
+	if (!frames)
+		return FALSE;
+
+	memset(&frames[pool->size], 0, (size - pool->size) * sizeof(struct bufpool_frame));
+	for (unsigned int i = pool->size; i < size; ++i)
+		frames[i].next = -1;
+
+	lprintf("[warn] Buffer pool grown to %u frames\n", size);
+	pool->frames = frames;
+	pool->size = size;
+	return TRUE;
+}
+
+/*
+ * Find a frame to hold a new structure. Unused frames are handed out first,
+ * after that the clock hand sweeps the pool and evicts the first unpinned
+ * frame without its reference bit set. Frames changed in the open log group
+ * cannot be evicted.
+ */
+static int victim_frame(const base_t *base) {
+	bufpool_t *pool = base->pool;
+	if (pool->used < pool->size)
+		return pool->used++;
+
+	for (unsigned int sweep = 0; sweep < pool->size * 2; ++sweep) {
+		int i = pool->hand;
+		struct bufpool_frame *frame = &pool->frames[i];
+		pool->hand = (pool->hand + 1) % pool->size;
+
+		if (frame->pin || (frame->dirty && !frame->logged))
+			continue;
+
+		if (frame->ref) {
+			frame->ref = FALSE;
+			continue;
+		}
+
+		if (frame->dirty)
+			write_frame(base, frame);
+
+		unlink_frame(pool, i);
+		frame->offset = 0;
+		pool->stats.evict++;
+		return i;
+	}
+
+	if (base->wal && grow_pool(pool))
+		return pool->used++;
+
+	error_throw_fatal("6e2b0a4e7da1", "Buffer pool exhausted");
+	return -1;
+}
+
+static struct bufpool_frame *alloc_frame(const base_t *base, uint64_t offset, size_t size) {
+	bufpool_t *pool = base->pool;
+
+	int i = victim_frame(base);
+	if (i < 0)
+		return NULL;
+
+	struct bufpool_frame *frame = &pool->frames[i];
+	if (frame->size != size) {
+		frame->data = zrealloc(frame->data, size);
+		if (!frame->data) {
+			frame->size = 0;
+			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+			return NULL;
+		}
+		frame->size = size;
+	}
+
+	frame->offset = offset;
+	frame->pin = 1;
+	frame->dirty = FALSE;
+	frame->ref = TRUE;
+	frame->logged = TRUE;
+	frame->lsn = 0;
+	link_frame(pool, i);
+	return frame;
+}
+
+void *bufpool_pin_load(const base_t *base, uint64_t offset, size_t size, bufpool_load_t load) {
+	zassert(offset != 0);
+	bufpool_t *pool = base->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	int i = find_frame(pool, offset);
+	if (i >= 0) {
+		struct bufpool_frame *frame = &pool->frames[i];
+		zassert(frame->size == size);
+
+		frame->pin++;
+		frame->ref = TRUE;
+		pool->stats.hit++;
+		pthread_mutex_unlock(&pool->lock);
+		return frame->data;
+	}
+
+	pool->stats.miss++;
+	struct bufpool_frame *frame = alloc_frame(base, offset, size);
+	if (!frame) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	read_frame(base, frame);
+	if (load)
+		load(base, frame->data, frame->size);
+	pthread_mutex_unlock(&pool->lock);
+	return frame->data;
+}
+
+void *bufpool_pin(const base_t *base, uint64_t offset, size_t size) {
+	return bufpool_pin_load(base, offset, size, NULL);
+}
+
+void *bufpool_pin_new(const base_t *base, uint64_t offset, size_t size) {
+	zassert(offset != 0);
+	bufpool_t *pool = base->pool;
+
+	struct bufpool_frame *frame = NULL;
+	pthread_mutex_lock(&pool->lock);
+	int i = find_frame(pool, offset);
+	if (i >= 0) {
+		frame = &pool->frames[i];
+		zassert(frame->size == size);
+		frame->pin++;
+		frame->ref = TRUE;
+	} else {
+		frame = alloc_frame(base, offset, size);
+		if (!frame) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+
+	memset(frame->data, 0, size);
+	frame->dirty = TRUE;
+	if (base->wal)
+		frame->logged = FALSE;
+	pthread_mutex_unlock(&pool->lock);
+	return frame->data;
+}
+
+void bufpool_unpin(const base_t *base, uint64_t offset, bool dirty) {
+	bufpool_t *pool = base->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	int i = find_frame(pool, offset);
+	zassert(i >= 0);
+	zassert(pool->frames[i].pin > 0);
+
+	pool->frames[i].pin--;
+	if (dirty) {
+		pool->frames[i].dirty = TRUE;
+		if (base->wal)
+			pool->frames[i].logged = FALSE;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void bufpool_log(const base_t *base) {
+	bufpool_t *pool = base->pool;
+	if (!pool || !base->wal)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	for (unsigned int i = 0; i < pool->used; ++i) {
+		struct bufpool_frame *frame = &pool->frames[i];
+		if (!frame->offset || !frame->dirty || frame->logged)
+			continue;
+
+		frame->lsn = wal_log(base->wal, frame->offset, frame->data, frame->size);
+		frame->logged = TRUE;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void bufpool_init(base_t *base, unsigned int size) {
+	if (size < BUFPOOL_MIN_SIZE)
+		size = BUFPOOL_MIN_SIZE;
+
+	base->pool = (bufpool_t *)zcalloc(1, sizeof(bufpool_t));
+	if (!base->pool) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	base->pool->size = size;
+	base->pool->bucket_count = (size * 2) + 1;
+	base->pool->frames = (struct bufpool_frame *)zcalloc(size, sizeof(struct bufpool_frame));
+	base->pool->buckets = (int *)zmalloc(base->pool->bucket_count * sizeof(int));
+	if (!base->pool->frames || !base->pool->buckets) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	for (unsigned int i = 0; i < base->pool->bucket_count; ++i)
+		base->pool->buckets[i] = -1;
+	for (unsigned int i = 0; i < size; ++i)
+		base->pool->frames[i].next = -1;
+
+	pthread_mutex_init(&base->pool->lock, NULL);
+}
+
+/* Write back all dirty frames */
+void bufpool_sync(const base_t *base) {
+	bufpool_t *pool = base->pool;
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	for (unsigned int i = 0; i < pool->used; ++i) {
+		if (pool->frames[i].offset && pool->frames[i].dirty)
+			write_frame(base, &pool->frames[i]);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void bufpool_close(base_t *base) {
+	bufpool_t *pool = base->pool;
+	if (!pool)
+		return;
+
+	bufpool_sync(base);
+	for (unsigned int i = 0; i < pool->used; ++i) {
+		if (pool->frames[i].pin)
+			lprintf("[warn] Buffer frame %u still pinned\n", i);
+		zfree(pool->frames[i].data);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	zfree(pool->buckets);
+	zfree(pool->frames);
+	zfree(pool);
+	base->pool = NULL;
+}
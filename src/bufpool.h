@@ -0,0 +1,74 @@
+#ifndef BUFPOOL_H_INCLUDED
+#define BUFPOOL_H_INCLUDED
+
+#include <pthread.h>
+
+#include <config.h>
+#include <common.h>
+#include "base.h"
+
+typedef struct base base_t;
+
+struct bufpool_frame {
+	uint64_t offset;		/* Global page offset, 0 if unused */
+	size_t size;			/* Structure size */
+	void *data;
+	unsigned int pin;		/* Pin count, frame cannot be evicted */
+	bool dirty;				/* Frame must be written back */
+	bool ref;				/* Reference bit for the clock */
+	bool logged;			/* Contents are in the write-ahead log */
+	uint64_t lsn;			/* Log group holding the contents */
+	int next;				/* Next frame in hash chain */
+};
+
+typedef struct bufpool {
+	unsigned int size;
+	unsigned int used;
+	unsigned int hand;
+	unsigned int bucket_count;
+	int *buckets;
+	struct bufpool_frame *frames;
+	pthread_mutex_t lock;
+	struct {
+		unsigned long long hit;
+		unsigned long long miss;
+		unsigned long long evict;
+		unsigned long long writeback;
+	} stats;
+} bufpool_t;
+
+/*
+ * Pin the structure at offset into the pool, reading it from disk on a
+ * miss. The returned buffer is valid until bufpool_unpin() is called.
+ */
+void *bufpool_pin(const base_t *base, uint64_t offset, size_t size);
+
+/*
+ * Same as bufpool_pin(), 'load' is called on the structure as it is read
+ * from disk so older formats are converted before anyone sees them.
+ */
+typedef void (*bufpool_load_t)(const base_t *base, void *data, size_t size);
+void *bufpool_pin_load(const base_t *base, uint64_t offset, size_t size, bufpool_load_t load);
+
+/*
+ * Pin a zeroed frame for a freshly allocated offset without reading it.
+ * The frame is marked dirty.
+ */
+void *bufpool_pin_new(const base_t *base, uint64_t offset, size_t size);
+
+/*
+ * Release a pinned frame, mark dirty if the buffer was modified.
+ */
+void bufpool_unpin(const base_t *base, uint64_t offset, bool dirty);
+
+/*
+ * Append all changed frames to the write-ahead log. Dirty frames are not
+ * written back before they are logged.
+ */
+void bufpool_log(const base_t *base);
+
+void bufpool_init(base_t *base, unsigned int size);
+void bufpool_sync(const base_t *base);
+void bufpool_close(base_t *base);
+
+#endif // BUFPOOL_H_INCLUDED
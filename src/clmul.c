@@ -0,0 +1,122 @@
+#include <stdver.h>
+#include <stddef.h>
+
+#include <config.h>
+#include <common.h>
+#include "clmul.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLMUL_X86
+#endif
+
+/* Reverse the bits in a 64-bit word */
+static uint64_t rev64(uint64_t a) {
+	a = ((a >> 1) & UINT64_C(0x5555555555555555)) | ((a & UINT64_C(0x5555555555555555)) << 1);
+	a = ((a >> 2) & UINT64_C(0x3333333333333333)) | ((a & UINT64_C(0x3333333333333333)) << 2);
+	a = ((a >> 4) & UINT64_C(0x0f0f0f0f0f0f0f0f)) | ((a & UINT64_C(0x0f0f0f0f0f0f0f0f)) << 4);
+	a = ((a >> 8) & UINT64_C(0x00ff00ff00ff00ff)) | ((a & UINT64_C(0x00ff00ff00ff00ff)) << 8);
+	a = ((a >> 16) & UINT64_C(0x0000ffff0000ffff)) | ((a & UINT64_C(0x0000ffff0000ffff)) << 16);
+	return a >> 32 | a << 32;
+}
+
+/*
+ * Return x^n mod P, reflected into 64 bits. The product of two reflected
+ * words comes out one bit short of the reflected 128 bit result, hence
+ * the callers ask for one power less.
+ */
+static uint64_t xpow_mod(unsigned int n, uint64_t poly, unsigned int width) {
+	uint64_t normal = rev64(poly) >> (64 - width);
+	uint64_t top = UINT64_C(1) << (width - 1);
+	uint64_t mask = top | (top - 1);
+
+	uint64_t v = 1;
+	while (n--) {
+		bool carry = (v & top) != 0;
+		v = (v << 1) & mask;
+		if (carry)
+			v ^= normal;
+	}
+	return rev64(v);
+}
+
+void clmul_fold_init(struct clmul_fold *fold, uint64_t poly, unsigned int width) {
+	fold->lane[0] = xpow_mod(512 + 63, poly, width);
+	fold->lane[1] = xpow_mod(512 - 1, poly, width);
+	fold->block[0] = xpow_mod(128 + 63, poly, width);
+	fold->block[1] = xpow_mod(128 - 1, poly, width);
+}
+
+#ifdef CLMUL_X86
+
+/* Move the block 'k' bits ahead, modulo P */
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold_block(__m128i x, __m128i k) {
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/*
+ * Four lanes of 16 bytes are folded 64 bytes ahead at a time, so the
+ * multiplies of the lanes overlap. The lanes are then folded into one
+ * and the remaining blocks follow one by one.
+ */
+__attribute__((target("pclmul,sse2")))
+static size_t fold_pclmul(const struct clmul_fold *fold, uint64_t crc, const void *buf, size_t len, unsigned char *rest) {
+	const unsigned char *next = (const unsigned char *)buf;
+	const __m128i lane = _mm_loadu_si128((const __m128i *)fold->lane);
+	const __m128i block = _mm_loadu_si128((const __m128i *)fold->block);
+
+	__m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)next), _mm_set_epi64x(0, (long long)crc));
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(next + 16));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(next + 32));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(next + 48));
+	next += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(fold_block(x0, lane), _mm_loadu_si128((const __m128i *)next));
+		x1 = _mm_xor_si128(fold_block(x1, lane), _mm_loadu_si128((const __m128i *)(next + 16)));
+		x2 = _mm_xor_si128(fold_block(x2, lane), _mm_loadu_si128((const __m128i *)(next + 32)));
+		x3 = _mm_xor_si128(fold_block(x3, lane), _mm_loadu_si128((const __m128i *)(next + 48)));
+		next += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(fold_block(x0, block), x1);
+	x0 = _mm_xor_si128(fold_block(x0, block), x2);
+	x0 = _mm_xor_si128(fold_block(x0, block), x3);
+	while (len >= 16) {
+		x0 = _mm_xor_si128(fold_block(x0, block), _mm_loadu_si128((const __m128i *)next));
+		next += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)rest, x0);
+	return next - (const unsigned char *)buf;
+}
+
+#endif // CLMUL_X86
+
+bool clmul_supported(void) {
+#ifdef CLMUL_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+#else
+	return FALSE;
+#endif
+}
+
+size_t clmul_fold(const struct clmul_fold *fold, uint64_t crc, const void *buf, size_t len, unsigned char *rest) {
+	if (len < CLMUL_FOLD_MIN)
+		return 0;
+
+#ifdef CLMUL_X86
+	return fold_pclmul(fold, crc, buf, len, rest);
+#else
+	unused(fold);
+	unused(crc);
+	unused(buf);
+	unused(rest);
+	return 0;
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef CLMUL_H_INCLUDED
+#define CLMUL_H_INCLUDED
+
+#include <config.h>
+#include <common.h>
+
+#define CLMUL_FOLD_MIN		64	/* Smallest input folded */
+#define CLMUL_REST_SIZE		16
+
+/*
+ * Fold constants for one reflected CRC, x^n mod P for the lane distance
+ * of 512 bits and the block distance of 128 bits.
+ */
+struct clmul_fold {
+	uint64_t lane[2];
+	uint64_t block[2];
+};
+
+/*
+ * Check for carry-less multiply support.
+ */
+bool clmul_supported(void);
+
+/*
+ * Derive the fold constants for the reflected polynomial 'poly' of a CRC
+ * 'width' bits wide.
+ */
+void clmul_fold_init(struct clmul_fold *fold, uint64_t poly, unsigned int width);
+
+/*
+ * Fold the 16 byte blocks of 'buf' with the CRC register 'crc' applied
+ * into 'rest'. The CRC of 'rest' with a zero register equals the CRC of
+ * the folded bytes. Returns the number of bytes folded, 0 when 'len' is
+ * below CLMUL_FOLD_MIN. Only call when clmul_supported().
+ */
+size_t clmul_fold(const struct clmul_fold *fold, uint64_t crc, const void *buf, size_t len, unsigned char *rest);
+
+#endif // CLMUL_H_INCLUDED
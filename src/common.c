@@ -129,7 +129,7 @@ size_t file_size(int fd) {
 }
 
 char *get_version_string() {
-	static char buf[16];
+	static _Thread_local char buf[16];
 	snprintf(buf, 16, "%d.%d.%d", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 	return buf;
 }
@@ -1,5 +1,7 @@
+#include <stdver.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
@@ -17,6 +19,9 @@
 #include "time.h"
 #include "base.h"
 #include "pager.h"
+#include "bufpool.h"
+#include "wal.h"
+#include "backup.h"
 #include "btree.h"
 #include "index.h"
 #include "marshall.h"
@@ -37,6 +42,147 @@ static base_t control;
 static bool ready = FALSE;
 static long long uptime;
 static quid_t sessionid;
+static pthread_rwlock_t engine_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void engine_unlock(int *guard) {
+	unused(guard);
+	pthread_rwlock_unlock(&engine_lock);
+}
+
+/*
+ * Close the log group before the lock is released, the wait for the log
+ * to reach the disk is shared with writers queued behind us.
+ */
+static void engine_commit(int *guard) {
+	unused(guard);
+	wal_t *wal = control.wal;
+	uint64_t lsn = wal_commit(&control);
+	pthread_rwlock_unlock(&engine_lock);
+	wal_sync(wal, lsn);
+}
+
+/*
+ * Hold the engine lock for the remainder of the calling function. Readers
+ * share the lock, any operation altering the database runs exclusively.
+ */
+#define read_guard() \
+	int __engine_guard __attribute__((cleanup(engine_unlock))) = pthread_rwlock_rdlock(&engine_lock)
+#define write_guard() \
+	int __engine_guard __attribute__((cleanup(engine_commit))) = pthread_rwlock_wrlock(&engine_lock)
+
+/*
+ * Background compaction. Each step runs under the engine lock, the lock is
+ * handed back between steps so requests continue while pages are emptied.
+ */
+static struct {
+	pthread_t thread;
+	bool run;
+	bool wake;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} compactor = {
+	.run = FALSE,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Sleep for 'ms' milliseconds or until woken, 0 waits for a wakeup only */
+static bool compact_wait(long long ms) {
+	pthread_mutex_lock(&compactor.lock);
+	if (ms) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += ms / 1000;
+		until.tv_nsec += (ms % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		while (compactor.run && !compactor.wake) {
+			if (pthread_cond_timedwait(&compactor.cond, &compactor.lock, &until))
+				break;
+		}
+	} else {
+		while (compactor.run && !compactor.wake)
+			pthread_cond_wait(&compactor.cond, &compactor.lock);
+	}
+	compactor.wake = FALSE;
+	bool run = compactor.run;
+	pthread_mutex_unlock(&compactor.lock);
+	return run;
+}
+
+static int compact_start() {
+	write_guard();
+	if (!ready)
+		return 0;
+
+	engine_compact_release(&control);
+	return engine_compact_start(&control);
+}
+
+static int compact_step() {
+	write_guard();
+	if (!ready)
+		return 0;
+
+	engine_compact_release(&control);
+	return engine_compact_step(&control, COMPACT_BUDGET);
+}
+
+/* Runs after the last step is committed */
+static size_t compact_finish() {
+	write_guard();
+	if (!ready)
+		return 0;
+
+	engine_compact_release(&control);
+	return control.engine->stats.released;
+}
+
+static void *compact_worker(void *arg) {
+	unused(arg);
+
+	while (compact_wait(COMPACT_INTERVAL * 1000LL)) {
+		int pages;
+		while ((pages = compact_start()) > 0) {
+			lprintf("[info] Compacting %d pages\n", pages);
+			unsigned long long released = control.engine->stats.released;
+			int rs;
+			while ((rs = compact_step()) > 0) {
+				if (!compact_wait(COMPACT_DELAY))
+					break;
+			}
+
+			released = compact_finish() - released;
+			lprintf("[info] Compaction released %llu bytes\n", released);
+			if (rs)
+				break;
+		}
+		error_clear();
+	}
+	return NULL;
+}
+
+static void start_compactor() {
+	compactor.run = TRUE;
+	compactor.wake = FALSE;
+	if (pthread_create(&compactor.thread, NULL, compact_worker, NULL) != 0) {
+		lprint("[erro] Failed to start compactor\n");
+		compactor.run = FALSE;
+	}
+}
+
+static void stop_compactor() {
+	pthread_mutex_lock(&compactor.lock);
+	bool run = compactor.run;
+	compactor.run = FALSE;
+	pthread_cond_signal(&compactor.cond);
+	pthread_mutex_unlock(&compactor.lock);
+
+	if (run)
+		pthread_join(compactor.thread, NULL);
+}
 
 void start_core() {
 	/* Start the logger */
@@ -47,23 +193,31 @@ void start_core() {
 	quid_create(&sessionid);
 
 	base_init(&control, &zero);
+	wal_init(&control);
 	pager_init(&control);
 	engine_init(&control);
 
 	/* Bootstrap database if not exist */
 	bootstrap(&control);
+	wal_checkpoint(&control);
 
 	/* Server ready */
 	uptime = get_timestamp();
 	ready = TRUE;
+
+	start_compactor();
 }
 
 void detach_core() {
+	stop_compactor();
+
+	write_guard();
 	if (!ready)
 		return;
 
 	/* Close all databases */
 	engine_close(&control);
+	wal_close(&control);
 	pager_close(&control);
 	base_close(&control);
 
@@ -75,6 +229,7 @@ void detach_core() {
 }
 
 void set_instance_name(char name[]) {
+	write_guard();
 	strtoupper(name);
 	strlcpy(control.instance_name, name, INSTANCE_LENGTH);
 	control.instance_name[INSTANCE_LENGTH - 1] = '\0';
@@ -90,25 +245,27 @@ char *get_instance_name() {
 }
 
 char *get_instance_key() {
-	static char buf[QUID_LENGTH + 1];
+	static _Thread_local char buf[QUID_LENGTH + 1];
 	quidtostr(buf, &control.instance_key);
 	return buf;
 }
 
 char *get_session_key() {
-	static char buf[QUID_LENGTH + 1];
+	static _Thread_local char buf[QUID_LENGTH + 1];
 	quidtostr(buf, &sessionid);
 	return buf;
 }
 
 char *get_pager_alloc_size() {
-	static char buf[10];
+	read_guard();
+	static _Thread_local char buf[10];
 	unsigned long long total_size = (BASE_PAGE_SIZE << control.pager.size) * control.core->count;
 	return unit_bytes(total_size, buf);
 }
 
 char *get_total_disk_size() {
-	static char buf[10];
+	read_guard();
+	static _Thread_local char buf[10];
 	size_t total_size = pager_total_disk_size(&control);
 	total_size += file_size(control.fd);
 	return unit_bytes(total_size, buf);
@@ -119,6 +276,7 @@ unsigned int get_pager_page_size() {
 }
 
 unsigned int get_pager_page_count() {
+	read_guard();
 	return control.core->count;
 }
 
@@ -126,14 +284,14 @@ unsigned int get_pager_page_count() {
  * Create instance key QUID from short QUID
  */
 char *get_instance_prefix_key(char *short_quid) {
-	static char buf[QUID_LENGTH + 1];
+	static _Thread_local char buf[QUID_LENGTH + 1];
 	quidtostr(buf, &control.instance_key);
 	memcpy(buf + 25, short_quid, SHORT_QUID_LENGTH - 2);
 	return buf;
 }
 
 char *get_uptime() {
-	static char buf[32];
+	static _Thread_local char buf[32];
 	long long passed = get_timestamp() - uptime;
 	unsigned int days = passed / 86400;
 	passed = passed % 86400;
@@ -234,25 +392,71 @@ char *auth_token(char *key) {
 }
 
 unsigned long int stat_getkeys() {
+	read_guard();
 	return control.stats.zero_size;
 }
 
 unsigned long int stat_getfreekeys() {
+	read_guard();
 	return control.stats.zero_free_size;
 }
 
 unsigned long int stat_getfreeblocks() {
+	read_guard();
 	return control.stats.heap_free_size;
 }
 
 unsigned long int stat_tablesize() {
+	read_guard();
 	return control.stats.alias_size;
 }
 
 unsigned long int stat_indexsize() {
+	read_guard();
 	return control.stats.index_list_size;
 }
 
+unsigned int stat_bufpool_size() {
+	read_guard();
+	return control.pool->size;
+}
+
+unsigned long long stat_bufpool_hit() {
+	read_guard();
+	return control.pool->stats.hit;
+}
+
+unsigned long long stat_bufpool_miss() {
+	read_guard();
+	return control.pool->stats.miss;
+}
+
+/* Ratio of data written to the bytes stored on the heap */
+double stat_compress_ratio() {
+	read_guard();
+	if (!control.engine->stats.stored_size)
+		return 1.0;
+	return (double)control.engine->stats.data_size / (double)control.engine->stats.stored_size;
+}
+
+unsigned long long stat_compact_released() {
+	read_guard();
+	return control.engine->stats.released;
+}
+
+unsigned long long stat_wal_commits() {
+	read_guard();
+	return control.wal->stats.commits;
+}
+
+unsigned long long stat_wal_syncs() {
+	read_guard();
+	pthread_mutex_lock(&control.wal->lock);
+	unsigned long long syncs = control.wal->stats.syncs;
+	pthread_mutex_unlock(&control.wal->lock);
+	return syncs;
+}
+
 sqlresult_t *exec_sqlquery(const char *query, size_t *len) {
 	return sql_exec(query, len);
 }
@@ -274,21 +478,43 @@ void quid_generate_short(char *quid) {
 }
 
 void filesync() {
+	write_guard();
 	engine_sync(&control);
+	wal_checkpoint(&control);
 	pager_sync(&control);
 	base_sync(&control);
 }
 
+/* Start a compaction run now instead of at the next interval */
+void zcompact() {
+	pthread_mutex_lock(&compactor.lock);
+	compactor.wake = TRUE;
+	pthread_cond_signal(&compactor.cond);
+	pthread_mutex_unlock(&compactor.lock);
+}
+
 int zvacuum(int page_size) {
+	write_guard();
 	base_t new_control;
 	engine_t new_zero;
 
 	if (!ready)
 		return -1;
 
+	/* Backups copy the current files */
+	if (control.wal && control.wal->backups) {
+		error_throw("8c2e51f07a3d", "Snapshot in use");
+		return -1;
+	}
+
 	if (!page_size)
 		page_size = control.pager.size;
 
+	/* Old storage is written directly from here on */
+	wal_t *wal = control.wal;
+	wal_checkpoint(&control);
+	control.wal = NULL;
+
 	/* Copy current database */
 	base_lock(&control);
 	base_copy(&control, &new_control, &new_zero, page_size);
@@ -309,6 +535,9 @@ int zvacuum(int page_size) {
 	memcpy(&control, &new_control, sizeof(base_t));
 	control.engine = &zero;
 
+	/* Log the new storage */
+	control.wal = wal;
+	wal_checkpoint(&control);
 	return 0;
 }
 
@@ -328,6 +557,7 @@ char *key_decode(char *quid) {
 }
 
 int db_put(char *quid, int *items, const void *data, size_t data_len, char *hint, char *hint_option) {
+	write_guard();
 	quid_t key;
 	size_t len = 0;
 	quid_create(&key);
@@ -387,12 +617,91 @@ db_store:;
 	return 0;
 }
 
-void *db_get(char *quid, size_t *len, bool descent, bool force) {
+/*
+ * Store every element of the array in data as a separate record. All keys
+ * are inserted in one pass, the keys are returned in request order.
+ */
+char *db_put_batch(int *items, const void *data, size_t data_len) {
+	write_guard();
+	slay_result_t nrs;
+
+	if (!ready)
+		return NULL;
+
+	marshall_t *dataobj = marshall_convert((char *)data, data_len);
+	if (!dataobj)
+		return NULL;
+
+	if (dataobj->type != MTYPE_ARRAY || !dataobj->size) {
+		error_throw("9c3e5bd0a427", "Batch expects an array of records");
+		marshall_free(dataobj);
+		return NULL;
+	}
+
+	size_t count = dataobj->size;
+	struct engine_batch *batch = (struct engine_batch *)zcalloc(count, sizeof(struct engine_batch));
+	if (!batch) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		marshall_free(dataobj);
+		return NULL;
+	}
+
+	*items = 0;
+	for (size_t i = 0; i < count; ++i) {
+		batch[i].data = slay_put(&control, dataobj->child[i], &batch[i].len, &nrs);
+		batch[i].index = i;
+		batch[i].meta.importance = MD_IMPORTANT_NORMAL;
+		quid_create(&batch[i].quid);
+		*items += nrs.items;
+
+		if (nrs.schema == SCHEMA_TABLE || nrs.schema == SCHEMA_SET) {
+			batch[i].meta.type = MD_TYPE_GROUP;
+			batch[i].meta.alias = 1;
+		}
+	}
+	marshall_free(dataobj);
+
+	int inserted = engine_insert_batch(&control, batch, count);
+
+	marshall_t *keyobj = (marshall_t *)tree_zcalloc(1, sizeof(marshall_t), NULL);
+	keyobj->child = (marshall_t **)tree_zcalloc(count, sizeof(marshall_t *), keyobj);
+	keyobj->type = MTYPE_ARRAY;
+	keyobj->size = count;
+
+	for (size_t i = 0; i < count; ++i) {
+		char squid[QUID_LENGTH + 1];
+		quidtostr(squid, &batch[i].quid);
+
+		if ((int)i < inserted && batch[i].meta.alias)
+			alias_add(&control, &batch[i].quid, squid, QUID_LENGTH);
+
+		marshall_t *elm = tree_zcalloc(1, sizeof(marshall_t), keyobj);
+		elm->type = MTYPE_QUID;
+		elm->data = tree_zstrdup(squid, keyobj);
+		elm->data_len = QUID_LENGTH;
+		keyobj->child[batch[i].index] = elm;
+
+		zfree((void *)batch[i].data);
+	}
+	zfree(batch);
+
+	char *buf = NULL;
+	if (inserted == (int)count)
+		buf = marshall_serialize(keyobj);
+	marshall_free(keyobj);
+	return buf;
+}
+
+/*
+ * Read the record as marshall object, the engine is only locked while the
+ * record is read so the object can be serialized without holding the lock.
+ */
+marshall_t *db_get_record(char *quid, bool descent, bool force) {
+	read_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
 	strtoquid(quid, &key);
-	void *data = NULL;
 	marshall_t *dataobj = NULL;
 
 	if (!ready)
@@ -402,15 +711,12 @@ void *db_get(char *quid, size_t *len, bool descent, bool force) {
 	switch (meta.type) {
 		case MD_TYPE_RECORD:
 		case MD_TYPE_GROUP: {
-			data = get_data_block(&control, offset, &_len);
+			void *data = get_data_block(&control, offset, &_len);
 			if (!data)
 				return NULL;
 
 			dataobj = slay_get(&control, data, NULL, descent);
-			if (!dataobj) {
-				zfree(data);
-				return NULL;
-			}
+			zfree(data);
 			break;
 		}
 		case MD_TYPE_INDEX: {
@@ -418,22 +724,349 @@ void *db_get(char *quid, size_t *len, bool descent, bool force) {
 			dataobj = index_btree_all(&control, index_offset, descent);
 			break;
 		}
+		case MD_TYPE_OBJECT:
+			error_throw("c59e07b2d4a3", "Large object must be streamed");
+			return NULL;
 		default:
 			/* Key contains data we cannot (yet) return */
 			error_throw("2f05699f70fa", "Key does not contain data");
 			return NULL;
 	}
 
+	return dataobj;
+}
+
+void *db_get(char *quid, size_t *len, bool descent, bool force) {
+	marshall_t *dataobj = db_get_record(quid, descent, force);
+	if (!dataobj)
+		return NULL;
+
 	char *buf = marshall_serialize(dataobj);
 	*len = strlen(buf);
-	if (data)
-		zfree(data);
 	marshall_free(dataobj);
 
 	return buf;
 }
 
+/*
+ * Large objects are written through a buffer of one chunk, the engine lock
+ * is taken per chunk so other requests go on during an upload.
+ */
+struct db_object {
+	engine_object_t object;
+	char *buffer;
+	size_t len;
+	size_t chunk;
+	bool committed;
+};
+
+db_object_t *db_object_new() {
+	read_guard();
+
+	if (!ready)
+		return NULL;
+
+	db_object_t *object = (db_object_t *)zcalloc(1, sizeof(db_object_t));
+	if (!object) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	object->chunk = engine_object_chunk(&control);
+	object->buffer = (char *)zmalloc(object->chunk);
+	if (!object->buffer) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		zfree(object);
+		return NULL;
+	}
+
+	return object;
+}
+
+static int object_flush(db_object_t *object) {
+	write_guard();
+
+	if (!object->len)
+		return 0;
+
+	if (engine_object_write(&control, &object->object, object->buffer, object->len) < 0)
+		return -1;
+
+	object->len = 0;
+	return 0;
+}
+
+int db_object_write(db_object_t *object, const void *data, size_t len) {
+	const char *pdata = (const char *)data;
+	while (len > 0) {
+		size_t count = object->chunk - object->len;
+		if (count > len)
+			count = len;
+
+		memcpy(object->buffer + object->len, pdata, count);
+		object->len += count;
+		pdata += count;
+		len -= count;
+
+		if (object->len == object->chunk && object_flush(object) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Bind the object to a new key, returned in 'quid' */
+int db_object_commit(db_object_t *object, char *quid) {
+	if (object_flush(object) < 0)
+		return -1;
+
+	write_guard();
+	quid_t key;
+	quid_create(&key);
+
+	unsigned long long offset = engine_object_finish(&control, &object->object);
+	if (!offset)
+		return -1;
+
+	object->committed = TRUE;
+	if (engine_insert_object(&control, &key, offset) < 0)
+		return -1;
+
+	quidtostr(quid, &key);
+	return 0;
+}
+
+/* Release the object, an object not committed is removed */
+void db_object_free(db_object_t *object) {
+	if (!object)
+		return;
+
+	if (!object->committed && object->object.head) {
+		write_guard();
+		engine_object_abort(&control, &object->object);
+	}
+
+	zfree(object->buffer);
+	zfree(object);
+}
+
+db_object_t *db_object_open(char *quid, unsigned long long *size) {
+	read_guard();
+	quid_t key;
+	struct metadata meta;
+	strtoquid(quid, &key);
+
+	if (!ready)
+		return NULL;
+
+	uint64_t offset = engine_get(&control, &key, &meta);
+	if (iserror())
+		return NULL;
+
+	if (meta.type != MD_TYPE_OBJECT) {
+		error_throw("7a2e9d04c6b1", "Not a large object");
+		return NULL;
+	}
+
+	db_object_t *object = (db_object_t *)zcalloc(1, sizeof(db_object_t));
+	if (!object) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	object->committed = TRUE;
+	if (engine_object_open(&control, offset, &object->object) < 0) {
+		zfree(object);
+		return NULL;
+	}
+
+	*size = object->object.size;
+	return object;
+}
+
+/* Next chunk of the object, NULL once all data is returned */
+void *db_object_read(db_object_t *object, size_t *len) {
+	read_guard();
+
+	if (!ready)
+		return NULL;
+
+	return engine_object_read(&control, &object->object, len);
+}
+
+/*
+ * Pages are copied under the shared lock while writes go on, the point in
+ * time the archive restores to is fixed once all pages are copied.
+ */
+db_backup_t *db_backup_open() {
+	write_guard();
+
+	if (!ready)
+		return NULL;
+
+	return backup_begin(&control);
+}
+
+/* Next part of the archive, NULL once the archive is complete */
+void *db_backup_read(db_backup_t *backup, size_t *len) {
+	for (;;) {
+		if (backup->state == BACKUP_STATE_SEAL) {
+			write_guard();
+			if (!ready)
+				return NULL;
+
+			backup_seal(&control, backup);
+			if (iserror())
+				return NULL;
+		}
+
+		read_guard();
+		if (!ready)
+			return NULL;
+
+		void *data = backup_read(&control, backup, len);
+		if (data || backup->state != BACKUP_STATE_SEAL)
+			return data;
+	}
+}
+
+void db_backup_free(db_backup_t *backup) {
+	if (!backup)
+		return;
+
+	write_guard();
+	backup_end(&control, backup);
+}
+
+struct mget_block {
+	size_t index;
+	unsigned long long offset;
+};
+
+static int mgetcmp(const void *a, const void *b) {
+	const struct mget_block *block_a = (const struct mget_block *)a;
+	const struct mget_block *block_b = (const struct mget_block *)b;
+	if (block_a->offset == block_b->offset)
+		return 0;
+	return block_a->offset < block_b->offset ? -1 : 1;
+}
+
+/*
+ * Retrieve every key in the array. The keys are resolved in one pass over
+ * the tree and the data blocks are read in storage order. Records are
+ * returned in request order, keys without a record yield null.
+ */
+char *db_get_many(int *items, const void *data, size_t data_len, bool descent) {
+	read_guard();
+
+	if (!ready)
+		return NULL;
+
+	marshall_t *keyobj = marshall_convert((char *)data, data_len);
+	if (!keyobj)
+		return NULL;
+
+	if (keyobj->type != MTYPE_ARRAY || !keyobj->size) {
+		error_throw("5d2a7e61c0b8", "Mget expects an array of keys");
+		marshall_free(keyobj);
+		return NULL;
+	}
+
+	size_t count = keyobj->size;
+	if (count > API_MGET_MAX) {
+		error_throw("c84e0f3a9b17", "Too many keys in request");
+		marshall_free(keyobj);
+		return NULL;
+	}
+
+	struct engine_lookup *lookup = (struct engine_lookup *)zcalloc(count, sizeof(struct engine_lookup));
+	struct mget_block *block = (struct mget_block *)zcalloc(count, sizeof(struct mget_block));
+	void **blockdata = (void **)zcalloc(count, sizeof(void *));
+	if (!lookup || !block || !blockdata) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		zfree(lookup);
+		zfree(block);
+		zfree(blockdata);
+		marshall_free(keyobj);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (keyobj->child[i]->type != MTYPE_QUID) {
+			error_throw("5d2a7e61c0b8", "Mget expects an array of keys");
+			zfree(lookup);
+			zfree(block);
+			zfree(blockdata);
+			marshall_free(keyobj);
+			return NULL;
+		}
+		strtoquid(keyobj->child[i]->data, &lookup[i].quid);
+	}
+	marshall_free(keyobj);
+
+	engine_get_many(&control, lookup, count);
+
+	size_t nblocks = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!lookup[i].found || !lookup[i].offset)
+			continue;
+		if (lookup[i].meta.type != MD_TYPE_RECORD && lookup[i].meta.type != MD_TYPE_GROUP)
+			continue;
+
+		block[nblocks].index = i;
+		block[nblocks].offset = lookup[i].offset;
+		nblocks++;
+	}
+
+	qsort(block, nblocks, sizeof(struct mget_block), mgetcmp);
+
+	marshall_t *listobj = (marshall_t *)tree_zcalloc(1, sizeof(marshall_t), NULL);
+	listobj->child = (marshall_t **)tree_zcalloc(count, sizeof(marshall_t *), listobj);
+	listobj->type = MTYPE_ARRAY;
+	listobj->size = count;
+
+	for (size_t i = 0; i < nblocks; ++i) {
+		size_t _len;
+		size_t index = block[i].index;
+		blockdata[index] = get_data_block(&control, block[i].offset, &_len);
+		if (blockdata[index])
+			listobj->child[index] = slay_get(&control, blockdata[index], listobj, descent);
+	}
+
+	*items = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (lookup[i].found && lookup[i].meta.type == MD_TYPE_INDEX) {
+			uint64_t index_offset = index_list_get_index_offset(&control, &lookup[i].quid);
+			listobj->child[i] = index_btree_all(&control, index_offset, descent);
+			tree_set_parent(listobj->child[i], listobj);
+		}
+
+		if (listobj->child[i]) {
+			(*items)++;
+			continue;
+		}
+
+		marshall_t *elm = tree_zcalloc(1, sizeof(marshall_t), listobj);
+		elm->type = MTYPE_NULL;
+		listobj->child[i] = elm;
+	}
+
+	/* Missing keys are part of the result */
+	error_clear();
+
+	char *buf = marshall_serialize(listobj);
+	marshall_free(listobj);
+	for (size_t i = 0; i < count; ++i) {
+		if (blockdata[i])
+			zfree(blockdata[i]);
+	}
+	zfree(blockdata);
+	zfree(block);
+	zfree(lookup);
+	return buf;
+}
+
 char *db_get_type(char *quid) {
+	read_guard();
 	quid_t key;
 	struct metadata meta;
 	strtoquid(quid, &key);
@@ -458,6 +1091,7 @@ char *db_get_type(char *quid) {
 }
 
 char *db_get_schema(char *quid) {
+	read_guard();
 	quid_t key;
 	struct metadata meta;
 	strtoquid(quid, &key);
@@ -482,6 +1116,7 @@ char *db_get_schema(char *quid) {
 }
 
 char *db_get_history(char *quid) {
+	read_guard();
 	quid_t key;
 	strtoquid(quid, &key);
 
@@ -495,6 +1130,7 @@ char *db_get_history(char *quid) {
 }
 
 char *db_get_version(char *quid, char *element) {
+	read_guard();
 	quid_t key;
 	size_t len;
 	strtoquid(quid, &key);
@@ -507,12 +1143,7 @@ char *db_get_version(char *quid, char *element) {
 		return NULL;
 	}
 
-	uint64_t offset = history_get_version_offset(&control, &key, atoi(element)) ;
-	if (iserror()) {
-		return NULL;
-	}
-
-	void *data = get_data_block(&control, offset, &len);
+	void *data = history_get_version(&control, &key, atoi(element), &len);
 	if (!data)
 		return NULL;
 
@@ -526,6 +1157,7 @@ char *db_get_version(char *quid, char *element) {
 }
 
 int db_update(char *quid, int *items, bool descent, const void *data, size_t data_len) {
+	write_guard();
 	quid_t key;
 	size_t len = 0;
 	size_t _len;
@@ -543,35 +1175,7 @@ int db_update(char *quid, int *items, bool descent, const void *data, size_t dat
 
 	uint64_t offset = engine_get(&control, &key, &meta);
 	switch (meta.type) {
-		case MD_TYPE_GROUP: {
-			if (descent) {
-				void *descentdata = get_data_block(&control, offset, &_len);
-				if (!descentdata)
-					break;
-
-				marshall_t *descentobj = slay_get(&control, descentdata, NULL, FALSE);
-				if (!descentobj) {
-					zfree(descentdata);
-					break;
-				}
-
-				for (unsigned int i = 0; i < descentobj->size; ++i) {
-					quid_t _key;
-					struct metadata _meta;
-					strtoquid(descentobj->child[i]->data, &_key);
-
-					engine_get(&control, &_key, &_meta);
-
-					if (_meta.alias)
-						alias_delete(&control, &_key);
-
-					engine_delete(&control, &_key);
-					error_clear();
-				}
-				marshall_free(descentobj);
-				zfree(descentdata);
-			}
-		}
+		case MD_TYPE_GROUP:
 		case MD_TYPE_RECORD:
 			break;
 		case MD_TYPE_INDEX:
@@ -588,17 +1192,52 @@ int db_update(char *quid, int *items, bool descent, const void *data, size_t dat
 		return -1;
 	}
 
-	/* Save old version as record history */
-	history_add(&control, &key, offset);
+	/* Old version is kept as history if it can be read */
+	void *olddata = NULL;
+	if (offset) {
+		olddata = get_data_block(&control, offset, &_len);
+		if (!olddata)
+			error_clear();
+	}
 
+	/*
+	 * The record is replaced before anything else changes, data that cannot
+	 * be stored is refused like on insert and the record stays as it was.
+	 */
 	void *dataslay = slay_put(&control, dataobj, &len, &nrs);
 	*items = nrs.items;
 	if (engine_update_data(&control, &key, dataslay, len) < 0) {
+		zfree(olddata);
 		zfree(dataslay);
 		marshall_free(dataobj);
 		return -1;
 	}
 
+	if (olddata) {
+		history_add(&control, &key, olddata, _len);
+
+		if (meta.type == MD_TYPE_GROUP && descent) {
+			marshall_t *descentobj = slay_get(&control, olddata, NULL, FALSE);
+			if (descentobj) {
+				for (unsigned int i = 0; i < descentobj->size; ++i) {
+					quid_t _key;
+					struct metadata _meta;
+					strtoquid(descentobj->child[i]->data, &_key);
+
+					engine_get(&control, &_key, &_meta);
+
+					if (_meta.alias)
+						alias_delete(&control, &_key);
+
+					engine_delete(&control, &_key);
+					error_clear();
+				}
+				marshall_free(descentobj);
+			}
+		}
+		zfree(olddata);
+	}
+
 	if (nrs.schema == SCHEMA_TABLE || nrs.schema == SCHEMA_SET) {
 		/* New data became a group */
 		if (meta.type != MD_TYPE_GROUP) {
@@ -625,6 +1264,7 @@ int db_update(char *quid, int *items, bool descent, const void *data, size_t dat
 }
 
 int db_duplicate(char *quid, char *nquid, int *items, bool copy_meta) {
+	write_guard();
 	quid_t key;
 	quid_t nkey;
 	size_t len = 0;
@@ -745,6 +1385,7 @@ int db_duplicate(char *quid, char *nquid, int *items, bool copy_meta) {
 }
 
 int db_count_group(char *quid) {
+	read_guard();
 	quid_t key;
 	size_t _len;
 	marshall_t *dataobj = NULL;
@@ -787,6 +1428,7 @@ int db_count_group(char *quid) {
 }
 
 int db_delete(char *quid, bool descent) {
+	write_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
@@ -848,6 +1490,7 @@ int db_delete(char *quid, bool descent) {
 }
 
 int db_purge(char *quid, bool descent) {
+	write_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
@@ -902,6 +1545,8 @@ int db_purge(char *quid, bool descent) {
 	if (meta.alias)
 		alias_delete(&control, &key);
 
+	history_remove(&control, &key);
+
 	if (engine_purge(&control, &key) < 0)
 		return -1;
 
@@ -909,6 +1554,7 @@ int db_purge(char *quid, bool descent) {
 }
 
 void *db_select(char *quid, const char *select_element, const char *where_element) {
+	read_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
@@ -1071,6 +1717,7 @@ where_done:
 }
 
 int db_item_add(char *quid, int *items, const void *ndata, size_t ndata_len) {
+	write_guard();
 	quid_t key;
 	size_t _len;
 	size_t len = 0;
@@ -1269,6 +1916,7 @@ int db_item_add(char *quid, int *items, const void *ndata, size_t ndata_len) {
 }
 
 int db_item_remove(char *quid, int *items, const void *ndata, size_t ndata_len) {
+	write_guard();
 	quid_t key;
 	size_t _len;
 	size_t len = 0;
@@ -1497,6 +2145,7 @@ int db_item_remove(char *quid, int *items, const void *ndata, size_t ndata_len)
 }
 
 int db_record_get_meta(char *quid, bool force, struct record_status * status) {
+	read_guard();
 	quid_t key;
 	struct metadata meta;
 	strtoquid(quid, &key);
@@ -1529,6 +2178,7 @@ int db_record_get_meta(char *quid, bool force, struct record_status * status) {
 }
 
 int db_record_set_meta(char *quid, struct record_status * status) {
+	write_guard();
 	quid_t key;
 	struct metadata meta;
 	strtoquid(quid, &key);
@@ -1549,6 +2199,7 @@ int db_record_set_meta(char *quid, struct record_status * status) {
 }
 
 char *db_index_on_group(char *quid) {
+	read_guard();
 	quid_t key;
 	strtoquid(quid, &key);
 
@@ -1562,6 +2213,7 @@ char *db_index_on_group(char *quid) {
 }
 
 char *db_alias_get_name(char *quid) {
+	read_guard();
 	quid_t key;
 	strtoquid(quid, &key);
 
@@ -1572,6 +2224,7 @@ char *db_alias_get_name(char *quid) {
 }
 
 int db_alias_update(char *quid, const char *name) {
+	write_guard();
 	quid_t key, _key;
 	struct metadata meta;
 	strtoquid(quid, &key);
@@ -1601,6 +2254,7 @@ int db_alias_update(char *quid, const char *name) {
 }
 
 char *db_alias_all() {
+	read_guard();
 	if (!ready)
 		return NULL;
 
@@ -1614,7 +2268,135 @@ char *db_alias_all() {
 	return buf;
 }
 
+struct key_page {
+	marshall_t *dataobj;
+	unsigned int limit;
+	char *next;
+};
+
+/* Add key to the page, or store it as the start of the next page */
+static bool list_key(const quid_t *key, const struct metadata *meta, void *arg) {
+	struct key_page *page = (struct key_page *)arg;
+	marshall_t *dataobj = page->dataobj;
+	if (dataobj->size == page->limit) {
+		quidtostr(page->next, key);
+		return FALSE;
+	}
+
+	char squid[QUID_LENGTH + 1];
+	quidtostr(squid, key);
+	char *type = get_str_type(meta->type);
+
+	dataobj->child[dataobj->size] = tree_zcalloc(1, sizeof(marshall_t), dataobj);
+	dataobj->child[dataobj->size]->type = MTYPE_STRING;
+	dataobj->child[dataobj->size]->name = tree_zstrdup(squid, dataobj);
+	dataobj->child[dataobj->size]->name_len = QUID_LENGTH;
+	dataobj->child[dataobj->size]->data = tree_zstrdup(type, dataobj);
+	dataobj->child[dataobj->size]->data_len = strlen(type);
+	dataobj->size++;
+	return TRUE;
+}
+
+static void key_page_init(struct key_page *page, unsigned int limit, char *next) {
+	next[0] = '\0';
+	page->limit = limit;
+	page->next = next;
+	page->dataobj = (marshall_t *)tree_zcalloc(1, sizeof(marshall_t), NULL);
+	page->dataobj->child = (marshall_t **)tree_zcalloc(limit, sizeof(marshall_t *), page->dataobj);
+	page->dataobj->type = MTYPE_OBJECT;
+}
+
+/*
+ * List at most 'limit' keys starting at 'from' in key order. The key to
+ * continue with is stored in 'next', or an empty string on the last page.
+ * Keys are read from a snapshot, the lock is released after each batch so
+ * writers are not held up by a long page.
+ */
+char *db_list_keys(const char *from, unsigned int limit, char *next) {
+	next[0] = '\0';
+
+	quid_t key;
+	if (from) {
+		if (!strquid_format(from)) {
+			error_throw("f0b867c41006", "Key malformed or invalid");
+			return NULL;
+		}
+		strtoquid(from, &key);
+	}
+
+	engine_snapshot_t snapshot;
+	engine_cursor_t cursor;
+	{
+		write_guard();
+		if (!ready)
+			return NULL;
+
+		engine_snapshot_open(&control, &snapshot);
+		engine_snapshot_cursor(&control, &snapshot, &cursor, from ? &key : NULL);
+	}
+
+	struct key_page page;
+	key_page_init(&page, limit, next);
+
+	struct metadata meta;
+	for (bool more = TRUE; more;) {
+		read_guard();
+		if (!ready) {
+			engine_cursor_close(&cursor);
+			engine_snapshot_close(&control, &snapshot);
+			marshall_free(page.dataobj);
+			return NULL;
+		}
+
+		for (unsigned int i = 0; more && i < SNAPSHOT_SCAN_BATCH; ++i)
+			more = engine_cursor_next(&control, &cursor, &key, &meta) && list_key(&key, &meta, &page);
+
+		if (!more) {
+			engine_cursor_close(&cursor);
+			engine_snapshot_close(&control, &snapshot);
+		}
+	}
+
+	char *buf = marshall_serialize(page.dataobj);
+	marshall_free(page.dataobj);
+	return buf;
+}
+
+/*
+ * List the keys created between the unix times 'from' and 'to', paged like
+ * db_list_keys(). A page continues at 'start' when given.
+ */
+char *db_list_range(long long from, long long to, const char *start, unsigned int limit, char *next) {
+	read_guard();
+	next[0] = '\0';
+	if (!ready)
+		return NULL;
+
+	quid_t key;
+	if (start) {
+		if (!strquid_format(start)) {
+			error_throw("f0b867c41006", "Key malformed or invalid");
+			return NULL;
+		}
+		strtoquid(start, &key);
+	}
+
+	struct key_page page;
+	key_page_init(&page, limit, next);
+
+	engine_scan_time(&control, quid_unixtime(from), quid_unixtime(to), start ? &key : NULL, list_key, &page);
+	if (iserror()) {
+		marshall_free(page.dataobj);
+		return NULL;
+	}
+
+	char *buf = marshall_serialize(page.dataobj);
+	marshall_free(page.dataobj);
+	return buf;
+}
+
 char *db_index_all() {
+	read_guard();
 	if (!ready)
 		return NULL;
 
@@ -1629,6 +2411,7 @@ char *db_index_all() {
 }
 
 char *db_pager_all() {
+	read_guard();
 	if (!ready)
 		return NULL;
 
@@ -1643,6 +2426,7 @@ char *db_pager_all() {
 }
 
 void *db_alias_get_data(char *name, size_t *len, bool descent) {
+	read_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
@@ -1675,6 +2459,9 @@ void *db_alias_get_data(char *name, size_t *len, bool descent) {
 			dataobj = index_btree_all(&control, index_offset, descent);
 			break;
 		}
+		case MD_TYPE_OBJECT:
+			error_throw("c59e07b2d4a3", "Large object must be streamed");
+			return NULL;
 		default:
 			/* Key contains data we cannot (yet) return */
 			error_throw("2f05699f70fa", "Key does not contain data");
@@ -1691,6 +2478,7 @@ void *db_alias_get_data(char *name, size_t *len, bool descent) {
 }
 
 int db_index_rebuild(char *quid, int *items) {
+	write_guard();
 	quid_t key;
 	index_result_t inrs;
 	struct metadata meta, group_meta;
@@ -1755,6 +2543,7 @@ int db_index_rebuild(char *quid, int *items) {
  * Set index on group element
  */
 int db_index_create(char *group_quid, char *index_quid, int *items, const char *idxkey) {
+	write_guard();
 	quid_t key;
 	size_t _len;
 	struct metadata meta;
@@ -59,10 +59,18 @@ unsigned long int stat_getfreekeys();
 unsigned long int stat_getfreeblocks();
 unsigned long int stat_tablesize();
 unsigned long int stat_indexsize();
+unsigned int stat_bufpool_size();
+unsigned long long stat_bufpool_hit();
+unsigned long long stat_bufpool_miss();
+double stat_compress_ratio();
+unsigned long long stat_compact_released();
+unsigned long long stat_wal_commits();
+unsigned long long stat_wal_syncs();
 int generate_random_number(int range);
 void quid_generate(char *quid);
 void quid_generate_short(char *quid);
 void filesync();
+void zcompact();
 int zvacuum(int page_size);
 
 /*
@@ -70,7 +78,10 @@ int zvacuum(int page_size);
  */
 char *key_decode(char *quid);
 int db_put(char *quid, int *items, const void *data, size_t len, char *hint, char *hint_option);
+char *db_put_batch(int *items, const void *data, size_t len);
 void *db_get(char *quid, size_t *len, bool descent, bool force);
+marshall_t *db_get_record(char *quid, bool descent, bool force);
+char *db_get_many(int *items, const void *data, size_t len, bool descent);
 char *db_get_type(char *quid);
 char *db_get_schema(char *quid);
 char *db_get_history(char *quid);
@@ -91,10 +102,33 @@ char *db_alias_get_name(char *quid);
 char *db_index_on_group(char *quid);
 int db_alias_update(char *quid, const char *name);
 char *db_alias_all();
+char *db_list_keys(const char *from, unsigned int limit, char *next);
+char *db_list_range(long long from, long long to, const char *start, unsigned int limit, char *next);
 char *db_index_all();
 char *db_pager_all();
 void *db_alias_get_data(char *name, size_t *len, bool descent);
 
+/*
+ * Large objects, streamed in and out one chunk at a time
+ */
+typedef struct db_object db_object_t;
+
+db_object_t *db_object_new();
+int db_object_write(db_object_t *object, const void *data, size_t len);
+int db_object_commit(db_object_t *object, char *quid);
+void db_object_free(db_object_t *object);
+db_object_t *db_object_open(char *quid, unsigned long long *size);
+void *db_object_read(db_object_t *object, size_t *len);
+
+/*
+ * Backup archive of the running database, streamed one part at a time
+ */
+typedef struct backup db_backup_t;
+
+db_backup_t *db_backup_open();
+void *db_backup_read(db_backup_t *backup, size_t *len);
+void db_backup_free(db_backup_t *backup);
+
 int db_index_rebuild(char *quid, int *items);
 int db_index_create(char *group_quid, char *index_quid, int *items, const char *idxkey);
 
@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <pthread.h>
 
 #include <config.h>
+#include <common.h>
+#include "clmul.h"
+
+#define POLY			0xedb88320
 
 static const unsigned long crc_table[256] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535,
@@ -42,14 +47,78 @@ static const unsigned long crc_table[256] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-unsigned long crc32_calculate(unsigned long in_crc32, const void *buf, size_t len) {
-	unsigned long crc32;
-	unsigned char *byte_buf;
+/*
+ * Rows for slicing-by-8, row k holds the CRC of each byte followed by k
+ * zero bytes. Filled in once, along with the carry-less multiply constants
+ * if the processor supports it.
+ */
+static uint32_t crc_slice_table[8][256];
+static struct clmul_fold crc_fold;
+static bool crc_clmul = FALSE;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
 
-	crc32 = in_crc32 ^ 0xffffffff;
-	byte_buf = (unsigned char*) buf;
+static void crc32_init(void) {
+	for (unsigned int n = 0; n < 256; ++n) {
+		uint32_t crc = crc_table[n];
+		crc_slice_table[0][n] = crc;
+		for (unsigned int k = 1; k < 8; ++k) {
+			crc = crc_table[crc & 0xff] ^ (crc >> 8);
+			crc_slice_table[k][n] = crc;
+		}
+	}
+
+	if (clmul_supported()) {
+		clmul_fold_init(&crc_fold, POLY, 32);
+		crc_clmul = TRUE;
+	}
+}
+
+/* Byte at a time, works on any architecture */
+static uint32_t crc32_bytes(uint32_t crc32, const unsigned char *byte_buf, size_t len) {
 	for (size_t i = 0; i < len; ++i) {
 		crc32 = (crc32 >> 8) ^ crc_table[(crc32 ^ byte_buf[i]) & 0xff];
 	}
-	return (crc32 ^ 0xffffffff);
+	return crc32;
+}
+
+/* Eight bytes at a time on a little-endian architecture */
+static uint32_t crc32_slice(uint32_t crc32, const unsigned char *next, size_t len) {
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc32 = (crc32 >> 8) ^ crc_table[(crc32 ^ *next++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t low = *(const uint32_t *)next ^ crc32;
+		uint32_t high = *(const uint32_t *)(next + 4);
+		crc32 = crc_slice_table[7][low & 0xff] ^
+		        crc_slice_table[6][(low >> 8) & 0xff] ^
+		        crc_slice_table[5][(low >> 16) & 0xff] ^
+		        crc_slice_table[4][low >> 24] ^
+		        crc_slice_table[3][high & 0xff] ^
+		        crc_slice_table[2][(high >> 8) & 0xff] ^
+		        crc_slice_table[1][(high >> 16) & 0xff] ^
+		        crc_slice_table[0][high >> 24];
+		next += 8;
+		len -= 8;
+	}
+	return crc32_bytes(crc32, next, len);
+}
+
+unsigned long crc32_calculate(unsigned long in_crc32, const void *buf, size_t len) {
+	uint32_t n = 1;
+	uint32_t crc32 = (uint32_t)in_crc32 ^ 0xffffffff;
+	const unsigned char *byte_buf = (const unsigned char *)buf;
+
+	if (!*(char *)&n)
+		return crc32_bytes(crc32, byte_buf, len) ^ 0xffffffff;
+
+	pthread_once(&crc_once, crc32_init);
+	if (crc_clmul && len >= CLMUL_FOLD_MIN) {
+		unsigned char rest[CLMUL_REST_SIZE];
+		size_t folded = clmul_fold(&crc_fold, crc32, byte_buf, len, rest);
+		crc32 = crc32_slice(0, rest, CLMUL_REST_SIZE);
+		byte_buf += folded;
+		len -= folded;
+	}
+	return crc32_slice(crc32, byte_buf, len) ^ 0xffffffff;
 }
@@ -1,10 +1,12 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
 #include <log.h>
+#include "clmul.h"
 
 /* 64-bit CRC polynomial with these coefficients, but reversed:
 	64, 62, 57, 55, 54, 53, 52, 47, 46, 45, 40, 39, 38, 37, 35, 33, 32,
@@ -15,15 +17,20 @@
    called once.  These could be replaced by constant tables generated in the
    same way.  There are two tables, one for each endianess.  Since these are
    static, i.e. local, one should be compiled out of existence if the compiler
-   can evaluate the endianess check in crc64() at compile time. */
-static uint64_t crc64_little_table[8][256];
+   can evaluate the endianess check in crc64() at compile time. The little
+   endian table has sixteen rows to take sixteen bytes at a time. */
+static uint64_t crc64_little_table[16][256];
 static uint64_t crc64_big_table[8][256];
 
+/* Carry-less multiply fold constants, used if the processor supports it. */
+static struct clmul_fold crc64_fold;
+static bool crc64_clmul = FALSE;
+
 #define GF2_DIM 64      /* dimension of GF(2) vectors (length of CRC) */
 #define CRC_BUFFER_SIZE  4096
 
-/* Fill in the CRC-64 constants table. */
-static void crc64_init(uint64_t table[][256]) {
+/* Fill in the CRC-64 constants table with 'rows' rows. */
+static void crc64_init(uint64_t table[][256], unsigned rows) {
 	unsigned n, k;
 	uint64_t crc;
 
@@ -35,10 +42,10 @@ static void crc64_init(uint64_t table[][256]) {
 		table[0][n] = crc;
 	}
 
-	/* generate CRC-64's for those followed by 1 to 7 zeros */
+	/* generate CRC-64's for those followed by 1 to rows - 1 zeros */
 	for (n = 0; n < 256; ++n) {
 		crc = table[0][n];
-		for (k = 1; k < 8; ++k) {
+		for (k = 1; k < rows; ++k) {
 			crc = table[0][crc & 0xff] ^ (crc >> 8);
 			table[k][n] = crc;
 		}
@@ -46,9 +53,15 @@ static void crc64_init(uint64_t table[][256]) {
 }
 
 /* This function is called once to initialize the CRC-64 table for use on a
-   little-endian architecture. */
+   little-endian architecture, and to select the carry-less multiply if the
+   processor has one. */
 static void crc64_little_init() {
-	crc64_init(crc64_little_table);
+	crc64_init(crc64_little_table, 16);
+
+	if (clmul_supported()) {
+		clmul_fold_init(&crc64_fold, POLY, 64);
+		crc64_clmul = TRUE;
+	}
 }
 
 /* Reverse the bytes in a 64-bit word. */
@@ -67,7 +80,7 @@ static inline uint64_t rev8(uint64_t a) {
 static void crc64_big_init() {
 	unsigned k, n;
 
-	crc64_init(crc64_big_table);
+	crc64_init(crc64_big_table, 8);
 	for (k = 0; k < 8; ++k)
 		for (n = 0; n < 256; ++n)
 			crc64_big_table[k][n] = rev8(crc64_big_table[k][n]);
@@ -98,34 +111,58 @@ static void crc64_big_init() {
 	} while (0)
 #endif
 
-/* Calculate a CRC-64 eight bytes at a time on a little-endian architecture. */
-static inline uint64_t crc64_little(uint64_t crc, void *buf, size_t len) {
-	unsigned char *next = buf;
-
-	ONCE(crc64_little_init);
-	crc = ~crc;
+/* Run the CRC-64 register over buf[0..len-1] sixteen bytes at a time on a
+   little-endian architecture. */
+static inline uint64_t crc64_little_slice(uint64_t crc, const unsigned char *next, size_t len) {
 	while (len && ((uintptr_t)next & 7) != 0) {
 		crc = crc64_little_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
 		len--;
 	}
-	while (len >= 8) {
-		crc ^= *(uint64_t *)next;
-		crc = crc64_little_table[7][crc & 0xff] ^
-		      crc64_little_table[6][(crc >> 8) & 0xff] ^
-		      crc64_little_table[5][(crc >> 16) & 0xff] ^
-		      crc64_little_table[4][(crc >> 24) & 0xff] ^
-		      crc64_little_table[3][(crc >> 32) & 0xff] ^
-		      crc64_little_table[2][(crc >> 40) & 0xff] ^
-		      crc64_little_table[1][(crc >> 48) & 0xff] ^
-		      crc64_little_table[0][crc >> 56];
-		next += 8;
-		len -= 8;
+	while (len >= 16) {
+		uint64_t high = *(const uint64_t *)(next + 8);
+		crc ^= *(const uint64_t *)next;
+		crc = crc64_little_table[15][crc & 0xff] ^
+		      crc64_little_table[14][(crc >> 8) & 0xff] ^
+		      crc64_little_table[13][(crc >> 16) & 0xff] ^
+		      crc64_little_table[12][(crc >> 24) & 0xff] ^
+		      crc64_little_table[11][(crc >> 32) & 0xff] ^
+		      crc64_little_table[10][(crc >> 40) & 0xff] ^
+		      crc64_little_table[9][(crc >> 48) & 0xff] ^
+		      crc64_little_table[8][crc >> 56] ^
+		      crc64_little_table[7][high & 0xff] ^
+		      crc64_little_table[6][(high >> 8) & 0xff] ^
+		      crc64_little_table[5][(high >> 16) & 0xff] ^
+		      crc64_little_table[4][(high >> 24) & 0xff] ^
+		      crc64_little_table[3][(high >> 32) & 0xff] ^
+		      crc64_little_table[2][(high >> 40) & 0xff] ^
+		      crc64_little_table[1][(high >> 48) & 0xff] ^
+		      crc64_little_table[0][high >> 56];
+		next += 16;
+		len -= 16;
 	}
 	while (len) {
 		crc = crc64_little_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
 		len--;
 	}
-	return ~crc;
+	return crc;
+}
+
+/* Calculate a CRC-64 on a little-endian architecture. Long buffers are folded
+   with carry-less multiplies if available, the folded rest and the tail go
+   through the tables. */
+static inline uint64_t crc64_little(uint64_t crc, void *buf, size_t len) {
+	unsigned char *next = buf;
+
+	ONCE(crc64_little_init);
+	crc = ~crc;
+	if (crc64_clmul && len >= CLMUL_FOLD_MIN) {
+		unsigned char rest[CLMUL_REST_SIZE];
+		size_t folded = clmul_fold(&crc64_fold, crc, next, len, rest);
+		crc = crc64_little_slice(0, rest, CLMUL_REST_SIZE);
+		next += folded;
+		len -= folded;
+	}
+	return ~crc64_little_slice(crc, next, len);
 }
 
 /* Calculate a CRC-64 eight bytes at a time on a big-endian architecture. */
@@ -244,6 +281,21 @@ uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uintmax_t len2) {
 	return crc1;
 }
 
+/* Fill 'op' with the operator that appends len2 zero bytes to a CRC-64. Many
+   blocks of the same length are then combined with crc64_combine_op() at the
+   cost of one matrix multiply each, instead of a crc64_combine() each. */
+void crc64_combine_init(uint64_t *op, uintmax_t len2) {
+	unsigned n;
+
+	for (n = 0; n < GF2_DIM; ++n)
+		op[n] = crc64_combine(UINT64_C(1) << n, 0, len2);
+}
+
+/* Same as crc64_combine() for the length 'op' was initialized with. */
+uint64_t crc64_combine_op(uint64_t *op, uint64_t crc1, uint64_t crc2) {
+	return gf2_matrix_times(op, crc1) ^ crc2;
+}
+
 bool crc_file(int fd, uint64_t *rscrc64) {
 	unsigned char buf[CRC_BUFFER_SIZE];
 	uint64_t curpos = lseek(fd, 0, SEEK_CUR);
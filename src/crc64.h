@@ -1,7 +1,12 @@
 #ifndef CRC64_H_INCLUDED
 #define CRC64_H_INCLUDED
 
+#define CRC64_OP_SIZE	64
+
 uint64_t crc64(uint64_t crc, void *buf, size_t len);
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uintmax_t len2);
+void crc64_combine_init(uint64_t *op, uintmax_t len2);
+uint64_t crc64_combine_op(uint64_t *op, uint64_t crc1, uint64_t crc2);
 bool crc_file(int fd, uint64_t *rscrc64);
 
 #endif // CRC64_H_INCLUDED
@@ -175,208 +175,271 @@ marshall_t *marshall_dict_decode(char *data, size_t data_len, char *name, size_t
 	return obj;
 }
 
+#define SERIALIZE_BUFFER_SIZE	4096
+#define SERIALIZE_INDENT		4
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+	marshall_format_t format;
+	marshall_sink_t sink;
+	void *ctx;
+	bool failed;
+} serializer_t;
+
 /*
- * Convert marshall object to string
+ * Pass the buffered output on to the sink, if any
  */
-char *marshall_serialize(marshall_t *obj) {
-	if (!obj)
-		return zstrdup("null");
+static void serialize_flush(serializer_t *s) {
+	if (!s->sink || !s->len || s->failed)
+		return;
 
-	switch (obj->type) {
-		case MTYPE_NULL: {
-			if (obj->name) {
-				size_t len = obj->name_len + 8;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\":null", obj->name);
-				return data;
-			} else {
-				return zstrdup("null");
-			}
-			break;
-		}
-		case MTYPE_TRUE: {
-			if (obj->name) {
-				size_t len = obj->name_len + 8;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\":true", obj->name);
-				return data;
-			} else {
-				return zstrdup("true");
-			}
-			break;
-		}
-		case MTYPE_FALSE: {
-			if (obj->name) {
-				size_t len = obj->name_len + 10;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\":false", obj->name);
-				return data;
-			} else {
-				return zstrdup("false");
-			}
-			break;
-		}
-		case MTYPE_FLOAT:
-		case MTYPE_INT: {
-			if (obj->name) {
-				size_t len = obj->name_len + obj->data_len + 4;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\":%s", obj->name, (char *)obj->data);
-				return data;
-			} else {
-				return zstrdup((char *)obj->data);
+	if (s->sink(s->ctx, s->data, s->len) != s->len)
+		s->failed = TRUE;
+	s->len = 0;
+}
+
+static void serialize_write(serializer_t *s, const char *str, size_t len) {
+	if (s->failed)
+		return;
+
+	if (s->len + len >= s->size) {
+		if (s->sink) {
+			serialize_flush(s);
+			if (len >= s->size) {
+				if (!s->failed && s->sink(s->ctx, str, len) != len)
+					s->failed = TRUE;
+				return;
 			}
-			break;
-		}
-		case MTYPE_QUID:
-		case MTYPE_STRING: {
-			if (obj->name) {
-				size_t len = obj->name_len + obj->data_len + 6;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\":\"%s\"", obj->name, (char *)obj->data);
-				return data;
-			} else {
-				size_t nlen = 0;
-				char *escdata = stresc(obj->data, &nlen);
-				size_t len = obj->data_len + nlen + 4;
-				char *data = (char *)zcalloc(len + 1, sizeof(char));
-				memset(data, 0, len + 1);
-				sprintf(data, "\"%s\"", (char *)escdata);
-				zfree(escdata);
-				return data;
+		} else {
+			size_t nsz = s->size * 2;
+			while (s->len + len >= nsz)
+				nsz *= 2;
+
+			char *data = (char *)zrealloc(s->data, nsz);
+			if (!data) {
+				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+				s->failed = TRUE;
+				return;
 			}
-			break;
+			s->data = data;
+			s->size = nsz;
 		}
-		case MTYPE_ARRAY: {
-			size_t nsz = 0;
+	}
 
-			if (!obj->size) {
-				if (obj->name) {
-					size_t len = obj->name_len + 8;
-					char *data = (char *)zcalloc(len + 1, sizeof(char));
-					memset(data, 0, len + 1);
-					sprintf(data, "\"%s\":null", obj->name);
-					return data;
-				} else {
-					return zstrdup("null");
-				}
-			}
+	memcpy(s->data + s->len, str, len);
+	s->len += len;
+}
 
-			unsigned int i;
-			for (i = 0; i < obj->size; ++i) {
-				char *elm = marshall_serialize(obj->child[i]);
-				if (elm) {
-					nsz += strlen(elm) + 2;
-					zfree(elm);
-				} else {
-					nsz += 5;
-				}
-			}
+#define serialize_literal(s,l) serialize_write(s, l, sizeof(l) - 1)
 
-			if (obj->name)
-				nsz += obj->name_len;
+static void serialize_string(serializer_t *s, const char *str) {
+	serialize_write(s, str, strlen(str));
+}
+
+/*
+ * Write string with special characters escaped, same as stresc()
+ */
+static void serialize_escape(serializer_t *s, const char *str) {
+	const char *run = str;
+	for (; *str; ++str) {
+		char esc;
+		switch (*str) {
+			case '\a':
+				esc = 'a';
+				break;
+			case '\b':
+				esc = 'b';
+				break;
+			case '\t':
+				esc = 't';
+				break;
+			case '\n':
+				esc = 'n';
+				break;
+			case '\v':
+				esc = 'v';
+				break;
+			case '\f':
+				esc = 'f';
+				break;
+			case '\r':
+				esc = 'r';
+				break;
+			case '\\':
+				esc = '\\';
+				break;
+			case '\"':
+				esc = '\"';
+				break;
+			default:
+				continue;
+		}
 
-			nsz += obj->size + 2;
+		char seq[2] = {'\\', esc};
+		serialize_write(s, run, str - run);
+		serialize_write(s, seq, 2);
+		run = str + 1;
+	}
+	serialize_write(s, run, str - run);
+}
 
-			char *data = (char *)zcalloc(nsz + 1, sizeof(char));
-			memset(data, 0, nsz + 1);
-			size_t curr_sz = 0;
+static void serialize_newline(serializer_t *s, unsigned int depth) {
+	static const char spaces[] = "                                ";
 
-			if (obj->name) {
-				sprintf(data, "\"%s\":", obj->name);
-				curr_sz += obj->name_len;
-			}
+	serialize_literal(s, "\n");
+	size_t indent = depth * SERIALIZE_INDENT;
+	while (indent) {
+		size_t n = indent < sizeof(spaces) - 1 ? indent : sizeof(spaces) - 1;
+		serialize_write(s, spaces, n);
+		indent -= n;
+	}
+}
 
-			strcat(data, "[");
-			curr_sz++;
+static void serialize_name(serializer_t *s, const marshall_t *obj) {
+	if (!obj->name)
+		return;
 
-			for (i = 0; i < obj->size; ++i) {
-				if (i > 0) {
-					strcat(data, ",");
-					curr_sz++;
-				}
-				char *elm = marshall_serialize(obj->child[i]);
-				if (elm) {
-					strcat(data, elm);
-					curr_sz += strlen(elm);
-					zfree(elm);
-				} else {
-					strcat(data, "null");
-					curr_sz += 5;
-				}
-			}
-			strcat(data, "]");
-			return data;
-		}
-		case MTYPE_OBJECT: {
-			size_t nsz = 0;
+	serialize_literal(s, "\"");
+	serialize_string(s, obj->name);
+	if (s->format == MARSHALL_INDENT)
+		serialize_literal(s, "\": ");
+	else
+		serialize_literal(s, "\":");
+}
 
+/*
+ * Write a single marshall object and its children to the output. Returns
+ * FALSE if the object has an unknown type, nothing is written in that case.
+ */
+static bool serialize_object(serializer_t *s, const marshall_t *obj, unsigned int depth) {
+	if (!obj) {
+		serialize_literal(s, "null");
+		return TRUE;
+	}
+
+	switch (obj->type) {
+		case MTYPE_NULL:
+			serialize_name(s, obj);
+			serialize_literal(s, "null");
+			break;
+		case MTYPE_TRUE:
+			serialize_name(s, obj);
+			serialize_literal(s, "true");
+			break;
+		case MTYPE_FALSE:
+			serialize_name(s, obj);
+			serialize_literal(s, "false");
+			break;
+		case MTYPE_FLOAT:
+		case MTYPE_INT:
+			serialize_name(s, obj);
+			serialize_string(s, (char *)obj->data);
+			break;
+		case MTYPE_QUID:
+		case MTYPE_STRING:
+			serialize_name(s, obj);
+			serialize_literal(s, "\"");
+			if (obj->name)
+				serialize_string(s, (char *)obj->data);
+			else
+				serialize_escape(s, (char *)obj->data);
+			serialize_literal(s, "\"");
+			break;
+		case MTYPE_ARRAY:
+		case MTYPE_OBJECT: {
+			serialize_name(s, obj);
 			if (!obj->size) {
-				if (obj->name) {
-					size_t len = obj->name_len + 8;
-					char *data = (char *)zcalloc(len + 1, sizeof(char));
-					memset(data, 0, len + 1);
-					sprintf(data, "\"%s\":null", obj->name);
-					return data;
-				} else {
-					return zstrdup("null");
-				}
+				serialize_literal(s, "null");
+				break;
 			}
 
-			unsigned int i;
-			for (i = 0; i < obj->size; ++i) {
-				char *elm = marshall_serialize(obj->child[i]);
-				if (elm) {
-					nsz += strlen(elm) + 2;
-					zfree(elm);
-				} else {
-					nsz += 5;
+			serialize_write(s, obj->type == MTYPE_ARRAY ? "[" : "{", 1);
+			for (unsigned int i = 0; i < obj->size; ++i) {
+				if (i > 0)
+					serialize_literal(s, ",");
+				if (s->format == MARSHALL_INDENT)
+					serialize_newline(s, depth + 1);
+				if (!serialize_object(s, obj->child[i], depth + 1)) {
+					error_throw("70bef771b0a3", "Invalid datatype");
+					serialize_literal(s, "null");
 				}
 			}
+			if (s->format == MARSHALL_INDENT)
+				serialize_newline(s, depth);
+			serialize_write(s, obj->type == MTYPE_ARRAY ? "]" : "}", 1);
+			break;
+		}
+		default:
+			return FALSE;
+	}
+	return TRUE;
+}
 
-			if (obj->name)
-				nsz += obj->name_len;
+static bool serialize_begin(serializer_t *s, marshall_format_t format) {
+	memset(s, 0, sizeof(serializer_t));
+	s->format = format;
+	s->size = SERIALIZE_BUFFER_SIZE;
+	s->data = (char *)zmalloc(s->size);
+	if (!s->data) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Convert marshall object to string in a single pass. The output is written
+ * into one growing buffer, the length of the result is stored in len if
+ * requested.
+ */
+char *marshall_serialize_format(marshall_t *obj, marshall_format_t format, size_t *len) {
+	serializer_t s;
+	if (!serialize_begin(&s, format))
+		return NULL;
 
-			nsz += obj->size + 2;
+	if (!serialize_object(&s, obj, 0)) {
+		error_throw("70bef771b0a3", "Invalid datatype");
+		zfree(s.data);
+		return NULL;
+	}
 
-			char *data = (char *)zcalloc(nsz + 1, sizeof(char));
-			memset(data, 0, nsz + 1);
-			size_t curr_sz = 0;
+	if (s.failed) {
+		zfree(s.data);
+		return NULL;
+	}
 
-			if (obj->name) {
-				sprintf(data, "\"%s\":", obj->name);
-				curr_sz += obj->name_len;
-			}
+	s.data[s.len] = '\0';
+	if (len)
+		*len = s.len;
+	return s.data;
+}
+
+/*
+ * Convert marshall object to string
+ */
+char *marshall_serialize(marshall_t *obj) {
+	return marshall_serialize_format(obj, MARSHALL_PACKED, NULL);
+}
 
-			strcat(data, "{");
-			curr_sz++;
+/*
+ * Stream marshall object to sink in chunks of at most the buffer size
+ * instead of building the entire string in memory.
+ */
+bool marshall_serialize_stream(marshall_t *obj, marshall_format_t format, marshall_sink_t sink, void *ctx) {
+	serializer_t s;
+	if (!serialize_begin(&s, format))
+		return FALSE;
 
-			for (i = 0; i < obj->size; ++i) {
-				if (i > 0) {
-					strcat(data, ",");
-					curr_sz++;
-				}
-				char *elm = marshall_serialize(obj->child[i]);
-				if (elm) {
-					strcat(data, elm);
-					curr_sz += strlen(elm);
-					zfree(elm);
-				} else {
-					strcat(data, "null");
-					curr_sz += 5;
-				}
-			}
-			strcat(data, "}");
-			return data;
-		}
-		default:
-			error_throw("70bef771b0a3", "Invalid datatype");
-			return NULL;
-	}
-	return NULL;
+	s.sink = sink;
+	s.ctx = ctx;
+
+	bool ok = serialize_object(&s, obj, 0);
+	if (!ok)
+		error_throw("70bef771b0a3", "Invalid datatype");
+
+	serialize_flush(&s);
+	zfree(s.data);
+	return ok && !s.failed;
 }
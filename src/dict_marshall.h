@@ -8,7 +8,17 @@
 
 #define marshall_free(v) tree_zfree(v);
 
+typedef enum {
+	MARSHALL_PACKED,	/* No whitespace */
+	MARSHALL_INDENT,	/* Newline and indent per level */
+} marshall_format_t;
+
+/* Output callback, must return the number of bytes consumed */
+typedef size_t (*marshall_sink_t)(void *ctx, const char *data, size_t len);
+
 marshall_t *marshall_dict_decode(char *data, size_t data_len, char *name, size_t name_len, void *parent);
 char *marshall_serialize(marshall_t *obj);
+char *marshall_serialize_format(marshall_t *obj, marshall_format_t format, size_t *len);
+bool marshall_serialize_stream(marshall_t *obj, marshall_format_t format, marshall_sink_t sink, void *ctx);
 
 #endif // DICT_MARSHALL_H_INCLUDED
@@ -68,6 +68,22 @@ uint64_t from_be64(__be64 x) {
 #endif
 }
 
+__le64 to_le64(uint64_t x) {
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+	return (FORCE __le64) x;
+#else
+	return (FORCE __le64) __builtin_bswap64(x);
+#endif
+}
+
+uint64_t from_le64(__le64 x) {
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+	return (FORCE uint64_t) x;
+#else
+	return __builtin_bswap64((FORCE uint64_t) x);
+#endif
+}
+
 __be16 incr_be16(__be16 x) {
 	uint16_t y = _ntohs((FORCE uint16_t) x);
 	return (FORCE __be16) _htons(++y);
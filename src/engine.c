@@ -1,5 +1,8 @@
+#include <stdver.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include <config.h>
@@ -14,13 +17,40 @@
 #include "dict.h"
 #include "marshall.h"
 #include "pager.h"
+#include "bufpool.h"
 #include "history.h"
+#include "wal.h"
+#include "memtable.h"
+#include "keysearch.h"
+#include "lz4.h"
 #include "core.h"
 #include "engine.h"
 
 #define TABLE_SIZE			128
 #define TABLE_DELETE_LARGE	1
+#define TABLE_LAYOUT		0x8002	/* Split table layout, never a valid size */
+#define SUPER_KEY_TIME		0x100	/* Keys are ordered by creation time */
+#define DBSUPER_BINS		0x100	/* Heap super block holds the size class bins */
+#define DBSUPER_VALUES		0x200	/* Heap super block holds the value page list */
+
+#define BLOB_FREE			0x01	/* Block is in a bin */
+#define BLOB_HISTORY		0x02	/* Block may be listed in a full copy history list */
+#define BLOB_LZ4			0x04	/* Data is compressed */
+#define BLOB_CLASS_SHIFT	3		/* Size class of the block, 0 if exact */
+
+#define VALUE_SLOTS			64
+#define VALUE_SLOT_SIZE		64
+#define VALUE_HANDLE		0x8000000000000000ULL	/* Offset refers to a value slot */
+#define VALUE_SLOT_SHIFT	48
+#define VALUE_LEN_SHIFT		54
+#define VALUE_PAGE_MASK		0xffffffffffffULL
+#define OBJECT_HANDLE		0x4000000000000000ULL	/* Offset refers to a large object */
+#define COMPACT_STEP_KEYS	4096	/* Keys visited per compaction step */
 
+/*
+ * Table layout written by earlier versions, converted when the table is
+ * read into the buffer pool.
+ */
 struct _engine_item {
 	quid_t quid;
 	struct metadata meta;
@@ -28,15 +58,64 @@ struct _engine_item {
 	__be64 child;
 } __attribute__((packed));
 
-struct _engine_table {
+struct _engine_table_v1 {
 	struct _engine_item items[TABLE_SIZE];
 	__be16 size;
 } __attribute__((packed));
 
+/*
+ * Every item field has its own array so the key search only touches the
+ * keys. A key is stored as two integers which compare in keycmp() order,
+ * the upper half decides nearly every comparison and is scanned with vector
+ * instructions. The table keeps the size of the first layout so existing
+ * tables are converted in place, the layout tag overlaps the old size.
+ */
+struct _engine_table {
+	__le64 key_hi[TABLE_SIZE];
+	__le64 key_lo[TABLE_SIZE];
+	__be64 offset[TABLE_SIZE];
+	__be64 child[TABLE_SIZE];
+	struct metadata meta[TABLE_SIZE];
+	__be16 size;
+	uint8_t _res[510];
+	__be16 layout;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct _engine_table) == sizeof(struct _engine_table_v1), "Table layouts must be of equal size");
+
+/* Key in the form stored in the tables */
+struct engine_key {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+/* Table item unpacked for the walk */
+struct engine_item {
+	struct engine_key key;
+	struct metadata meta;
+	unsigned long long offset;
+};
+
+/*
+ * Header of a data block. Free blocks are linked through 'next' into the bin
+ * of their size class, the block capacity follows from the class so a block
+ * can be reused by any item of that class.
+ */
 struct _blob_info {
 	__be32 len;
 	__be64 next;
-	bool free;
+	__be8 flags;
+} __attribute__((packed));
+
+/*
+ * Every chunk of a large object is a heap block starting with this header.
+ * The chunks are written outside the log as they arrive, nothing refers to
+ * them before the object is bound to a key.
+ */
+struct _blob_chunk {
+	__be64 next;	/* Next chunk, 0 for the last */
+	__be64 head;	/* First chunk of the object */
+	__be64 size;	/* Object size, kept in the first chunk */
 } __attribute__((packed));
 
 struct _engine_super {
@@ -45,9 +124,46 @@ struct _engine_super {
 	__be64 free_top;
 } __attribute__((packed));
 
+_Static_assert(HEAP_BINS < (1 << (8 - BLOB_CLASS_SHIFT)), "Size class must fit in the block flags");
+
+struct _engine_dbsuper_v1 {
+	__be32 version;
+	__be64 last;
+} __attribute__((packed));
+
+struct _engine_dbsuper_v2 {
+	__be32 version;
+	__be64 last;
+	__be64 bin[HEAP_BINS];
+} __attribute__((packed));
+
 struct _engine_dbsuper {
 	__be32 version;
 	__be64 last;
+	__be64 bin[HEAP_BINS];
+	__be64 value_free;
+} __attribute__((packed));
+
+/*
+ * Data up to VALUE_INLINE_SIZE shares a page of slots instead of taking a
+ * heap block each. The offset handed out for such a value holds the page,
+ * slot and length, so it is read from the buffer pool without a block
+ * header. Values of keys created together end up in the same page.
+ */
+struct _value_page {
+	char slot[VALUE_SLOTS][VALUE_SLOT_SIZE];
+	__be64 used;		/* Slots in use, one bit each */
+	__be64 next;		/* Next page with free slots */
+	__be8 listed;		/* Page is linked from the heap super block */
+} __attribute__((packed));
+
+_Static_assert(VALUE_INLINE_SIZE <= VALUE_SLOT_SIZE, "Inline values must fit in a slot");
+
+struct _memtable_record {
+	quid_t quid;
+	struct metadata meta;
+	__be64 offset;
+	bool removed;
 } __attribute__((packed));
 
 struct {
@@ -62,11 +178,16 @@ struct {
 	/* Containing data */
 	{MD_TYPE_RECORD,	TRUE},
 	{MD_TYPE_GROUP,		TRUE},
+	{MD_TYPE_OBJECT,	TRUE},
 };
 
 static void flush_super(base_t *base);
 static void flush_dbsuper(base_t *base);
-static unsigned long long remove_table(base_t *base, struct _engine_table *table, size_t i, quid_t *quid);
+static unsigned long long remove_table(base_t *base, struct _engine_table *table, size_t i, struct engine_key *key, struct metadata *meta);
+static void replay_key(base_t *base, const void *data, size_t len);
+static void free_object(base_t *base, unsigned long long offset);
+static int insert_offset(base_t *base, const quid_t *quid, struct metadata *meta, unsigned long long offset);
+static void reclaim_retired(base_t *base);
 
 /*
  * Does marshall type require additional data
@@ -79,112 +200,241 @@ bool engine_keytype_hasdata(enum key_type type) {
 	return FALSE;
 }
 
-static struct _engine_table *get_table(const base_t *base, uint64_t offset) {
-	zassert(offset != 0);
+/*
+ * Key order of the tree. Instances created before keys were ordered by time
+ * keep the byte order until they are vacuumed.
+ */
+static int keycmp(const base_t *base, const quid_t *a, const quid_t *b) {
+	if (!base->engine->time_order)
+		return memcmp(a, b, sizeof(quid_t));
+
+	return quidcmp(a, b);
+}
+
+/* Big endian value of 'len' bytes */
+static uint64_t load_bytes(const unsigned char *p, size_t len) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < len; ++i)
+		value = (value << 8) | p[i];
+	return value;
+}
 
-	/* take from cache */
-	struct engine_cache *slot = &base->engine->cache[offset % CACHE_SLOTS];
-	if (slot->offset == offset) {
-		slot->offset = 0;
-		return slot->table;
+static void store_bytes(unsigned char *p, size_t len, uint64_t value) {
+	for (size_t i = len; i > 0; --i) {
+		p[i - 1] = value & 0xff;
+		value >>= 8;
 	}
+}
 
-	struct _engine_table *table = (struct _engine_table *)zcalloc(1, sizeof(struct _engine_table));
-	if (!table) {
-		zfree(table);
-		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-		return NULL;
+/*
+ * Convert the key to table form. Byte ordered keys skip the upper half of
+ * time_low, which is never set.
+ */
+static void key_pack(const base_t *base, const quid_t *quid, struct engine_key *key) {
+	if (base->engine->time_order) {
+		quid_pack(quid, &key->hi, &key->lo);
+		return;
 	}
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		zfree(table);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
+	const unsigned char *p = (const unsigned char *)quid;
+	key->hi = (load_bytes(p, 4) << 32) | load_bytes(p + 8, 4);
+	key->lo = load_bytes(p + 12, 8);
+}
+
+static void key_unpack(const base_t *base, const struct engine_key *key, quid_t *quid) {
+	if (base->engine->time_order) {
+		quid_unpack(quid, key->hi, key->lo);
+		return;
 	}
-	if (read(fd, table, sizeof(struct _engine_table)) != sizeof(struct _engine_table)) {
-		zfree(table);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
+
+	unsigned char *p = (unsigned char *)quid;
+	memset(quid, 0, sizeof(quid_t));
+	store_bytes(p, 4, key->hi >> 32);
+	store_bytes(p + 8, 4, key->hi & 0xffffffff);
+	store_bytes(p + 12, 8, key->lo);
+}
+
+static void table_get_key(const struct _engine_table *table, size_t i, struct engine_key *key) {
+	key->hi = from_le64(table->key_hi[i]);
+	key->lo = from_le64(table->key_lo[i]);
+}
+
+static void table_set_key(struct _engine_table *table, size_t i, const struct engine_key *key) {
+	table->key_hi[i] = to_le64(key->hi);
+	table->key_lo[i] = to_le64(key->lo);
+}
+
+/* Move item slots within a table or between tables, slots may overlap */
+static void table_move(struct _engine_table *dst, size_t to, const struct _engine_table *src, size_t from, size_t count) {
+	memmove(&dst->key_hi[to], &src->key_hi[from], count * sizeof(__le64));
+	memmove(&dst->key_lo[to], &src->key_lo[from], count * sizeof(__le64));
+	memmove(&dst->offset[to], &src->offset[from], count * sizeof(__be64));
+	memmove(&dst->child[to], &src->child[from], count * sizeof(__be64));
+	memmove(&dst->meta[to], &src->meta[from], count * sizeof(struct metadata));
+}
+
+/*
+ * Position of the first key equal to or greater than 'key'. The upper key
+ * halves are counted by the vector search, equal halves are rare and
+ * resolved one by one.
+ */
+static size_t table_search(const struct _engine_table *table, const struct engine_key *key, bool *found) {
+	size_t size = from_be16(table->size);
+
+	/* Frames are allocated aligned, so is the key array */
+	const void *keys = (const char *)table + offsetof(struct _engine_table, key_hi);
+	size_t i = keysearch_count(keys, size, key->hi);
+	while (i < size && from_le64(table->key_hi[i]) == key->hi && from_le64(table->key_lo[i]) < key->lo)
+		i++;
+
+	*found = (i < size && from_le64(table->key_hi[i]) == key->hi && from_le64(table->key_lo[i]) == key->lo);
+	return i;
+}
+
+/* Convert a table from the first layout as it is read */
+static void table_upgrade(const base_t *base, void *data, size_t size) {
+	zassert(size == sizeof(struct _engine_table));
+	struct _engine_table *table = (struct _engine_table *)data;
+	if (from_be16(table->layout) == TABLE_LAYOUT)
+		return;
+
+	struct _engine_table_v1 old;
+	memcpy(&old, data, sizeof(struct _engine_table_v1));
+	memset(table, 0, sizeof(struct _engine_table));
+
+	for (size_t i = 0; i < TABLE_SIZE; ++i) {
+		struct engine_key key;
+		key_pack(base, &old.items[i].quid, &key);
+		table_set_key(table, i, &key);
+		table->meta[i] = old.items[i].meta;
+		table->offset[i] = old.items[i].offset;
+		table->child[i] = old.items[i].child;
 	}
+	table->size = old.size;
+	table->layout = to_be16(TABLE_LAYOUT);
+}
+
+/* Pin a table in the buffer pool */
+static struct _engine_table *get_table(const base_t *base, uint64_t offset) {
+	zassert(offset != 0);
+
+	return (struct _engine_table *)bufpool_pin_load(base, offset, sizeof(struct _engine_table), table_upgrade);
+}
+
+/* Pin a zeroed table for a newly allocated chunk */
+static struct _engine_table *get_table_new(const base_t *base, uint64_t offset) {
+	zassert(offset != 0);
+
+	struct _engine_table *table = (struct _engine_table *)bufpool_pin_new(base, offset, sizeof(struct _engine_table));
+	if (table)
+		table->layout = to_be16(TABLE_LAYOUT);
 	return table;
 }
 
-/* Free a table or put it into the cache */
-static void put_table(engine_t *engine, struct _engine_table *table, uint64_t offset) {
+/* Release a table without changes */
+static void put_table(const base_t *base, uint64_t offset) {
 	zassert(offset != 0);
 
-	/* overwrite cache */
-	struct engine_cache *slot = &engine->cache[offset % CACHE_SLOTS];
-	if (slot->offset != 0) {
-		zfree(slot->table);
-	}
-	slot->offset = offset;
-	slot->table = table;
+	bufpool_unpin(base, offset, FALSE);
 }
 
-/* Write a table and free it */
-static void flush_table(base_t *base, struct _engine_table *table, uint64_t offset) {
+/* Release a table and schedule it for write back */
+static void flush_table(const base_t *base, uint64_t offset) {
 	zassert(offset != 0);
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
+	bufpool_unpin(base, offset, TRUE);
+}
+
+/* Read a region that is not kept in the buffer pool */
+static int read_block(const base_t *base, uint64_t offset, void *buf, size_t len) {
+	const void *map = pager_get_map(base, offset, len);
+	if (map) {
+		memcpy(buf, map, len);
+		return 0;
 	}
-	if (write(fd, table, sizeof(struct _engine_table)) != sizeof(struct _engine_table)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
+
+	int fd = pager_get_fd(base, &offset);
+	if (pread(fd, buf, len, offset) != (ssize_t)len) {
+		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+		return -1;
 	}
-	put_table(base->engine, table, offset);
+	return 0;
 }
 
 static int engine_open(base_t *base) {
 	memset(base->engine, 0, sizeof(engine_t));
+	pthread_mutex_init(&base->engine->snapshot.lock, NULL);
 	struct _engine_super super;
 	struct _engine_dbsuper dbsuper;
 
 	uint64_t offset = base->offset.zero;
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return -1;
-	}
-	if (read(fd, &super, sizeof(struct _engine_super)) != sizeof(struct _engine_super)) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return -1;
+	const void *map = pager_get_map(base, offset, sizeof(struct _engine_super));
+	if (map) {
+		memcpy(&super, map, sizeof(struct _engine_super));
+	} else {
+		int fd = pager_get_fd(base, &offset);
+		if (lseek(fd, offset, SEEK_SET) < 0) {
+			error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+			return -1;
+		}
+		if (read(fd, &super, sizeof(struct _engine_super)) != sizeof(struct _engine_super)) {
+			error_throw_fatal("a7df40ba3075", "Failed to read disk");
+			return -1;
+		}
 	}
 
+	uint32_t version = from_be32(super.version);
 	base->engine->top = from_be64(super.top);
 	base->engine->free_top = from_be64(super.free_top);
-	zassert(from_be64(super.version) == VERSION_MAJOR);
+	base->engine->time_order = (version & SUPER_KEY_TIME) ? TRUE : FALSE;
+	zassert((version & ~SUPER_KEY_TIME) == VERSION_MAJOR);
 
-	uint64_t offseth = base->offset.heap;
-	int fdh = pager_get_fd(base, &offseth);
-	if (lseek(fd, offseth, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+	memset(&dbsuper, 0, sizeof(struct _engine_dbsuper));
+	if (read_block(base, base->offset.heap, &dbsuper, sizeof(struct _engine_dbsuper_v1)) < 0)
 		return -1;
+
+	uint32_t dbversion = from_be32(dbsuper.version);
+	zassert((dbversion & ~(DBSUPER_BINS | DBSUPER_VALUES)) == VERSION_MAJOR);
+	base->engine->last_block = from_be64(dbsuper.last);
+
+	if (dbversion & DBSUPER_BINS) {
+		size_t size = (dbversion & DBSUPER_VALUES) ? sizeof(struct _engine_dbsuper) : sizeof(struct _engine_dbsuper_v2);
+		if (read_block(base, base->offset.heap, &dbsuper, size) < 0)
+			return -1;
+
+		for (int i = 0; i < HEAP_BINS; ++i)
+			base->engine->heap_bin[i] = from_be64(dbsuper.bin[i]);
+		base->engine->value_free = from_be64(dbsuper.value_free);
 	}
-	if (read(fdh, &dbsuper, sizeof(struct _engine_dbsuper)) != sizeof(struct _engine_dbsuper)) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return -1;
+
+	if (!(dbversion & DBSUPER_VALUES)) {
+		/* Earlier super blocks are too small, blocks freed before the
+		   bins existed are left to the vacuum */
+		lprint("[info] Moving heap super block\n");
+		base->offset.heap = zpalloc(base, sizeof(struct _engine_dbsuper));
+		flush_dbsuper(base);
 	}
 
-	zassert(from_be64(dbsuper.version) == VERSION_MAJOR);
-	base->engine->last_block = from_be64(dbsuper.last);
+	/* Byte ordered trees are not buffered, merging relies on time order */
+	if (base->engine->time_order && MEMTABLE_SIZE)
+		base->engine->memtable = memtable_new(MEMTABLE_SIZE);
 	return 0;
 }
 
 static int engine_create(base_t *base) {
 	memset(base->engine, 0, sizeof(engine_t));
+	pthread_mutex_init(&base->engine->snapshot.lock, NULL);
 	base->engine->last_block = 0;
+	base->engine->time_order = TRUE;
+	if (MEMTABLE_SIZE)
+		base->engine->memtable = memtable_new(MEMTABLE_SIZE);
 
 	lprint("[info] Creating core index\n");
-	flush_super(base);
-	flush_dbsuper(base);
-
 	base->offset.zero = zpalloc(base, sizeof(struct _engine_super));
 	base->offset.heap = zpalloc(base, sizeof(struct _engine_dbsuper));
+
+	flush_super(base);
+	flush_dbsuper(base);
 	return 0;
 }
 
@@ -194,64 +444,210 @@ void engine_init(base_t *base) {
 	} else {
 		engine_create(base);
 	}
+
+	keysearch_init();
+
+	/* Keys buffered before a crash */
+	wal_replay_keys(base, replay_key);
 }
 
+/* Tables are written back by the pager */
 void engine_close(base_t *base) {
+	/* Snapshots do not outlive the engine, those still open are unlinked */
+	engine_snapshot_t *snapshot = base->engine->snapshot.oldest;
+	while (snapshot) {
+		engine_snapshot_t *next = snapshot->next;
+		snapshot->prev = NULL;
+		snapshot->next = NULL;
+		snapshot = next;
+	}
+	base->engine->snapshot.oldest = NULL;
+	base->engine->snapshot.newest = NULL;
+	reclaim_retired(base);
+
+	engine_flush(base);
 	flush_super(base);
 	flush_dbsuper(base);
 
-	for (size_t i = 0; i < CACHE_SLOTS; ++i) {
-		if (base->engine->cache[i].offset) {
-			zfree(base->engine->cache[i].table);
-		}
-	}
+	memtable_free(base->engine->memtable);
+	base->engine->memtable = NULL;
+
+	/* Blocks not yet released stay unused until vacuum */
+	zfree(base->engine->compact.release);
+	memset(&base->engine->compact, 0, sizeof(base->engine->compact));
+
+	zfree(base->engine->snapshot.retired);
+	zfree(base->engine->snapshot.fresh);
+	pthread_mutex_destroy(&base->engine->snapshot.lock);
+	memset(&base->engine->snapshot, 0, sizeof(base->engine->snapshot));
 }
 
 void engine_sync(base_t *base) {
+	reclaim_retired(base);
+	engine_flush(base);
 	flush_super(base);
 	flush_dbsuper(base);
 }
 
+static bool snapshot_active(engine_t *engine) {
+	pthread_mutex_lock(&engine->snapshot.lock);
+	bool active = engine->snapshot.oldest != NULL;
+	pthread_mutex_unlock(&engine->snapshot.lock);
+	return active;
+}
+
+/* Slot holding 'offset' in the set of fresh tables, or the slot to take */
+static size_t fresh_slot(const engine_t *engine, unsigned long long offset) {
+	size_t mask = engine->snapshot.fresh_size - 1;
+	size_t i = (size_t)((offset * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+	while (engine->snapshot.fresh[i] && engine->snapshot.fresh[i] != offset)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/* Table was created after the last snapshot was taken */
+static bool fresh_has(const engine_t *engine, unsigned long long offset) {
+	if (!engine->snapshot.fresh_count)
+		return FALSE;
+
+	return engine->snapshot.fresh[fresh_slot(engine, offset)] == offset;
+}
+
+static void fresh_add(engine_t *engine, unsigned long long offset) {
+	if ((engine->snapshot.fresh_count + 1) * 2 > engine->snapshot.fresh_size) {
+		unsigned long long *old = engine->snapshot.fresh;
+		size_t old_size = engine->snapshot.fresh_size;
+		size_t size = old_size ? old_size * 2 : 256;
+
+		/* Without the set tables are copied once more */
+		unsigned long long *fresh = (unsigned long long *)zcalloc(size, sizeof(unsigned long long));
+		if (!fresh)
+			return;
+
+		engine->snapshot.fresh = fresh;
+		engine->snapshot.fresh_size = size;
+		for (size_t i = 0; i < old_size; ++i) {
+			if (old[i])
+				fresh[fresh_slot(engine, old[i])] = old[i];
+		}
+		zfree(old);
+	}
+
+	size_t i = fresh_slot(engine, offset);
+	if (!engine->snapshot.fresh[i]) {
+		engine->snapshot.fresh[i] = offset;
+		engine->snapshot.fresh_count++;
+	}
+}
+
+/* Keep the chunk until the snapshots able to see it are closed */
+static void retire_chunk(engine_t *engine, unsigned long long offset, bool table) {
+	if (engine->snapshot.retired_count == engine->snapshot.retired_size) {
+		size_t size = engine->snapshot.retired_size ? engine->snapshot.retired_size * 2 : 64;
+		struct engine_retired *retired = (struct engine_retired *)zrealloc(engine->snapshot.retired, size * sizeof(struct engine_retired));
+		if (!retired)
+			return;
+
+		engine->snapshot.retired = retired;
+		engine->snapshot.retired_size = size;
+	}
+
+	struct engine_retired *item = &engine->snapshot.retired[engine->snapshot.retired_count++];
+	item->offset = offset;
+	item->generation = engine->snapshot.generation;
+	item->table = table;
+}
+
 /* Allocate a chunk from the index file for new table */
 static unsigned long long alloc_table_chunk(base_t *base, size_t len) {
 	zassert(len > 0);
 
+	reclaim_retired(base);
+
 	/* Use blocks from freelist instead of allocation */
-	if (base->engine->free_top) {
-		unsigned long long offset = base->engine->free_top;
+	unsigned long long offset = base->engine->free_top;
+	if (offset) {
 		struct _engine_table *table = get_table(base, offset);
-		base->engine->free_top = from_be64(table->items[0].child);
+		base->engine->free_top = from_be64(table->child[0]);
 		base->stats.zero_free_size--;
 
-		zfree(table);
-		return offset;
+		put_table(base, offset);
+	} else {
+		offset = zpalloc(base, len);
+	}
+
+	/* No snapshot can see the new table */
+	if (snapshot_active(base->engine))
+		fresh_add(base->engine, offset);
+	return offset;
+}
+
+/*
+ * Size classes of the data heap, two per power of two up to 768 KB. A block
+ * is allocated with the capacity of its class, so at most a third of a block
+ * is unused. Larger blocks are allocated as is.
+ */
+static size_t heap_class_size(unsigned int class) {
+	zassert(class > 0 && class <= HEAP_BINS);
+	unsigned int group = (class - 1) / 2;
+	return (16ULL << group) + ((class - 1) % 2) * (8ULL << group);
+}
+
+/* Smallest class holding 'len', 0 if there is none */
+static unsigned int heap_class(size_t len) {
+	for (unsigned int class = 1; class <= HEAP_BINS; ++class) {
+		if (heap_class_size(class) >= len)
+			return class;
 	}
+	return 0;
+}
 
-	return zpalloc(base, len);
+/* Largest class fitting in 'len', 0 if there is none */
+static unsigned int heap_class_floor(size_t len) {
+	unsigned int class = 0;
+	while (class < HEAP_BINS && heap_class_size(class + 1) <= len)
+		class++;
+	return class;
 }
 
-/* Allocate a chunk from the database file */
-static unsigned long long alloc_dbchunk(base_t *base, size_t len) {
+/*
+ * Allocate a chunk from the database file. Free blocks of the class, or a
+ * few classes up, are reused before the heap grows.
+ */
+static unsigned long long alloc_dbchunk(base_t *base, size_t len, unsigned int *class) {
 	zassert(len > 0);
 
-	if (base->engine->dbcache[DBCACHE_SLOTS - 1].len) {
-		for (int i = 0; i < DBCACHE_SLOTS; ++i) {
-			struct engine_dbcache *slot = &base->engine->dbcache[i];
-			if (len <= slot->len) {
-				int diff = (((double)(len) / (double)slot->len) * 100);
-				if (diff >= DBCACHE_DENSITY) {
-					slot->len = 0;
-					base->stats.heap_free_size--;
-
-					/* Datablock reused so remove from history */
-					history_delete(base, slot->offset);
-					return slot->offset;
-				}
-			}
+	reclaim_retired(base);
+
+	*class = heap_class(len);
+	if (!*class)
+		return zpalloc(base, sizeof(struct _blob_info) + len);
+
+	for (unsigned int fit = *class; fit <= HEAP_BINS && fit <= *class + HEAP_BIN_FIT; ++fit) {
+		unsigned long long offset = base->engine->heap_bin[fit - 1];
+		if (!offset)
+			continue;
+
+		struct _blob_info info;
+		if (read_block(base, offset, &info, sizeof(struct _blob_info)) < 0)
+			return 0;
+
+		zassert(info.flags & BLOB_FREE);
+		base->engine->heap_bin[fit - 1] = from_be64(info.next);
+		base->stats.heap_free_size--;
+		flush_dbsuper(base);
+
+		/* Datablock reused so remove from history */
+		if (info.flags & BLOB_HISTORY) {
+			if (history_delete(base, offset) < 0)
+				error_clear();
 		}
+
+		*class = fit;
+		return offset;
 	}
 
-	return zpalloc(base, sizeof(struct _blob_info) + len);
+	return zpalloc(base, sizeof(struct _blob_info) + heap_class_size(*class));
 }
 
 /* Mark a chunk as unused in the database file */
@@ -259,151 +655,412 @@ static void free_index_chunk(base_t *base, uint64_t offset) {
 	zassert(offset > 0);
 	struct _engine_table *table = get_table(base, offset);
 
-	quid_t quid;
-	memset(&quid, 0, sizeof(quid_t));
+	struct engine_key key;
+	memset(&key, 0, sizeof(struct engine_key));
 
-	memcpy(&table->items[0].quid, &quid, sizeof(quid_t));
+	table_set_key(table, 0, &key);
 	table->size = incr_be16(table->size);
-	table->items[0].offset = 0;
-	table->items[0].child = to_be64(base->engine->free_top);
+	table->offset[0] = 0;
+	table->child[0] = to_be64(base->engine->free_top);
 
-	flush_table(base, table, offset);
+	flush_table(base, offset);
 	base->engine->free_top = offset;
 	base->stats.zero_free_size++;
 }
 
-static void free_dbchunk(base_t *base, uint64_t offset) {
-	struct _blob_info info;
+/* Pin a value page in the buffer pool */
+static struct _value_page *get_value_page(const base_t *base, uint64_t offset) {
+	zassert(offset != 0);
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return;
+	return (struct _value_page *)bufpool_pin(base, offset, sizeof(struct _value_page));
+}
+
+/* Store the value in a free slot, returns the offset of the value */
+static unsigned long long insert_value(base_t *base, const void *data, size_t len) {
+	zassert(len > 0 && len <= VALUE_SLOT_SIZE);
+
+	struct _value_page *page = NULL;
+	unsigned long long page_offset = base->engine->value_free;
+	unsigned long long value_free = page_offset;
+	if (page_offset) {
+		page = get_value_page(base, page_offset);
+	} else {
+		page_offset = zpalloc(base, sizeof(struct _value_page));
+		zassert(!(page_offset & ~VALUE_PAGE_MASK));
+
+		page = (struct _value_page *)bufpool_pin_new(base, page_offset, sizeof(struct _value_page));
+		if (!page)
+			return 0;
+
+		page->listed = 1;
+		base->engine->value_free = page_offset;
 	}
-	if (read(fd, &info, sizeof(struct _blob_info)) != sizeof(struct _blob_info)) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return;
+
+	uint64_t used = from_be64(page->used);
+	unsigned int slot = __builtin_ctzll(~used);
+	used |= 1ULL << slot;
+	page->used = to_be64(used);
+	memcpy(page->slot[slot], data, len);
+
+	/* Full pages leave the list */
+	if (used == ~0ULL) {
+		base->engine->value_free = from_be64(page->next);
+		page->next = 0;
+		page->listed = 0;
 	}
+	bufpool_unpin(base, page_offset, TRUE);
+	if (base->engine->value_free != value_free)
+		flush_dbsuper(base);
 
-	info.free = 1;
-	info.next = 0;
-	struct engine_dbcache dbinfo;
-	size_t len = from_be32(info.len);
-	dbinfo.offset = offset;
-	base->stats.heap_free_size++;
-	for (int i = DBCACHE_SLOTS - 1; i >= 0; --i) {
-		struct engine_dbcache *slot = &base->engine->dbcache[i];
-		if (len > slot->len) {
-			if (slot->len) {
-				for (int j = 0; j < i; ++j) {
-					base->engine->dbcache[j] = base->engine->dbcache[j + 1];
-				}
-			}
-			dbinfo.len = len;
-			base->engine->dbcache[i] = dbinfo;
-			break;
-		}
+	return VALUE_HANDLE | ((unsigned long long)len << VALUE_LEN_SHIFT) | ((unsigned long long)slot << VALUE_SLOT_SHIFT) | page_offset;
+}
+
+static void *get_value(const base_t *base, uint64_t offset, size_t *len) {
+	unsigned long long page_offset = offset & VALUE_PAGE_MASK;
+	unsigned int slot = (offset >> VALUE_SLOT_SHIFT) & (VALUE_SLOTS - 1);
+	*len = (offset >> VALUE_LEN_SHIFT) & 0x7f;
+
+	void *data = zmalloc(*len);
+	if (!data) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
 	}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+	const struct _value_page *page = get_value_page(base, page_offset);
+	memcpy(data, page->slot[slot], *len);
+	bufpool_unpin(base, page_offset, FALSE);
+	return data;
+}
+
+/* Release the slot, the page is linked again once it has room */
+static void free_value(base_t *base, uint64_t offset) {
+	unsigned long long page_offset = offset & VALUE_PAGE_MASK;
+	unsigned int slot = (offset >> VALUE_SLOT_SHIFT) & (VALUE_SLOTS - 1);
+
+	struct _value_page *page = get_value_page(base, page_offset);
+	uint64_t used = from_be64(page->used);
+	if (!(used & (1ULL << slot))) {
+		bufpool_unpin(base, page_offset, FALSE);
 		return;
 	}
-	if (write(fd, &info, sizeof(struct _blob_info)) != sizeof(struct _blob_info)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
+
+	page->used = to_be64(used & ~(1ULL << slot));
+	if (!page->listed) {
+		page->next = to_be64(base->engine->value_free);
+		page->listed = 1;
+		base->engine->value_free = page_offset;
+		flush_dbsuper(base);
 	}
+	bufpool_unpin(base, page_offset, TRUE);
 }
 
-static void flush_super(base_t *base) {
-	struct _engine_super super;
-	memset(&super, 0, sizeof(struct _engine_super));
-	uint64_t offset = base->offset.zero;
-	int fd = pager_get_fd(base, &offset);
-
-	super.version = to_be64(VERSION_MAJOR);
-	super.top = to_be64(base->engine->top);
-	super.free_top = to_be64(base->engine->free_top);
+/* Storage taken by a data block including the header */
+static size_t block_size(const struct _blob_info *info) {
+	unsigned int class = info->flags >> BLOB_CLASS_SHIFT;
+	return sizeof(struct _blob_info) + (class ? heap_class_size(class) : from_be32(info->len));
+}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	if (write(fd, &super, sizeof(struct _engine_super)) != sizeof(struct _engine_super)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
+/* Block lies in a page being emptied by the compactor */
+static bool compact_page(const base_t *base, unsigned long long offset) {
+	unsigned int page = offset / (BASE_PAGE_SIZE << base->pager.size);
+	for (unsigned int i = 0; i < base->engine->compact.count; ++i) {
+		if (base->engine->compact.page[i] == page)
+			return TRUE;
 	}
+	return FALSE;
 }
 
-static void flush_dbsuper(base_t *base) {
-	struct _engine_dbsuper dbsuper;
-	memset(&dbsuper, 0, sizeof(struct _engine_dbsuper));
-	uint64_t offset = base->offset.heap;
-	int fd = pager_get_fd(base, &offset);
+/* Queue a free block for engine_compact_release() */
+static void compact_retire(base_t *base, unsigned long long offset, size_t len) {
+	engine_t *engine = base->engine;
+	if (engine->compact.release_count == engine->compact.release_size) {
+		size_t size = engine->compact.release_size ? engine->compact.release_size * 2 : 64;
+		struct engine_release *release = (struct engine_release *)zrealloc(engine->compact.release, size * sizeof(struct engine_release));
+		if (!release)
+			return;
+
+		engine->compact.release = release;
+		engine->compact.release_size = size;
+	}
 
-	dbsuper.version = to_be64(VERSION_MAJOR);
-	dbsuper.last = to_be64(base->engine->last_block);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+	engine->compact.release[engine->compact.release_count].offset = offset;
+	engine->compact.release[engine->compact.release_count].len = len;
+	engine->compact.release_count++;
+}
+
+/*
+ * Return the block to the bin of its class. Blocks written by earlier
+ * versions have no class and go to the largest class they can hold. Blocks
+ * in pages being compacted are retired instead.
+ */
+static void release_dbchunk(base_t *base, uint64_t offset) {
+	if (!offset)
 		return;
-	}
-	if (write(fd, &dbsuper, sizeof(struct _engine_dbsuper)) != sizeof(struct _engine_dbsuper)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+
+	if (offset & VALUE_HANDLE) {
+		free_value(base, offset);
 		return;
 	}
-}
 
-static unsigned long long insert_data(base_t *base, const void *data, size_t len) {
-	if (!data || len == 0) {
-		error_throw("e8880046e019", "No data provided");
-		return len;
+	if (offset & OBJECT_HANDLE) {
+		free_object(base, offset & ~OBJECT_HANDLE);
+		return;
 	}
 
 	struct _blob_info info;
-	memset(&info, 0, sizeof(struct _blob_info));
-	info.len = to_be32(len);
-	info.free = 0;
+	if (read_block(base, offset, &info, sizeof(struct _blob_info)) < 0)
+		return;
 
-	uint64_t offset = alloc_dbchunk(base, len);
-	info.next = to_be64(base->engine->last_block);
-	base->engine->last_block = offset;
+	if (info.flags & BLOB_FREE)
+		return;
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return 0;
-	}
-	if (write(fd, &info, sizeof(struct _blob_info)) != sizeof(struct _blob_info)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return 0;
-	}
-	if (write(fd, data, len) != (ssize_t)len) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return 0;
+	unsigned int class = info.flags >> BLOB_CLASS_SHIFT;
+	if (!class)
+		class = heap_class_floor(from_be32(info.len));
+
+	bool retire = compact_page(base, offset) && !(info.flags & BLOB_HISTORY);
+	info.flags = BLOB_FREE | (info.flags & BLOB_LZ4) | (class << BLOB_CLASS_SHIFT);
+	info.next = 0;
+	if (retire) {
+		compact_retire(base, offset, block_size(&info));
+	} else if (class) {
+		info.next = to_be64(base->engine->heap_bin[class - 1]);
+		base->engine->heap_bin[class - 1] = offset;
+		base->stats.heap_free_size++;
+		flush_dbsuper(base);
 	}
 
-	return base->engine->last_block;
+	/* Length is kept, the block is read until the change is committed */
+	wal_write(base, offset, &info, sizeof(struct _blob_info));
 }
 
-/* Split a table. The pivot item is stored to 'quid' and 'offset'.
-   Returns offset to the new table. */
-static unsigned long long split_table(base_t *base, struct _engine_table *table, quid_t *quid, unsigned long long *offset) {
-	memcpy(quid, &table->items[TABLE_SIZE / 2].quid, sizeof(quid_t));
-	*offset = from_be64(table->items[TABLE_SIZE / 2].offset);
+/* Open snapshots may still read the block, it is released after them */
+static void free_dbchunk(base_t *base, uint64_t offset) {
+	if (!offset)
+		return;
+
+	if (snapshot_active(base->engine)) {
+		retire_chunk(base->engine, offset, FALSE);
+		return;
+	}
+
+	release_dbchunk(base, offset);
+}
+
+/*
+ * Release the retired chunks no open snapshot can see. Chunks are retired
+ * in generation order, the oldest snapshot marks where to stop.
+ */
+static void reclaim_retired(base_t *base) {
+	engine_t *engine = base->engine;
+	if (engine->snapshot.retired_head == engine->snapshot.retired_count)
+		return;
+
+	pthread_mutex_lock(&engine->snapshot.lock);
+	unsigned long long oldest = engine->snapshot.oldest ? engine->snapshot.oldest->generation : ULLONG_MAX;
+	pthread_mutex_unlock(&engine->snapshot.lock);
+
+	while (engine->snapshot.retired_head < engine->snapshot.retired_count) {
+		struct engine_retired item = engine->snapshot.retired[engine->snapshot.retired_head];
+		if (item.generation >= oldest)
+			break;
+
+		engine->snapshot.retired_head++;
+		if (item.table)
+			free_index_chunk(base, item.offset);
+		else
+			release_dbchunk(base, item.offset);
+	}
+
+	/* Keep the list from growing while snapshots come and go */
+	size_t head = engine->snapshot.retired_head;
+	if (head == engine->snapshot.retired_count) {
+		engine->snapshot.retired_head = 0;
+		engine->snapshot.retired_count = 0;
+	} else if (head >= engine->snapshot.retired_size / 2) {
+		memmove(engine->snapshot.retired, &engine->snapshot.retired[head], (engine->snapshot.retired_count - head) * sizeof(struct engine_retired));
+		engine->snapshot.retired_count -= head;
+		engine->snapshot.retired_head = 0;
+	}
+}
+
+/*
+ * Table to change in place. While snapshots are open a table they may see
+ * is copied to a new chunk first, the caller links the copy in its parent.
+ */
+static unsigned long long cow_table(base_t *base, unsigned long long offset) {
+	engine_t *engine = base->engine;
+	if (!offset || !snapshot_active(engine) || fresh_has(engine, offset))
+		return offset;
+
+	unsigned long long copy = alloc_table_chunk(base, sizeof(struct _engine_table));
+	struct _engine_table *new_table = get_table_new(base, copy);
+	if (!new_table)
+		return offset;
+
+	const struct _engine_table *table = get_table(base, offset);
+	memcpy(new_table, table, sizeof(struct _engine_table));
+	put_table(base, offset);
+	flush_table(base, copy);
+
+	retire_chunk(engine, offset, TRUE);
+	return copy;
+}
+
+/* Make the top table writable, a copy is stored in the super block */
+static unsigned long long cow_top(base_t *base) {
+	unsigned long long top = cow_table(base, base->engine->top);
+	if (top != base->engine->top) {
+		base->engine->top = top;
+		flush_super(base);
+	}
+	return top;
+}
+
+static void flush_super(base_t *base) {
+	struct _engine_super super;
+	memset(&super, 0, sizeof(struct _engine_super));
+	super.version = to_be32(VERSION_MAJOR | (base->engine->time_order ? SUPER_KEY_TIME : 0));
+	super.top = to_be64(base->engine->top);
+	super.free_top = to_be64(base->engine->free_top);
+
+	wal_defer(base, base->offset.zero, &super, sizeof(struct _engine_super));
+}
+
+static void flush_dbsuper(base_t *base) {
+	struct _engine_dbsuper dbsuper;
+	memset(&dbsuper, 0, sizeof(struct _engine_dbsuper));
+	dbsuper.version = to_be32(VERSION_MAJOR | DBSUPER_BINS | DBSUPER_VALUES);
+	dbsuper.last = to_be64(base->engine->last_block);
+	for (int i = 0; i < HEAP_BINS; ++i)
+		dbsuper.bin[i] = to_be64(base->engine->heap_bin[i]);
+	dbsuper.value_free = to_be64(base->engine->value_free);
+
+	wal_defer(base, base->offset.heap, &dbsuper, sizeof(struct _engine_dbsuper));
+}
 
-	struct _engine_table *new_table = (struct _engine_table *)zcalloc(1, sizeof(struct _engine_table));
-	if (!new_table) {
-		zfree(new_table);
+/*
+ * Compress the data if it shrinks by at least an eighth. The compressed
+ * block is preceded by the original length. Returns NULL if the data is
+ * to be stored as is.
+ */
+static void *pack_data(const void *data, size_t len, size_t *stored) {
+#if COMPRESS_THRESHOLD
+	if (len < COMPRESS_THRESHOLD)
+		return NULL;
+
+	size_t capacity = len - len / 8;
+	char *packed = (char *)zmalloc(capacity);
+	if (!packed)
+		return NULL;
+
+	size_t packed_len = lz4_compress(data, len, packed + sizeof(__be32), capacity - sizeof(__be32));
+	if (!packed_len) {
+		zfree(packed);
+		return NULL;
+	}
+
+	__be32 raw_len = to_be32(len);
+	memcpy(packed, &raw_len, sizeof(__be32));
+	*stored = sizeof(__be32) + packed_len;
+	return packed;
+#else
+	unused(data);
+	unused(len);
+	unused(stored);
+	return NULL;
+#endif
+}
+
+static void *unpack_data(const void *packed, size_t *len) {
+	__be32 raw_len;
+	if (*len < sizeof(__be32)) {
+		error_throw("d3a5e0c71f28", "Data block corrupt");
+		return NULL;
+	}
+
+	memcpy(&raw_len, packed, sizeof(__be32));
+	size_t size = from_be32(raw_len);
+	void *data = zmalloc(size);
+	if (!data) {
 		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	if (lz4_decompress((const char *)packed + sizeof(__be32), *len - sizeof(__be32), data, size) != size) {
+		error_throw("d3a5e0c71f28", "Data block corrupt");
+		zfree(data);
+		return NULL;
+	}
+
+	*len = size;
+	return data;
+}
+
+static unsigned long long insert_data(base_t *base, const void *data, size_t len) {
+	if (!data || len == 0) {
+		error_throw("e8880046e019", "No data provided");
+		return len;
+	}
+
+	if (len <= VALUE_INLINE_SIZE) {
+		base->engine->stats.data_size += len;
+		base->engine->stats.stored_size += len;
+		return insert_value(base, data, len);
+	}
+
+	size_t stored = len;
+	void *packed = pack_data(data, len, &stored);
+
+	/* A block cannot span pages */
+	size_t block = heap_class(stored) ? heap_class_size(heap_class(stored)) : stored;
+	if (sizeof(struct _blob_info) + block > pager_max_alloc(base)) {
+		zfree(packed);
+		error_throw("0b6f3d92a1e5", "Record too large, store as large object");
 		return 0;
 	}
-	new_table->size = to_be16(from_be16(table->size) - TABLE_SIZE / 2 - 1);
 
-	table->size = to_be16(TABLE_SIZE / 2);
-	memcpy(new_table->items, &table->items[TABLE_SIZE / 2 + 1], (from_be16(new_table->size) + 1) * sizeof(struct _engine_item));
+	struct _blob_info info;
+	memset(&info, 0, sizeof(struct _blob_info));
+	info.len = to_be32(stored);
+
+	unsigned int class;
+	uint64_t offset = alloc_dbchunk(base, stored, &class);
+	if (!offset) {
+		zfree(packed);
+		return 0;
+	}
+
+	info.flags = (class << BLOB_CLASS_SHIFT) | (packed ? BLOB_LZ4 : 0);
+	info.next = to_be64(base->engine->last_block);
+	base->engine->last_block = offset;
+
+	wal_write(base, offset, &info, sizeof(struct _blob_info));
+	wal_write(base, offset + sizeof(struct _blob_info), packed ? packed : data, stored);
+	zfree(packed);
+
+	base->engine->stats.data_size += len;
+	base->engine->stats.stored_size += stored;
+	return base->engine->last_block;
+}
+
+/* Split a table. The pivot item is stored to 'key', 'offset' and 'meta'.
+   Returns offset to the new table. */
+static unsigned long long split_table(base_t *base, struct _engine_table *table, struct engine_key *key, unsigned long long *offset, struct metadata *meta) {
+	table_get_key(table, TABLE_SIZE / 2, key);
+	*offset = from_be64(table->offset[TABLE_SIZE / 2]);
+	memcpy(meta, &table->meta[TABLE_SIZE / 2], sizeof(struct metadata));
 
 	unsigned long long new_table_offset = alloc_table_chunk(base, sizeof(struct _engine_table));
-	flush_table(base, new_table, new_table_offset);
+	struct _engine_table *new_table = get_table_new(base, new_table_offset);
+	if (!new_table)
+		return 0;
+
+	new_table->size = to_be16(from_be16(table->size) - TABLE_SIZE / 2 - 1);
+
+	table->size = to_be16(TABLE_SIZE / 2);
+	table_move(new_table, 0, table, TABLE_SIZE / 2 + 1, from_be16(new_table->size) + 1);
+	flush_table(base, new_table_offset);
 
 	return new_table_offset;
 }
@@ -412,245 +1069,258 @@ static unsigned long long split_table(base_t *base, struct _engine_table *table,
 static unsigned long long table_join(base_t *base, unsigned long long offset) {
 	struct _engine_table *table = get_table(base, offset);
 	if (from_be16(table->size) == 0) {
-		unsigned long long ret = from_be64(table->items[0].child);
+		unsigned long long ret = from_be64(table->child[0]);
 		free_index_chunk(base, offset);
 
-		zfree(table);
+		put_table(base, offset);
 		return ret;
 	}
-	put_table(base->engine, table, offset);
+	put_table(base, offset);
 	return offset;
 }
 
 /* Find and remove the smallest item from the given table. The key of the item
-   is stored to 'quid'. Returns offset to the item */
-static unsigned long long take_smallest(base_t *base, unsigned long long table_offset, quid_t *quid) {
+   is stored to 'key' and its metadata to 'meta'. Returns offset to the item */
+static unsigned long long take_smallest(base_t *base, unsigned long long table_offset, struct engine_key *key, struct metadata *meta) {
 	struct _engine_table *table = get_table(base, table_offset);
 	zassert(from_be16(table->size) > 0);
 
 	unsigned long long offset = 0;
-	unsigned long long child = from_be64(table->items[0].child);
+	unsigned long long child = from_be64(table->child[0]);
 	if (child == 0) {
-		offset = remove_table(base, table, 0, quid);
+		offset = remove_table(base, table, 0, key, meta);
 	} else {
 		/* recursion */
-		offset = take_smallest(base, child, quid);
-		table->items[0].child = to_be64(table_join(base, child));
+		child = cow_table(base, child);
+		offset = take_smallest(base, child, key, meta);
+		table->child[0] = to_be64(table_join(base, child));
 	}
-	flush_table(base, table, table_offset);
+	flush_table(base, table_offset);
 	return offset;
 }
 
 /* Find and remove the largest item from the given table. The key of the item
-   is stored to 'quid'. Returns offset to the item */
-static unsigned long long take_largest(base_t *base, unsigned long long table_offset, quid_t *quid) {
+   is stored to 'key' and its metadata to 'meta'. Returns offset to the item */
+static unsigned long long take_largest(base_t *base, unsigned long long table_offset, struct engine_key *key, struct metadata *meta) {
 	struct _engine_table *table = get_table(base, table_offset);
 	zassert(from_be16(table->size) > 0);
 
 	unsigned long long offset = 0;
-	unsigned long long child = from_be64(table->items[from_be16(table->size)].child);
+	unsigned long long child = from_be64(table->child[from_be16(table->size)]);
 	if (child == 0) {
-		offset = remove_table(base, table, from_be16(table->size) - 1, quid);
+		offset = remove_table(base, table, from_be16(table->size) - 1, key, meta);
 	} else {
 		/* recursion */
-		offset = take_largest(base, child, quid);
-		table->items[from_be16(table->size)].child = to_be64(table_join(base, child));
+		child = cow_table(base, child);
+		offset = take_largest(base, child, key, meta);
+		table->child[from_be16(table->size)] = to_be64(table_join(base, child));
 	}
-	flush_table(base, table, table_offset);
+	flush_table(base, table_offset);
 	return offset;
 }
 
 /* Remove an item in position 'i' from the given table. The key of the
-   removed item is stored to 'quid'. Returns offset to the item. */
-static unsigned long long remove_table(base_t *base, struct _engine_table *table, size_t i, quid_t *quid) {
+   removed item is stored to 'key' and its metadata to 'meta', if given.
+   Returns offset to the item. */
+static unsigned long long remove_table(base_t *base, struct _engine_table *table, size_t i, struct engine_key *key, struct metadata *meta) {
 	zassert(i < from_be16(table->size));
 
-	if (quid)
-		memcpy(quid, &table->items[i].quid, sizeof(quid_t));
+	if (key)
+		table_get_key(table, i, key);
+	if (meta)
+		memcpy(meta, &table->meta[i], sizeof(struct metadata));
 
-	unsigned long long offset = from_be64(table->items[i].offset);
-	unsigned long long left_child = from_be64(table->items[i].child);
-	unsigned long long right_child = from_be64(table->items[i + 1].child);
+	unsigned long long offset = from_be64(table->offset[i]);
+	unsigned long long left_child = from_be64(table->child[i]);
+	unsigned long long right_child = from_be64(table->child[i + 1]);
 
 	if (left_child != 0 && right_child != 0) {
 		/* replace the removed item by taking an item from one of the child tables */
+		struct engine_key new_key;
+		struct metadata new_meta;
 		unsigned long long new_offset;
 		if (arc4random() & 1) {
-			new_offset = take_largest(base, left_child, &table->items[i].quid);
-			table->items[i].child = to_be64(table_join(base, left_child));
+			left_child = cow_table(base, left_child);
+			new_offset = take_largest(base, left_child, &new_key, &new_meta);
+			table->child[i] = to_be64(table_join(base, left_child));
 		} else {
-			new_offset = take_smallest(base, right_child, &table->items[i].quid);
-			table->items[i + 1].child = to_be64(table_join(base, right_child));
+			right_child = cow_table(base, right_child);
+			new_offset = take_smallest(base, right_child, &new_key, &new_meta);
+			table->child[i + 1] = to_be64(table_join(base, right_child));
 		}
-		table->items[i].offset = to_be64(new_offset);
+		table_set_key(table, i, &new_key);
+		table->offset[i] = to_be64(new_offset);
+		memcpy(&table->meta[i], &new_meta, sizeof(struct metadata));
 	} else {
-		memmove(&table->items[i], &table->items[i + 1], (from_be16(table->size) - i) * sizeof(struct _engine_item));
+		table_move(table, i, table, i + 1, from_be16(table->size) - i);
 		table->size = decr_be16(table->size);
 
 		if (left_child != 0) {
-			table->items[i].child = to_be64(left_child);
+			table->child[i] = to_be64(left_child);
 		} else {
-			table->items[i].child = to_be64(right_child);
+			table->child[i] = to_be64(right_child);
 		}
 	}
 	return offset;
 }
 
-/* Insert a new item with key 'quid' with the contents in 'data' to the given table.
-   Returns offset to the new item. */
-static unsigned long long insert_table(base_t *base, unsigned long long table_offset, quid_t *quid, struct metadata *meta, const void *data, size_t len) {
+/* Insert a new item with key 'key' pointing to the data block at 'dboffset'
+   to the given table. Returns offset to the new item. */
+static unsigned long long insert_table(base_t *base, unsigned long long table_offset, struct engine_key *key, struct metadata *meta, unsigned long long dboffset) {
 	struct _engine_table *table = get_table(base, table_offset);
+	struct metadata item_meta = *meta;
 	zassert(from_be16(table->size) < TABLE_SIZE - 1);
 
-	size_t left = 0, right = from_be16(table->size);
-	while (left < right) {
-		size_t i = (right - left) / 2 + left;
-		int cmp = quidcmp(quid, &table->items[i].quid);
-		if (cmp == 0) {
-			/* already in the table */
-			unsigned long long ret = from_be64(table->items[i].offset);
-			put_table(base->engine, table, table_offset);
-			error_throw("a475446c70e8", "Key exists");
-			return ret;
-		}
-		if (cmp < 0) {
-			right = i;
-		} else {
-			left = i + 1;
-		}
+	bool found;
+	size_t i = table_search(table, key, &found);
+	if (found) {
+		/* already in the table */
+		unsigned long long ret = from_be64(table->offset[i]);
+		put_table(base, table_offset);
+		error_throw("a475446c70e8", "Key exists");
+		return ret;
 	}
 
-	size_t i = left;
 	unsigned long long offset = 0;
-	unsigned long long left_child = from_be64(table->items[i].child);
+	unsigned long long left_child = from_be64(table->child[i]);
 	unsigned long long right_child = 0; /* after insertion */
 	unsigned long long ret = 0;
 	if (left_child != 0) {
+		/* The child changes, link its copy if it was made */
+		unsigned long long copy = cow_table(base, left_child);
+		bool relinked = copy != left_child;
+		if (relinked) {
+			table->child[i] = to_be64(copy);
+			left_child = copy;
+		}
+
 		/* recursion */
-		ret = insert_table(base, left_child, quid, meta, data, len);
+		ret = insert_table(base, left_child, key, meta, dboffset);
 
 		/* check if we need to split */
 		struct _engine_table *child = get_table(base, left_child);
 		if (from_be16(child->size) < TABLE_SIZE - 1) {
 			/* nothing to do */
-			put_table(base->engine, table, table_offset);
-			put_table(base->engine, child, left_child);
+			if (relinked)
+				flush_table(base, table_offset);
+			else
+				put_table(base, table_offset);
+			put_table(base, left_child);
 			return ret;
 		}
-		/* overwrites QUID */
-		right_child = split_table(base, child, quid, &offset);
+		/* overwrites key */
+		right_child = split_table(base, child, key, &offset, &item_meta);
 		/* flush just in case changes happened */
-		flush_table(base, child, left_child);
+		flush_table(base, left_child);
 	} else {
-		if (data && len > 0) {
-			ret = offset = insert_data(base, data, len);
-		}
+		ret = offset = dboffset;
 	}
 
 	table->size = incr_be16(table->size);
-	memmove(&table->items[i + 1], &table->items[i], (from_be16(table->size) - i) * sizeof(struct _engine_item));
-	memcpy(&table->items[i].quid, quid, sizeof(quid_t));
-	table->items[i].offset = to_be64(offset);
-	memcpy(&table->items[i].meta, meta, sizeof(struct metadata));
-	table->items[i].child = to_be64(left_child);
-	table->items[i + 1].child = to_be64(right_child);
-
-	flush_table(base, table, table_offset);
+	table_move(table, i + 1, table, i, from_be16(table->size) - i);
+	table_set_key(table, i, key);
+	table->offset[i] = to_be64(offset);
+	memcpy(&table->meta[i], &item_meta, sizeof(struct metadata));
+	table->child[i] = to_be64(left_child);
+	table->child[i + 1] = to_be64(right_child);
+
+	flush_table(base, table_offset);
 	return ret;
 }
 
 /*
- * Remove a item with key 'quid' from the given table. The offset to the
+ * Remove a item with key 'key' from the given table. The offset to the
  * removed item is returned.
- * Please note that 'quid' is overwritten when called inside the allocator.
+ * Please note that 'key' is overwritten when called inside the allocator.
  */
-static unsigned long long delete_table(base_t *base, unsigned long long table_offset, quid_t *quid) {
+static unsigned long long delete_table(base_t *base, unsigned long long table_offset, struct engine_key *key) {
 	if (!table_offset) {
 		error_throw("6ef42da7901f", "Record not found");
 		return 0;
 	}
 	struct _engine_table *table = get_table(base, table_offset);
 
-	size_t left = 0, right = from_be16(table->size);
-	while (left < right) {
-		size_t i = (right - left) / 2 + left;
-		int cmp = quidcmp(quid, &table->items[i].quid);
-		if (cmp == 0) {
-			/* found */
-			if (table->items[i].meta.syslock || table->items[i].meta.freeze) {
-				error_throw("4987a3310049", "Record locked");
-				put_table(base->engine, table, table_offset);
-				return 0;
-			}
-			unsigned long long ret = remove_table(base, table, i, quid);
-			flush_table(base, table, table_offset);
-			return ret;
-		}
-		if (cmp < 0) {
-			right = i;
-		} else {
-			left = i + 1;
+	bool found;
+	size_t i = table_search(table, key, &found);
+	if (found) {
+		if (table->meta[i].syslock || table->meta[i].freeze) {
+			error_throw("4987a3310049", "Record locked");
+			put_table(base, table_offset);
+			return 0;
 		}
+		unsigned long long ret = remove_table(base, table, i, key, NULL);
+		flush_table(base, table_offset);
+		return ret;
 	}
 
 	/* not found - recursion */
-	size_t i = left;
-	unsigned long long child = from_be64(table->items[i].child);
-	unsigned long long ret = delete_table(base, child, quid);
+	unsigned long long child = from_be64(table->child[i]);
+	unsigned long long copy = cow_table(base, child);
+	if (copy != child)
+		table->child[i] = to_be64(copy);
+
+	unsigned long long ret = delete_table(base, copy, key);
 	if (ret != 0)
-		table->items[i].child = to_be64(table_join(base, child));
+		table->child[i] = to_be64(table_join(base, copy));
 
 	if (ret == 0 && TABLE_DELETE_LARGE && i < from_be16(table->size)) {
 		/* remove the next largest */
-		ret = remove_table(base, table, i, quid);
+		ret = remove_table(base, table, i, key, NULL);
 	}
-	if (ret != 0) {
+	if (ret != 0 || copy != child) {
 		/* flush just in case changes happened */
-		flush_table(base, table, table_offset);
+		flush_table(base, table_offset);
 	} else {
-		put_table(base->engine, table, table_offset);
+		put_table(base, table_offset);
 	}
 	return ret;
 }
 
-static unsigned long long insert_toplevel(base_t *base, unsigned long long *table_offset, quid_t *quid, struct metadata *meta, const void *data, size_t len) {
+static unsigned long long insert_toplevel(base_t *base, unsigned long long *table_offset, const struct engine_key *c_key, struct metadata *meta, unsigned long long dboffset) {
 	unsigned long long offset = 0;
 	unsigned long long ret = 0;
 	unsigned long long right_child = 0;
+
+	/* Split overwrites the key with the pivot, keep the callers key intact */
+	struct engine_key key;
+	memcpy(&key, c_key, sizeof(struct engine_key));
+	struct metadata item_meta = *meta;
+
 	if (*table_offset != 0) {
-		ret = insert_table(base, *table_offset, quid, meta, data, len);
+		/* The copy is kept even if the insert fails */
+		unsigned long long copy = cow_table(base, *table_offset);
+		if (copy != *table_offset) {
+			*table_offset = copy;
+			flush_super(base);
+		}
+		ret = insert_table(base, *table_offset, &key, meta, dboffset);
 
 		/* check if we need to split */
 		struct _engine_table *table = get_table(base, *table_offset);
 		if (from_be16(table->size) < TABLE_SIZE - 1) {
 			/* nothing to do */
-			put_table(base->engine, table, *table_offset);
+			put_table(base, *table_offset);
 			return ret;
 		}
-		right_child = split_table(base, table, quid, &offset);
-		flush_table(base, table, *table_offset);
+		right_child = split_table(base, table, &key, &offset, &item_meta);
+		flush_table(base, *table_offset);
 	} else {
-		if (data && len > 0) {
-			ret = offset = insert_data(base, data, len);
-		}
+		ret = offset = dboffset;
 	}
 
 	/* create new top level table */
-	struct _engine_table *new_table = (struct _engine_table *)zcalloc(1, sizeof(struct _engine_table));
-	if (!new_table) {
-		zfree(new_table);
-		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+	unsigned long long new_table_offset = alloc_table_chunk(base, sizeof(struct _engine_table));
+	struct _engine_table *new_table = get_table_new(base, new_table_offset);
+	if (!new_table)
 		return 0;
-	}
-	new_table->size = to_be16(1);
-	memcpy(&new_table->items[0].quid, quid, sizeof(quid_t));
-	new_table->items[0].offset = to_be64(offset);
-	memcpy(&new_table->items[0].meta, meta, sizeof(struct metadata));
-	new_table->items[0].child = to_be64(*table_offset);
-	new_table->items[1].child = to_be64(right_child);
 
-	unsigned long long new_table_offset = alloc_table_chunk(base, sizeof(struct _engine_table));
-	flush_table(base, new_table, new_table_offset);
+	new_table->size = to_be16(1);
+	table_set_key(new_table, 0, &key);
+	new_table->offset[0] = to_be64(offset);
+	memcpy(&new_table->meta[0], &item_meta, sizeof(struct metadata));
+	new_table->child[0] = to_be64(*table_offset);
+	new_table->child[1] = to_be64(right_child);
+	flush_table(base, new_table_offset);
 
 	*table_offset = new_table_offset;
 	return ret;
@@ -665,6 +1335,122 @@ static bool islocked(base_t *base) {
 	return FALSE;
 }
 
+/* Key waiting in the memtable, if any */
+static struct memtable_item *find_buffered(const base_t *base, const quid_t *quid) {
+	if (!base->engine->memtable)
+		return NULL;
+
+	return memtable_find(base->engine->memtable, quid);
+}
+
+/* Check if the key is in the tree without raising an error */
+static bool tree_has_key(base_t *base, const quid_t *quid) {
+	struct engine_key key;
+	key_pack(base, quid, &key);
+
+	unsigned long long table_offset = base->engine->top;
+	while (table_offset) {
+		const struct _engine_table *table = get_table(base, table_offset);
+		bool found;
+		size_t i = table_search(table, &key, &found);
+		unsigned long long child = from_be64(table->child[i]);
+		put_table(base, table_offset);
+		if (found)
+			return TRUE;
+
+		table_offset = child;
+	}
+	return FALSE;
+}
+
+/* Log the buffered key so it survives until the next merge */
+static void log_key(base_t *base, const quid_t *quid, const struct metadata *meta, unsigned long long offset, bool removed) {
+	if (!base->wal)
+		return;
+
+	struct _memtable_record record;
+	memset(&record, 0, sizeof(struct _memtable_record));
+	memcpy(&record.quid, quid, sizeof(quid_t));
+	if (meta)
+		memcpy(&record.meta, meta, sizeof(struct metadata));
+	record.offset = to_be64(offset);
+	record.removed = removed;
+
+	wal_log_key(base->wal, &record, sizeof(struct _memtable_record));
+}
+
+/*
+ * Merge the buffered keys into the tree. The keys are inserted in order so
+ * consecutive keys descend along the same path, and every table touched is
+ * logged once for the merge instead of once per key.
+ */
+void engine_flush(base_t *base) {
+	memtable_t *memtable = base->engine->memtable;
+	if (!memtable || !memtable->size)
+		return;
+
+	for (size_t i = 0; i < memtable->size; ++i) {
+		struct memtable_item *item = &memtable->items[i];
+		struct engine_key key;
+		key_pack(base, &item->quid, &key);
+		insert_toplevel(base, &base->engine->top, &key, &item->meta, item->offset);
+	}
+	memtable_clear(memtable);
+
+	flush_super(base);
+	if (base->wal)
+		wal_log_merge(base->wal);
+}
+
+/*
+ * Store a new key with its data. When the engine buffers keys the key is
+ * added to the memtable, otherwise it goes into the tree right away.
+ */
+static int insert_key(base_t *base, const quid_t *quid, struct metadata *meta, const void *data, size_t len) {
+	memtable_t *memtable = base->engine->memtable;
+	if (memtable && (memtable_find(memtable, quid) || tree_has_key(base, quid))) {
+		error_throw("a475446c70e8", "Key exists");
+		return -1;
+	}
+
+	unsigned long long offset = 0;
+	if (data && len > 0) {
+		offset = insert_data(base, data, len);
+		if (iserror())
+			return -1;
+	}
+
+	return insert_offset(base, quid, meta, offset);
+}
+
+/* Bind the key to data already stored, the data is released on failure */
+static int insert_offset(base_t *base, const quid_t *quid, struct metadata *meta, unsigned long long offset) {
+	memtable_t *memtable = base->engine->memtable;
+	if (!memtable) {
+		struct engine_key key;
+		key_pack(base, quid, &key);
+		insert_toplevel(base, &base->engine->top, &key, meta, offset);
+		if (iserror()) {
+			if (offset)
+				free_dbchunk(base, offset);
+			return -1;
+		}
+
+		base->stats.zero_size++;
+		return 0;
+	}
+
+	struct memtable_item *item = memtable_insert(memtable, quid);
+	memcpy(&item->meta, meta, sizeof(struct metadata));
+	item->offset = offset;
+	log_key(base, quid, meta, offset, FALSE);
+
+	base->stats.zero_size++;
+	if (memtable_full(memtable))
+		engine_flush(base);
+	return 0;
+}
+
 int engine_insert_data(base_t *base, quid_t *quid, const void *data, size_t len) {
 	if (islocked(base))
 		return -1;
@@ -673,11 +1459,31 @@ int engine_insert_data(base_t *base, quid_t *quid, const void *data, size_t len)
 	memset(&meta, 0, sizeof(struct metadata));
 	meta.importance = MD_IMPORTANT_NORMAL;
 
-	insert_toplevel(base, &base->engine->top, quid, &meta, data, len);
-	if (iserror())
+	if (insert_key(base, quid, &meta, data, len) < 0)
+		return -1;
+
+	flush_super(base);
+	return 0;
+}
+
+int engine_insert_object(base_t *base, quid_t *quid, unsigned long long offset) {
+	if (islocked(base))
+		return -1;
+
+	memtable_t *memtable = base->engine->memtable;
+	if (memtable && (memtable_find(memtable, quid) || tree_has_key(base, quid))) {
+		error_throw("a475446c70e8", "Key exists");
+		return -1;
+	}
+
+	struct metadata meta;
+	memset(&meta, 0, sizeof(struct metadata));
+	meta.importance = MD_IMPORTANT_NORMAL;
+	meta.type = MD_TYPE_OBJECT;
+
+	if (insert_offset(base, quid, &meta, offset) < 0)
 		return -1;
 
-	base->stats.zero_size++;
 	flush_super(base);
 	return 0;
 }
@@ -686,11 +1492,9 @@ int engine_insert_meta_data(base_t *base, quid_t *quid, struct metadata *meta, c
 	if (islocked(base))
 		return -1;
 
-	insert_toplevel(base, &base->engine->top, quid, meta, data, len);
-	if (iserror())
+	if (insert_key(base, quid, meta, data, len) < 0)
 		return -1;
 
-	base->stats.zero_size++;
 	flush_super(base);
 	return 0;
 }
@@ -704,11 +1508,9 @@ int engine_insert(base_t *base, quid_t *quid) {
 	meta.nodata = TRUE;
 	meta.importance = MD_IMPORTANT_NORMAL;
 
-	insert_toplevel(base, &base->engine->top, quid, &meta, NULL, 0);
-	if (iserror())
+	if (insert_key(base, quid, &meta, NULL, 0) < 0)
 		return -1;
 
-	base->stats.zero_size++;
 	flush_super(base);
 	return 0;
 }
@@ -717,48 +1519,120 @@ int engine_insert_meta(base_t *base, quid_t *quid, struct metadata *meta) {
 	if (islocked(base))
 		return -1;
 
-	insert_toplevel(base, &base->engine->top, quid, meta, NULL, 0);
-	if (iserror())
+	if (insert_key(base, quid, meta, NULL, 0) < 0)
 		return -1;
 
-	base->stats.zero_size++;
 	flush_super(base);
 	return 0;
 }
 
+static int batchcmp(const void *a, const void *b) {
+	const struct engine_batch *item_a = (const struct engine_batch *)a;
+	const struct engine_batch *item_b = (const struct engine_batch *)b;
+	return quidcmp(&item_a->quid, &item_b->quid);
+}
+
+/*
+ * Insert all items in key order. Sorted keys descend along the same path
+ * so the tables involved stay in the buffer pool, and the super block is
+ * written once for the entire batch.
+ */
+int engine_insert_batch(base_t *base, struct engine_batch *items, size_t count) {
+	if (islocked(base))
+		return -1;
+
+	qsort(items, count, sizeof(struct engine_batch), batchcmp);
+
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		struct engine_batch *item = &items[i];
+		if (insert_key(base, &item->quid, &item->meta, item->data, item->len) < 0)
+			break;
+	}
+
+	flush_super(base);
+	return i;
+}
+
+/* Apply a key record recovered from the log */
+static void replay_key(base_t *base, const void *data, size_t len) {
+	struct _memtable_record record;
+	if (len != sizeof(struct _memtable_record))
+		return;
+
+	memcpy(&record, data, sizeof(struct _memtable_record));
+	struct metadata meta = record.meta;
+	unsigned long long offset = from_be64(record.offset);
+
+	/* Buffering was disabled since, the key goes into the tree */
+	memtable_t *memtable = base->engine->memtable;
+	if (!memtable) {
+		struct engine_key key;
+		key_pack(base, &record.quid, &key);
+		if (record.removed) {
+			if (tree_has_key(base, &record.quid)) {
+				cow_top(base);
+				delete_table(base, base->engine->top, &key);
+				base->engine->top = table_join(base, base->engine->top);
+			}
+		} else if (!tree_has_key(base, &record.quid)) {
+			insert_toplevel(base, &base->engine->top, &key, &meta, offset);
+		}
+		return;
+	}
+
+	if (record.removed) {
+		memtable_remove(memtable, &record.quid);
+		return;
+	}
+
+	struct memtable_item *item = memtable_find(memtable, &record.quid);
+	if (!item) {
+		if (memtable_full(memtable))
+			engine_flush(base);
+		item = memtable_insert(memtable, &record.quid);
+	}
+	memcpy(&item->meta, &meta, sizeof(struct metadata));
+	item->offset = offset;
+}
+
 /*
  * Look up item with the given key 'quid' in the given table. Returns offset
  * to the item.
  */
 static unsigned long long lookup_key(base_t *base, unsigned long long table_offset, const quid_t *quid, bool *nodata, bool force, struct metadata *meta) {
+	const struct memtable_item *item = find_buffered(base, quid);
+	if (item) {
+		if (!force && item->meta.lifecycle != MD_LIFECYCLE_FINITE) {
+			error_throw("6ef42da7901f", "Record not found");
+			return 0;
+		}
+		*nodata = item->meta.nodata;
+		memcpy(meta, &item->meta, sizeof(struct metadata));
+		return item->offset;
+	}
+
+	struct engine_key key;
+	key_pack(base, quid, &key);
+
 	while (table_offset) {
-		struct _engine_table *table = get_table(base, table_offset);
-		size_t left = 0, right = from_be16(table->size);
-		while (left < right) {
-			size_t i;
-			i = (right - left) / 2 + left;
-			int cmp = quidcmp(quid, &table->items[i].quid);
-			if (cmp == 0) {
-				/* found */
-				if (!force && table->items[i].meta.lifecycle != MD_LIFECYCLE_FINITE) {
-					error_throw("6ef42da7901f", "Record not found");
-					put_table(base->engine, table, table_offset);
-					return 0;
-				}
-				unsigned long long ret = from_be64(table->items[i].offset);
-				*nodata = table->items[i].meta.nodata;
-				memcpy(meta, &table->items[i].meta, sizeof(struct metadata));
-				put_table(base->engine, table, table_offset);
-				return ret;
-			}
-			if (cmp < 0) {
-				right = i;
-			} else {
-				left = i + 1;
+		const struct _engine_table *table = get_table(base, table_offset);
+		bool found;
+		size_t i = table_search(table, &key, &found);
+		if (found) {
+			if (!force && table->meta[i].lifecycle != MD_LIFECYCLE_FINITE) {
+				error_throw("6ef42da7901f", "Record not found");
+				put_table(base, table_offset);
+				return 0;
 			}
+			unsigned long long ret = from_be64(table->offset[i]);
+			*nodata = table->meta[i].nodata;
+			memcpy(meta, &table->meta[i], sizeof(struct metadata));
+			put_table(base, table_offset);
+			return ret;
 		}
-		unsigned long long child = from_be64(table->items[left].child);
-		put_table(base->engine, table, table_offset);
+		unsigned long long child = from_be64(table->child[i]);
+		put_table(base, table_offset);
 		table_offset = child;
 	}
 	error_throw("6ef42da7901f", "Record not found");
@@ -768,12 +1642,38 @@ static unsigned long long lookup_key(base_t *base, unsigned long long table_offs
 static void *get_data(base_t *base, uint64_t offset, size_t *len) {
 	struct _blob_info info;
 
-	int fd = pager_get_fd(base, &offset);
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+	if (offset & VALUE_HANDLE)
+		return get_value(base, offset, len);
+
+	if (offset & OBJECT_HANDLE) {
+		error_throw("c59e07b2d4a3", "Large object must be streamed");
 		return NULL;
 	}
-	if (read(fd, &info, sizeof(struct _blob_info)) != (ssize_t)sizeof(struct _blob_info)) {
+
+	const struct _blob_info *pinfo = pager_get_map(base, offset, sizeof(struct _blob_info));
+	if (pinfo) {
+		*len = from_be32(pinfo->len);
+		if (!*len)
+			return NULL;
+
+		const void *pdata = pager_get_map(base, offset + sizeof(struct _blob_info), *len);
+		if (pdata) {
+			if (pinfo->flags & BLOB_LZ4)
+				return unpack_data(pdata, len);
+
+			void *data = zcalloc(*len, sizeof(char));
+			if (!data) {
+				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+				return NULL;
+			}
+
+			memcpy(data, pdata, *len);
+			return data;
+		}
+	}
+
+	int fd = pager_get_fd(base, &offset);
+	if (pread(fd, &info, sizeof(struct _blob_info), offset) != (ssize_t)sizeof(struct _blob_info)) {
 		error_throw_fatal("a7df40ba3075", "Failed to read disk");
 		return NULL;
 	}
@@ -788,24 +1688,217 @@ static void *get_data(base_t *base, uint64_t offset, size_t *len) {
 		return NULL;
 	}
 
-	if (read(fd, data, *len) != (ssize_t) *len) {
+	if (pread(fd, data, *len, offset + sizeof(struct _blob_info)) != (ssize_t) *len) {
 		error_throw_fatal("a7df40ba3075", "Failed to read disk");
 		zfree(data);
 		data = NULL;
 		return NULL;
 	}
 
+	if (info.flags & BLOB_LZ4) {
+		void *packed = data;
+		data = unpack_data(packed, len);
+		zfree(packed);
+	}
+
 	return data;
 }
 
-void *get_data_block(base_t *base, unsigned long long offset, size_t *len) {
+unsigned long long put_data_block(base_t *base, const void *data, size_t len) {
 	if (islocked(base))
-		return NULL;
-
-	if (!offset)
-		return NULL;
+		return 0;
 
-	return get_data(base, offset, len);
+	return insert_data(base, data, len);
+}
+
+void free_data_block(base_t *base, unsigned long long offset) {
+	if (islocked(base))
+		return;
+
+	free_dbchunk(base, offset);
+}
+
+void *get_data_block(base_t *base, unsigned long long offset, size_t *len) {
+	if (islocked(base))
+		return NULL;
+
+	if (!offset)
+		return NULL;
+
+	return get_data(base, offset, len);
+}
+
+/* Size class of the object chunks, a chunk takes at most a quarter page */
+static unsigned int object_class(const base_t *base) {
+	size_t limit = pager_max_alloc(base) / 4;
+	if (limit > OBJECT_CHUNK_SIZE)
+		limit = OBJECT_CHUNK_SIZE;
+
+	return heap_class_floor(limit - sizeof(struct _blob_info));
+}
+
+size_t engine_object_chunk(const base_t *base) {
+	return heap_class_size(object_class(base)) - sizeof(struct _blob_chunk);
+}
+
+/* Read the chunk header, the chunk must belong to object 'head' */
+static int read_object_chunk(const base_t *base, uint64_t offset, unsigned long long head, struct _blob_info *info, struct _blob_chunk *chunk) {
+	if (read_block(base, offset, info, sizeof(struct _blob_info)) < 0)
+		return -1;
+	if (read_block(base, offset + sizeof(struct _blob_info), chunk, sizeof(struct _blob_chunk)) < 0)
+		return -1;
+
+	if ((info->flags & BLOB_FREE) || from_be32(info->len) < sizeof(struct _blob_chunk) || from_be64(chunk->head) != head) {
+		error_throw("41c53d0a8e17", "Large object changed during read");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Chunks are always taken from the end of the heap. A block from a bin may
+ * still be referenced by a change that is not yet committed, and chunks are
+ * written in place without the log.
+ */
+int engine_object_write(base_t *base, engine_object_t *object, const void *data, size_t len) {
+	if (islocked(base))
+		return -1;
+
+	if (!data || len == 0) {
+		error_throw("e8880046e019", "No data provided");
+		return -1;
+	}
+
+	zassert(len <= engine_object_chunk(base));
+
+	unsigned int class = object_class(base);
+	uint64_t offset = zpalloc(base, sizeof(struct _blob_info) + heap_class_size(class));
+	if (!offset)
+		return -1;
+
+	struct {
+		struct _blob_info info;
+		struct _blob_chunk chunk;
+	} __attribute__((packed)) header;
+	memset(&header, 0, sizeof(header));
+	header.info.len = to_be32(sizeof(struct _blob_chunk) + len);
+	header.info.flags = class << BLOB_CLASS_SHIFT;
+	header.chunk.head = to_be64(object->head ? object->head : offset);
+
+	wal_write_direct(base, offset, &header, sizeof(header));
+	wal_write_direct(base, offset + sizeof(header), data, len);
+	if (iserror())
+		return -1;
+
+	if (object->tail) {
+		__be64 next = to_be64(offset);
+		wal_write_direct(base, object->tail + sizeof(struct _blob_info) + offsetof(struct _blob_chunk, next), &next, sizeof(__be64));
+	} else {
+		object->head = offset;
+	}
+
+	object->tail = offset;
+	object->size += len;
+	return 0;
+}
+
+unsigned long long engine_object_finish(base_t *base, engine_object_t *object) {
+	if (islocked(base))
+		return 0;
+
+	if (!object->head) {
+		error_throw("e8880046e019", "No data provided");
+		return 0;
+	}
+
+	__be64 size = to_be64(object->size);
+	wal_write_direct(base, object->head + sizeof(struct _blob_info) + offsetof(struct _blob_chunk, size), &size, sizeof(__be64));
+	if (iserror())
+		return 0;
+
+	/* Chunks must be on disk before the key is logged */
+	if (base->wal)
+		pager_fsync(base);
+
+	base->engine->stats.data_size += object->size;
+	base->engine->stats.stored_size += object->size;
+	return OBJECT_HANDLE | object->head;
+}
+
+/* Release the chunks from 'offset' onwards */
+static void free_object(base_t *base, unsigned long long offset) {
+	unsigned long long head = offset;
+	while (offset) {
+		struct _blob_info info;
+		struct _blob_chunk chunk;
+		if (read_object_chunk(base, offset, head, &info, &chunk) < 0) {
+			error_clear();
+			return;
+		}
+
+		release_dbchunk(base, offset);
+		offset = from_be64(chunk.next);
+	}
+}
+
+void engine_object_abort(base_t *base, engine_object_t *object) {
+	if (islocked(base))
+		return;
+
+	free_object(base, object->head);
+	memset(object, 0, sizeof(engine_object_t));
+}
+
+int engine_object_open(base_t *base, unsigned long long offset, engine_object_t *object) {
+	if (islocked(base))
+		return -1;
+
+	memset(object, 0, sizeof(engine_object_t));
+	if (!(offset & OBJECT_HANDLE)) {
+		error_throw("7a2e9d04c6b1", "Not a large object");
+		return -1;
+	}
+
+	offset &= ~OBJECT_HANDLE;
+
+	struct _blob_info info;
+	struct _blob_chunk chunk;
+	if (read_object_chunk(base, offset, offset, &info, &chunk) < 0)
+		return -1;
+
+	object->head = offset;
+	object->next = offset;
+	object->size = from_be64(chunk.size);
+	return 0;
+}
+
+void *engine_object_read(base_t *base, engine_object_t *object, size_t *len) {
+	if (islocked(base))
+		return NULL;
+
+	*len = 0;
+	if (!object->next)
+		return NULL;
+
+	struct _blob_info info;
+	struct _blob_chunk chunk;
+	if (read_object_chunk(base, object->next, object->head, &info, &chunk) < 0)
+		return NULL;
+
+	*len = from_be32(info.len) - sizeof(struct _blob_chunk);
+	void *data = zmalloc(*len);
+	if (!data) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	if (read_block(base, object->next + sizeof(struct _blob_info) + sizeof(struct _blob_chunk), data, *len) < 0) {
+		zfree(data);
+		return NULL;
+	}
+
+	object->next = from_be64(chunk.next);
+	return data;
 }
 
 unsigned long long engine_get(base_t *base, const quid_t *quid, struct metadata *meta) {
@@ -840,13 +1933,131 @@ unsigned long long engine_get_force(base_t *base, const quid_t *quid, struct met
 	return offset;
 }
 
+struct lookup_key {
+	struct engine_key key;
+	struct engine_lookup *item;
+};
+
+static int lookupcmp(const void *a, const void *b) {
+	const struct engine_key *key_a = &((const struct lookup_key *)a)->key;
+	const struct engine_key *key_b = &((const struct lookup_key *)b)->key;
+	if (key_a->hi != key_b->hi)
+		return key_a->hi < key_b->hi ? -1 : 1;
+	if (key_a->lo != key_b->lo)
+		return key_a->lo < key_b->lo ? -1 : 1;
+	return 0;
+}
+
+static void lookup_found(struct engine_lookup *item, const struct metadata *meta, unsigned long long offset) {
+	if (meta->lifecycle != MD_LIFECYCLE_FINITE)
+		return;
+
+	memcpy(&item->meta, meta, sizeof(struct metadata));
+	item->offset = meta->nodata ? 0 : offset;
+	item->found = TRUE;
+}
+
+/*
+ * Resolve the sorted keys against the table. Keys that are not in the table
+ * are grouped by the child they fall into, so every child is visited once.
+ */
+static void lookup_many(base_t *base, unsigned long long table_offset, struct lookup_key *keys, size_t count) {
+	if (!table_offset || !count)
+		return;
+
+	const struct _engine_table *table = get_table(base, table_offset);
+	size_t size = from_be16(table->size);
+	size_t i = 0;
+	while (i < count) {
+		bool found;
+		size_t pos = table_search(table, &keys[i].key, &found);
+		if (found) {
+			struct metadata meta;
+			memcpy(&meta, &table->meta[pos], sizeof(struct metadata));
+			lookup_found(keys[i].item, &meta, from_be64(table->offset[pos]));
+			i++;
+			continue;
+		}
+
+		size_t j = i + 1;
+		if (pos < size) {
+			struct engine_key bound;
+			table_get_key(table, pos, &bound);
+			while (j < count && (keys[j].key.hi < bound.hi || (keys[j].key.hi == bound.hi && keys[j].key.lo < bound.lo)))
+				j++;
+		} else {
+			j = count;
+		}
+
+		lookup_many(base, from_be64(table->child[pos]), &keys[i], j - i);
+		i = j;
+	}
+	put_table(base, table_offset);
+}
+
+void engine_get_many(base_t *base, struct engine_lookup *items, size_t count) {
+	if (islocked(base))
+		return;
+
+	struct lookup_key *keys = (struct lookup_key *)zcalloc(count, sizeof(struct lookup_key));
+	if (!keys) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	size_t pending = 0;
+	for (size_t i = 0; i < count; ++i) {
+		struct engine_lookup *item = &items[i];
+		item->found = FALSE;
+		item->offset = 0;
+
+		const struct memtable_item *buffered = find_buffered(base, &item->quid);
+		if (buffered) {
+			lookup_found(item, &buffered->meta, buffered->offset);
+			continue;
+		}
+
+		key_pack(base, &item->quid, &keys[pending].key);
+		keys[pending].item = item;
+		pending++;
+	}
+
+	qsort(keys, pending, sizeof(struct lookup_key), lookupcmp);
+	lookup_many(base, base->engine->top, keys, pending);
+	zfree(keys);
+}
+
 int engine_purge(base_t *base, quid_t *quid) {
 	if (islocked(base))
 		return -1;
 
-	unsigned long long offset = delete_table(base, base->engine->top, quid);
-	if (iserror())
+	struct memtable_item *item = find_buffered(base, quid);
+	if (item) {
+		if (item->meta.syslock || item->meta.freeze) {
+			error_throw("4987a3310049", "Record locked");
+			return -1;
+		}
+
+		unsigned long long offset = item->offset;
+		memtable_remove(base->engine->memtable, quid);
+		log_key(base, quid, NULL, 0, TRUE);
+		base->stats.zero_size--;
+
+		if (offset)
+			free_dbchunk(base, offset);
+		flush_super(base);
+		return 0;
+	}
+
+	struct engine_key key;
+	key_pack(base, quid, &key);
+	cow_top(base);
+	unsigned long long offset = delete_table(base, base->engine->top, &key);
+	if (iserror()) {
+		/* The path may have been copied all the same */
+		flush_super(base);
 		return -1;
+	}
 
 	base->engine->top = table_join(base, base->engine->top);
 	base->stats.zero_size--;
@@ -856,42 +2067,88 @@ int engine_purge(base_t *base, quid_t *quid) {
 	return 0;
 }
 
-static int set_meta(base_t *base, unsigned long long table_offset, const quid_t *quid, const struct metadata *md) {
-	while (table_offset) {
-		struct _engine_table *table = get_table(base, table_offset);
-		size_t left = 0, right = from_be16(table->size);
-		while (left < right) {
-			size_t i = (right - left) / 2 + left;
-			int cmp = quidcmp(quid, &table->items[i].quid);
-			if (cmp == 0) {
-				if (table->items[i].meta.syslock) {
-					error_throw("4987a3310049", "Record locked");
-					put_table(base->engine, table, table_offset);
-					return -1;
-				}
-				memcpy(&table->items[i].meta, md, sizeof(struct metadata));
-				flush_table(base, table, table_offset);
-				return 0;
-			}
-			if (cmp < 0) {
-				right = i;
-			} else {
-				left = i + 1;
-			}
-		}
-		unsigned long long child = from_be64(table->items[left].child);
-		put_table(base->engine, table, table_offset);
+/*
+ * Find the table holding 'key' and make it writable. With snapshots open
+ * the tables on the path are copied top down, each copy is linked in the
+ * copy of its parent. Returns the table offset and stores the position of
+ * the item in 'index', or 0 if the key is not in the tree.
+ */
+static unsigned long long find_writable(base_t *base, const struct engine_key *key, size_t *index) {
+	unsigned long long path[CURSOR_DEPTH];
+	size_t slot[CURSOR_DEPTH];
+	int depth = 0;
+	bool found = FALSE;
+
+	unsigned long long table_offset = base->engine->top;
+	while (table_offset && !found) {
+		zassert(depth < CURSOR_DEPTH);
+
+		const struct _engine_table *table = get_table(base, table_offset);
+		size_t i = table_search(table, key, &found);
+		unsigned long long child = from_be64(table->child[i]);
+		put_table(base, table_offset);
+
+		path[depth] = table_offset;
+		slot[depth] = i;
+		depth++;
 		table_offset = child;
 	}
-	error_throw("6ef42da7901f", "Record not found");
-	return -1;
+	if (!found)
+		return 0;
+
+	table_offset = cow_top(base);
+	for (int d = 1; d < depth; ++d) {
+		unsigned long long copy = cow_table(base, path[d]);
+		if (copy != path[d]) {
+			struct _engine_table *parent = get_table(base, table_offset);
+			parent->child[slot[d - 1]] = to_be64(copy);
+			flush_table(base, table_offset);
+		}
+		table_offset = copy;
+	}
+
+	*index = slot[depth - 1];
+	return table_offset;
+}
+
+static int set_meta(base_t *base, const quid_t *quid, const struct metadata *md) {
+	struct memtable_item *item = find_buffered(base, quid);
+	if (item) {
+		if (item->meta.syslock) {
+			error_throw("4987a3310049", "Record locked");
+			return -1;
+		}
+		memcpy(&item->meta, md, sizeof(struct metadata));
+		log_key(base, quid, md, item->offset, FALSE);
+		return 0;
+	}
+
+	struct engine_key key;
+	key_pack(base, quid, &key);
+
+	size_t i;
+	unsigned long long table_offset = find_writable(base, &key, &i);
+	if (!table_offset) {
+		error_throw("6ef42da7901f", "Record not found");
+		return -1;
+	}
+
+	struct _engine_table *table = get_table(base, table_offset);
+	if (table->meta[i].syslock) {
+		error_throw("4987a3310049", "Record locked");
+		put_table(base, table_offset);
+		return -1;
+	}
+	memcpy(&table->meta[i], md, sizeof(struct metadata));
+	flush_table(base, table_offset);
+	return 0;
 }
 
 int engine_setmeta(base_t *base, const quid_t *quid, const struct metadata *data) {
 	if (islocked(base))
 		return -1;
 
-	set_meta(base, base->engine->top, quid, data);
+	set_meta(base, quid, data);
 	if (iserror())
 		return -1;
 	return 0;
@@ -908,7 +2165,7 @@ int engine_delete(base_t *base, const quid_t *quid) {
 		return -1;
 
 	meta.lifecycle = MD_LIFECYCLE_RECYCLE;
-	set_meta(base, base->engine->top, quid, &meta);
+	set_meta(base, quid, &meta);
 	if (iserror())
 		return -1;
 
@@ -918,12 +2175,12 @@ int engine_delete(base_t *base, const quid_t *quid) {
 
 #ifdef DEBUG
 void engine_traverse(const base_t *base, unsigned long long table_offset) {
-	struct _engine_table *table = get_table(base, table_offset);
+	const struct _engine_table *table = get_table(base, table_offset);
 	size_t sz = from_be16(table->size);
 	for (int i = 0; i < (int)sz; ++i) {
-		unsigned long long child = from_be64(table->items[i].child);
-		unsigned long long right = from_be64(table->items[i + 1].child);
-		unsigned long long dboffset = from_be64(table->items[i].offset);
+		unsigned long long child = from_be64(table->child[i]);
+		unsigned long long right = from_be64(table->child[i + 1]);
+		unsigned long long dboffset = from_be64(table->offset[i]);
 
 		printf("Location %d data offset: %llu\n", i, dboffset);
 
@@ -932,36 +2189,395 @@ void engine_traverse(const base_t *base, unsigned long long table_offset) {
 		if (right)
 			engine_traverse(base, right);
 	}
-	put_table(base->engine, table, table_offset);
+	put_table(base, table_offset);
 }
 #endif
 
-static void engine_copy(base_t *base, base_t *new_base, unsigned long long table_offset) {
-	struct _engine_table *table = get_table(base, table_offset);
-	size_t sz = from_be16(table->size);
-	for (int i = 0; i < (int)sz; ++i) {
-		unsigned long long child = from_be64(table->items[i].child);
-		unsigned long long right = from_be64(table->items[i + 1].child);
-		unsigned long long dboffset = from_be64(table->items[i].offset);
+/*
+ * In order walk over all items in the tree. The cursor keeps a stack of the
+ * tables on the path to the current item.
+ */
+static void walk_descend(const base_t *base, engine_cursor_t *walk, unsigned long long offset) {
+	while (offset) {
+		zassert(walk->depth < CURSOR_DEPTH - 1);
+
+		walk->depth++;
+		walk->offset[walk->depth] = offset;
+		walk->index[walk->depth] = 0;
+
+		const struct _engine_table *table = get_table(base, offset);
+		unsigned long long child = from_be64(table->child[0]);
+		put_table(base, offset);
+		offset = child;
+	}
+}
 
-		size_t len;
-		void *data = get_data(base, dboffset, &len);
+static void walk_init(const base_t *base, engine_cursor_t *walk) {
+	walk->depth = -1;
+	walk_descend(base, walk, base->engine->top);
+}
 
-		/* Only copy active keys */
-		if (table->items[i].meta.lifecycle == MD_LIFECYCLE_FINITE) {
-			insert_toplevel(new_base, &new_base->engine->top, &table->items[i].quid, &table->items[i].meta, data, len);
-			new_base->stats.zero_size++;
-			flush_super(new_base);
-			error_clear();
+static bool walk_next(const base_t *base, engine_cursor_t *walk, struct engine_item *item) {
+	while (walk->depth >= 0) {
+		unsigned long long offset = walk->offset[walk->depth];
+		size_t i = walk->index[walk->depth];
+
+		const struct _engine_table *table = get_table(base, offset);
+		if (i < from_be16(table->size)) {
+			table_get_key(table, i, &item->key);
+			memcpy(&item->meta, &table->meta[i], sizeof(struct metadata));
+			item->offset = from_be64(table->offset[i]);
+			unsigned long long right = from_be64(table->child[i + 1]);
+			put_table(base, offset);
+
+			walk->index[walk->depth]++;
+			walk_descend(base, walk, right);
+			return TRUE;
+		}
+
+		put_table(base, offset);
+		walk->depth--;
+	}
+	return FALSE;
+}
+
+/* Next item worth keeping, only active keys are copied */
+static bool walk_next_active(const base_t *base, engine_cursor_t *walk, struct engine_item *item) {
+	while (walk_next(base, walk, item)) {
+		if (item->meta.lifecycle == MD_LIFECYCLE_FINITE)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void engine_cursor_open(const base_t *base, engine_cursor_t *cursor) {
+	walk_init(base, cursor);
+	cursor->buffered = 0;
+	cursor->pending = FALSE;
+	cursor->snapshot = FALSE;
+}
+
+/* Descend from 'offset' to the first item equal to or greater than 'quid' */
+static void cursor_seek(const base_t *base, engine_cursor_t *cursor, unsigned long long offset, const quid_t *quid) {
+	cursor->depth = -1;
+
+	struct engine_key key;
+	key_pack(base, quid, &key);
+
+	while (offset) {
+		zassert(cursor->depth < CURSOR_DEPTH - 1);
+
+		const struct _engine_table *table = get_table(base, offset);
+		bool found;
+		size_t i = table_search(table, &key, &found);
+
+		/* Items before the seek key are skipped in this table */
+		cursor->depth++;
+		cursor->offset[cursor->depth] = offset;
+		cursor->index[cursor->depth] = i;
+
+		unsigned long long child = 0;
+		if (!found)
+			child = from_be64(table->child[i]);
+		put_table(base, offset);
+		offset = child;
+	}
+}
+
+void engine_cursor_seek(const base_t *base, engine_cursor_t *cursor, const quid_t *quid) {
+	cursor_seek(base, cursor, base->engine->top, quid);
+	cursor->buffered = 0;
+	cursor->pending = FALSE;
+	cursor->snapshot = FALSE;
+	if (base->engine->memtable)
+		cursor->buffered = memtable_lower_bound(base->engine->memtable, quid);
+}
+
+/*
+ * The memtable only holds keys absent from the tree, so the next key is the
+ * smaller of the next tree item and the next buffered item.
+ */
+bool engine_cursor_next(const base_t *base, engine_cursor_t *cursor, quid_t *quid, struct metadata *meta) {
+	if (!cursor->pending) {
+		struct engine_item item;
+		if (walk_next_active(base, cursor, &item)) {
+			key_unpack(base, &item.key, &cursor->quid);
+			memcpy(&cursor->meta, &item.meta, sizeof(struct metadata));
+			cursor->pending = TRUE;
 		}
+	}
+
+	const memtable_t *memtable = cursor->snapshot ? NULL : base->engine->memtable;
+	const struct memtable_item *buffered = NULL;
+	if (memtable) {
+		while (cursor->buffered < memtable->size && memtable->items[cursor->buffered].meta.lifecycle != MD_LIFECYCLE_FINITE)
+			cursor->buffered++;
+		if (cursor->buffered < memtable->size)
+			buffered = &memtable->items[cursor->buffered];
+	}
+
+	if (buffered && (!cursor->pending || keycmp(base, &buffered->quid, &cursor->quid) < 0)) {
+		cursor->buffered++;
+		memcpy(quid, &buffered->quid, sizeof(quid_t));
+		if (meta)
+			memcpy(meta, &buffered->meta, sizeof(struct metadata));
+		return TRUE;
+	}
+
+	if (!cursor->pending)
+		return FALSE;
+
+	cursor->pending = FALSE;
+	memcpy(quid, &cursor->quid, sizeof(quid_t));
+	if (meta)
+		memcpy(meta, &cursor->meta, sizeof(struct metadata));
+	return TRUE;
+}
+
+void engine_cursor_close(engine_cursor_t *cursor) {
+	cursor->depth = -1;
+}
+
+void engine_snapshot_open(base_t *base, engine_snapshot_t *snapshot) {
+	engine_t *engine = base->engine;
+
+	/* Buffered keys are not in the tree */
+	engine_flush(base);
+
+	/* Every table now in the tree is seen by the snapshot */
+	if (engine->snapshot.fresh_count) {
+		memset(engine->snapshot.fresh, 0, engine->snapshot.fresh_size * sizeof(unsigned long long));
+		engine->snapshot.fresh_count = 0;
+	}
+
+	pthread_mutex_lock(&engine->snapshot.lock);
+	snapshot->root = engine->top;
+	snapshot->generation = ++engine->snapshot.generation;
+	snapshot->prev = engine->snapshot.newest;
+	snapshot->next = NULL;
+	if (engine->snapshot.newest)
+		engine->snapshot.newest->next = snapshot;
+	else
+		engine->snapshot.oldest = snapshot;
+	engine->snapshot.newest = snapshot;
+	pthread_mutex_unlock(&engine->snapshot.lock);
+}
+
+/* Retired chunks are released by the next change to the tree */
+void engine_snapshot_close(base_t *base, engine_snapshot_t *snapshot) {
+	engine_t *engine = base->engine;
+
+	/* The engine was closed since, the snapshot is no longer linked */
+	if (!engine->snapshot.oldest)
+		return;
+
+	pthread_mutex_lock(&engine->snapshot.lock);
+	if (snapshot->prev)
+		snapshot->prev->next = snapshot->next;
+	else
+		engine->snapshot.oldest = snapshot->next;
+	if (snapshot->next)
+		snapshot->next->prev = snapshot->prev;
+	else
+		engine->snapshot.newest = snapshot->prev;
+	pthread_mutex_unlock(&engine->snapshot.lock);
+
+	snapshot->prev = NULL;
+	snapshot->next = NULL;
+}
+
+void engine_snapshot_cursor(const base_t *base, const engine_snapshot_t *snapshot, engine_cursor_t *cursor, const quid_t *quid) {
+	if (quid) {
+		cursor_seek(base, cursor, snapshot->root, quid);
+	} else {
+		cursor->depth = -1;
+		walk_descend(base, cursor, snapshot->root);
+	}
+	cursor->buffered = 0;
+	cursor->pending = FALSE;
+	cursor->snapshot = TRUE;
+}
+
+unsigned long long engine_scan_time(const base_t *base, cuuid_time_t from, cuuid_time_t to, const quid_t *start, engine_scan_t fn, void *arg) {
+	if (!base->engine->time_order) {
+		error_throw("3b1f8a9c2d64", "Vacuum required for time range");
+		return 0;
+	}
+
+	quid_t lower, upper;
+	quid_time_bound(&lower, from);
+	quid_time_bound(&upper, to);
+	if (start && quidcmp(start, &lower) > 0)
+		memcpy(&lower, start, sizeof(quid_t));
+
+	engine_cursor_t cursor;
+	engine_cursor_seek(base, &cursor, &lower);
+
+	quid_t quid;
+	struct metadata meta;
+	unsigned long long count = 0;
+	while (engine_cursor_next(base, &cursor, &quid, &meta)) {
+		if (quidcmp(&quid, &upper) >= 0)
+			break;
+
+		count++;
+		if (!fn(&quid, &meta, arg))
+			break;
+	}
+	engine_cursor_close(&cursor);
+
+	return count;
+}
 
+/* Copy the data at 'offset' into the new base, large objects chunk by chunk */
+static unsigned long long copy_data(base_t *base, base_t *new_base, unsigned long long offset) {
+	size_t len = 0;
+	if (!(offset & OBJECT_HANDLE)) {
+		void *data = get_data(base, offset, &len);
+		unsigned long long new_offset = 0;
+		if (data && len > 0)
+			new_offset = insert_data(new_base, data, len);
+		zfree(data);
+		return new_offset;
+	}
+
+	engine_object_t object, new_object;
+	memset(&new_object, 0, sizeof(engine_object_t));
+	if (engine_object_open(base, offset, &object) < 0)
+		return 0;
+
+	void *data;
+	while ((data = engine_object_read(base, &object, &len))) {
+		engine_object_write(new_base, &new_object, data, len);
 		zfree(data);
-		if (child)
-			engine_copy(base, new_base, child);
-		if (right)
-			engine_copy(base, new_base, right);
 	}
-	put_table(base->engine, table, table_offset);
+
+	if (iserror())
+		return 0;
+	return engine_object_finish(new_base, &new_object);
+}
+
+static void copy_item(base_t *base, base_t *new_base, const struct engine_item *item, struct _engine_table *table, size_t i) {
+	table_set_key(table, i, &item->key);
+	memcpy(&table->meta[i], &item->meta, sizeof(struct metadata));
+	table->offset[i] = 0;
+
+	if (item->offset)
+		table->offset[i] = to_be64(copy_data(base, new_base, item->offset));
+}
+
+/*
+ * Build a subtree of given height holding the next 'count' items from the
+ * walk. The items are divided evenly over the least number of children that
+ * can hold them, 'capacity' lists the item limit per subtree height. Tables
+ * are written as soon as they are complete, children before their parent.
+ */
+static unsigned long long bulk_build(base_t *base, base_t *new_base, engine_cursor_t *walk, unsigned long long count, unsigned int height, const unsigned long long *capacity) {
+	struct _engine_table *table = (struct _engine_table *)zcalloc(1, sizeof(struct _engine_table));
+	if (!table) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return 0;
+	}
+
+	struct engine_item item;
+	unsigned int size = 0;
+	if (!height) {
+		for (; size < count; ++size) {
+			if (!walk_next_active(base, walk, &item))
+				break;
+			copy_item(base, new_base, &item, table, size);
+		}
+	} else {
+		unsigned long long separators = count / (capacity[height - 1] + 1);
+		if (!separators)
+			separators = 1;
+
+		unsigned long long child_items = count - separators;
+		for (unsigned long long j = 0; j <= separators; ++j) {
+			unsigned long long share = child_items / (separators + 1);
+			if (j < child_items % (separators + 1))
+				share++;
+
+			unsigned long long child = bulk_build(base, new_base, walk, share, height - 1, capacity);
+			if (j == separators || !walk_next_active(base, walk, &item)) {
+				table->child[size] = to_be64(child);
+				break;
+			}
+
+			copy_item(base, new_base, &item, table, size);
+			table->child[size] = to_be64(child);
+			size++;
+		}
+	}
+	table->size = to_be16(size);
+	table->layout = to_be16(TABLE_LAYOUT);
+
+	unsigned long long offset = alloc_table_chunk(new_base, sizeof(struct _engine_table));
+	struct _engine_table *new_table = get_table_new(new_base, offset);
+	if (new_table) {
+		memcpy(new_table, table, sizeof(struct _engine_table));
+		flush_table(new_base, offset);
+	}
+
+	zfree(table);
+	return offset;
+}
+
+/*
+ * The source tree is walked in key order, so the new tree is packed bottom
+ * up instead of inserting key by key. Each table is filled up to
+ * REBUILD_FILL percent to leave room for new keys.
+ */
+static void engine_copy(base_t *base, base_t *new_base) {
+	engine_cursor_t walk;
+	struct engine_item item;
+
+	/* Byte ordered keys are inserted one by one into time order */
+	if (!base->engine->time_order) {
+		walk_init(base, &walk);
+		while (walk_next_active(base, &walk, &item)) {
+			unsigned long long offset = 0;
+			if (item.offset)
+				offset = copy_data(base, new_base, item.offset);
+
+			quid_t quid;
+			struct engine_key key;
+			key_unpack(base, &item.key, &quid);
+			key_pack(new_base, &quid, &key);
+			insert_toplevel(new_base, &new_base->engine->top, &key, &item.meta, offset);
+			new_base->stats.zero_size++;
+		}
+		flush_super(new_base);
+		flush_dbsuper(new_base);
+		return;
+	}
+
+	unsigned long long count = 0;
+	walk_init(base, &walk);
+	while (walk_next_active(base, &walk, &item))
+		count++;
+
+	if (!count)
+		return;
+
+	unsigned long long fill = ((TABLE_SIZE - 2) * REBUILD_FILL) / 100;
+	if (fill < 4)
+		fill = 4;
+
+	unsigned long long capacity[CURSOR_DEPTH];
+	unsigned int height = 0;
+	capacity[0] = fill;
+	while (capacity[height] < count) {
+		zassert(height < CURSOR_DEPTH - 1);
+		capacity[height + 1] = fill + (fill + 1) * capacity[height];
+		height++;
+	}
+
+	walk_init(base, &walk);
+	new_base->engine->top = bulk_build(base, new_base, &walk, count, height, capacity);
+	new_base->stats.zero_size = count;
+	flush_super(new_base);
+	flush_dbsuper(new_base);
 }
 
 int engine_rebuild(base_t *base, base_t *new_base) {
@@ -975,8 +2591,15 @@ int engine_rebuild(base_t *base, base_t *new_base) {
 		return -1;
 	}
 
+	/* Open snapshots refer to this tree */
+	if (snapshot_active(base->engine)) {
+		error_throw("8c2e51f07a3d", "Snapshot in use");
+		return -1;
+	}
+
+	engine_flush(base);
 	engine_create(new_base);
-	engine_copy(base, new_base, base->engine->top);
+	engine_copy(base, new_base);
 
 	return 0;
 }
@@ -985,44 +2608,303 @@ int engine_update_data(base_t *base, const quid_t *quid, const void *data, size_
 	if (islocked(base))
 		return -1;
 
-	unsigned long long offset = 0;
-	unsigned long long table_offset = base->engine->top;
-	while (table_offset) {
-		struct _engine_table *table = get_table(base, table_offset);
-		size_t left = 0, right = from_be16(table->size);
-		while (left < right) {
-			size_t i = (right - left) / 2 + left;
-			int cmp = quidcmp(quid, &table->items[i].quid);
-			if (cmp == 0) {
-				if (table->items[i].meta.syslock) {
-					error_throw("4987a3310049", "Record locked");
-					put_table(base->engine, table, table_offset);
-					return -1;
-				}
-				offset = from_be64(table->items[i].offset);
-				free_dbchunk(base, offset);
-				offset = insert_data(base, data, len);
-				table->items[i].offset = to_be64(offset);
-				flush_table(base, table, table_offset);
-				flush_super(base);
-				return 0;
+	struct memtable_item *item = find_buffered(base, quid);
+	if (item) {
+		if (item->meta.syslock) {
+			error_throw("4987a3310049", "Record locked");
+			return -1;
+		}
+		/* The old data is kept if the new data cannot be stored */
+		unsigned long long data_offset = insert_data(base, data, len);
+		if (!data_offset || iserror())
+			return -1;
+
+		unsigned long long offset = item->offset;
+		item->offset = data_offset;
+		free_dbchunk(base, offset);
+		log_key(base, quid, &item->meta, item->offset, FALSE);
+		flush_super(base);
+		return 0;
+	}
+
+	struct engine_key key;
+	key_pack(base, quid, &key);
+
+	size_t i;
+	unsigned long long table_offset = find_writable(base, &key, &i);
+	if (!table_offset) {
+		error_throw("6ef42da7901f", "Record not found");
+		return -1;
+	}
+
+	struct _engine_table *table = get_table(base, table_offset);
+	if (table->meta[i].syslock) {
+		error_throw("4987a3310049", "Record locked");
+		put_table(base, table_offset);
+		return -1;
+	}
+	unsigned long long data_offset = insert_data(base, data, len);
+	if (!data_offset || iserror()) {
+		put_table(base, table_offset);
+		return -1;
+	}
+
+	unsigned long long offset = from_be64(table->offset[i]);
+	table->offset[i] = to_be64(data_offset);
+	free_dbchunk(base, offset);
+	flush_table(base, table_offset);
+	flush_super(base);
+	return 0;
+}
+
+/*
+ * Pages with at least COMPACT_THRESHOLD percent of free heap are emptied,
+ * sparsest first. The page allocations are taken from is left alone.
+ */
+int engine_compact_start(base_t *base) {
+	if (islocked(base))
+		return -1;
+
+	engine_t *engine = base->engine;
+	if (engine->compact.count)
+		return engine->compact.count;
+
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+	unsigned long long *space = (unsigned long long *)zcalloc(base->core->count, sizeof(unsigned long long));
+	if (!space) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return -1;
+	}
+
+	for (int i = 0; i < HEAP_BINS; ++i) {
+		unsigned long long offset = engine->heap_bin[i];
+		while (offset) {
+			struct _blob_info info;
+			if (read_block(base, offset, &info, sizeof(struct _blob_info)) < 0) {
+				zfree(space);
+				return -1;
 			}
-			if (cmp < 0) {
-				right = i;
+
+			if (!(info.flags & BLOB_HISTORY))
+				space[offset / page_size] += block_size(&info);
+			offset = from_be64(info.next);
+		}
+	}
+
+	unsigned int current = base->pager.offset / page_size;
+	while (engine->compact.count < COMPACT_PAGES) {
+		unsigned int sparsest = current;
+		for (unsigned int page = 0; page < base->core->count; ++page) {
+			if (page != current && space[page] > space[sparsest])
+				sparsest = page;
+		}
+
+		if (sparsest == current || space[sparsest] * 100 < page_size * COMPACT_THRESHOLD)
+			break;
+
+		engine->compact.page[engine->compact.count++] = sparsest;
+		space[sparsest] = 0;
+	}
+	zfree(space);
+
+	if (!engine->compact.count)
+		return 0;
+
+	/* Free blocks in these pages are no longer handed out */
+	for (int i = 0; i < HEAP_BINS; ++i) {
+		struct _blob_info prev_info;
+		unsigned long long prev = 0;
+		unsigned long long offset = engine->heap_bin[i];
+		while (offset) {
+			struct _blob_info info;
+			if (read_block(base, offset, &info, sizeof(struct _blob_info)) < 0)
+				return -1;
+
+			unsigned long long next = from_be64(info.next);
+			if (compact_page(base, offset) && !(info.flags & BLOB_HISTORY)) {
+				compact_retire(base, offset, block_size(&info));
+				base->stats.heap_free_size--;
+				if (prev) {
+					prev_info.next = to_be64(next);
+					wal_write(base, prev, &prev_info, sizeof(struct _blob_info));
+				} else {
+					engine->heap_bin[i] = next;
+				}
 			} else {
-				left = i + 1;
+				prev = offset;
+				memcpy(&prev_info, &info, sizeof(struct _blob_info));
 			}
+			offset = next;
 		}
-		unsigned long long child = from_be64(table->items[left].child);
-		put_table(base->engine, table, table_offset);
-		table_offset = child;
 	}
-	error_throw("6ef42da7901f", "Record not found");
-	return -1;
+	flush_dbsuper(base);
+
+	engine->compact.resume = FALSE;
+	return engine->compact.count;
+}
+
+/* Point the key to the moved data block */
+static int replace_offset(base_t *base, const struct engine_key *key, unsigned long long old_offset, unsigned long long offset) {
+	size_t i;
+	unsigned long long table_offset = find_writable(base, key, &i);
+	if (!table_offset)
+		return -1;
+
+	struct _engine_table *table = get_table(base, table_offset);
+	if (from_be64(table->offset[i]) != old_offset) {
+		put_table(base, table_offset);
+		return -1;
+	}
+
+	table->offset[i] = to_be64(offset);
+	flush_table(base, table_offset);
+	return 0;
+}
+
+/* Copy the data block of the item out of the compacted page as stored */
+static size_t relocate_block(base_t *base, const struct engine_item *item) {
+	struct _blob_info info;
+	if (read_block(base, item->offset, &info, sizeof(struct _blob_info)) < 0)
+		return 0;
+
+	size_t len = from_be32(info.len);
+	if (!len || (info.flags & (BLOB_FREE | BLOB_HISTORY)))
+		return 0;
+
+	void *data = zmalloc(len);
+	if (!data) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return 0;
+	}
+
+	if (read_block(base, item->offset + sizeof(struct _blob_info), data, len) < 0) {
+		zfree(data);
+		return 0;
+	}
+
+	unsigned int class;
+	unsigned long long offset = alloc_dbchunk(base, len, &class);
+	if (!offset) {
+		zfree(data);
+		return 0;
+	}
+
+	info.flags = (class << BLOB_CLASS_SHIFT) | (info.flags & BLOB_LZ4);
+	info.next = to_be64(base->engine->last_block);
+	base->engine->last_block = offset;
+
+	wal_write(base, offset, &info, sizeof(struct _blob_info));
+	wal_write(base, offset + sizeof(struct _blob_info), data, len);
+	zfree(data);
+
+	if (replace_offset(base, &item->key, item->offset, offset) < 0) {
+		free_dbchunk(base, offset);
+		return 0;
+	}
+
+	free_dbchunk(base, item->offset);
+	return sizeof(struct _blob_info) + len;
+}
+
+/*
+ * Walk the keys from where the previous step stopped. Value slots and large
+ * objects stay where they are.
+ */
+int engine_compact_step(base_t *base, size_t budget) {
+	if (islocked(base))
+		return -1;
+
+	engine_t *engine = base->engine;
+	if (!engine->compact.count)
+		return 0;
+
+	/* Blocks moved now would only be released after the snapshots */
+	if (snapshot_active(engine))
+		return 1;
+
+	/* Buffered keys have no table slot to update */
+	engine_flush(base);
+
+	engine_cursor_t walk;
+	if (engine->compact.resume)
+		engine_cursor_seek(base, &walk, &engine->compact.next);
+	else
+		walk_init(base, &walk);
+
+	size_t moved = 0;
+	unsigned int visited = 0;
+	struct engine_item item;
+	while (walk_next(base, &walk, &item)) {
+		if (moved >= budget || visited >= COMPACT_STEP_KEYS) {
+			key_unpack(base, &item.key, &engine->compact.next);
+			engine->compact.resume = TRUE;
+			return 1;
+		}
+		visited++;
+
+		if (!item.offset || (item.offset & (VALUE_HANDLE | OBJECT_HANDLE)) || !compact_page(base, item.offset))
+			continue;
+
+		moved += relocate_block(base, &item);
+		if (iserror())
+			return -1;
+	}
+
+	engine->compact.count = 0;
+	engine->compact.resume = FALSE;
+	flush_super(base);
+	flush_dbsuper(base);
+	return 0;
+}
+
+static int releasecmp(const void *a, const void *b) {
+	const struct engine_release *release_a = (const struct engine_release *)a;
+	const struct engine_release *release_b = (const struct engine_release *)b;
+	if (release_a->offset == release_b->offset)
+		return 0;
+	return release_a->offset < release_b->offset ? -1 : 1;
+}
+
+/*
+ * Hand the storage of retired blocks back to the file system. The log is
+ * forced first, recovery must not bring back a reference to these blocks.
+ * Neighbouring blocks are released as one region, the file system only
+ * frees whole blocks of its own.
+ */
+size_t engine_compact_release(base_t *base) {
+	engine_t *engine = base->engine;
+	if (!engine->compact.release_count)
+		return 0;
+
+	if (base->wal)
+		wal_sync(base->wal, base->wal->lsn);
+
+	struct engine_release *release = engine->compact.release;
+	qsort(release, engine->compact.release_count, sizeof(struct engine_release), releasecmp);
+
+	size_t size = 0;
+	for (size_t i = 0; i < engine->compact.release_count;) {
+		unsigned long long offset = release[i].offset;
+		size_t len = release[i].len;
+		for (++i; i < engine->compact.release_count && release[i].offset == offset + len; ++i)
+			len += release[i].len;
+
+		pager_release(base, offset, len);
+		size += len;
+	}
+	engine->compact.release_count = 0;
+	engine->stats.released += size;
+
+	if (!engine->compact.count) {
+		zfree(engine->compact.release);
+		engine->compact.release = NULL;
+		engine->compact.release_size = 0;
+	}
+	return size;
 }
 
 char *get_str_lifecycle(enum key_lifecycle lifecycle) {
-	static char buf[STATUS_LIFECYCLE_SIZE];
+	static _Thread_local char buf[STATUS_LIFECYCLE_SIZE];
 	switch (lifecycle) {
 		case MD_LIFECYCLE_FINITE:
 			strlcpy(buf, "FINITE", STATUS_LIFECYCLE_SIZE);
@@ -1048,7 +2930,7 @@ char *get_str_lifecycle(enum key_lifecycle lifecycle) {
 }
 
 char *get_str_type(enum key_type key_type) {
-	static char buf[STATUS_TYPE_SIZE];
+	static _Thread_local char buf[STATUS_TYPE_SIZE];
 	switch (key_type) {
 		case MD_TYPE_GROUP:
 			strlcpy(buf, "GROUP", STATUS_TYPE_SIZE);
@@ -1059,6 +2941,9 @@ char *get_str_type(enum key_type key_type) {
 		case MD_TYPE_INDEX:
 			strlcpy(buf, "INDEX", STATUS_TYPE_SIZE);
 			break;
+		case MD_TYPE_OBJECT:
+			strlcpy(buf, "OBJECT", STATUS_TYPE_SIZE);
+			break;
 		case MD_TYPE_RECORD:
 		default:
 			strlcpy(buf, "RECORD", STATUS_TYPE_SIZE);
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
@@ -12,8 +13,12 @@
 #include "base.h"
 
 #define INSTANCE_LENGTH 32
+#define CURSOR_DEPTH	32
+#define HEAP_BINS		31
+#define COMPACT_PAGES	8
 
 typedef struct base base_t;
+typedef struct memtable memtable_t;
 
 enum key_lifecycle {
 	MD_LIFECYCLE_FINITE = 0,
@@ -43,7 +48,8 @@ enum key_type {
 	MD_TYPE_RECORD = 0,		/* Key maps to record */
 	MD_TYPE_GROUP,			/* Key represents a table or set */
 	MD_TYPE_INDEX,			/* Key points to index */
-	MD_TYPE_RAW				/* Key for internal strucuture */
+	MD_TYPE_RAW,			/* Key for internal strucuture */
+	MD_TYPE_OBJECT			/* Key maps to large object */
 };
 
 struct metadata {
@@ -58,23 +64,66 @@ struct metadata {
 	unsigned int _res		: 15;	/* Reserved */
 };
 
-struct engine_cache {
+/* Heap range to hand back to the file system */
+struct engine_release {
 	unsigned long long offset;
-	struct _engine_table *table;
+	size_t len;
 };
 
-struct engine_dbcache {
-	unsigned int len;
+/* Chunk freed while an open snapshot may still read it */
+struct engine_retired {
 	unsigned long long offset;
+	unsigned long long generation;	/* Last generation able to see it */
+	bool table;
 };
 
+/*
+ * Point in time view of the tree. The tables reachable from 'root' are not
+ * changed, nor are the chunks they refer to released, while it is open.
+ */
+typedef struct engine_snapshot {
+	unsigned long long root;
+	unsigned long long generation;
+	struct engine_snapshot *prev;
+	struct engine_snapshot *next;
+} engine_snapshot_t;
+
 typedef struct engine {
 	unsigned long long top;
 	unsigned long long free_top;
 	unsigned long long last_block;
 	bool lock;
-	struct engine_cache cache[CACHE_SLOTS];
-	struct engine_dbcache dbcache[DBCACHE_SLOTS];
+	bool time_order;		/* Keys are ordered by creation time */
+	unsigned long long heap_bin[HEAP_BINS];	/* Free data blocks per size class */
+	unsigned long long value_free;	/* Value pages with free slots */
+	memtable_t *memtable;	/* New keys not yet merged into the tree */
+	struct {
+		unsigned int page[COMPACT_PAGES];	/* Pages being emptied */
+		unsigned int count;
+		bool resume;			/* Walk continues at 'next' */
+		quid_t next;
+		struct engine_release *release;	/* Free blocks in the pages */
+		size_t release_count;
+		size_t release_size;
+	} compact;
+	struct {
+		pthread_mutex_t lock;	/* Guards the list, closed without engine lock */
+		engine_snapshot_t *oldest;
+		engine_snapshot_t *newest;
+		unsigned long long generation;
+		struct engine_retired *retired;	/* In generation order */
+		size_t retired_head;
+		size_t retired_count;
+		size_t retired_size;
+		unsigned long long *fresh;	/* Tables created since the last snapshot */
+		size_t fresh_count;
+		size_t fresh_size;
+	} snapshot;
+	struct {
+		unsigned long long data_size;	/* Data written since open */
+		unsigned long long stored_size;	/* Same data as stored on the heap */
+		unsigned long long released;	/* Heap returned by compaction */
+	} stats;
 } engine_t;
 
 bool engine_keytype_hasdata(enum key_type type);
@@ -99,15 +148,86 @@ int engine_insert_meta_data(base_t *base, quid_t *quid, struct metadata *meta, c
 int engine_insert_meta(base_t *base, quid_t *quid, struct metadata *meta);
 int engine_insert(base_t *base, quid_t *quid);
 
+struct engine_batch {
+	quid_t quid;
+	struct metadata meta;
+	const void *data;
+	size_t len;
+	size_t index;			/* Position in the callers request */
+};
+
+/*
+ * Insert a batch of items in one pass. The items are sorted by key in place,
+ * use 'index' to map them back. Returns the number of items inserted.
+ */
+int engine_insert_batch(base_t *base, struct engine_batch *items, size_t count);
+
 /*
  * Look up item with the given key 'quid' in the database file. Length of the
  * item is stored in 'len'. Returns a pointer to the contents of the item.
  * The returned pointer should be released with free() after use.
  */
 void *get_data_block(base_t *base, unsigned long long offset, size_t *len);
+
+/*
+ * Store data on the heap without a key, the block is released with
+ * free_data_block(). Returns the offset of the block.
+ */
+unsigned long long put_data_block(base_t *base, const void *data, size_t len);
+void free_data_block(base_t *base, unsigned long long offset);
 unsigned long long engine_get(base_t *base, const quid_t *quid, struct metadata *meta);
 unsigned long long engine_get_force(base_t *base, const quid_t *quid, struct metadata *meta);
 
+struct engine_lookup {
+	quid_t quid;
+	struct metadata meta;
+	unsigned long long offset;	/* Data block, 0 if none */
+	bool found;
+};
+
+/*
+ * Look up a set of keys in one descent of the tree, each table on the way is
+ * read once for all keys below it. Only live items are marked 'found', the
+ * order of the items is left as is.
+ */
+void engine_get_many(base_t *base, struct engine_lookup *items, size_t count);
+
+/*
+ * Large object stored as a chain of chunks, each small enough for a page.
+ * An object is written and read one chunk at a time so it never has to be
+ * held in memory as a whole.
+ */
+typedef struct engine_object {
+	unsigned long long head;	/* First chunk */
+	unsigned long long tail;	/* Last chunk written */
+	unsigned long long next;	/* Next chunk to read */
+	unsigned long long size;
+} engine_object_t;
+
+/*
+ * Largest chunk accepted by engine_object_write().
+ */
+size_t engine_object_chunk(const base_t *base);
+
+/*
+ * Append a chunk to the object. Chunks bypass the log, the object becomes
+ * durable in engine_object_finish() which returns the data offset to bind
+ * to a key with engine_insert_object(). Unfinished objects are released
+ * with engine_object_abort().
+ */
+int engine_object_write(base_t *base, engine_object_t *object, const void *data, size_t len);
+unsigned long long engine_object_finish(base_t *base, engine_object_t *object);
+void engine_object_abort(base_t *base, engine_object_t *object);
+int engine_insert_object(base_t *base, quid_t *quid, unsigned long long offset);
+
+/*
+ * Open the object at the data offset of a key, engine_object_read() then
+ * returns one chunk per call and NULL after the last chunk. The returned
+ * pointer should be released with free() after use.
+ */
+int engine_object_open(base_t *base, unsigned long long offset, engine_object_t *object);
+void *engine_object_read(base_t *base, engine_object_t *object, size_t *len);
+
 /*
  * Remove item with the given key 'quid' from the database file.
  */
@@ -115,6 +235,11 @@ int engine_purge(base_t *base, quid_t *quid);
 
 void engine_sync(base_t *base);
 
+/*
+ * Merge the keys buffered in the memtable into the tree.
+ */
+void engine_flush(base_t *base);
+
 int engine_setmeta(base_t *base, const quid_t *quid, const struct metadata *data);
 
 int engine_delete(base_t *base, const quid_t *quid);
@@ -123,7 +248,77 @@ int engine_delete(base_t *base, const quid_t *quid);
 void engine_traverse(const base_t *base, unsigned long long table_offset);
 #endif
 
+/*
+ * Cursor over the keys in QUID order. The cursor holds no reference into the
+ * tree between calls, but is only valid while the tree is not altered.
+ * Buffered keys are merged with the tree on the fly.
+ */
+typedef struct engine_cursor {
+	unsigned long long offset[CURSOR_DEPTH];
+	size_t index[CURSOR_DEPTH];
+	int depth;
+	size_t buffered;		/* Next item in the memtable */
+	bool pending;			/* Tree item read ahead */
+	bool snapshot;			/* Walks a snapshot, memtable is left out */
+	quid_t quid;
+	struct metadata meta;
+} engine_cursor_t;
+
+/*
+ * Position the cursor on the first key, or on the first key equal to or
+ * greater than 'quid'.
+ */
+void engine_cursor_open(const base_t *base, engine_cursor_t *cursor);
+void engine_cursor_seek(const base_t *base, engine_cursor_t *cursor, const quid_t *quid);
+
+/*
+ * Store the next active key and its metadata, returns FALSE past the last
+ * key.
+ */
+bool engine_cursor_next(const base_t *base, engine_cursor_t *cursor, quid_t *quid, struct metadata *meta);
+void engine_cursor_close(engine_cursor_t *cursor);
+
+/*
+ * Take a snapshot of the tree. Buffered keys are merged first, so the caller
+ * must hold the engine exclusively. While snapshots are open every table
+ * about to change is copied to a new chunk and the copy is linked in its
+ * place, released chunks are kept until no snapshot can see them. The
+ * tables of a snapshot can thus be read while the tree is being changed.
+ * A snapshot may be closed at any time.
+ */
+void engine_snapshot_open(base_t *base, engine_snapshot_t *snapshot);
+void engine_snapshot_close(base_t *base, engine_snapshot_t *snapshot);
+
+/*
+ * Position the cursor on the first key of the snapshot, or on the first key
+ * equal to or greater than 'quid' when given. The cursor stays valid for as
+ * long as the snapshot is open.
+ */
+void engine_snapshot_cursor(const base_t *base, const engine_snapshot_t *snapshot, engine_cursor_t *cursor, const quid_t *quid);
+
+typedef bool (*engine_scan_t)(const quid_t *quid, const struct metadata *meta, void *arg);
+
+/*
+ * Visit the active keys created in the time window [from, to) in order of
+ * creation, or from 'start' onwards when given. The scan seeks to the start
+ * of the window and stops when 'fn' returns FALSE. Returns the number of
+ * keys visited.
+ */
+unsigned long long engine_scan_time(const base_t *base, cuuid_time_t from, cuuid_time_t to, const quid_t *start, engine_scan_t fn, void *arg);
+
 int engine_rebuild(base_t *base, base_t *new_base);
+
+/*
+ * Online compaction in small steps. engine_compact_start() picks the pages
+ * with the most free heap space and takes their free blocks out of the bins.
+ * Every engine_compact_step() then moves live data blocks out of these
+ * pages, up to 'budget' bytes, and returns 0 once all keys are visited.
+ * The storage of the free blocks is handed back by engine_compact_release()
+ * which must only run after the changes are committed.
+ */
+int engine_compact_start(base_t *base);
+int engine_compact_step(base_t *base, size_t budget);
+size_t engine_compact_release(base_t *base);
 int engine_update_data(base_t *base, const quid_t *quid, const void *data, size_t len);
 
 char *get_str_lifecycle(enum key_lifecycle lifecycle);
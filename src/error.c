@@ -9,7 +9,7 @@
 #include "zmalloc.h"
 #include "error.h"
 
-static struct error stack;
+static _Thread_local struct error stack;
 
 void error_clear() {
 	memset(&stack.error_squid, 0, 12 + 1);
@@ -7,9 +7,14 @@
 #include <error.h>
 #include "zmalloc.h"
 #include "quid.h"
+#include "time.h"
+#include "lz4.h"
+#include "engine.h"
 #include "pager.h"
+#include "bufpool.h"
 
 #define HISTORY_LIST_SIZE	32
+#define HISTORY_LAYOUT		0x8000	/* List items refer to version records */
 
 struct _history_list {
 	struct {
@@ -21,122 +26,315 @@ struct _history_list {
 	__be64 link;
 } __attribute__((packed));
 
+/*
+ * Version record on the heap. The newest version of a key is compressed
+ * on its own, every older version is compressed against the next newer
+ * one so only the changes between versions take up space.
+ */
+struct _history_record {
+	__be64 timestamp;
+	__be32 len;
+	__be8 delta;
+} __attribute__((packed));
+
+/* Version of a key as found in the lists */
+struct history_entry {
+	unsigned long long list;
+	int index;
+	unsigned short version;
+	unsigned long long offset;
+	bool record;
+};
+
 /* Read list structure from offset */
 static struct _history_list *get_history_list(base_t *base, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+	return (struct _history_list *)bufpool_pin(base, offset, sizeof(struct _history_list));
+}
 
-	struct _history_list *list = (struct _history_list *)zcalloc(1, sizeof(struct _history_list));
-	if (!list) {
-		zfree(list);
-		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-		return NULL;
-	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	if (read(fd, list, sizeof(struct _history_list)) != sizeof(struct _history_list)) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	return list;
+/* Pin a zeroed list structure for a newly allocated chunk */
+static struct _history_list *get_history_list_new(base_t *base, uint64_t offset) {
+	return (struct _history_list *)bufpool_pin_new(base, offset, sizeof(struct _history_list));
 }
 
-static void flush_history_list(base_t *base, struct _history_list *list, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+/* Release list structure without changes */
+static void put_history_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, FALSE);
+}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	if (write(fd, list, sizeof(struct _history_list)) != sizeof(struct _history_list)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	zfree(list);
+/* Release list structure and schedule it for write back */
+static void flush_history_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, TRUE);
+}
+
+static int list_size(const struct _history_list *list) {
+	return from_be16(list->size) & ~HISTORY_LAYOUT;
+}
+
+/* Lists from older versions refer to full data blocks */
+static bool list_records(const struct _history_list *list) {
+	return from_be16(list->size) & HISTORY_LAYOUT;
 }
 
 #ifdef DEBUG
 void history_dump(base_t *base) {
 	unsigned long long offset = base->offset.history;
 	while (offset) {
-		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+		const struct _history_list *list = get_history_list(base, offset);
+		zassert(list_size(list) <= HISTORY_LIST_SIZE);
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
+		for (int i = 0; i < list_size(list); ++i) {
 			char squid[QUID_LENGTH + 1];
 			quidtostr(squid, &list->items[i].quid);
 
 			printf("Location %d key: %s, version: %d, offset: %llu\n", i, squid, from_be16(list->items[i].version), (unsigned long long)from_be64(list->items[i].offset));
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_history_list(base, offset);
+		offset = link;
 	}
 }
 #endif
 
-static unsigned short history_get_next_version(base_t *base, const quid_t *c_quid) {
-	short version = -1;
+static int entrycmp(const void *a, const void *b) {
+	const struct history_entry *ea = (const struct history_entry *)a;
+	const struct history_entry *eb = (const struct history_entry *)b;
+	return (ea->version > eb->version) - (ea->version < eb->version);
+}
+
+/*
+ * Gather all versions of a key ordered from old to new. If hole is given
+ * it receives the first free slot in a record list, if any.
+ */
+static struct history_entry *history_collect(base_t *base, const quid_t *c_quid, size_t *count, struct history_entry *hole) {
+	struct history_entry *entries = NULL;
+	size_t allocated = 0;
+
+	*count = 0;
+	if (hole)
+		hole->list = 0;
 
 	unsigned long long offset = base->offset.history;
 	while (offset) {
-		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+		const struct _history_list *list = get_history_list(base, offset);
+		zassert(list_size(list) <= HISTORY_LIST_SIZE);
+
+		for (int i = 0; i < list_size(list); ++i) {
+			if (!list->items[i].offset) {
+				if (hole && !hole->list && list_records(list)) {
+					hole->list = offset;
+					hole->index = i;
+				}
+				continue;
+			}
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
-			int cmp = quidcmp(c_quid, &list->items[i].quid);
-			if (cmp == 0) {
-				version = from_be16(list->items[i].version);
+			if (quidcmp(c_quid, &list->items[i].quid))
+				continue;
+
+			if (*count == allocated) {
+				allocated = allocated ? allocated * 2 : 16;
+				entries = (struct history_entry *)zrealloc(entries, allocated * sizeof(struct history_entry));
 			}
+
+			struct history_entry *entry = &entries[(*count)++];
+			entry->list = offset;
+			entry->index = i;
+			entry->version = from_be16(list->items[i].version);
+			entry->offset = from_be64(list->items[i].offset);
+			entry->record = list_records(list);
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_history_list(base, offset);
+		offset = link;
 	}
 
-	if (version != -1)
-		return ++version;
+	if (*count > 1)
+		qsort(entries, *count, sizeof(struct history_entry), entrycmp);
 
-	return 0;
+	return entries;
 }
 
-unsigned long long history_get_version_offset(base_t *base, const quid_t *c_quid, unsigned short version) {
-	unsigned long long offset = base->offset.history;
-	while (offset) {
-		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+/* Store a version, compressed against the next newer version if given */
+static unsigned long long put_record(base_t *base, const void *data, size_t len, const void *newer, size_t newer_len, long long timestamp) {
+	size_t bound = lz4_bound(len);
+	char *window = (char *)zmalloc(newer_len + len + 1);
+	char *record = (char *)zmalloc(sizeof(struct _history_record) + bound);
+	if (!window || !record) {
+		zfree(window);
+		zfree(record);
+		return 0;
+	}
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
-			if (!list->items[i].offset)
-				continue;
+	if (newer_len)
+		memcpy(window, newer, newer_len);
+	memcpy(window + newer_len, data, len);
 
-			int cmp = quidcmp(c_quid, &list->items[i].quid);
-			if (cmp == 0) {
-				if (from_be16(list->items[i].version) == version) {
-					unsigned long long version_offset = from_be64(list->items[i].offset);
-					zfree(list);
-					return version_offset;
-				}
-			}
+	struct _history_record header;
+	header.timestamp = to_be64(timestamp);
+	header.len = to_be32(len);
+	header.delta = newer ? 1 : 0;
+	memcpy(record, &header, sizeof(struct _history_record));
+
+	size_t packed = lz4_compress_prefix(window, newer_len, len, record + sizeof(struct _history_record), bound);
+	unsigned long long offset = put_data_block(base, record, sizeof(struct _history_record) + packed);
+
+	zfree(window);
+	zfree(record);
+	return offset;
+}
+
+/* Restore a version, delta records need the next newer version */
+static void *get_record(base_t *base, unsigned long long offset, const void *newer, size_t newer_len, size_t *len, long long *timestamp) {
+	size_t record_len;
+	char *record = (char *)get_data_block(base, offset, &record_len);
+	if (!record)
+		return NULL;
+
+	struct _history_record header;
+	if (record_len < sizeof(struct _history_record))
+		goto corrupt;
+
+	memcpy(&header, record, sizeof(struct _history_record));
+	if (header.delta && !newer)
+		goto corrupt;
+
+	*len = from_be32(header.len);
+	if (timestamp)
+		*timestamp = from_be64(header.timestamp);
+
+	size_t prefix = header.delta ? newer_len : 0;
+	char *data = (char *)zmalloc(prefix + *len + 1);
+	if (prefix)
+		memcpy(data, newer, prefix);
+
+	if (lz4_decompress_prefix(record + sizeof(struct _history_record), record_len - sizeof(struct _history_record), data, prefix, *len) != *len) {
+		zfree(data);
+		goto corrupt;
+	}
+
+	if (prefix)
+		memmove(data, data + prefix, *len);
+
+	zfree(record);
+	return data;
+
+corrupt:
+	zfree(record);
+	error_throw("d3a5e0c71f28", "Data block corrupt");
+	return NULL;
+}
+
+/* Time the version was replaced, without restoring it */
+static long long get_record_timestamp(base_t *base, unsigned long long offset) {
+	size_t record_len;
+	struct _history_record header;
+	char *record = (char *)get_data_block(base, offset, &record_len);
+	if (!record)
+		return 0;
+
+	if (record_len < sizeof(struct _history_record)) {
+		zfree(record);
+		return 0;
+	}
+
+	memcpy(&header, record, sizeof(struct _history_record));
+	zfree(record);
+	return from_be64(header.timestamp);
+}
+
+static void set_entry(base_t *base, const struct history_entry *entry, unsigned long long offset) {
+	struct _history_list *list = get_history_list(base, entry->list);
+	list->items[entry->index].offset = to_be64(offset);
+	flush_history_list(base, entry->list);
+}
+
+/* Clear the slot and release the version record */
+static void drop_entry(base_t *base, const struct history_entry *entry) {
+	struct _history_list *list = get_history_list(base, entry->list);
+	memset(&list->items[entry->index].quid, 0, sizeof(quid_t));
+	list->items[entry->index].offset = 0;
+	list->items[entry->index].version = 0;
+	flush_history_list(base, entry->list);
+
+	if (entry->record)
+		free_data_block(base, entry->offset);
+}
+
+static int insert_entry(base_t *base, const quid_t *c_quid, unsigned short version, unsigned long long offset, const struct history_entry *hole) {
+	unsigned long long list_offset = hole->list;
+	int index = hole->index;
+
+	struct _history_list *list = NULL;
+	if (list_offset) {
+		list = get_history_list(base, list_offset);
+	} else {
+		list_offset = base->offset.history;
+		if (list_offset)
+			list = get_history_list(base, list_offset);
+
+		if (list && list_records(list) && list_size(list) < HISTORY_LIST_SIZE) {
+			index = list_size(list);
+			list->size = to_be16(HISTORY_LAYOUT | (index + 1));
+		} else {
+			if (list)
+				put_history_list(base, list_offset);
+
+			/* Start a new list, older lists are never extended */
+			unsigned long long new_list_offset = zpalloc(base, sizeof(struct _history_list));
+			list = get_history_list_new(base, new_list_offset);
+			if (!list)
+				return -1;
+
+			list->link = to_be64(base->offset.history);
+			list->size = to_be16(HISTORY_LAYOUT | 1);
+			index = 0;
+
+			list_offset = new_list_offset;
+			base->offset.history = new_list_offset;
+			base_sync(base);
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
 	}
 
-	error_throw("595a8ca9706d", "Key has no history");
+	memcpy(&list->items[index].quid, c_quid, sizeof(quid_t));
+	list->items[index].version = to_be16(version);
+	list->items[index].offset = to_be64(offset);
+	flush_history_list(base, list_offset);
 	return 0;
 }
 
+/*
+ * Drop the oldest versions beyond the retention policy. The version just
+ * added is not part of the entries and always stays.
+ */
+static void history_retain(base_t *base, const struct history_entry *entries, size_t count, long long now) {
+	size_t total = count + 1;
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!HISTORY_MAX_VERSIONS || total <= HISTORY_MAX_VERSIONS) {
+			if (!HISTORY_MAX_AGE)
+				break;
+
+			/* Full copies from older versions carry no time */
+			if (!entries[i].record)
+				continue;
+
+			if (now - get_record_timestamp(base, entries[i].offset) <= HISTORY_MAX_AGE)
+				break;
+		}
+
+		drop_entry(base, &entries[i]);
+		total--;
+	}
+}
+
 int history_count(base_t *base, const quid_t *c_quid) {
 	int counter = 0;
 
 	unsigned long long offset = base->offset.history;
 	while (offset) {
-		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+		const struct _history_list *list = get_history_list(base, offset);
+		zassert(list_size(list) <= HISTORY_LIST_SIZE);
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
+		for (int i = 0; i < list_size(list); ++i) {
 			if (!list->items[i].offset)
 				continue;
 
@@ -145,86 +343,149 @@ int history_count(base_t *base, const quid_t *c_quid) {
 				counter++;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_history_list(base, offset);
+		offset = link;
 	}
 
 	return counter;
 }
 
+/* Release a full copy from an older history list */
 int history_delete(base_t *base, unsigned long long data_offset) {
 	unsigned long long offset = base->offset.history;
 	while (offset) {
 		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+		zassert(list_size(list) <= HISTORY_LIST_SIZE);
+
+		for (int i = 0; i < list_size(list); ++i) {
+			if (list_records(list))
+				break;
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
 			if (from_be64(list->items[i].offset) == data_offset) {
 				memset(&list->items[i].quid, 0, sizeof(quid_t));
 				list->items[i].offset = 0;
 				list->items[i].version = 0;
-				flush_history_list(base, list, offset);
+				flush_history_list(base, offset);
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_history_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("595a8ca9706d", "Key has no history");
 	return -1;
 }
 
-int history_add(base_t *base, const quid_t *c_quid, unsigned long long offset) {
-	/* Does list exist */
-	if (base->offset.history != 0) {
-		struct _history_list *list = get_history_list(base, base->offset.history);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
-
-		memcpy(&list->items[from_be16(list->size)].quid, c_quid, sizeof(quid_t));
-		list->items[from_be16(list->size)].offset = to_be64(offset);
-		list->items[from_be16(list->size)].version = to_be16(history_get_next_version(base, c_quid));
-		list->size = incr_be16(list->size);
-
-		/* Check if we need to add a new table*/
-		if (from_be16(list->size) >= HISTORY_LIST_SIZE) {
-			flush_history_list(base, list, base->offset.history);
-
-			struct _history_list *new_list = (struct _history_list *)zcalloc(1, sizeof(struct _history_list));
-			if (!new_list) {
-				zfree(new_list);
-				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-				return -1;
-			}
+/*
+ * Save the data being replaced as the newest version of the key. The
+ * former newest version is rewritten as a delta against this one.
+ */
+int history_add(base_t *base, const quid_t *c_quid, const void *data, size_t len) {
+	size_t count;
+	struct history_entry hole;
+	struct history_entry *entries = history_collect(base, c_quid, &count, &hole);
+	long long now = get_unixtimestamp();
+
+	unsigned long long offset = put_record(base, data, len, NULL, 0, now);
+	if (!offset) {
+		zfree(entries);
+		return -1;
+	}
 
-			new_list->link = to_be64(base->offset.history);
-			unsigned long long new_list_offset = zpalloc(base, sizeof(struct _history_list));
-			flush_history_list(base, new_list, new_list_offset);
-			base->offset.history = new_list_offset;
-		} else {
-			flush_history_list(base, list, base->offset.history);
+	if (count && entries[count - 1].record) {
+		struct history_entry *newest = &entries[count - 1];
+
+		size_t newest_len;
+		long long timestamp;
+		void *newest_data = get_record(base, newest->offset, NULL, 0, &newest_len, &timestamp);
+		if (newest_data) {
+			unsigned long long delta = put_record(base, newest_data, newest_len, data, len, timestamp);
+			if (delta) {
+				set_entry(base, newest, delta);
+				free_data_block(base, newest->offset);
+				newest->offset = delta;
+			}
+			zfree(newest_data);
 		}
-	} else {
-		struct _history_list *new_list = (struct _history_list *)zcalloc(1, sizeof(struct _history_list));
-		if (!new_list) {
-			zfree(new_list);
-			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-			return -1;
+	}
+
+	unsigned short version = count ? entries[count - 1].version + 1 : 0;
+	if (insert_entry(base, c_quid, version, offset, &hole) < 0) {
+		free_data_block(base, offset);
+		zfree(entries);
+		return -1;
+	}
+
+	history_retain(base, entries, count, now);
+
+	zfree(entries);
+	return 0;
+}
+
+/* Restore a version by applying the deltas from the newest version down */
+void *history_get_version(base_t *base, const quid_t *c_quid, unsigned short version, size_t *len) {
+	size_t count;
+	struct history_entry *entries = history_collect(base, c_quid, &count, NULL);
+
+	size_t target = count;
+	for (size_t i = 0; i < count; ++i) {
+		if (entries[i].version == version) {
+			target = i;
+			break;
 		}
+	}
+
+	if (target == count) {
+		zfree(entries);
+		error_throw("595a8ca9706d", "Key has no history");
+		return NULL;
+	}
 
-		new_list->size = to_be16(1);
-		memcpy(&new_list->items[0].quid, c_quid, sizeof(quid_t));
-		new_list->items[0].offset = to_be64(offset);
-		new_list->items[0].version = 0;
+	if (!entries[target].record) {
+		void *data = get_data_block(base, entries[target].offset, len);
+		zfree(entries);
+		return data;
+	}
+
+	void *data = NULL;
+	size_t data_len = 0;
+	for (size_t i = count; i-- > target;) {
+		if (!entries[i].record) {
+			zfree(data);
+			zfree(entries);
+			error_throw("d3a5e0c71f28", "Data block corrupt");
+			return NULL;
+		}
 
-		unsigned long long new_list_offset = zpalloc(base, sizeof(struct _history_list));
-		flush_history_list(base, new_list, new_list_offset);
+		size_t older_len;
+		void *older = get_record(base, entries[i].offset, data, data_len, &older_len, NULL);
+		zfree(data);
+		if (!older) {
+			zfree(entries);
+			return NULL;
+		}
 
-		base->offset.history = new_list_offset;
+		data = older;
+		data_len = older_len;
 	}
 
-	base_sync(base);
-	return 0;
+	zfree(entries);
+	*len = data_len;
+	return data;
+}
+
+/* Release all versions of the key */
+void history_remove(base_t *base, const quid_t *c_quid) {
+	size_t count;
+	struct history_entry *entries = history_collect(base, c_quid, &count, NULL);
+
+	for (size_t i = 0; i < count; ++i)
+		drop_entry(base, &entries[i]);
+
+	zfree(entries);
 }
 
 marshall_t *history_all(base_t *base, const quid_t *c_quid) {
@@ -239,10 +500,10 @@ marshall_t *history_all(base_t *base, const quid_t *c_quid) {
 
 	unsigned long long offset = base->offset.history;
 	while (offset) {
-		struct _history_list *list = get_history_list(base, offset);
-		zassert(from_be16(list->size) <= HISTORY_LIST_SIZE);
+		const struct _history_list *list = get_history_list(base, offset);
+		zassert(list_size(list) <= HISTORY_LIST_SIZE);
 
-		for (int i = 0; i < from_be16(list->size); ++i) {
+		for (int i = 0; i < list_size(list); ++i) {
 			if (!list->items[i].offset)
 				continue;
 
@@ -256,8 +517,9 @@ marshall_t *history_all(base_t *base, const quid_t *c_quid) {
 				marshall->size++;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_history_list(base, offset);
+		offset = link;
 	}
 
 	return marshall;
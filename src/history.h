@@ -5,10 +5,11 @@
 void history_dump(base_t *base);
 #endif
 
-unsigned long long history_get_version_offset(base_t *base, const quid_t *c_quid, unsigned short version);
 int history_count(base_t *base, const quid_t *c_quid);
 int history_delete(base_t *base, unsigned long long data_offset);
-int history_add(base_t *base, const quid_t *c_quid, unsigned long long offset);
+int history_add(base_t *base, const quid_t *c_quid, const void *data, size_t len);
+void *history_get_version(base_t *base, const quid_t *c_quid, unsigned short version, size_t *len);
+void history_remove(base_t *base, const quid_t *c_quid);
 marshall_t *history_all(base_t *base, const quid_t *c_quid);
 
 #endif // HISTORY_H_INCLUDED
@@ -149,7 +149,6 @@ marshall_t *index_get(base_t *base, unsigned long long offset, char *key) {
 	}
 
 	vector_free(result);
-	btree_close(base, &index);
 
 	return marshall;
 }
@@ -234,7 +233,6 @@ marshall_t *index_btree_all(base_t *base, unsigned long long offset, bool descen
 	}
 
 	vector_free(rskv);
-	btree_close(base, &index);
 
 	return marshall;
 }
@@ -1,3 +1,4 @@
+#include <stdver.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,8 @@
 #include "alias.h"
 #include "index.h"
 #include "pager.h"
+#include "bufpool.h"
+#include "wal.h"
 #include "index_list.h"
 
 #define INDEX_LIST_SIZE	64
@@ -30,56 +33,40 @@ struct _engine_index_list {
 } __attribute__((packed));
 
 static struct _engine_index_list *get_index_list(base_t *base, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+	return (struct _engine_index_list *)bufpool_pin(base, offset, sizeof(struct _engine_index_list));
+}
 
-	struct _engine_index_list *list = (struct _engine_index_list *)zmalloc(sizeof(struct _engine_index_list));
-	if (!list) {
-		zfree(list);
-		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
-		return NULL;
-	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	if (read(fd, list, sizeof(struct _engine_index_list)) != sizeof(struct _engine_index_list)) {
-		zfree(list);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
-	}
-	return list;
+/* Pin a zeroed list structure for a newly allocated chunk */
+static struct _engine_index_list *get_index_list_new(base_t *base, uint64_t offset) {
+	return (struct _engine_index_list *)bufpool_pin_new(base, offset, sizeof(struct _engine_index_list));
 }
 
-static void flush_index_list(base_t *base, struct _engine_index_list *list, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
+/* Release list structure without changes */
+static void put_index_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, FALSE);
+}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	if (write(fd, list, sizeof(struct _engine_index_list)) != sizeof(struct _engine_index_list)) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	zfree(list);
+/* Release list structure and schedule it for write back */
+static void flush_index_list(base_t *base, uint64_t offset) {
+	bufpool_unpin(base, offset, TRUE);
 }
 
 static char *get_element_name(base_t *base, size_t element_len, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
-
 	char *element = (char *)zcalloc(element_len + 1, sizeof(char));
 	if (!element) {
 		zfree(element);
 		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
 		return NULL;
 	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		zfree(element);
-		error_throw_fatal("a7df40ba3075", "Failed to read disk");
-		return NULL;
+
+	const void *map = pager_get_map(base, offset, element_len);
+	if (map) {
+		memcpy(element, map, element_len);
+		return element;
 	}
-	if (read(fd, element, element_len) != (ssize_t)element_len) {
+
+	int fd = pager_get_fd(base, &offset);
+	if (pread(fd, element, element_len, offset) != (ssize_t)element_len) {
 		zfree(element);
 		error_throw_fatal("a7df40ba3075", "Failed to read disk");
 		return NULL;
@@ -88,16 +75,7 @@ static char *get_element_name(base_t *base, size_t element_len, uint64_t offset)
 }
 
 static void flush_element_name(base_t *base, char *element, size_t element_len, uint64_t offset) {
-	int fd = pager_get_fd(base, &offset);
-
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
-	if (write(fd, element, element_len) != (ssize_t)element_len) {
-		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
-		return;
-	}
+	wal_write(base, offset, element, element_len);
 }
 
 int index_list_add(base_t *base, const quid_t *index, const quid_t *group, char *element, index_type_t type, uint64_t offset) {
@@ -122,30 +100,25 @@ int index_list_add(base_t *base, const quid_t *index, const quid_t *group, char
 
 		/* Check if we need to add a new table*/
 		if (from_be16(list->size) >= INDEX_LIST_SIZE) {
-			flush_index_list(base, list, base->offset.index_list);
+			flush_index_list(base, base->offset.index_list);
 
-			struct _engine_index_list *new_list = (struct _engine_index_list *)zcalloc(1, sizeof(struct _engine_index_list));
-			if (!new_list) {
-				zfree(new_list);
-				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+			unsigned long long new_list_offset = zpalloc(base, sizeof(struct _engine_index_list));
+			struct _engine_index_list *new_list = get_index_list_new(base, new_list_offset);
+			if (!new_list)
 				return -1;
-			}
 
 			new_list->link = to_be64(base->offset.index_list);
-			unsigned long long new_list_offset = zpalloc(base, sizeof(struct _engine_index_list));
-			flush_index_list(base, new_list, new_list_offset);
+			flush_index_list(base, new_list_offset);
 
 			base->offset.index_list = new_list_offset;
 		} else {
-			flush_index_list(base, list, base->offset.index_list);
+			flush_index_list(base, base->offset.index_list);
 		}
 	} else {
-		struct _engine_index_list *new_list = (struct _engine_index_list *)zcalloc(1, sizeof(struct _engine_index_list));
-		if (!new_list) {
-			zfree(new_list);
-			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		unsigned long long new_list_offset = zpalloc(base, sizeof(struct _engine_index_list));
+		struct _engine_index_list *new_list = get_index_list_new(base, new_list_offset);
+		if (!new_list)
 			return -1;
-		}
 
 		size_t psz = strlen(element);
 		unsigned long long psz_offset = zpalloc(base, psz);
@@ -159,8 +132,7 @@ int index_list_add(base_t *base, const quid_t *index, const quid_t *group, char
 		new_list->items[0].type = type;
 		new_list->size = to_be16(1);
 
-		unsigned long long new_list_offset = zpalloc(base, sizeof(struct _engine_index_list));
-		flush_index_list(base, new_list, new_list_offset);
+		flush_index_list(base, new_list_offset);
 
 		base->offset.index_list = new_list_offset;
 		base->stats.index_list_size = 1;
@@ -178,7 +150,7 @@ int index_list_add(base_t *base, const quid_t *index, const quid_t *group, char
 quid_t *index_list_get_index(base_t *base, const quid_t *c_quid) {
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -189,12 +161,13 @@ quid_t *index_list_get_index(base_t *base, const quid_t *c_quid) {
 			if (cmp == 0) {
 				quid_t *index = (quid_t *)zmalloc(sizeof(quid_t));
 				memcpy(index, &list->items[i].index, sizeof(quid_t));
-				zfree(list);
+				put_index_list(base, offset);
 				return index;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -205,7 +178,7 @@ size_t index_list_size(base_t *base, const quid_t *c_quid) {
 	size_t count = 0;
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -215,8 +188,9 @@ size_t index_list_size(base_t *base, const quid_t *c_quid) {
 			if (!quidcmp(c_quid, &list->items[i].group))
 				count++;
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	return count;
@@ -234,7 +208,7 @@ marshall_t *index_list_get_element(base_t *base, const quid_t *c_quid) {
 
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -251,8 +225,9 @@ marshall_t *index_list_get_element(base_t *base, const quid_t *c_quid) {
 				zfree(element);
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -271,7 +246,7 @@ marshall_t *index_list_on_group(base_t *base, const quid_t *c_quid) {
 
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -319,8 +294,9 @@ marshall_t *index_list_on_group(base_t *base, const quid_t *c_quid) {
 				marshall->size++;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	return marshall;
@@ -330,7 +306,7 @@ marshall_t *index_list_on_group(base_t *base, const quid_t *c_quid) {
 uint64_t index_list_get_index_offset(base_t *base, const quid_t *c_quid) {
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -340,12 +316,13 @@ uint64_t index_list_get_index_offset(base_t *base, const quid_t *c_quid) {
 			int cmp = quidcmp(c_quid, &list->items[i].index);
 			if (cmp == 0) {
 				unsigned long long index_offset = from_be64(list->items[i].offset);
-				zfree(list);
+				put_index_list(base, offset);
 				return index_offset;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -356,7 +333,7 @@ uint64_t index_list_get_index_offset(base_t *base, const quid_t *c_quid) {
 char *index_list_get_index_element(base_t *base, const quid_t *c_quid) {
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -365,12 +342,13 @@ char *index_list_get_index_element(base_t *base, const quid_t *c_quid) {
 
 			if (!quidcmp(c_quid, &list->items[i].index)) {
 				char *element = get_element_name(base, from_be32(list->items[i].element_len), from_be64(list->items[i].element));
-				zfree(list);
+				put_index_list(base, offset);
 				return element;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -381,7 +359,7 @@ char *index_list_get_index_element(base_t *base, const quid_t *c_quid) {
 quid_t *index_list_get_index_group(base_t *base, const quid_t *c_quid) {
 	unsigned long long offset = base->offset.index_list;
 	while (offset) {
-		struct _engine_index_list *list = get_index_list(base, offset);
+		const struct _engine_index_list *list = get_index_list(base, offset);
 		zassert(from_be16(list->size) <= INDEX_LIST_SIZE);
 
 		for (int i = 0; i < from_be16(list->size); ++i) {
@@ -391,12 +369,13 @@ quid_t *index_list_get_index_group(base_t *base, const quid_t *c_quid) {
 			if (!quidcmp(c_quid, &list->items[i].index)) {
 				quid_t *group = (quid_t *)zmalloc(sizeof(quid_t));
 				memcpy(group, &list->items[i].group, sizeof(quid_t));
-				zfree(list);
+				put_index_list(base, offset);
 				return group;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -415,12 +394,13 @@ int index_list_update_offset(base_t *base, const quid_t *index, uint64_t index_o
 
 			if (!quidcmp(index, &list->items[i].index)) {
 				list->items[i].offset = to_be64(index_offset);
-				flush_index_list(base, list, offset);
+				flush_index_list(base, offset);
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -444,13 +424,14 @@ int index_list_delete(base_t *base, const quid_t *index) {
 				memset(&list->items[i].element, 0, 64);
 				list->items[i].element_len = 0;
 				list->items[i].offset = 0;
-				flush_index_list(base, list, offset);
+				flush_index_list(base, offset);
 				base->stats.index_list_size--;
 				return 0;
 			}
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	error_throw("e553d927706a", "Index not found");
@@ -518,8 +499,9 @@ marshall_t *index_list_all(base_t *base) {
 			marshall->child[marshall->size]->child[2]->data_len = strlen(type);
 			marshall->size++;
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 
 	return marshall;
@@ -573,8 +555,9 @@ void index_list_rebuild(base_t *base, base_t *new_base) {
 			index_list_add(new_base, &list->items[i].index, &list->items[i].group, element, list->items[i].type, nrs.offset);
 			zfree(element);
 		}
-		offset = list->link ? from_be64(list->link) : 0;
-		zfree(list);
+		unsigned long long link = list->link ? from_be64(list->link) : 0;
+		put_index_list(base, offset);
+		offset = link;
 	}
 }
 
@@ -1,7 +1,7 @@
 #define INT_DIGITS 19
 
 char *itoa(long i) {
-	static char buf[INT_DIGITS + 2];
+	static _Thread_local char buf[INT_DIGITS + 2];
 	char *p = buf + INT_DIGITS + 1;
 	if (i >= 0) {
 		do {
@@ -0,0 +1,117 @@
+#include <stdver.h>
+#include <stddef.h>
+
+#include <config.h>
+#include <common.h>
+#include <log.h>
+#include "keysearch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYSEARCH_X86
+#endif
+
+static size_t count_scalar(const __le64 *keys, size_t n, uint64_t key) {
+	size_t left = 0, right = n;
+	while (left < right) {
+		size_t i = (right - left) / 2 + left;
+		if (from_le64(keys[i]) < key) {
+			left = i + 1;
+		} else {
+			right = i;
+		}
+	}
+	return left;
+}
+
+#ifdef KEYSEARCH_X86
+
+/*
+ * The keys are sorted, so the lanes holding smaller keys always precede the
+ * others and the scan stops at the first vector not entirely smaller. The
+ * sign bit is flipped to compare unsigned with the signed instructions.
+ */
+__attribute__((target("sse2")))
+static size_t count_sse2(const __le64 *keys, size_t n, uint64_t key) {
+	const __m128i sign = _mm_set1_epi32((int)0x80000000);
+	const __m128i needle = _mm_xor_si128(_mm_set1_epi64x((long long)key), sign);
+
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&keys[i]), sign);
+
+		/* No 64 bit compare, combine the halves */
+		__m128i lt = _mm_cmpgt_epi32(needle, v);
+		__m128i eq = _mm_cmpeq_epi32(needle, v);
+		__m128i lt_hi = _mm_shuffle_epi32(lt, _MM_SHUFFLE(3, 3, 1, 1));
+		__m128i lt_lo = _mm_shuffle_epi32(lt, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128i eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+		__m128i less = _mm_or_si128(lt_hi, _mm_and_si128(eq_hi, lt_lo));
+
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(less));
+		if (mask != 0x3)
+			return i + (mask & 0x1);
+	}
+
+	while (i < n && (FORCE uint64_t)keys[i] < key)
+		i++;
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const __le64 *keys, size_t n, uint64_t key) {
+	const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+	const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&keys[i]), sign);
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, v)));
+		if (mask != 0xf)
+			return i + __builtin_popcount(mask);
+	}
+
+	while (i < n && (FORCE uint64_t)keys[i] < key)
+		i++;
+	return i;
+}
+
+#endif // KEYSEARCH_X86
+
+static size_t (*count_keys)(const __le64 *keys, size_t n, uint64_t key) = count_scalar;
+
+bool keysearch_select(enum keysearch_unit unit) {
+	switch (unit) {
+		case KEYSEARCH_SCALAR:
+			count_keys = count_scalar;
+			return TRUE;
+#ifdef KEYSEARCH_X86
+		case KEYSEARCH_SSE2:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("sse2"))
+				return FALSE;
+			count_keys = count_sse2;
+			return TRUE;
+		case KEYSEARCH_AVX2:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("avx2"))
+				return FALSE;
+			count_keys = count_avx2;
+			return TRUE;
+#endif
+		default:
+			return FALSE;
+	}
+}
+
+void keysearch_init(void) {
+	if (keysearch_select(KEYSEARCH_AVX2)) {
+		lprint("[info] Key search using AVX2\n");
+	} else if (keysearch_select(KEYSEARCH_SSE2)) {
+		lprint("[info] Key search using SSE2\n");
+	}
+}
+
+size_t keysearch_count(const __le64 *keys, size_t n, uint64_t key) {
+	return count_keys(keys, n, key);
+}
@@ -0,0 +1,30 @@
+#ifndef KEYSEARCH_H_INCLUDED
+#define KEYSEARCH_H_INCLUDED
+
+#include <config.h>
+#include <common.h>
+#include "endian.h"
+
+enum keysearch_unit {
+	KEYSEARCH_SCALAR,
+	KEYSEARCH_SSE2,
+	KEYSEARCH_AVX2
+};
+
+/*
+ * Select the widest vector unit the processor supports.
+ */
+void keysearch_init(void);
+
+/*
+ * Use the given unit for all searches. Returns FALSE if the processor
+ * does not support it.
+ */
+bool keysearch_select(enum keysearch_unit unit);
+
+/*
+ * Number of keys in the sorted array that are smaller than 'key'.
+ */
+size_t keysearch_count(const __le64 *keys, size_t n, uint64_t key);
+
+#endif // KEYSEARCH_H_INCLUDED
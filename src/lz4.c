@@ -0,0 +1,197 @@
+#include <stdver.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <config.h>
+#include <common.h>
+#include "lz4.h"
+
+#define MINMATCH		4
+#define LASTLITERALS	5	/* Block ends with literals */
+#define MFLIMIT			12	/* No match starts this close to the end */
+#define MAX_DISTANCE	65535
+#define HASH_LOG		12
+#define SKIP_TRIGGER	6	/* Search faster through incompressible data */
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(uint32_t));
+	return value;
+}
+
+static uint32_t hash32(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Length beyond the token nibble */
+static uint8_t *write_length(uint8_t *op, size_t len) {
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+	uint8_t byte;
+	do {
+		if (*ip >= iend)
+			return FALSE;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return TRUE;
+}
+
+/* Token, literals and the match offset if any */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t litlen, size_t offset, size_t matchlen) {
+	size_t need = 1 + litlen + (litlen / 255 + 1) + (offset ? 2 + matchlen / 255 + 1 : 0);
+	if ((size_t)(oend - op) < need)
+		return NULL;
+
+	uint8_t *token = op++;
+	*token = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15)
+		op = write_length(op, litlen);
+	memcpy(op, literals, litlen);
+	op += litlen;
+
+	if (offset) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= (matchlen < 15 ? matchlen : 15);
+		if (matchlen >= 15)
+			op = write_length(op, matchlen);
+	}
+	return op;
+}
+
+size_t lz4_bound(size_t len) {
+	return len + len / 255 + 16;
+}
+
+size_t lz4_compress_prefix(const void *src, size_t prefix_len, size_t len, void *dst, size_t capacity) {
+	const uint8_t *in = (const uint8_t *)src;
+	const uint8_t *ip = in + prefix_len;
+	const uint8_t *anchor = ip;
+	const uint8_t *iend = ip + len;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *oend = op + capacity;
+	uint32_t table[1 << HASH_LOG];
+
+	if (len > MFLIMIT) {
+		const uint8_t *mflimit = iend - MFLIMIT;
+		const uint8_t *matchlimit = iend - LASTLITERALS;
+
+		memset(table, 0, sizeof(table));
+
+		/* Index the part of the prefix within reach */
+		const uint8_t *p = (prefix_len > MAX_DISTANCE) ? ip - MAX_DISTANCE : in;
+		for (; p + MINMATCH <= ip; ++p)
+			table[hash32(read32(p))] = (uint32_t)(p - in);
+
+		if (!prefix_len)
+			ip++;
+		size_t last_offset = 0;
+		while (ip < mflimit) {
+			uint32_t sequence = read32(ip);
+			uint32_t h = hash32(sequence);
+			const uint8_t *ref = in + table[h];
+			table[h] = (uint32_t)(ip - in);
+
+			/* Edited data lines up again at the offset of the last match */
+			if (last_offset && (size_t)(ip - in) >= last_offset && read32(ip - last_offset) == sequence)
+				ref = ip - last_offset;
+
+			if (ref >= ip || (size_t)(ip - ref) > MAX_DISTANCE || read32(ref) != sequence) {
+				ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+				continue;
+			}
+
+			while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			const uint8_t *end = ip + MINMATCH;
+			const uint8_t *match = ref + MINMATCH;
+			while (end < matchlimit && *end == *match) {
+				end++;
+				match++;
+			}
+
+			op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, end - ip - MINMATCH);
+			if (!op)
+				return 0;
+
+			last_offset = ip - ref;
+			ip = end;
+			anchor = ip;
+		}
+	}
+
+	op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t capacity) {
+	return lz4_compress_prefix(src, 0, len, dst, capacity);
+}
+
+size_t lz4_decompress_prefix(const void *src, size_t len, void *dst, size_t prefix_len, size_t capacity) {
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *iend = ip + len;
+	uint8_t *op = (uint8_t *)dst + prefix_len;
+	uint8_t *oend = op + capacity;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		size_t litlen = token >> 4;
+		if (litlen == 15 && !read_length(&ip, iend, &litlen))
+			return 0;
+		if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen)
+			return 0;
+
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		/* Last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (size_t)(op - (uint8_t *)dst))
+			return 0;
+
+		size_t matchlen = token & 15;
+		if (matchlen == 15 && !read_length(&ip, iend, &matchlen))
+			return 0;
+		matchlen += MINMATCH;
+		if ((size_t)(oend - op) < matchlen)
+			return 0;
+
+		/* Matches may overlap the output */
+		const uint8_t *match = op - offset;
+		if (offset >= matchlen) {
+			memcpy(op, match, matchlen);
+			op += matchlen;
+		} else {
+			while (matchlen--)
+				*op++ = *match++;
+		}
+	}
+
+	return op - ((uint8_t *)dst + prefix_len);
+}
+
+size_t lz4_decompress(const void *src, size_t len, void *dst, size_t capacity) {
+	return lz4_decompress_prefix(src, len, dst, 0, capacity);
+}
@@ -0,0 +1,37 @@
+#ifndef LZ4_H_INCLUDED
+#define LZ4_H_INCLUDED
+
+#include <config.h>
+#include <common.h>
+
+/*
+ * Compress 'len' bytes into the LZ4 block format. Returns the compressed
+ * size, or 0 if the result does not fit in 'capacity'.
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t capacity);
+
+/*
+ * Decompress a block of 'len' bytes. Returns the size of the original data,
+ * or 0 if the block is malformed or does not fit in 'capacity'.
+ */
+size_t lz4_decompress(const void *src, size_t len, void *dst, size_t capacity);
+
+/*
+ * Largest compressed size of 'len' bytes.
+ */
+size_t lz4_bound(size_t len);
+
+/*
+ * Compress the 'len' bytes that follow a prefix of 'prefix_len' bytes in
+ * 'src'. Matches may refer back into the prefix, so the block can only be
+ * decompressed behind the same prefix.
+ */
+size_t lz4_compress_prefix(const void *src, size_t prefix_len, size_t len, void *dst, size_t capacity);
+
+/*
+ * Decompress a block behind the prefix held in the first 'prefix_len' bytes
+ * of 'dst'. Returns the size of the data written after the prefix.
+ */
+size_t lz4_decompress_prefix(const void *src, size_t len, void *dst, size_t prefix_len, size_t capacity);
+
+#endif // LZ4_H_INCLUDED
@@ -0,0 +1,90 @@
+#include <stdver.h>
+#include <string.h>
+
+#include <config.h>
+#include <common.h>
+#include <error.h>
+#include "zmalloc.h"
+#include "quid.h"
+#include "memtable.h"
+
+memtable_t *memtable_new(size_t allocated) {
+	memtable_t *memtable = (memtable_t *)zcalloc(1, sizeof(memtable_t));
+	if (!memtable) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	memtable->items = (struct memtable_item *)zcalloc(allocated, sizeof(struct memtable_item));
+	if (!memtable->items) {
+		zfree(memtable);
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return NULL;
+	}
+
+	memtable->allocated = allocated;
+	return memtable;
+}
+
+void memtable_free(memtable_t *memtable) {
+	if (!memtable)
+		return;
+
+	zfree(memtable->items);
+	zfree(memtable);
+}
+
+size_t memtable_lower_bound(const memtable_t *memtable, const quid_t *quid) {
+	size_t left = 0, right = memtable->size;
+	while (left < right) {
+		size_t i = (right - left) / 2 + left;
+		if (quidcmp(&memtable->items[i].quid, quid) < 0) {
+			left = i + 1;
+		} else {
+			right = i;
+		}
+	}
+	return left;
+}
+
+struct memtable_item *memtable_find(const memtable_t *memtable, const quid_t *quid) {
+	size_t i = memtable_lower_bound(memtable, quid);
+	if (i < memtable->size && !quidcmp(&memtable->items[i].quid, quid))
+		return &memtable->items[i];
+
+	return NULL;
+}
+
+struct memtable_item *memtable_insert(memtable_t *memtable, const quid_t *quid) {
+	zassert(memtable->size < memtable->allocated);
+
+	/* New keys are the largest in most cases */
+	size_t i = memtable->size;
+	if (i && quidcmp(&memtable->items[i - 1].quid, quid) > 0) {
+		i = memtable_lower_bound(memtable, quid);
+		memmove(&memtable->items[i + 1], &memtable->items[i], (memtable->size - i) * sizeof(struct memtable_item));
+	}
+
+	struct memtable_item *item = &memtable->items[i];
+	memset(item, 0, sizeof(struct memtable_item));
+	memcpy(&item->quid, quid, sizeof(quid_t));
+	memtable->size++;
+	return item;
+}
+
+void memtable_remove(memtable_t *memtable, const quid_t *quid) {
+	size_t i = memtable_lower_bound(memtable, quid);
+	if (i == memtable->size || quidcmp(&memtable->items[i].quid, quid))
+		return;
+
+	memmove(&memtable->items[i], &memtable->items[i + 1], (memtable->size - i - 1) * sizeof(struct memtable_item));
+	memtable->size--;
+}
+
+bool memtable_full(const memtable_t *memtable) {
+	return memtable->size >= memtable->allocated;
+}
+
+void memtable_clear(memtable_t *memtable) {
+	memtable->size = 0;
+}
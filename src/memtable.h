@@ -0,0 +1,43 @@
+#ifndef MEMTABLE_H_INCLUDED
+#define MEMTABLE_H_INCLUDED
+
+#include <config.h>
+#include <common.h>
+#include "quid.h"
+#include "engine.h"
+
+struct memtable_item {
+	quid_t quid;
+	struct metadata meta;
+	unsigned long long offset;	/* Data block, 0 if none */
+};
+
+/*
+ * Keys not yet merged into the tree, kept sorted by quidcmp(). Keys are
+ * mostly created in order so inserts tend to append.
+ */
+typedef struct memtable {
+	struct memtable_item *items;
+	size_t size;
+	size_t allocated;
+} memtable_t;
+
+memtable_t *memtable_new(size_t allocated);
+void memtable_free(memtable_t *memtable);
+
+/*
+ * Position of the first item equal to or greater than 'quid'.
+ */
+size_t memtable_lower_bound(const memtable_t *memtable, const quid_t *quid);
+struct memtable_item *memtable_find(const memtable_t *memtable, const quid_t *quid);
+
+/*
+ * Add a zeroed item for the key, which must not be present and the table
+ * must not be full.
+ */
+struct memtable_item *memtable_insert(memtable_t *memtable, const quid_t *quid);
+void memtable_remove(memtable_t *memtable, const quid_t *quid);
+bool memtable_full(const memtable_t *memtable);
+void memtable_clear(memtable_t *memtable);
+
+#endif // MEMTABLE_H_INCLUDED
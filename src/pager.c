@@ -1,7 +1,12 @@
+/* fallocate() */
+#define _GNU_SOURCE
+#include <stdver.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <config.h>
 #include <common.h>
@@ -10,6 +15,8 @@
 #include "zmalloc.h"
 #include "crc64.h"
 #include "base.h"
+#include "bufpool.h"
+#include "wal.h"
 #include "pager.h"
 
 #define DEFAULT_PAGE_ALLOC	10
@@ -34,7 +41,92 @@ void pager_list(base_t *base) {
 }
 #endif
 
-static void flush_page(page_t *page) {
+/* Number of checksum blocks in a page */
+static unsigned int crc_blocks(const base_t *base) {
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+	return (page_size + PAGE_CRC_BLOCK - 1) / PAGE_CRC_BLOCK;
+}
+
+static void alloc_crc_map(base_t *base, page_t *page) {
+	unsigned int blocks = crc_blocks(base);
+	page->crc_map = (uint64_t *)tree_zcalloc(blocks, sizeof(uint64_t), page);
+	page->crc_dirty = (unsigned char *)tree_zcalloc(blocks, sizeof(unsigned char), page);
+}
+
+/* Mark the blocks in the region, caller holds the pager lock */
+static void mark_blocks(page_t *page, uint64_t offset, size_t len) {
+	if (!len)
+		return;
+
+	for (uint64_t i = offset / PAGE_CRC_BLOCK; i <= (offset + len - 1) / PAGE_CRC_BLOCK; ++i)
+		page->crc_dirty[i] = TRUE;
+	page->crc_changed = TRUE;
+}
+
+static void mark_page(pager_t *core, page_t *page, uint64_t offset, size_t len) {
+	pthread_mutex_lock(&core->lock);
+	mark_blocks(page, offset, len);
+	pthread_mutex_unlock(&core->lock);
+}
+
+/*
+ * Take the checksum of every block written since the last time and chain
+ * the block checksums into the checksum of the page. Only marked blocks
+ * are read, a page without changes costs nothing.
+ */
+static uint64_t page_crc_sum(base_t *base, page_t *page) {
+	pager_t *core = base->core;
+	size_t size = file_size(page->fd);
+
+	pthread_mutex_lock(&core->lock);
+	if (size > page->crc_size)
+		mark_blocks(page, page->crc_size, size - page->crc_size);
+	page->crc_size = size;
+
+	if (!page->crc_changed) {
+		pthread_mutex_unlock(&core->lock);
+		return page->crc_sum;
+	}
+	page->crc_changed = FALSE;
+	pthread_mutex_unlock(&core->lock);
+
+	char *buffer = (char *)zmalloc(PAGE_CRC_BLOCK);
+	if (!buffer) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return page->crc_sum;
+	}
+
+	uint64_t crc64sum = 0;
+	unsigned int blocks = (size + PAGE_CRC_BLOCK - 1) / PAGE_CRC_BLOCK;
+	for (unsigned int i = 0; i < blocks; ++i) {
+		uint64_t offset = (uint64_t)i * PAGE_CRC_BLOCK;
+		size_t len = size - offset < PAGE_CRC_BLOCK ? size - offset : PAGE_CRC_BLOCK;
+
+		pthread_mutex_lock(&core->lock);
+		bool dirty = page->crc_dirty[i];
+		page->crc_dirty[i] = FALSE;
+		pthread_mutex_unlock(&core->lock);
+
+		if (dirty) {
+			if (pread(page->fd, buffer, len, offset) != (ssize_t)len) {
+				zfree(buffer);
+				error_throw_fatal("a7df40ba3075", "Failed to read disk");
+				return page->crc_sum;
+			}
+			page->crc_map[i] = crc64(0, buffer, len);
+		}
+
+		if (len == PAGE_CRC_BLOCK)
+			crc64sum = crc64_combine_op(core->crc_op, crc64sum, page->crc_map[i]);
+		else
+			crc64sum = crc64_combine(crc64sum, page->crc_map[i], len);
+	}
+
+	zfree(buffer);
+	return crc64sum;
+}
+
+static void flush_page(base_t *base, page_t *page) {
 	struct _page super;
 	nullify(&super, sizeof(struct _page));
 
@@ -50,17 +142,45 @@ static void flush_page(page_t *page) {
 		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
 		return;
 	}
+	mark_page(base->core, page, 0, sizeof(struct _page));
 }
 
-static uint64_t page_crc_sum(page_t *page) {
-	uint64_t crc64sum;
-	if (!crc_file(page->fd, &crc64sum)) {
-		lprint("[erro] Failed to calculate CRC\n");
-		return 0;
+#if PAGER_MMAP
+/*
+ * Map the entire page range once, the file is grown underneath
+ * the mapping as allocations are handed out
+ */
+static void map_page(base_t *base, page_t *page) {
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+
+	page->size = file_size(page->fd);
+	page->map = mmap(NULL, page_size, PROT_READ, MAP_SHARED, page->fd, 0);
+	if (page->map == MAP_FAILED) {
+		lprintf("[warn] Failed to map page %u\n", page->sequence);
+		page->map = NULL;
 	}
-	return crc64sum;
 }
 
+static void grow_page(page_t *page, size_t size) {
+	if (!page->map || size <= page->size)
+		return;
+
+	if (ftruncate(page->fd, size) < 0) {
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+		return;
+	}
+	page->size = size;
+}
+
+static void unmap_page(base_t *base, page_t *page) {
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+
+	if (page->map)
+		munmap(page->map, page_size);
+	page->map = NULL;
+}
+#endif
+
 static void create_page(base_t *base, pager_t *core) {
 	struct _page super;
 	char name[SHORT_QUID_LENGTH + 1];
@@ -70,6 +190,7 @@ static void create_page(base_t *base, pager_t *core) {
 	quid_short_create(&page->page_key);
 	quid_shorttostr(name, &page->page_key);
 	page->sequence = base->pager.sequence++;
+	alloc_crc_map(base, page);
 	page->fd = open(name, O_RDWR | O_TRUNC | O_CREAT | O_BINARY, 0644);
 	if (page->fd < 0) {
 		error_throw_fatal("65ccc95b60a6", "Failed to acquire descriptor");
@@ -93,10 +214,19 @@ static void create_page(base_t *base, pager_t *core) {
 	page->exit_status = EXSTAT_CHECKPOINT;
 	core->pages[core->count++] = page;
 	base_list_add(base, &page->page_key);
-	flush_page(page);
+	flush_page(base, page);
+
+	/* Page list is not logged */
+	if (base->wal) {
+		fsync(page->fd);
+		fsync(base->fd);
+	}
+#if PAGER_MMAP
+	map_page(base, page);
+#endif
 }
 
-static void open_page(quid_short_t *page_key, pager_t *core, unsigned long long sum) {
+static void open_page(base_t *base, quid_short_t *page_key, pager_t *core, unsigned long long sum) {
 	struct _page super;
 	char name[SHORT_QUID_LENGTH + 1];
 	nullify(&super, sizeof(struct _page));
@@ -109,17 +239,13 @@ static void open_page(quid_short_t *page_key, pager_t *core, unsigned long long
 		return;
 	}
 
-	uint64_t crc64sum;
-	if (!crc_file(page->fd, &crc64sum)) {
-		lprint("[erro] Failed to calculate CRC\n");
-		return;
-	}
+	/* Checksums of all blocks are taken once, later only changed blocks */
+	alloc_crc_map(base, page);
+	page->crc_sum = sum;
+	uint64_t crc64sum = page_crc_sum(base, page);
 
-	if (crc64sum != sum) {
-		lprintf("[erro] Page %d corrupt\n", page->sequence);
-		//TODO we should do something
-		return;
-	}
+	/* Pages are not synced on every change, the log holds the difference */
+	bool changed = crc64sum != sum;
 
 	if (read(page->fd, &super, sizeof(struct _page)) != sizeof(struct _page)) {
 		error_throw_fatal("a7df40ba3075", "Failed to read disk");
@@ -131,21 +257,21 @@ static void open_page(quid_short_t *page_key, pager_t *core, unsigned long long
 	page->exit_status = EXSTAT_CHECKPOINT;
 	zassert(from_be16(super.version) == VERSION_MAJOR);
 	zassert(!strcmp(super.magic, PAGE_MAGIC));
-	if (super.exit_status != EXSTAT_SUCCESS) {
-		lprintf("[warn] Page %d was not flushed on exit\n", page->sequence);
-		//TODO we should do something
-		return;
-	}
+	if (changed || super.exit_status != EXSTAT_SUCCESS)
+		lprintf("[warn] Page %d was not flushed on exit, recovering from log\n", page->sequence);
 
 	if (core->count >= core->allocated) {
 		core->allocated += DEFAULT_PAGE_ALLOC;
 		core->pages = (page_t **)tree_zrealloc(core->pages, core->allocated * sizeof(page_t *));
 	}
 	core->pages[core->count++] = page;
+#if PAGER_MMAP
+	map_page(base, page);
+#endif
 }
 
 uint64_t pager_alloc(base_t *base, size_t len) {
-	zassert(len > 0);
+	zassert(len > 0 && len <= pager_max_alloc(base));
 
 	bool flush = FALSE;
 	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
@@ -161,6 +287,9 @@ uint64_t pager_alloc(base_t *base, size_t len) {
 	}
 
 	base->pager.offset = offset + len;
+#if PAGER_MMAP
+	grow_page(base->core->pages[offset / page_size], (offset % page_size) + len);
+#endif
 	if (flush) {
 		base_sync(base);
 	}
@@ -168,6 +297,38 @@ uint64_t pager_alloc(base_t *base, size_t len) {
 	return offset;
 }
 
+/* Largest allocation that fits in a page */
+size_t pager_max_alloc(const base_t *base) {
+	return (BASE_PAGE_SIZE << base->pager.size) - sizeof(struct _page) - 1;
+}
+
+/*
+ * Give the storage of a region back to the file system, the region reads
+ * as zeros afterwards. Offsets stay valid, so an emptied page costs no disk
+ * space while its file remains.
+ */
+void pager_release(base_t *base, uint64_t offset, size_t len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	uint64_t global_offset = offset;
+	int fd = pager_get_fd(base, &offset);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0)
+		lprint("[warn] Failed to release page region\n");
+	pager_dirty(base, global_offset, len);
+#else
+	unused(base);
+	unused(offset);
+	unused(len);
+#endif
+}
+
+void pager_dirty(const base_t *base, uint64_t offset, size_t len) {
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+	unsigned long long page = floor(offset / page_size);
+
+	zassert(page <= (base->core->count - 1));
+	mark_page(base->core, base->core->pages[page], offset % page_size, len);
+}
+
 int pager_get_fd(const base_t *base, uint64_t *offset) {
 	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
 	unsigned long long page = floor(*offset / page_size);
@@ -177,6 +338,30 @@ int pager_get_fd(const base_t *base, uint64_t *offset) {
 	return base->core->pages[page]->fd;
 }
 
+/*
+ * Return a pointer to the mapped region at offset, or NULL when the
+ * page is not mapped and the caller should go through the descriptor
+ */
+void *pager_get_map(const base_t *base, uint64_t offset, size_t len) {
+#if PAGER_MMAP
+	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
+	unsigned long long page = floor(offset / page_size);
+
+	zassert(page <= (base->core->count - 1));
+	page_t *ppage = base->core->pages[page];
+	offset %= page_size;
+	if (!ppage->map || offset + len > ppage->size)
+		return NULL;
+
+	return (char *)ppage->map + offset;
+#else
+	unused(base);
+	unused(offset);
+	unused(len);
+	return NULL;
+#endif
+}
+
 unsigned int pager_get_sequence(base_t *base, uint64_t offset) {
 	unsigned long long page_size = BASE_PAGE_SIZE << base->pager.size;
 	unsigned long long page = floor(offset / page_size);
@@ -192,7 +377,16 @@ void pager_init(base_t *base) {
 	struct _page_list list;
 	nullify(&list, sizeof(struct _page_list));
 
+	/* Pager outlives any request arena */
+	zarena_t *arena = tree_zarena(NULL);
 	base->core = (pager_t *)tree_zcalloc(1, sizeof(pager_t), NULL);
+	tree_zarena(arena);
+
+	base->core->allocated = DEFAULT_PAGE_ALLOC;
+	base->core->pages = (page_t **)tree_zcalloc(base->core->allocated, sizeof(page_t *), base->core);
+	pthread_mutex_init(&base->core->lock, NULL);
+	crc64_combine_init(base->core->crc_op, PAGE_CRC_BLOCK);
+	bufpool_init(base, BUFPOOL_SIZE);
 	for (unsigned int i = 0; i <= base->page_list_count; ++i) {
 		unsigned long offset = sizeof(struct _base) * (i + 1);
 		if (lseek(base->fd, offset, SEEK_SET) < 0) {
@@ -208,39 +402,57 @@ void pager_init(base_t *base) {
 		if (i == 0 && list_size == 0) {
 			lprint("[info] Creating dataheap\n");
 
-			base->core->allocated = DEFAULT_PAGE_ALLOC;
-			base->core->pages = (page_t **)tree_zcalloc(base->core->allocated, sizeof(page_t *), base->core);
 			create_page(base, base->core);
 			base->pager.offset = sizeof(struct _page);
 			goto flush_base;
 		} else {
-			base->core->allocated = list_size < DEFAULT_PAGE_ALLOC ? DEFAULT_PAGE_ALLOC : list_size + DEFAULT_PAGE_ALLOC;
-			base->core->pages = (page_t **)tree_zcalloc(base->core->allocated, sizeof(page_t *), base->core);
 			for (unsigned short x = 0; x < list_size; ++x) {
-				open_page(&list.item[x].page_key, base->core, from_be64(list.item[x].crc_sum));
+				open_page(base, &list.item[x].page_key, base->core, from_be64(list.item[x].crc_sum));
 			}
 		}
 	}
 
 flush_base:
+	wal_recover(base);
 	base_sync(base);
 }
 
-void pager_sync(base_t *base) {
-	for (unsigned int i = 0; i < base->core->count; ++i) {
-		base->core->pages[i]->exit_status = EXSTAT_SUCCESS;
-		flush_page(base->core->pages[i]);
-		base_list_set_crc_sum(base, &base->core->pages[i]->page_key, page_crc_sum(base->core->pages[i]));
+/* Store the checksum of a page, unchanged pages are not touched */
+static void sync_page(base_t *base, page_t *page) {
+	if (page->exit_status != EXSTAT_SUCCESS) {
+		page->exit_status = EXSTAT_SUCCESS;
+		flush_page(base, page);
+	}
+
+	uint64_t crc64sum = page_crc_sum(base, page);
+	if (crc64sum != page->crc_sum) {
+		page->crc_sum = crc64sum;
+		base_list_set_crc_sum(base, &page->page_key, crc64sum);
 	}
 }
 
+void pager_sync(base_t *base) {
+	bufpool_sync(base);
+	for (unsigned int i = 0; i < base->core->count; ++i)
+		sync_page(base, base->core->pages[i]);
+}
+
+/* Force written data to disk */
+void pager_fsync(base_t *base) {
+	for (unsigned int i = 0; i < base->core->count; ++i)
+		fsync(base->core->pages[i]->fd);
+}
+
 void pager_close(base_t *base) {
+	bufpool_close(base);
 	for (unsigned int i = 0; i < base->core->count; ++i) {
-		base->core->pages[i]->exit_status = EXSTAT_SUCCESS;
-		flush_page(base->core->pages[i]);
-		base_list_set_crc_sum(base, &base->core->pages[i]->page_key, page_crc_sum(base->core->pages[i]));
+		sync_page(base, base->core->pages[i]);
+#if PAGER_MMAP
+		unmap_page(base, base->core->pages[i]);
+#endif
 		close(base->core->pages[i]->fd);
 	}
+	pthread_mutex_destroy(&base->core->lock);
 	tree_zfree(base->core);
 }
 
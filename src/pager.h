@@ -1,10 +1,13 @@
 #ifndef PAGE_H_INCLUDED
 #define PAGE_H_INCLUDED
 
+#include <pthread.h>
+
 #include <config.h>
 #include <common.h>
 #include "base.h"
 #include "quid.h"
+#include "crc64.h"
 
 #define zpalloc(b,s) \
 	pager_alloc(b, s);
@@ -16,19 +19,38 @@ typedef struct {
 	quid_short_t page_key;
 	enum exit_status exit_status;
 	int fd;
+	void *map;
+	size_t size;
+	uint64_t crc_sum;			/* Checksum kept in the page list */
+	uint64_t *crc_map;			/* Checksum per block */
+	unsigned char *crc_dirty;	/* Blocks written since their checksum was taken */
+	bool crc_changed;			/* Any block is marked */
+	size_t crc_size;			/* File size covered by the map */
 } page_t;
 
 typedef struct pager {
 	unsigned int count;
 	unsigned int allocated;
 	page_t **pages;
+	pthread_mutex_t lock;		/* Guards the checksum maps */
+	uint64_t crc_op[CRC64_OP_SIZE];	/* Combines the checksums of full blocks */
 } pager_t;
 
 uint64_t pager_alloc(base_t *base, size_t len);
+size_t pager_max_alloc(const base_t *base);
+void pager_release(base_t *base, uint64_t offset, size_t len);
+
+/*
+ * Note a write to the region at offset, the checksums of the blocks it
+ * touches are taken again on the next sync.
+ */
+void pager_dirty(const base_t *base, uint64_t offset, size_t len);
 int pager_get_fd(const base_t *base, uint64_t *offset);
+void *pager_get_map(const base_t *base, uint64_t offset, size_t len);
 unsigned int pager_get_sequence(base_t *base, uint64_t offset);
 void pager_init(base_t *base);
 void pager_sync(base_t *base);
+void pager_fsync(base_t *base);
 void pager_close(base_t *base);
 void pager_unlink_all(base_t *base);
 size_t pager_total_disk_size(base_t *base);
@@ -6,6 +6,7 @@
 #include <sys/time.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
@@ -47,6 +48,28 @@ void quid_create(quid_t *uid) {
 	format_quid(uid, clockseq, timestamp);
 }
 
+/* Timestamp embedded in the QUID */
+cuuid_time_t quid_get_time(const quid_t *uid) {
+	cuuid_time_t timestamp = (cuuid_time_t)((uid->time_hi_and_version & 0xfff) ^ QUID_SIGNATURE) << 48;
+	timestamp |= (cuuid_time_t)uid->time_mid << 32;
+	timestamp |= (cuuid_time_t)(uid->time_low & 0xffffffff);
+	return timestamp;
+}
+
+/* Lowest QUID created at the timestamp */
+void quid_time_bound(quid_t *uid, cuuid_time_t timestamp) {
+	nullify(uid, sizeof(quid_t));
+	uid->time_low = (unsigned long)(timestamp & 0xffffffff);
+	uid->time_mid = (unsigned short)((timestamp >> 32) & 0xffff);
+	uid->time_hi_and_version = (unsigned short)((timestamp >> 48) & 0xfff);
+	uid->time_hi_and_version ^= QUID_SIGNATURE;
+	uid->time_hi_and_version |= QUID_VERSION_3;
+}
+
+cuuid_time_t quid_unixtime(long long unixtime) {
+	return (EPOCH_DIFF + unixtime) * 10000000LL;
+}
+
 /* Construct short QUID */
 void quid_short_create(quid_short_t *uid) {
 	for (int i = 0; i < 4; ++i) {
@@ -154,11 +177,13 @@ static void format_quid(quid_t *uid, unsigned short clock_seq, cuuid_time_t time
 
 /* Get current time including cpu clock */
 static void get_current_time(cuuid_time_t *timestamp) {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	static int inited = 0;
 	static cuuid_time_t time_last;
 	static unsigned short ids_this_tick;
 	cuuid_time_t time_now;
 
+	pthread_mutex_lock(&lock);
 	if (!inited) {
 		get_system_time(&time_now);
 		ids_this_tick = UIDS_PER_TICK;
@@ -181,11 +206,49 @@ static void get_current_time(cuuid_time_t *timestamp) {
 	}
 
 	*timestamp = time_now + ids_this_tick;
+	pthread_mutex_unlock(&lock);
 }
 
 /* Compare two identifiers */
 int quidcmp(const quid_t *a, const quid_t *b) {
-	return memcmp(a, b, sizeof(quid_t));
+	unsigned short version_a = a->time_hi_and_version & 0xf000;
+	unsigned short version_b = b->time_hi_and_version & 0xf000;
+	if (version_a != version_b)
+		return version_a < version_b ? -1 : 1;
+
+	/* Keys of the same version sort by creation time */
+	cuuid_time_t time_a = quid_get_time(a);
+	cuuid_time_t time_b = quid_get_time(b);
+	if (time_a != time_b)
+		return time_a < time_b ? -1 : 1;
+
+	return memcmp(&a->clock_seq_hi_and_reserved, &b->clock_seq_hi_and_reserved, 8);
+}
+
+void quid_pack(const quid_t *uid, uint64_t *hi, uint64_t *lo) {
+	*hi = ((uint64_t)(uid->time_hi_and_version >> 12) << 60) | quid_get_time(uid);
+
+	const unsigned char *p = &uid->clock_seq_hi_and_reserved;
+	*lo = 0;
+	for (int i = 0; i < 8; ++i)
+		*lo = (*lo << 8) | p[i];
+}
+
+void quid_unpack(quid_t *uid, uint64_t hi, uint64_t lo) {
+	cuuid_time_t timestamp = hi & 0x0fffffffffffffffULL;
+
+	nullify(uid, sizeof(quid_t));
+	uid->time_low = (unsigned long)(timestamp & 0xffffffff);
+	uid->time_mid = (unsigned short)((timestamp >> 32) & 0xffff);
+	uid->time_hi_and_version = (unsigned short)((timestamp >> 48) & 0xfff);
+	uid->time_hi_and_version ^= QUID_SIGNATURE;
+	uid->time_hi_and_version |= (unsigned short)((hi >> 60) << 12);
+
+	unsigned char *p = &uid->clock_seq_hi_and_reserved;
+	for (int i = 7; i >= 0; --i) {
+		p[i] = lo & 0xff;
+		lo >>= 8;
+	}
 }
 
 /* Compare two identifiers */
@@ -194,7 +257,7 @@ int quid_shortcmp(const quid_short_t *a, const quid_short_t *b) {
 }
 
 /* Print QUID to string */
-void quidtostr(char *s, quid_t *u) {
+void quidtostr(char *s, const quid_t *u) {
 	snprintf(s, QUID_LENGTH + 1, "{%.8x-%.4x-%.4x-%.2x%.2x-%.2x%.2x%.2x%.2x%.2x%.2x}"
 	         , (unsigned int)u->time_low
 	         , u->time_mid
@@ -43,16 +43,30 @@ marshall_t *quid_decode(quid_t *uid);
 
 void quid_shorttostr(char *s, quid_short_t *u);
 
+/*
+ * Creation time in 100ns intervals since 1582, and the lowest QUID created
+ * at such a time. Keys compare in order of creation.
+ */
+cuuid_time_t quid_get_time(const quid_t *uid);
+void quid_time_bound(quid_t *uid, cuuid_time_t timestamp);
+cuuid_time_t quid_unixtime(long long unixtime);
+
 /*
  * Compare to QUID keys
  */
 int quidcmp(const quid_t *a, const quid_t *b);
+
+/*
+ * Convert a QUID to and from two integers which compare in quidcmp() order.
+ */
+void quid_pack(const quid_t *uid, uint64_t *hi, uint64_t *lo);
+void quid_unpack(quid_t *uid, uint64_t hi, uint64_t lo);
 int quid_shortcmp(const quid_short_t *a, const quid_short_t *b);
 
 /*
  * Convert QUID key to string
  */
-void quidtostr(char *s, quid_t *u);
+void quidtostr(char *s, const quid_t *u);
 
 /*
  * Convert string to QUID key
@@ -1,3 +1,4 @@
+#include <stdver.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -31,13 +32,16 @@ long long get_unixtimestamp() {
 
 char *tstostrf(char *buf, size_t len, long long ts, char *fmt) {
 	time_t now = ts + EPOCH_DIFF;
-	struct tm uts = *localtime(&now);
+	struct tm uts;
+	localtime_r(&now, &uts);
 	strftime(buf, len, fmt, &uts);
 	return buf;
 }
 
 char *unixtostrf(char *buf, size_t len, long long ts, char *fmt) {
-	struct tm tm_ts = *localtime((time_t *)&ts);
+	struct tm tm_ts;
+	time_t t = (time_t)ts;
+	localtime_r(&t, &tm_ts);
 	strftime(buf, len, fmt, &tm_ts);
 	return buf;
 }
@@ -0,0 +1,574 @@
+#include <stdver.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <config.h>
+#include <common.h>
+#include <log.h>
+#include <error.h>
+#include "zmalloc.h"
+#include "crc64.h"
+#include "pager.h"
+#include "bufpool.h"
+#include "base.h"
+#include "engine.h"
+#include "wal.h"
+
+#define WAL_BUFFER_SIZE		65536
+
+enum wal_type {
+	WAL_PAGE = 1,
+	WAL_BASE,
+	WAL_COMMIT,
+	WAL_KEY,
+	WAL_MERGE,
+};
+
+struct _wal_record {
+	__be64 lsn;
+	__be64 offset;
+	__be32 len;
+	__be8 type;
+	__be64 crc_sum;
+} __attribute__((packed));
+
+static uint64_t record_crc_sum(struct _wal_record *record, const void *data, size_t len) {
+	uint64_t sum = record->crc_sum;
+	record->crc_sum = 0;
+
+	uint64_t crc = crc64(0, record, sizeof(struct _wal_record));
+	if (len)
+		crc = crc64(crc, (void *)data, len);
+
+	record->crc_sum = sum;
+	return crc;
+}
+
+static void append_buffer(wal_t *wal, const void *data, size_t len) {
+	if (wal->len + len > wal->size) {
+		size_t nsz = wal->size * 2;
+		while (wal->len + len > nsz)
+			nsz *= 2;
+
+		char *buffer = (char *)zrealloc(wal->buffer, nsz);
+		if (!buffer) {
+			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+			return;
+		}
+		wal->buffer = buffer;
+		wal->size = nsz;
+	}
+
+	memcpy(wal->buffer + wal->len, data, len);
+	wal->len += len;
+}
+
+/* Append record to the current group, caller holds the log lock */
+static void append_record(wal_t *wal, enum wal_type type, uint64_t offset, const void *data, size_t len) {
+	struct _wal_record record;
+	nullify(&record, sizeof(struct _wal_record));
+
+	record.lsn = to_be64(wal->lsn + 1);
+	record.offset = to_be64(offset);
+	record.len = to_be32(len);
+	record.type = type;
+	record.crc_sum = to_be64(record_crc_sum(&record, data, len));
+
+	append_buffer(wal, &record, sizeof(struct _wal_record));
+	if (len)
+		append_buffer(wal, data, len);
+}
+
+static bool write_all(int fd, const void *data, size_t len, uint64_t offset) {
+	const char *p = (const char *)data;
+	while (len > 0) {
+		ssize_t rs = pwrite(fd, p, len, offset);
+		if (rs <= 0)
+			return FALSE;
+
+		p += rs;
+		len -= rs;
+		offset += rs;
+	}
+	return TRUE;
+}
+
+/*
+ * Write deferred regions in place once their group is on stable storage,
+ * caller holds the log lock
+ */
+static void apply_deferred(wal_t *wal) {
+	struct wal_deferred **link = &wal->deferred;
+	while (*link) {
+		struct wal_deferred *item = *link;
+		if (!item->logged || item->lsn > wal->flushed_lsn) {
+			link = &item->next;
+			continue;
+		}
+
+		if (!write_all(item->fd, item->data, item->len, item->local_offset))
+			error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+
+		*link = item->next;
+		zfree(item->data);
+		zfree(item);
+	}
+}
+
+/*
+ * Write the buffered records to the log and sync it. The caller must hold
+ * the log lock, it is released during the write so other writers can
+ * append to the next group in the meantime.
+ */
+static void flush_log(wal_t *wal) {
+	char *buffer = wal->buffer;
+	size_t len = wal->len;
+	uint64_t lsn = wal->lsn;
+	uint64_t offset = wal->log_size;
+
+	wal->buffer = (char *)zmalloc(WAL_BUFFER_SIZE);
+	wal->size = WAL_BUFFER_SIZE;
+	wal->len = 0;
+	wal->log_size += len;
+	wal->flushing = TRUE;
+	pthread_mutex_unlock(&wal->lock);
+
+	bool failed = !write_all(wal->fd, buffer, len, offset);
+	if (!failed && fdatasync(wal->fd) < 0)
+		failed = TRUE;
+	zfree(buffer);
+
+	pthread_mutex_lock(&wal->lock);
+	if (failed)
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+
+	wal->flushed_lsn = lsn;
+	wal->flushing = FALSE;
+	wal->stats.syncs++;
+	apply_deferred(wal);
+	pthread_cond_broadcast(&wal->flushed);
+}
+
+void wal_sync(wal_t *wal, uint64_t lsn) {
+	if (!wal || !lsn)
+		return;
+
+	pthread_mutex_lock(&wal->lock);
+	while (wal->flushed_lsn < lsn && lsn <= wal->lsn) {
+		if (wal->flushing) {
+			pthread_cond_wait(&wal->flushed, &wal->lock);
+			continue;
+		}
+
+		/* First one in leads the group */
+		flush_log(wal);
+	}
+	pthread_mutex_unlock(&wal->lock);
+}
+
+uint64_t wal_log(wal_t *wal, uint64_t offset, const void *data, size_t len) {
+	pthread_mutex_lock(&wal->lock);
+	append_record(wal, WAL_PAGE, offset, data, len);
+	uint64_t lsn = wal->lsn + 1;
+	pthread_mutex_unlock(&wal->lock);
+
+	return lsn;
+}
+
+void wal_log_key(wal_t *wal, const void *data, size_t len) {
+	pthread_mutex_lock(&wal->lock);
+	append_record(wal, WAL_KEY, 0, data, len);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_log_merge(wal_t *wal) {
+	pthread_mutex_lock(&wal->lock);
+	append_record(wal, WAL_MERGE, 0, NULL, 0);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_write(const base_t *base, uint64_t offset, const void *data, size_t len) {
+	uint64_t local_offset = offset;
+	int fd = pager_get_fd(base, &local_offset);
+	if (!write_all(fd, data, len, local_offset)) {
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+		return;
+	}
+	pager_dirty(base, offset, len);
+
+	if (base->wal)
+		wal_log(base->wal, offset, data, len);
+}
+
+void wal_write_direct(const base_t *base, uint64_t offset, const void *data, size_t len) {
+	uint64_t local_offset = offset;
+	int fd = pager_get_fd(base, &local_offset);
+	if (!write_all(fd, data, len, local_offset)) {
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+		return;
+	}
+	pager_dirty(base, offset, len);
+
+	/* A backup may already have copied past this region */
+	if (base->wal && base->wal->backups)
+		wal_log(base->wal, offset, data, len);
+}
+
+static void defer_region(wal_t *wal, int fd, uint64_t local_offset, uint64_t offset, const void *data, size_t len) {
+	pthread_mutex_lock(&wal->lock);
+	struct wal_deferred *item = wal->deferred;
+	for (; item; item = item->next) {
+		if (item->fd == fd && item->local_offset == local_offset && item->len == len)
+			break;
+	}
+
+	if (!item) {
+		item = (struct wal_deferred *)zcalloc(1, sizeof(struct wal_deferred));
+		if (!item || !(item->data = zmalloc(len))) {
+			zfree(item);
+			pthread_mutex_unlock(&wal->lock);
+			error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+			return;
+		}
+		item->fd = fd;
+		item->local_offset = local_offset;
+		item->offset = offset;
+		item->len = len;
+		item->next = wal->deferred;
+		wal->deferred = item;
+	}
+
+	memcpy(item->data, data, len);
+	item->logged = FALSE;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_defer(const base_t *base, uint64_t offset, const void *data, size_t len) {
+	uint64_t local_offset = offset;
+	int fd = pager_get_fd(base, &local_offset);
+
+	/* Deferred writes are in place before the pages are synced */
+	pager_dirty(base, offset, len);
+
+	if (!base->wal) {
+		if (!write_all(fd, data, len, local_offset))
+			error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+		return;
+	}
+
+	defer_region(base->wal, fd, local_offset, offset, data, len);
+}
+
+uint64_t wal_commit(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return 0;
+
+	/* Changed pool frames are logged as a whole */
+	bufpool_log(base);
+
+	struct _base image;
+	base_pack(base, &image);
+	if (memcmp(&image, &wal->image, sizeof(struct _base))) {
+		memcpy(&wal->image, &image, sizeof(struct _base));
+		defer_region(wal, base->fd, 0, 0, &image, sizeof(struct _base));
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	bool changed = wal->len > 0;
+	for (struct wal_deferred *item = wal->deferred; item; item = item->next) {
+		if (item->logged)
+			continue;
+
+		append_record(wal, item->offset ? WAL_PAGE : WAL_BASE, item->offset, item->data, item->len);
+		item->logged = TRUE;
+		item->lsn = wal->lsn + 1;
+		changed = TRUE;
+	}
+
+	if (!changed) {
+		pthread_mutex_unlock(&wal->lock);
+		return 0;
+	}
+
+	append_record(wal, WAL_COMMIT, 0, NULL, 0);
+	uint64_t lsn = ++wal->lsn;
+	wal->stats.commits++;
+	bool full = !wal->checkpoint && !wal->backups && (wal->log_size + wal->len) > WAL_CHECKPOINT_SIZE;
+	pthread_mutex_unlock(&wal->lock);
+
+	if (full) {
+		wal_checkpoint(base);
+		return 0;
+	}
+
+	return lsn;
+}
+
+void wal_checkpoint(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return;
+
+	/* Buffered keys must be in the tree before the log is emptied */
+	wal->checkpoint = TRUE;
+	engine_flush(base);
+
+	uint64_t lsn = wal_commit(base);
+	wal->checkpoint = FALSE;
+	wal_sync(wal, lsn ? lsn : wal->lsn);
+
+	/* Nothing can commit now, write everything in place */
+	bufpool_sync(base);
+	for (unsigned int i = 0; i < base->core->count; ++i)
+		fsync(base->core->pages[i]->fd);
+	fsync(base->fd);
+
+	pthread_mutex_lock(&wal->lock);
+	if (!wal->backups && !wal->len && !wal->deferred) {
+		if (ftruncate(wal->fd, 0) < 0)
+			lprint("[erro] Failed to truncate log\n");
+		wal->log_size = 0;
+	}
+	wal->stats.checkpoints++;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_backup_begin(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return;
+
+	/* Start from a short log */
+	wal_checkpoint(base);
+
+	pthread_mutex_lock(&wal->lock);
+	wal->backups++;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+uint64_t wal_backup_sync(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return 0;
+
+	uint64_t lsn = wal_commit(base);
+	wal_sync(wal, lsn ? lsn : wal->lsn);
+
+	pthread_mutex_lock(&wal->lock);
+	uint64_t size = wal->log_size;
+	pthread_mutex_unlock(&wal->lock);
+	return size;
+}
+
+void wal_backup_end(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return;
+
+	pthread_mutex_lock(&wal->lock);
+	if (wal->backups)
+		wal->backups--;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+/* Keep key record until the engine is opened */
+static void keep_key(wal_t *wal, const void *data, size_t len) {
+	size_t nsz = wal->replay_len + sizeof(uint32_t) + len;
+	char *replay = (char *)zrealloc(wal->replay, nsz);
+	if (!replay) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	uint32_t record_len = len;
+	memcpy(replay + wal->replay_len, &record_len, sizeof(uint32_t));
+	memcpy(replay + wal->replay_len + sizeof(uint32_t), data, len);
+	wal->replay = replay;
+	wal->replay_len = nsz;
+}
+
+/* Apply one commit group, records are known to be intact */
+static void replay_group(base_t *base, const char *data, size_t len) {
+	size_t pos = 0;
+	while (pos < len) {
+		const struct _wal_record *record = (const struct _wal_record *)(data + pos);
+		const char *payload = data + pos + sizeof(struct _wal_record);
+		size_t record_len = from_be32(record->len);
+		pos += sizeof(struct _wal_record) + record_len;
+
+		switch (record->type) {
+			case WAL_PAGE: {
+				uint64_t offset = from_be64(record->offset);
+				pager_dirty(base, offset, record_len);
+
+				int fd = pager_get_fd(base, &offset);
+				if (!write_all(fd, payload, record_len, offset))
+					error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+				break;
+			}
+			case WAL_BASE:
+				if (record_len == sizeof(struct _base))
+					base_unpack(base, (const struct _base *)payload);
+				break;
+			case WAL_KEY:
+				keep_key(base->wal, payload, record_len);
+				break;
+			case WAL_MERGE:
+				/* Keys before the merge are in the tree */
+				base->wal->replay_len = 0;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static size_t count_keys(const wal_t *wal) {
+	size_t count = 0, pos = 0;
+	while (pos < wal->replay_len) {
+		uint32_t len;
+		memcpy(&len, wal->replay + pos, sizeof(uint32_t));
+		pos += sizeof(uint32_t) + len;
+		count++;
+	}
+	return count;
+}
+
+void wal_recover(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return;
+
+	size_t size = file_size(wal->fd);
+	if (!size)
+		return;
+
+	char *data = (char *)zmalloc(size);
+	if (!data) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	if (pread(wal->fd, data, size, 0) != (ssize_t)size) {
+		error_throw_fatal("a7df40ba3075", "Failed to read disk");
+		zfree(data);
+		return;
+	}
+
+	/* Page list is written in place and may be ahead of the log */
+	unsigned short page_list_count = base->page_list_count;
+	unsigned short sequence = base->pager.sequence;
+
+	unsigned int groups = 0;
+	size_t group = 0, pos = 0;
+	while (pos + sizeof(struct _wal_record) <= size) {
+		struct _wal_record *record = (struct _wal_record *)(data + pos);
+		size_t record_len = from_be32(record->len);
+		if (pos + sizeof(struct _wal_record) + record_len > size)
+			break;
+
+		/* Torn write at the tail */
+		if (from_be64(record->crc_sum) != record_crc_sum(record, data + pos + sizeof(struct _wal_record), record_len))
+			break;
+
+		pos += sizeof(struct _wal_record) + record_len;
+		if (record->type == WAL_COMMIT) {
+			replay_group(base, data + group, pos - group);
+			group = pos;
+			groups++;
+		}
+	}
+	zfree(data);
+
+	if (base->page_list_count < page_list_count)
+		base->page_list_count = page_list_count;
+	if (base->pager.sequence < sequence)
+		base->pager.sequence = sequence;
+
+	struct _base image;
+	base_pack(base, &image);
+	if (!write_all(base->fd, &image, sizeof(struct _base), 0))
+		error_throw_fatal("1fd531fa70c1", "Failed to write disk");
+
+	lprintf("[info] Recovered %u groups from log\n", groups);
+	for (unsigned int i = 0; i < base->core->count; ++i)
+		fsync(base->core->pages[i]->fd);
+	fsync(base->fd);
+
+	/* Buffered keys are replayed by the engine, drop only the torn tail */
+	if (wal->replay_len)
+		lprintf("[info] Replaying %zu key records\n", count_keys(wal));
+	else
+		group = 0;
+
+	if (ftruncate(wal->fd, group) < 0)
+		lprint("[erro] Failed to truncate log\n");
+	wal->log_size = group;
+}
+
+void wal_replay_keys(base_t *base, wal_replay_t fn) {
+	wal_t *wal = base->wal;
+	if (!wal || !wal->replay)
+		return;
+
+	size_t pos = 0;
+	while (pos < wal->replay_len) {
+		uint32_t len;
+		memcpy(&len, wal->replay + pos, sizeof(uint32_t));
+		fn(base, wal->replay + pos + sizeof(uint32_t), len);
+		pos += sizeof(uint32_t) + len;
+	}
+
+	zfree(wal->replay);
+	wal->replay = NULL;
+	wal->replay_len = 0;
+}
+
+void wal_init(base_t *base) {
+	wal_t *wal = (wal_t *)zcalloc(1, sizeof(wal_t));
+	if (!wal) {
+		error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+		return;
+	}
+
+	wal->fd = open(WALFILE, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (wal->fd < 0) {
+		zfree(wal);
+		error_throw_fatal("65ccc95b60a6", "Failed to acquire descriptor");
+		return;
+	}
+
+	wal->size = WAL_BUFFER_SIZE;
+	wal->buffer = (char *)zmalloc(wal->size);
+	wal->log_size = file_size(wal->fd);
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->flushed, NULL);
+	base->wal = wal;
+}
+
+void wal_close(base_t *base) {
+	wal_t *wal = base->wal;
+	if (!wal)
+		return;
+
+	wal_checkpoint(base);
+	base->wal = NULL;
+
+	while (wal->deferred) {
+		struct wal_deferred *item = wal->deferred;
+		wal->deferred = item->next;
+		zfree(item->data);
+		zfree(item);
+	}
+
+	close(wal->fd);
+	unlink(WALFILE);
+	zfree(wal->replay);
+	pthread_cond_destroy(&wal->flushed);
+	pthread_mutex_destroy(&wal->lock);
+	zfree(wal->buffer);
+	zfree(wal);
+}
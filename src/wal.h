@@ -0,0 +1,134 @@
+#ifndef WAL_H_INCLUDED
+#define WAL_H_INCLUDED
+
+#include <pthread.h>
+
+#include <config.h>
+#include <common.h>
+#include "base.h"
+
+#define WALFILE		"wal"
+
+typedef struct base base_t;
+
+struct wal_deferred {
+	int fd;
+	uint64_t local_offset;	/* Offset in file */
+	uint64_t offset;		/* Global page offset, 0 for the base control */
+	size_t len;
+	void *data;
+	uint64_t lsn;			/* Commit holding the latest contents */
+	bool logged;
+	struct wal_deferred *next;
+};
+
+typedef struct wal {
+	int fd;
+	char *buffer;			/* Records not yet written to the log */
+	size_t len;
+	size_t size;
+	uint64_t log_size;		/* Bytes in the log file */
+	uint64_t lsn;			/* Last committed group */
+	uint64_t flushed_lsn;	/* Last group on stable storage */
+	bool flushing;
+	bool checkpoint;		/* Checkpoint in progress */
+	unsigned int backups;	/* Backups holding on to the log */
+	struct _base image;		/* Last logged base control */
+	struct wal_deferred *deferred;
+	char *replay;			/* Recovered key records */
+	size_t replay_len;
+	pthread_mutex_t lock;
+	pthread_cond_t flushed;
+	struct {
+		unsigned long long commits;
+		unsigned long long syncs;
+		unsigned long long checkpoints;
+	} stats;
+} wal_t;
+
+/*
+ * Open the log and attach it to the base. Everything written through the
+ * wal_* calls is logged from here on.
+ */
+void wal_init(base_t *base);
+
+/*
+ * Replay all complete commit groups from the log onto the pages and the
+ * base control. Must be called once the pages are opened.
+ */
+void wal_recover(base_t *base);
+
+/*
+ * Append a page image to the current group, returns the group number the
+ * record belongs to.
+ */
+uint64_t wal_log(wal_t *wal, uint64_t offset, const void *data, size_t len);
+
+/*
+ * Append an opaque key record to the current group. Records logged after
+ * the last wal_log_merge() are handed back by wal_replay_keys() on recovery.
+ */
+void wal_log_key(wal_t *wal, const void *data, size_t len);
+void wal_log_merge(wal_t *wal);
+
+/*
+ * Pass the recovered key records to the callback in log order.
+ */
+typedef void (*wal_replay_t)(base_t *base, const void *data, size_t len);
+void wal_replay_keys(base_t *base, wal_replay_t fn);
+
+/*
+ * Write data to storage and log it as part of the current group. Only for
+ * regions that are not referenced before the group is committed.
+ */
+void wal_write(const base_t *base, uint64_t offset, const void *data, size_t len);
+
+/*
+ * Write data to storage without logging it. Only for fresh regions that
+ * become reachable later, pager_fsync() must run before that happens.
+ */
+void wal_write_direct(const base_t *base, uint64_t offset, const void *data, size_t len);
+
+/*
+ * Log data as part of the current group, the in place write is postponed
+ * until the group is on stable storage. Repeated writes to the same region
+ * are coalesced.
+ */
+void wal_defer(const base_t *base, uint64_t offset, const void *data, size_t len);
+
+/*
+ * Close the current group, all changes made since the previous commit are
+ * appended to the log. Returns the group number to pass to wal_sync(), or 0
+ * if nothing changed.
+ */
+uint64_t wal_commit(base_t *base);
+
+/*
+ * Wait until the group is on stable storage. Concurrent callers share a
+ * single write and fsync of the log.
+ */
+void wal_sync(wal_t *wal, uint64_t lsn);
+
+/*
+ * Write all logged changes in place, sync the storage and empty the log.
+ */
+void wal_checkpoint(base_t *base);
+void wal_close(base_t *base);
+
+/*
+ * Keep the log from the next checkpoint on while a backup copies the
+ * storage. Checkpoints still write in place but no longer empty the log,
+ * and unlogged writes are logged as well, so the log brings any copy of
+ * the files taken meanwhile up to date. Caller holds the engine exclusively.
+ */
+void wal_backup_begin(base_t *base);
+
+/*
+ * Commit and sync the current group, returns the log size covering all
+ * changes so far. The log is not truncated below this size until the
+ * backup ends.
+ */
+uint64_t wal_backup_sync(base_t *base);
+void wal_backup_end(base_t *base);
+
+#endif // WAL_H_INCLUDED
@@ -3,14 +3,18 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <config.h>
 #include <common.h>
@@ -39,14 +43,82 @@
 #define RLOGLINE_SIZE		256
 #define RESPONSE_SIZE		512
 
+#define EPOLL_EVENTS		64
+#define JOB_QUEUE_SIZE		1024
+#define CONN_BUFFER_SIZE	4096
+#define RESPONSE_IOV_SIZE	16
+#define UPLOAD_LINE_SIZE	1024
+
 int serversock4 = 0;
 int serversock6 = 0;
-int max_sd;
-fd_set readfds;
-fd_set readsock;
-static unsigned long long int client_requests = 0;
+static int epollfd = -1;
+static int wakefd = -1;
+static char static_headers[256];
+static size_t static_headers_len = 0;
+static _Atomic unsigned long long int client_requests = 0;
 unsigned int run = 1;
 
+/*
+ * Body decoder state of a streamed upload
+ */
+typedef enum {
+	UPLOAD_NONE = 0,
+	UPLOAD_DATA,				/* Body of known length */
+	UPLOAD_CHUNK_SIZE,
+	UPLOAD_CHUNK_DATA,
+	UPLOAD_CHUNK_END,
+	UPLOAD_TRAILER
+} upload_state_t;
+
+/*
+ * Client connection state. Incoming bytes are collected in the buffer until
+ * a complete request (header and body) is available, any pipelined request
+ * following it stays in the buffer for the next round. The body of an upload
+ * is passed on to the object as it arrives, only the header is kept.
+ */
+typedef struct connection {
+	int sd;
+	char addr[INET6_ADDRSTRLEN];
+	char *buffer;
+	size_t size;
+	size_t len;
+	size_t head_len;			/* Header length, 0 while incomplete */
+	size_t body_len;
+	db_object_t *object;		/* Large object being uploaded */
+	upload_state_t upload;
+	size_t remaining;			/* Bytes left in body or chunk */
+	unsigned int requests;
+	long long last_active;
+	bool busy;					/* Owned by a worker */
+	struct connection *prev;
+	struct connection *next;
+} connection_t;
+
+static struct {
+	connection_t *head;
+	pthread_mutex_t lock;
+} connections = {
+	.head = NULL,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Connections ready for reading are queued by the event loop and picked
+ * up by the first idle worker.
+ */
+static struct {
+	connection_t *conn[JOB_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+} jobs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.space = PTHREAD_COND_INITIALIZER,
+};
+
 typedef enum {
 	HTTP_GET = 1,
 	HTTP_POST,
@@ -70,6 +142,15 @@ typedef struct {
 	hashtable_t *querystring;
 	hashtable_t *header;
 	http_method_t method;
+	struct {
+		const char *prefix;
+		char *data;
+		const char *suffix;
+	} payload;
+	connection_t *conn;
+	vector_t *headers;
+	bool streamed;				/* Response was sent by the handler */
+	bool broken;				/* Response ended early, close connection */
 } http_request_t;
 
 struct webroute {
@@ -103,55 +184,135 @@ void handle_shutdown(int intsig) {
 	exit(0);
 }
 
-void raw_response(FILE *socket_stream, vector_t *headers, const char *status) {
-	char squid[QUID_LENGTH + 1] = {'\0'};
-	quid_generate(squid);
+/*
+ * Headers equal for every response, set up once on startup
+ */
+static void init_static_headers() {
+	int len = snprintf(static_headers, sizeof(static_headers),
+	                   "Server: " PROGNAME "/%s " VERSION_STRING "\r\n"
+	                   "Access-Control-Allow-Origin: *\r\n"
+	                   "Access-Control-Allow-Methods: GET,POST,HEAD,OPTIONS\r\n", get_version_string());
+	static_headers_len = (len < (int)sizeof(static_headers)) ? (size_t)len : sizeof(static_headers) - 1;
+}
 
-	fprintf(socket_stream,
-	        "HTTP/1.1 %s\r\n"
-	        "Server: " PROGNAME "/%s " VERSION_STRING "\r\n"
-	        "Content-Type: application/json\r\n"
-	        "Content-Length: 0\r\n", status, get_version_string());
+/*
+ * Gather write of all vectors, sendmsg() is used over writev() so a closed
+ * peer does not raise SIGPIPE. Returns FALSE if the peer is gone.
+ */
+static bool send_iov(int sd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		ssize_t n = sendmsg(sd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
 
-	size_t i;
-	for (i = 0; i < headers->size; ++i) {
-		char *str = (char*)(vector_at(headers, i));
-		fprintf(socket_stream, "%s", str);
+		/* Skip over written vectors and resume partial writes */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
+	return TRUE;
+}
 
-	fprintf(socket_stream,
-	        "Access-Control-Allow-Origin: *\r\n"
-	        "Access-Control-Allow-Methods: GET,POST,HEAD,OPTIONS\r\n"
-	        "X-QUID: %s\r\n"
-	        "\r\n", squid);
+/* Send one chunk of a response with chunked transfer encoding */
+static bool send_chunk(int sd, void *data, size_t len) {
+	struct iovec iov[3];
+	char chunk_head[24];
+	iov[0].iov_base = chunk_head;
+	iov[0].iov_len = snprintf(chunk_head, sizeof(chunk_head), "%zx\r\n", len);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	return send_iov(sd, iov, 3);
 }
 
-void json_response(FILE *socket_stream, vector_t *headers, const char *status, const char *message) {
+struct response_head {
+	char line[128];
+	char tail[QUID_LENGTH + 16];
+};
+
+/*
+ * Vectors of the status line, the body headers in 'fields', the static and
+ * dynamic headers and the empty line. At most 'iov_max' vectors are used.
+ */
+static int response_head(struct response_head *head, struct iovec *iov, int iov_max, vector_t *headers, const char *status, const char *fields) {
 	char squid[QUID_LENGTH + 1] = {'\0'};
 	quid_generate(squid);
 
-	fprintf(socket_stream,
-	        "HTTP/1.1 %s\r\n"
-	        "Server: " PROGNAME "/%s " VERSION_STRING "\r\n"
-	        "Content-Type: application/json\r\n"
-	        "Content-Length: %zu\r\n", status, get_version_string(), (strlen(message) + 2));
+	int line_len = snprintf(head->line, sizeof(head->line), "HTTP/1.1 %s\r\n%s", status, fields);
+	int tail_len = snprintf(head->tail, sizeof(head->tail), "X-QUID: %s\r\n\r\n", squid);
+
+	int iovcnt = 0;
+	iov[iovcnt].iov_base = head->line;
+	iov[iovcnt++].iov_len = line_len;
+	iov[iovcnt].iov_base = static_headers;
+	iov[iovcnt++].iov_len = static_headers_len;
+	for (unsigned int i = 0; i < headers->size && iovcnt < iov_max - 1; ++i) {
+		char *str = (char *)(vector_at(headers, i));
+		iov[iovcnt].iov_base = str;
+		iov[iovcnt++].iov_len = strlen(str);
+	}
+	iov[iovcnt].iov_base = head->tail;
+	iov[iovcnt++].iov_len = tail_len;
+	return iovcnt;
+}
+
+/*
+ * Assemble the response from the status line, static and dynamic headers
+ * and the body parts, then send it in a single call. Body parts are not
+ * copied.
+ */
+static void send_response(connection_t *conn, vector_t *headers, const char *status, const struct iovec *body, int body_cnt) {
+	size_t content_length = 0;
+	for (int i = 0; i < body_cnt; ++i)
+		content_length += body[i].iov_len;
+	if (body_cnt)
+		content_length += 2;
 
-	size_t i;
-	for (i = 0; i < headers->size; ++i) {
-		char *str = (char*)(vector_at(headers, i));
-		fprintf(socket_stream, "%s", str);
+	char fields[80];
+	snprintf(fields, sizeof(fields), "Content-Length: %zu\r\nContent-Type: application/json\r\n", content_length);
+
+	struct response_head head;
+	struct iovec iov[RESPONSE_IOV_SIZE];
+	int iovcnt = response_head(&head, iov, RESPONSE_IOV_SIZE - body_cnt - 1, headers, status, fields);
+
+	if (body_cnt) {
+		for (int i = 0; i < body_cnt; ++i)
+			iov[iovcnt++] = body[i];
+		iov[iovcnt].iov_base = "\r\n";
+		iov[iovcnt++].iov_len = 2;
 	}
 
-	fprintf(socket_stream,
-	        "Access-Control-Allow-Origin: *\r\n"
-	        "Access-Control-Allow-Methods: GET,POST,HEAD,OPTIONS\r\n"
-	        "X-QUID: %s\r\n"
-	        "\r\n"
-	        "%s\r\n", squid, message);
+	send_iov(conn->sd, iov, iovcnt);
+}
+
+void raw_response(connection_t *conn, vector_t *headers, const char *status) {
+	send_response(conn, headers, status, NULL, 0);
+}
+
+void json_response(connection_t *conn, vector_t *headers, const char *status, const char *message) {
+	struct iovec body;
+	body.iov_base = (void *)message;
+	body.iov_len = strlen(message);
+	send_response(conn, headers, status, &body, 1);
 }
 
 char *get_http_status(http_status_t status) {
-	static char buf[16];
+	static _Thread_local char buf[16];
 	switch (status) {
 		case HTTP_OK:
 			strlcpy(buf, "200 OK", 16);
@@ -192,6 +353,111 @@ http_status_t response_internal_error(char **response) {
 	return HTTP_OK;
 }
 
+/*
+ * Attach serialized data as response body. The data is sent as is between
+ * prefix and suffix and released once the response is written.
+ */
+http_status_t response_payload(http_request_t *req, const char *prefix, char *data, const char *suffix) {
+	req->payload.prefix = prefix;
+	req->payload.data = data;
+	req->payload.suffix = suffix;
+	return HTTP_OK;
+}
+
+/*
+ * Serialized body is buffered up to API_STREAM_SIZE and attached as payload,
+ * larger bodies are sent with chunked transfer encoding while the object is
+ * serialized.
+ */
+struct response_sink {
+	http_request_t *req;
+	const char *prefix;
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static size_t response_sink_write(void *ctx, const char *data, size_t len) {
+	struct response_sink *sink = (struct response_sink *)ctx;
+	http_request_t *req = sink->req;
+
+	if (!req->streamed && sink->len + len < API_STREAM_SIZE) {
+		if (sink->len + len >= sink->size) {
+			size_t nsz = sink->size ? sink->size * 2 : CONN_BUFFER_SIZE;
+			while (sink->len + len >= nsz)
+				nsz *= 2;
+
+			char *ndata = (char *)zrealloc(sink->data, nsz);
+			if (!ndata) {
+				error_throw_fatal("7b8a6ac440e2", "Failed to request memory");
+				return 0;
+			}
+			sink->data = ndata;
+			sink->size = nsz;
+		}
+		memcpy(sink->data + sink->len, data, len);
+		sink->len += len;
+		return len;
+	}
+
+	if (!req->streamed) {
+		struct response_head head;
+		struct iovec iov[RESPONSE_IOV_SIZE];
+		int iovcnt = response_head(&head, iov, RESPONSE_IOV_SIZE, req->headers, get_http_status(HTTP_OK), "Transfer-Encoding: chunked\r\nContent-Type: application/json\r\n");
+		req->streamed = TRUE;
+		if (!send_iov(req->conn->sd, iov, iovcnt))
+			return 0;
+		if (!send_chunk(req->conn->sd, (void *)sink->prefix, strlen(sink->prefix)))
+			return 0;
+		if (sink->len && !send_chunk(req->conn->sd, sink->data, sink->len))
+			return 0;
+		sink->len = 0;
+	}
+
+	if (!send_chunk(req->conn->sd, (void *)data, len))
+		return 0;
+	return len;
+}
+
+/*
+ * Serialize the object as response body between prefix and suffix. The
+ * object is released, errors after the response was started close the
+ * connection.
+ */
+http_status_t response_object(char **response, http_request_t *req, const char *prefix, marshall_t *obj, marshall_format_t format, const char *suffix) {
+	struct response_sink sink;
+	memset(&sink, 0, sizeof(struct response_sink));
+	sink.req = req;
+	sink.prefix = prefix;
+
+	bool ok = marshall_serialize_stream(obj, format, response_sink_write, &sink);
+	marshall_free(obj);
+
+	if (req->streamed) {
+		zfree(sink.data);
+		if (!ok) {
+			req->broken = TRUE;
+			return HTTP_OK;
+		}
+
+		struct iovec iov[1];
+		iov[0].iov_base = "0\r\n\r\n";
+		iov[0].iov_len = 5;
+		if (!send_chunk(req->conn->sd, (void *)suffix, strlen(suffix)) || !send_iov(req->conn->sd, iov, 1))
+			req->broken = TRUE;
+		return HTTP_OK;
+	}
+
+	if (!ok) {
+		zfree(sink.data);
+		return response_internal_error(response);
+	}
+
+	/* Payload is a string, the buffer always has room left */
+	sink.data[sink.len] = '\0';
+	return response_payload(req, prefix, sink.data, suffix);
+}
+
 http_status_t response_empty_error(char **response) {
 	strlcpy(*response, "{\"description\":\"Request expects data\",\"status\":\"EMPTY_DATA\",\"success\":false}", RESPONSE_SIZE);
 	return HTTP_OK;
@@ -228,7 +494,7 @@ http_status_t api_variables(char **response, http_request_t *req) {
 	char *hostname = get_system_fqdn();
 
 	*response = zrealloc(*response, RESPONSE_SIZE * 2);
-	snprintf(*response, RESPONSE_SIZE * 2, "{\"server\":{\"uptime\":\"%s\",\"client_requests\":%llu,\"port\":%d,\"host\":\"%s\"},\"pager\":{\"page_size\":%u,\"page_count\":%d,\"allocated\":\"%s\",\"in_use\":\"%s\"},\"engine\":{\"records\":%lu,\"free\":%lu,\"blocks_free\":%lu,\"groups\":%lu,\"indexes\":%lu,\"default_key\":\"%s\"},\"date\":{\"timestamp\":%lld,\"unixtime\":%lld,\"datetime\":\"%s\",\"timename\":\"%s\"},\"version\":{\"major\":%d,\"minor\":%d,\"patch\":%d},\"description\":\"Database statistics\",\"status\":\"SUCCEEDED\",\"success\":true}"
+	snprintf(*response, RESPONSE_SIZE * 2, "{\"server\":{\"uptime\":\"%s\",\"client_requests\":%llu,\"port\":%d,\"host\":\"%s\"},\"pager\":{\"page_size\":%u,\"page_count\":%d,\"allocated\":\"%s\",\"in_use\":\"%s\"},\"engine\":{\"records\":%lu,\"free\":%lu,\"blocks_free\":%lu,\"groups\":%lu,\"indexes\":%lu,\"compress_ratio\":%.2f,\"released\":%llu,\"default_key\":\"%s\"},\"bufpool\":{\"frames\":%u,\"hit\":%llu,\"miss\":%llu},\"wal\":{\"commits\":%llu,\"syncs\":%llu},\"date\":{\"timestamp\":%lld,\"unixtime\":%lld,\"datetime\":\"%s\",\"timename\":\"%s\"},\"version\":{\"major\":%d,\"minor\":%d,\"patch\":%d},\"description\":\"Database statistics\",\"status\":\"SUCCEEDED\",\"success\":true}"
 	         , get_uptime()
 	         , client_requests
 	         , API_PORT
@@ -242,7 +508,14 @@ http_status_t api_variables(char **response, http_request_t *req) {
 	         , stat_getfreeblocks()
 	         , stat_tablesize()
 	         , stat_indexsize()
+	         , stat_compress_ratio()
+	         , stat_compact_released()
 	         , get_instance_prefix_key("000000000000")
+	         , stat_bufpool_size()
+	         , stat_bufpool_hit()
+	         , stat_bufpool_miss()
+	         , stat_wal_commits()
+	         , stat_wal_syncs()
 	         , get_timestamp()
 	         , get_unixtimestamp()
 	         , htime
@@ -414,6 +687,13 @@ http_status_t api_vacuum(char **response, http_request_t *req) {
 	return HTTP_OK;
 }
 
+http_status_t api_compact(char **response, http_request_t *req) {
+	unused(req);
+	zcompact();
+	strlcpy(*response, "{\"description\":\"Compaction started\",\"status\":\"SUCCEEDED\",\"success\":true}", RESPONSE_SIZE);
+	return HTTP_OK;
+}
+
 http_status_t api_sync(char **response, http_request_t *req) {
 	unused(req);
 	filesync();
@@ -424,6 +704,44 @@ http_status_t api_sync(char **response, http_request_t *req) {
 	return HTTP_OK;
 }
 
+/*
+ * Stream a backup archive of the database with chunked transfer encoding,
+ * the database remains available while the archive is sent.
+ */
+http_status_t api_snapshot(char **response, http_request_t *req) {
+	if (req->method == HTTP_HEAD)
+		return HTTP_OK;
+
+	db_backup_t *backup = db_backup_open();
+	if (!backup)
+		return response_internal_error(response);
+
+	struct response_head head;
+	struct iovec iov[RESPONSE_IOV_SIZE];
+	int iovcnt = response_head(&head, iov, RESPONSE_IOV_SIZE, req->headers, get_http_status(HTTP_OK), "Transfer-Encoding: chunked\r\nContent-Type: application/octet-stream\r\n");
+	send_iov(req->conn->sd, iov, iovcnt);
+	req->streamed = TRUE;
+
+	size_t len;
+	void *data;
+	while ((data = db_backup_read(backup, &len))) {
+		send_chunk(req->conn->sd, data, len);
+		zfree(data);
+	}
+	db_backup_free(backup);
+
+	/* Archive is incomplete */
+	if (iserror()) {
+		req->broken = TRUE;
+		return HTTP_OK;
+	}
+
+	iov[0].iov_base = "0\r\n\r\n";
+	iov[0].iov_len = 5;
+	send_iov(req->conn->sd, iov, 1);
+	return HTTP_OK;
+}
+
 http_status_t api_gen_quid(char **response, http_request_t *req) {
 	bool qshort = FALSE;
 	char *squid = NULL;
@@ -468,7 +786,11 @@ http_status_t api_gen_rand(char **response, http_request_t *req) {
 
 http_status_t api_shutdown(char **response, http_request_t *req) {
 	unused(req);
-	run = 0;
+
+	/* Wake up the event loop, which stops the server */
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(uint64_t)) < 0)
+		lprint("[erro] Failed to wake event loop\n");
 	strlcpy(*response, "{\"description\":\"Shutting down database\",\"status\":\"SUCCEEDED\",\"success\":true}", RESPONSE_SIZE);
 	return HTTP_OK;
 }
@@ -521,50 +843,94 @@ http_status_t api_db_put(char **response, http_request_t *req) {
 	return response_empty_error(response);
 }
 
+http_status_t api_db_put_batch(char **response, http_request_t *req) {
+	int items = 0;
+
+	char *data = get_param(req, "data");
+	if (data) {
+		char *quids = db_put_batch(&items, data, strlen(data));
+		if (iserror()) {
+			zfree(quids);
+			return response_internal_error(response);
+		}
+
+		if (!quids)
+			quids = zstrdup("null");
+
+		/* Response buffer is kept until the payload is sent */
+		snprintf(*response, RESPONSE_SIZE, ",\"items\":%d,\"description\":\"Data stored in records\",\"status\":\"SUCCEEDED\",\"success\":true}", items);
+		return response_payload(req, "{\"quids\":", quids, *response);
+	}
+	return response_empty_error(response);
+}
+
 http_status_t api_db_get(char **response, http_request_t *req) {
-	size_t len = 0, resplen;
 	bool _resolve = TRUE;
 	bool getforce = FALSE;
+	marshall_format_t format = MARSHALL_PACKED;
 
 	char *quid = (char *)hashtable_get(req->data, "quid");
 	char *resolve = get_param(req, "resolve");
 	char *selector = get_param(req, "select");
 	char *force = get_param(req, "force");
 	char *where = get_param(req, "where");
+	char *indent = get_param(req, "indent");
 	if (quid) {
-		char *data = NULL;
 		if (selector || where) {
-			data = db_select(quid, selector, where);
+			char *data = db_select(quid, selector, where);
 			if (iserror()) {
 				return response_internal_error(response);
 			}
-		} else {
-			if (resolve) {
-				if (!strcmp(resolve, "false")) {
-					_resolve = FALSE;
-				}
+			return response_payload(req, "{\"data\":", data, ",\"description\":\"Retrieve record by requested key\",\"status\":\"SUCCEEDED\",\"success\":true}");
+		}
+
+		if (resolve) {
+			if (!strcmp(resolve, "false")) {
+				_resolve = FALSE;
 			}
-			if (force) {
-				if (!strcmp(force, "true")) {
-					getforce = TRUE;
-				}
+		}
+		if (force) {
+			if (!strcmp(force, "true")) {
+				getforce = TRUE;
 			}
-
-			data = db_get(quid, &len, _resolve, getforce);
-			if (iserror()) {
-				return response_internal_error(response);
+		}
+		if (indent) {
+			if (!strcmp(indent, "true")) {
+				format = MARSHALL_INDENT;
 			}
 		}
 
-		len = strlen(data);
-		resplen = RESPONSE_SIZE;
-		if (len > (RESPONSE_SIZE / 2)) {
-			resplen = RESPONSE_SIZE + len;
-			*response = zrealloc(*response, resplen);
+		marshall_t *dataobj = db_get_record(quid, _resolve, getforce);
+		if (iserror()) {
+			marshall_free(dataobj);
+			return response_internal_error(response);
 		}
-		snprintf(*response, resplen, "{\"data\":%s,\"description\":\"Retrieve record by requested key\",\"status\":\"SUCCEEDED\",\"success\":true}", data);
-		zfree(data);
-		return HTTP_OK;
+		if (req->method == HTTP_HEAD) {
+			marshall_free(dataobj);
+			return HTTP_OK;
+		}
+
+		return response_object(response, req, "{\"data\":", dataobj, format, ",\"description\":\"Retrieve record by requested key\",\"status\":\"SUCCEEDED\",\"success\":true}");
+	}
+	return response_empty_error(response);
+}
+
+http_status_t api_db_get_many(char **response, http_request_t *req) {
+	int items = 0;
+
+	char *keys = get_param(req, "keys");
+	char *resolve = get_param(req, "resolve");
+	if (keys) {
+		bool _resolve = !(resolve && !strcmp(resolve, "false"));
+		char *data = db_get_many(&items, keys, strlen(keys), _resolve);
+		if (iserror()) {
+			zfree(data);
+			return response_internal_error(response);
+		}
+
+		/* Response buffer is kept until the payload is sent */
+		snprintf(*response, RESPONSE_SIZE, ",\"items\":%d,\"description\":\"Retrieve records by requested keys\",\"status\":\"SUCCEEDED\",\"success\":true}", items);
+		return response_payload(req, "{\"data\":", data, *response);
 	}
 	return response_empty_error(response);
 }
@@ -602,9 +968,7 @@ http_status_t api_db_get_history(char **response, http_request_t *req) {
 		if (iserror()) {
 			return response_internal_error(response);
 		}
-		snprintf(*response, RESPONSE_SIZE, "{\"history_versions\":%s,\"description\":\"Record history\",\"status\":\"SUCCEEDED\",\"success\":true}", history);
-		zfree(history);
-		return HTTP_OK;
+		return response_payload(req, "{\"history_versions\":", history, ",\"description\":\"Record history\",\"status\":\"SUCCEEDED\",\"success\":true}");
 	}
 	return response_empty_error(response);
 }
@@ -616,17 +980,72 @@ http_status_t api_db_get_version(char **response, http_request_t *req) {
 		if (iserror()) {
 			return response_internal_error(response);
 		}
-		size_t len = strlen(data);
-		size_t resplen = RESPONSE_SIZE;
-		if (len > (RESPONSE_SIZE / 2)) {
-			resplen = RESPONSE_SIZE + len;
-			*response = zrealloc(*response, resplen);
-		}
-		snprintf(*response, resplen, "{\"data\":%s,\"description\":\"Retrieve historic record by version key\",\"status\":\"SUCCEEDED\",\"success\":true}", data);
+		return response_payload(req, "{\"data\":", data, ",\"description\":\"Retrieve historic record by version key\",\"status\":\"SUCCEEDED\",\"success\":true}");
+	}
+	return response_empty_error(response);
+}
+
+/*
+ * The body of the upload was written to the object while it came in, the
+ * object is bound to a new key here.
+ */
+http_status_t api_db_put_object(char **response, http_request_t *req) {
+	char squid[QUID_LENGTH + 1];
+
+	db_object_t *object = req->conn->object;
+	if (!object)
+		return response_empty_error(response);
+
+	if (db_object_commit(object, squid) < 0)
+		return response_internal_error(response);
+
+	snprintf(*response, RESPONSE_SIZE, "{\"quid\":\"%s\",\"description\":\"Data stored in large object\",\"status\":\"SUCCEEDED\",\"success\":true}", squid);
+	return HTTP_OK;
+}
+
+/*
+ * Send the object with chunked transfer encoding, one chunk at a time. Errors
+ * after the header was sent can only be signaled by closing the connection.
+ */
+http_status_t api_db_get_object(char **response, http_request_t *req) {
+	unsigned long long size = 0;
+
+	char *quid = (char *)hashtable_get(req->data, "quid");
+	if (!quid)
+		return response_empty_error(response);
+
+	db_object_t *object = db_object_open(quid, &size);
+	if (!object)
+		return response_internal_error(response);
+
+	if (req->method == HTTP_HEAD) {
+		db_object_free(object);
+		return HTTP_OK;
+	}
+
+	struct response_head head;
+	struct iovec iov[RESPONSE_IOV_SIZE];
+	int iovcnt = response_head(&head, iov, RESPONSE_IOV_SIZE, req->headers, get_http_status(HTTP_OK), "Transfer-Encoding: chunked\r\nContent-Type: application/octet-stream\r\n");
+	send_iov(req->conn->sd, iov, iovcnt);
+	req->streamed = TRUE;
+
+	size_t len;
+	void *data;
+	while ((data = db_object_read(object, &len))) {
+		send_chunk(req->conn->sd, data, len);
 		zfree(data);
+	}
+	db_object_free(object);
+
+	if (iserror()) {
+		req->broken = TRUE;
 		return HTTP_OK;
 	}
-	return response_empty_error(response);
+
+	iov[0].iov_base = "0\r\n\r\n";
+	iov[0].iov_len = 5;
+	send_iov(req->conn->sd, iov, 1);
+	return HTTP_OK;
 }
 
 http_status_t api_db_delete(char **response, http_request_t *req) {
@@ -897,7 +1316,7 @@ http_status_t api_alias_name(char **response, http_request_t *req) {
 }
 
 http_status_t api_alias_get(char **response, http_request_t *req) {
-	size_t len = 0, resplen;
+	size_t len = 0;
 	bool _resolve = TRUE;
 	char *resolve = get_param(req, "resolve");
 	if (resolve) {
@@ -911,20 +1330,10 @@ http_status_t api_alias_get(char **response, http_request_t *req) {
 		return response_internal_error(response);
 	}
 
-	resplen = RESPONSE_SIZE;
-	if (len > (RESPONSE_SIZE / 2)) {
-		resplen = RESPONSE_SIZE + len;
-		*response = zrealloc(*response, resplen);
-	}
-	snprintf(*response, resplen, "{\"data\":%s,\"description\":\"Retrieve record by requested key\",\"status\":\"SUCCEEDED\",\"success\":true}", data);
-	zfree(data);
-	return HTTP_OK;
+	return response_payload(req, "{\"data\":", data, ",\"description\":\"Retrieve record by requested key\",\"status\":\"SUCCEEDED\",\"success\":true}");
 }
 
 http_status_t api_alias_all(char **response, http_request_t *req) {
-	unused(req);
-	size_t len = 0, resplen;
-
 	char *list = db_alias_all();
 	if (iserror()) {
 		return response_internal_error(response);
@@ -933,21 +1342,79 @@ http_status_t api_alias_all(char **response, http_request_t *req) {
 	if (!list)
 		list = zstrdup("null");
 
-	len = strlen(list);
-	resplen = RESPONSE_SIZE;
-	if (len > (RESPONSE_SIZE / 2)) {
-		resplen = RESPONSE_SIZE + len;
-		*response = zrealloc(*response, resplen);
+	return response_payload(req, "{\"aliasses\":", list, ",\"description\":\"Listening aliasses\",\"status\":\"SUCCEEDED\",\"success\":true}");
+}
+
+static unsigned int get_page_limit(http_request_t *req) {
+	char *param_limit = get_param(req, "limit");
+	if (param_limit) {
+		int limit = atoi(param_limit);
+		if (limit > 0)
+			return limit > API_KEYS_PAGE_MAX ? API_KEYS_PAGE_MAX : limit;
 	}
-	snprintf(*response, resplen, "{\"aliasses\":%s,\"description\":\"Listening aliasses\",\"status\":\"SUCCEEDED\",\"success\":true}", list);
-	zfree(list);
-	return HTTP_OK;
+	return API_KEYS_PAGE;
 }
 
-http_status_t api_index_all(char **response, http_request_t *req) {
-	unused(req);
-	size_t len = 0, resplen;
+static http_status_t response_key_page(char **response, http_request_t *req, char *list, const char *next) {
+	if (iserror()) {
+		zfree(list);
+		return response_internal_error(response);
+	}
 
+	if (!list)
+		list = zstrdup("null");
+
+	/* Response buffer is kept until the payload is sent */
+	if (next[0])
+		snprintf(*response, RESPONSE_SIZE, ",\"next\":\"%s\",\"description\":\"Listening keys\",\"status\":\"SUCCEEDED\",\"success\":true}", next);
+	else
+		strlcpy(*response, ",\"next\":null,\"description\":\"Listening keys\",\"status\":\"SUCCEEDED\",\"success\":true}", RESPONSE_SIZE);
+	return response_payload(req, "{\"keys\":", list, *response);
+}
+
+http_status_t api_db_keys(char **response, http_request_t *req) {
+	char next[QUID_LENGTH + 1];
+
+	char *from = get_param(req, "from");
+	char *list = db_list_keys(from, get_page_limit(req), next);
+	return response_key_page(response, req, list, next);
+}
+
+/*
+ * Parse a unix timestamp, the entire parameter must be a number
+ */
+static bool get_param_timestamp(const char *param, long long *ts) {
+	char *end;
+	errno = 0;
+	*ts = strtoll(param, &end, 10);
+	if (errno || end == param || *end) {
+		error_throw("bc6e0b2f1efd", "Invalid timestamp");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+http_status_t api_db_range(char **response, http_request_t *req) {
+	char next[QUID_LENGTH + 1];
+	long long ts_from;
+	long long ts_to = get_unixtimestamp() + 1;
+
+	char *from = get_param(req, "from");
+	char *to = get_param(req, "to");
+	char *start = get_param(req, "next");
+	if (!from)
+		return response_empty_error(response);
+
+	if (!get_param_timestamp(from, &ts_from))
+		return response_internal_error(response);
+	if (to && !get_param_timestamp(to, &ts_to))
+		return response_internal_error(response);
+
+	char *list = db_list_range(ts_from, ts_to, start, get_page_limit(req), next);
+	return response_key_page(response, req, list, next);
+}
+
+http_status_t api_index_all(char **response, http_request_t *req) {
 	char *list = db_index_all();
 	if (iserror()) {
 		return response_internal_error(response);
@@ -956,21 +1423,10 @@ http_status_t api_index_all(char **response, http_request_t *req) {
 	if (!list)
 		list = zstrdup("null");
 
-	len = strlen(list);
-	resplen = RESPONSE_SIZE;
-	if (len > (RESPONSE_SIZE / 2)) {
-		resplen = RESPONSE_SIZE + len;
-		*response = zrealloc(*response, resplen);
-	}
-	snprintf(*response, resplen, "{\"indexes\":%s,\"description\":\"Listening indexes\",\"status\":\"SUCCEEDED\",\"success\":true}", list);
-	zfree(list);
-	return HTTP_OK;
+	return response_payload(req, "{\"indexes\":", list, ",\"description\":\"Listening indexes\",\"status\":\"SUCCEEDED\",\"success\":true}");
 }
 
 http_status_t api_page_all(char **response, http_request_t *req) {
-	unused(req);
-	size_t len = 0, resplen;
-
 	char *list = db_pager_all();
 	if (iserror()) {
 		return response_internal_error(response);
@@ -979,15 +1435,7 @@ http_status_t api_page_all(char **response, http_request_t *req) {
 	if (!list)
 		list = zstrdup("null");
 
-	len = strlen(list);
-	resplen = RESPONSE_SIZE;
-	if (len > (RESPONSE_SIZE / 2)) {
-		resplen = RESPONSE_SIZE + len;
-		*response = zrealloc(*response, resplen);
-	}
-	snprintf(*response, resplen, "{\"pages\":%s,\"description\":\"Listening pages\",\"status\":\"SUCCEEDED\",\"success\":true}", list);
-	zfree(list);
-	return HTTP_OK;
+	return response_payload(req, "{\"pages\":", list, ",\"description\":\"Listening pages\",\"status\":\"SUCCEEDED\",\"success\":true}");
 }
 
 http_status_t api_auth_token(char **response, http_request_t *req) {
@@ -1023,11 +1471,15 @@ static const struct webroute route[] = {
 	/* Daemon related operations				*/
 	{"/sync",			api_sync,			FALSE,	"Flush datastorage to disk"},
 	{"/vacuum",			api_vacuum,			FALSE,	"Vacuum the datastorage"},
+	{"/compact",		api_compact,		FALSE,	"Compact sparse pages online"},
+	{"/snapshot",		api_snapshot,		FALSE,	"Stream online backup archive"},
 	{"/instance",		api_instance,		FALSE,	"Get/set daemon instance name"},
 	{"/shutdown",		api_shutdown,		FALSE,	"Shutting down the daemon"},
 	{"/vars",			api_variables,		FALSE, 	"List current config and settings"},
 	{"/help",			api_help,			FALSE,	"Show all API calls"},
 	{"/pager",			api_page_all,		FALSE,	"Show all storage pages"},
+	{"/keys",			api_db_keys,		FALSE,	"List keys in order"},
+	{"/range",			api_db_range,		FALSE,	"List keys created in time range"},
 
 	/* Encryption and encoding operations		*/
 	{"/sha1",			api_sha1,			FALSE, 	"SHA1 hash function"},
@@ -1048,8 +1500,10 @@ static const struct webroute route[] = {
 	{"/put",			api_db_put,			FALSE, 	"Insert new dataset"},
 	{"/store",			api_db_put,			FALSE,	"Insert new dataset"},
 	{"/insert",			api_db_put,			FALSE,	"Insert new dataset"},
+	{"/batch",			api_db_put_batch,	FALSE,	"Insert array of datasets"},
 	{"/get",			api_db_get,			TRUE,	"Retrieve dataset by key"},
 	{"/retrieve",		api_db_get,			TRUE,	"Retrieve dataset by key"},
+	{"/mget",			api_db_get_many,	FALSE,	"Retrieve datasets by keys"},
 	{"/count",			api_db_count,		TRUE,	"Count items in group"},
 	{"/update",			api_db_update,		TRUE,	"Update dataset by key"},
 	{"/duplicate",		api_db_duplicate,	TRUE,	"Duplicate record into new record"},
@@ -1062,6 +1516,10 @@ static const struct webroute route[] = {
 	{"/type",			api_db_get_type,	TRUE,	"Show datatype"},
 	{"/schema",			api_db_get_schema,	TRUE,	"Show data schema"},
 
+	/* Large object operations					*/
+	{"/blob",			api_db_put_object,	FALSE,	"Store streamed large object"},
+	{"/blob",			api_db_get_object,	TRUE,	"Stream large object by key"},
+
 	/* Record version control */
 	{"/history",		api_db_get_history,	TRUE,	"Show record history"},
 	{"/history/*",		api_db_get_version,	TRUE,	"Show record history"},
@@ -1086,7 +1544,7 @@ static const struct webroute route[] = {
 };
 
 http_status_t api_help(char **response, http_request_t *req) {
-	unused(req);
+	unused(response);
 	size_t nsz = RSIZE(route);
 
 	marshall_t *marshall = (marshall_t *)tree_zcalloc(1, sizeof(marshall_t), NULL);
@@ -1104,74 +1562,34 @@ http_status_t api_help(char **response, http_request_t *req) {
 	}
 
 	char *data = marshall_serialize(marshall);
-	size_t len = strlen(data);
-	size_t resplen = RESPONSE_SIZE;
-	if (len > (RESPONSE_SIZE / 2)) {
-		resplen = RESPONSE_SIZE + len;
-		*response = zrealloc(*response, resplen);
-	}
-	snprintf(*response, resplen, "{\"api\":%s,\"description\":\"Available API calls\",\"status\":\"SUCCEEDED\",\"success\":true}", data);
-	zfree(data);
 	marshall_free(marshall);
-
-	return HTTP_OK;
+	return response_payload(req, "{\"api\":", data, ",\"description\":\"Available API calls\",\"status\":\"SUCCEEDED\",\"success\":true}");
 }
 
-void handle_request(int sd, fd_set * set) {
-	FILE *socket_stream = fdopen(sd, "r+");
-	if (!socket_stream) {
-		lprint("[erro] Failed to get file descriptor\n");
-		goto disconnect;
-	};
-
+bool handle_request(connection_t *conn, const char *head, size_t head_len, const char *body, size_t body_len) {
 	/* No errors from this point on */
 	error_clear();
 
-	struct sockaddr_storage addr;
-	char str_addr[INET6_ADDRSTRLEN];
-	socklen_t len = sizeof(addr);
-	if (!getpeername(sd, (struct sockaddr*)&addr, &len)) {
-		inet_ntop(addr.ss_family, get_in_addr((struct sockaddr *)&addr), str_addr, sizeof(str_addr));
-	} else {
-		str_addr[0] = '?';
-		str_addr[1] = '\0';
-	}
-
 	vector_t *queue = alloc_vector(VECTOR_RHEAD_SIZE);
 	vector_t *headers = alloc_vector(VECTOR_SHEAD_SIZE);
 	hashtable_t *postdata = alloc_hashtable(HASHTABLE_DATA_SIZE);
 	hashtable_t *getdata = NULL;
 	hashtable_t *headdata = alloc_hashtable(HASHTABLE_DATA_SIZE);
-	char buf[HEADER_SIZE];
-	while (!feof(socket_stream)) {
-		char *in = fgets(buf, HEADER_SIZE - 2, socket_stream);
-		if (!in)
-			break;
-
-		if (!strcmp(in, "\r\n") || !strcmp(in, "\n"))
+	const char *line = head;
+	const char *next = NULL;
+	while ((next = memchr(line, '\n', head_len - (line - head)))) {
+		if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n'))
 			break;
 
-		if (!strstr(in, "\n")) {
-			raw_response(socket_stream, headers, "400 Bad Request");
-			fflush(socket_stream);
-			vector_free(queue);
-			vector_free(headers);
-			goto disconnect;
-		}
-
-		size_t request_sz = (strlen(buf) + 1) * sizeof(char);
+		size_t request_sz = (next - line) + 2;
 		char *request_line = tree_zmalloc(request_sz, queue);
-		strlcpy(request_line, buf, request_sz);
+		memcpy(request_line, line, request_sz - 1);
+		request_line[request_sz - 1] = '\0';
 		vector_append(queue, (void *)request_line);
+		line = next + 1;
 	}
 
-	if (feof(socket_stream)) {
-		vector_free(queue);
-		vector_free(headers);
-		goto disconnect;
-	}
-
-	unsigned int keepalive = 0;
+	bool keepalive = FALSE;
 	char *filename = NULL;
 	char *_filename = NULL;
 	char *querystring = NULL;
@@ -1183,7 +1601,6 @@ void handle_request(int sd, fd_set * set) {
 	char *c_referer = NULL;
 	char *c_connection = NULL;
 	char *c_buf = NULL;
-	client_requests++;
 
 	unsigned int i;
 	for (i = 0; i < queue->size; ++i) {
@@ -1192,8 +1609,7 @@ void handle_request(int sd, fd_set * set) {
 		char *colon = strchr(str, ':');
 		if (!colon) {
 			if (i > 0) {
-				raw_response(socket_stream, headers, "400 Bad Request");
-				fflush(socket_stream);
+				raw_response(conn, headers, "400 Bad Request");
 				vector_free(queue);
 				vector_free(headers);
 				goto disconnect;
@@ -1261,9 +1677,8 @@ void handle_request(int sd, fd_set * set) {
 					if (strstr(str, "CONNECT ") == str) {
 						r_type_width = 8;
 						request_type = HTTP_CONNECT;
-						raw_response(socket_stream, headers, "400 Bad Request");
-						fflush(socket_stream);
-						vector_free(queue);
+						raw_response(conn, headers, "400 Bad Request");
+								vector_free(queue);
 						vector_free(headers);
 						goto disconnect;
 					} else {
@@ -1276,8 +1691,7 @@ void handle_request(int sd, fd_set * set) {
 
 			filename = str + r_type_width;
 			if (filename[0] == ' ' || filename[0] == '\r' || filename[0] == '\n') {
-				raw_response(socket_stream, headers, "400 Bad Request");
-				fflush(socket_stream);
+				raw_response(conn, headers, "400 Bad Request");
 				vector_free(queue);
 				vector_free(headers);
 				goto disconnect;
@@ -1285,8 +1699,7 @@ void handle_request(int sd, fd_set * set) {
 
 			http_version = strstr(filename, "HTTP/");
 			if (!http_version) {
-				raw_response(socket_stream, headers, "400 Bad Request");
-				fflush(socket_stream);
+				raw_response(conn, headers, "400 Bad Request");
 				vector_free(queue);
 				vector_free(headers);
 				goto disconnect;
@@ -1307,7 +1720,7 @@ void handle_request(int sd, fd_set * set) {
 			}
 		} else {
 			if (i == 0) {
-				raw_response(socket_stream, headers, "400 Bad Request");
+				raw_response(conn, headers, "400 Bad Request");
 				goto done;
 			}
 
@@ -1348,7 +1761,7 @@ void handle_request(int sd, fd_set * set) {
 
 	char logreqline[RLOGLINE_SIZE];
 	memset(logreqline, 0, RLOGLINE_SIZE);
-	snprintf(logreqline, RLOGLINE_SIZE, "[info] %s - ", str_addr);
+	snprintf(logreqline, RLOGLINE_SIZE, "[info] %s - ", conn->addr);
 	switch (request_type) {
 		case HTTP_GET:
 			strlcat(logreqline, "GET", RLOGLINE_SIZE);
@@ -1396,25 +1809,34 @@ void handle_request(int sd, fd_set * set) {
 	}
 	lprint(logreqline);
 
+	/* HTTP/1.1 connections are persistent unless the client opts out */
+	keepalive = !strcmp(http_version, "HTTP/1.1");
 	if (c_connection) {
-		if (!strcmp(c_connection, "close")) {
-			vector_append_str(headers, "Connection: close\r\n");
-		} else if (!strcmp(c_connection, "keep-alive")) {
-			vector_append_str(headers, "Connection: keep-alive\r\n");
-			keepalive = 1;
-		}
+		if (!strcmp(c_connection, "close"))
+			keepalive = FALSE;
+		else if (!strcmp(c_connection, "keep-alive"))
+			keepalive = TRUE;
+	}
+	if (conn->requests + 1 >= API_KEEPALIVE_MAX)
+		keepalive = FALSE;
+
+	if (keepalive) {
+		char keepalive_header[64];
+		snprintf(keepalive_header, 64, "Keep-Alive: timeout=%d, max=%u\r\n", API_KEEPALIVE_TIMEOUT, API_KEEPALIVE_MAX - conn->requests - 1);
+		vector_append_str(headers, "Connection: keep-alive\r\n");
+		vector_append_str(headers, keepalive_header);
+	} else {
+		vector_append_str(headers, "Connection: close\r\n");
 	}
 
 	if (!request_type) {
 unsupported:
-		raw_response(socket_stream, headers, "405 Method Not Allowed");
-		fflush(socket_stream);
+		raw_response(conn, headers, "405 Method Not Allowed");
 		goto done;
 	}
 
 	if (!filename || strstr(filename, "'") || strstr(filename, " ") || (querystring && strstr(querystring, " "))) {
-		raw_response(socket_stream, headers, "400 Bad Request");
-		fflush(socket_stream);
+		raw_response(conn, headers, "400 Bad Request");
 		goto done;
 	}
 
@@ -1448,23 +1870,17 @@ unsupported:
 
 	if (request_type == HTTP_OPTIONS) {
 		vector_append_str(headers, "Allow: POST,OPTIONS,GET,HEAD\r\n");
-		raw_response(socket_stream, headers, "200 OK");
+		raw_response(conn, headers, "200 OK");
 		goto done;
 	}
 
-	if (c_length > 0) {
-		size_t total_read = 0;
-		c_buf = (char *)zmalloc(c_length + 1);
-		while ((total_read < c_length) && (!feof(socket_stream))) {
-			size_t diff = c_length - total_read;
-			if (diff > 1024)
-				diff = 1024;
-			size_t chunk_read = fread(total_read + c_buf, 1, diff, socket_stream);
-			total_read += chunk_read;
-		}
-		c_buf[total_read] = '\0';
+	if (body_len > 0) {
+		c_buf = (char *)zmalloc(body_len + 1);
+		memcpy(c_buf, body, body_len);
+		c_buf[body_len] = '\0';
 
-		char *var = strtok(c_buf, "&");
+		char *saveptr = NULL;
+		char *var = strtok_r(c_buf, "&", &saveptr);
 		while (var != NULL) {
 			char *value = strchr(var, '=');
 			if (value) {
@@ -1472,13 +1888,14 @@ unsupported:
 				value++;
 				hashtable_put(&postdata, var, value);
 			}
-			var = strtok(NULL, "&");
+			var = strtok_r(NULL, "&", &saveptr);
 		}
 	}
 
 	if (querystring) {
 		getdata = alloc_hashtable(HASHTABLE_DATA_SIZE);
-		char *var = strtok(querystring, "&");
+		char *saveptr = NULL;
+		char *var = strtok_r(querystring, "&", &saveptr);
 		while (var != NULL) {
 			char *value = strchr(var, '=');
 			if (value) {
@@ -1486,7 +1903,7 @@ unsupported:
 				value++;
 				hashtable_put(&getdata, var, value);
 			}
-			var = strtok(NULL, "&");
+			var = strtok_r(NULL, "&", &saveptr);
 		}
 	}
 
@@ -1495,10 +1912,13 @@ unsupported:
 	char *resp_message = (char *)zmalloc(RESPONSE_SIZE);
 	http_status_t status = 0;
 	http_request_t req;
+	memset(&req, 0, sizeof(http_request_t));
 	req.data = postdata;
 	req.querystring = getdata;
 	req.header = headdata;
 	req.method = request_type;
+	req.conn = conn;
+	req.headers = headers;
 	while (nsz-- > 0) {
 		if (route[nsz].require_quid) {
 			char squid[QUID_LENGTH + 1];
@@ -1554,15 +1974,30 @@ unsupported:
 		status = api_not_found(&resp_message, &req);
 
 respond:
-	if (request_type == HTTP_HEAD) {
-		raw_response(socket_stream, headers, get_http_status(status));
+	if (req.broken)
+		keepalive = FALSE;
+
+	if (req.streamed) {
+		/* Handler sent the response */
+	} else if (request_type == HTTP_HEAD) {
+		raw_response(conn, headers, get_http_status(status));
+	} else if (req.payload.data) {
+		struct iovec payload[3];
+		payload[0].iov_base = (void *)req.payload.prefix;
+		payload[0].iov_len = strlen(req.payload.prefix);
+		payload[1].iov_base = req.payload.data;
+		payload[1].iov_len = strlen(req.payload.data);
+		payload[2].iov_base = (void *)req.payload.suffix;
+		payload[2].iov_len = strlen(req.payload.suffix);
+		send_response(conn, headers, get_http_status(status), payload, 3);
 	} else {
-		json_response(socket_stream, headers, get_http_status(status), resp_message);
+		json_response(conn, headers, get_http_status(status), resp_message);
 	}
+	if (req.payload.data)
+		zfree(req.payload.data);
 	zfree(resp_message);
 
 done:
-	fflush(socket_stream);
 	if (c_buf)
 		zfree(c_buf);
 	zfree(_filename);
@@ -1574,23 +2009,483 @@ done:
 	free_hashtable(postdata);
 	free_hashtable(headdata);
 
-	if (keepalive) {
+	/* Erase any errors */
+	error_clear();
+	return keepalive;
+
+disconnect:
+	error_clear();
+	return FALSE;
+}
+
+static connection_t *open_connection(int sd, struct sockaddr_storage *addr) {
+	connection_t *conn = (connection_t *)zcalloc(1, sizeof(connection_t));
+	if (!conn)
+		return NULL;
+
+	conn->buffer = (char *)zmalloc(CONN_BUFFER_SIZE);
+	if (!conn->buffer) {
+		zfree(conn);
+		return NULL;
+	}
+
+	conn->sd = sd;
+	conn->size = CONN_BUFFER_SIZE;
+	conn->last_active = get_timestamp();
+	inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *)addr), conn->addr, sizeof(conn->addr));
+
+	pthread_mutex_lock(&connections.lock);
+	conn->next = connections.head;
+	if (connections.head)
+		connections.head->prev = conn;
+	connections.head = conn;
+	pthread_mutex_unlock(&connections.lock);
+	return conn;
+}
+
+/* Caller must hold the connection list lock */
+static void unlink_connection(connection_t *conn) {
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		connections.head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+}
+
+static void free_connection(connection_t *conn) {
+	/* Descriptor can be reused by another worker as soon as it is closed */
+	shutdown(conn->sd, SHUT_RDWR);
+	close(conn->sd);
+
+	/* Unfinished upload is dropped */
+	db_object_free(conn->object);
+	zfree(conn->buffer);
+	zfree(conn);
+}
+
+static void close_connection(connection_t *conn) {
+	pthread_mutex_lock(&connections.lock);
+	unlink_connection(conn);
+	pthread_mutex_unlock(&connections.lock);
+	free_connection(conn);
+}
+
+/* Offset past the empty line terminating the header, 0 if incomplete */
+static size_t header_end(const char *buf, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		if (buf[i] != '\n')
+			continue;
+
+		if (i + 1 < len && buf[i + 1] == '\n')
+			return i + 2;
+		if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+			return i + 3;
+	}
+	return 0;
+}
+
+/* Value of header field 'name', NULL if the field is absent */
+static const char *header_value(const char *head, size_t len, const char *name) {
+	size_t name_len = strlen(name);
+	const char *line = head;
+	const char *eol = NULL;
+	while ((eol = memchr(line, '\n', len - (line - head)))) {
+		if ((size_t)(eol - line) > name_len && line[name_len] == ':' && !strncasecmp(line, name, name_len)) {
+			const char *value = line + name_len + 1;
+			while (*value == ' ')
+				value++;
+			return value;
+		}
+		line = eol + 1;
+	}
+	return NULL;
+}
+
+static size_t header_content_length(const char *head, size_t len) {
+	const char *value = header_value(head, len, "content-length");
+	if (!value)
+		return 0;
+
+	return strtoul(value, NULL, 10);
+}
+
+/* Uploads to the large object store are not buffered as a whole */
+static bool header_upload(const char *head, size_t len) {
+	const char *uri = NULL;
+	if (len > 5 && !strncmp(head, "POST ", 5))
+		uri = head + 5;
+	else if (len > 4 && !strncmp(head, "PUT ", 4))
+		uri = head + 4;
+	if (!uri || (size_t)(uri - head) + 6 > len)
+		return FALSE;
+
+	return !strncmp(uri, "/blob", 5) && (uri[5] == ' ' || uri[5] == '?' || uri[5] == '/');
+}
+
+/*
+ * Set up the object and body decoder for an upload. The client is told to
+ * continue if it waits for it.
+ */
+static bool start_upload(connection_t *conn) {
+	conn->object = db_object_new();
+	if (!conn->object) {
 		error_clear();
-#if __KEEPALIVE__
-		return;
-#endif
+		return FALSE;
 	}
 
-disconnect:
-	/* Erase any errors */
+	const char *encoding = header_value(conn->buffer, conn->head_len, "transfer-encoding");
+	if (encoding && !strncasecmp(encoding, "chunked", 7)) {
+		conn->upload = UPLOAD_CHUNK_SIZE;
+	} else {
+		conn->upload = UPLOAD_DATA;
+		conn->remaining = header_content_length(conn->buffer, conn->head_len);
+	}
+
+	const char *expect = header_value(conn->buffer, conn->head_len, "expect");
+	if (expect && !strncasecmp(expect, "100-continue", 12)) {
+		struct iovec iov;
+		iov.iov_base = "HTTP/1.1 100 Continue\r\n\r\n";
+		iov.iov_len = 25;
+		send_iov(conn->sd, &iov, 1);
+	}
+	return TRUE;
+}
+
+/*
+ * Pass the buffered body of an upload on to the object and remove it from
+ * the buffer. Returns 1 once the body is complete, 0 if more data is needed
+ * or -1 if the body is malformed or cannot be stored.
+ */
+static int stream_upload(connection_t *conn) {
+	char *body = conn->buffer + conn->head_len;
+	size_t len = conn->len - conn->head_len;
+	size_t pos = 0;
+	int rs = 0;
+
+	for (;;) {
+		if (conn->upload == UPLOAD_DATA || conn->upload == UPLOAD_CHUNK_DATA) {
+			if (!conn->remaining) {
+				if (conn->upload == UPLOAD_DATA) {
+					rs = 1;
+					break;
+				}
+				conn->upload = UPLOAD_CHUNK_END;
+				continue;
+			}
+
+			size_t count = len - pos;
+			if (count > conn->remaining)
+				count = conn->remaining;
+			if (!count)
+				break;
+
+			if (db_object_write(conn->object, body + pos, count) < 0) {
+				rs = -1;
+				break;
+			}
+			pos += count;
+			conn->remaining -= count;
+			continue;
+		}
+
+		/* Remaining states take a line */
+		const char *line = body + pos;
+		const char *eol = memchr(line, '\n', len - pos);
+		if (!eol) {
+			if (len - pos > UPLOAD_LINE_SIZE)
+				rs = -1;
+			break;
+		}
+
+		size_t line_len = eol - line;
+		if (line_len && line[line_len - 1] == '\r')
+			line_len--;
+		pos = (eol - body) + 1;
+
+		if (conn->upload == UPLOAD_CHUNK_SIZE) {
+			char *end = NULL;
+			conn->remaining = strtoull(line, &end, 16);
+			if (end == line) {
+				rs = -1;
+				break;
+			}
+			conn->upload = conn->remaining ? UPLOAD_CHUNK_DATA : UPLOAD_TRAILER;
+		} else if (conn->upload == UPLOAD_CHUNK_END) {
+			if (line_len) {
+				rs = -1;
+				break;
+			}
+			conn->upload = UPLOAD_CHUNK_SIZE;
+		} else if (!line_len) {
+			rs = 1;
+			break;
+		}
+	}
+
+	/* Header stays in front for the request */
+	memmove(body, body + pos, len - pos);
+	conn->len -= pos;
+	return rs;
+}
+
+/*
+ * Drain the socket into the connection buffer. Returns 1 while the
+ * connection is open, 0 when the peer closed the connection or -1 on error.
+ */
+static int fill_connection(connection_t *conn) {
+	for (;;) {
+		/* Upload is read in rounds, the socket stays readable */
+		if (conn->object && conn->len >= conn->head_len + API_UPLOAD_BUFFER)
+			return 1;
+
+		if (conn->len == conn->size) {
+			char *buffer = (char *)zrealloc(conn->buffer, conn->size * 2);
+			if (!buffer)
+				return -1;
+
+			conn->buffer = buffer;
+			conn->size *= 2;
+		}
+
+		ssize_t n = recv(conn->sd, conn->buffer + conn->len, conn->size - conn->len, MSG_DONTWAIT);
+		if (n > 0) {
+			conn->len += n;
+			continue;
+		}
+
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 1;
+		return -1;
+	}
+}
+
+/*
+ * Run every complete request in the connection buffer. Returns FALSE when
+ * the connection must be closed.
+ */
+static bool serve_connection(connection_t *conn) {
+	int status = fill_connection(conn);
+	bool keepalive = (status >= 0);
+
+	while (keepalive) {
+		if (!conn->head_len) {
+			conn->head_len = header_end(conn->buffer, conn->len);
+			if (!conn->head_len) {
+				if (conn->len > HEADER_SIZE) {
+					vector_t *headers = alloc_vector(VECTOR_SHEAD_SIZE);
+					raw_response(conn, headers, "400 Bad Request");
+					vector_free(headers);
+					keepalive = FALSE;
+				}
+				break;
+			}
+			conn->body_len = header_content_length(conn->buffer, conn->head_len);
+
+			if (header_upload(conn->buffer, conn->head_len)) {
+				conn->body_len = 0;
+				if (!start_upload(conn)) {
+					vector_t *headers = alloc_vector(VECTOR_SHEAD_SIZE);
+					raw_response(conn, headers, "503 Service Unavailable");
+					vector_free(headers);
+					keepalive = FALSE;
+					break;
+				}
+			}
+		}
+
+		if (conn->object) {
+			int rs = stream_upload(conn);
+			if (rs < 0) {
+				vector_t *headers = alloc_vector(VECTOR_SHEAD_SIZE);
+				raw_response(conn, headers, "400 Bad Request");
+				vector_free(headers);
+				keepalive = FALSE;
+				break;
+			}
+			if (!rs)
+				break;
+		}
+
+		size_t request_len = conn->head_len + conn->body_len;
+		if (conn->len < request_len)
+			break;
+
+		client_requests++;
+		keepalive = handle_request(conn, conn->buffer, conn->head_len, conn->buffer + conn->head_len, conn->body_len);
+		conn->requests++;
+
+		db_object_free(conn->object);
+		conn->object = NULL;
+		conn->upload = UPLOAD_NONE;
+
+		/* Drop all tree memory claimed by the request */
+		tree_zarena_reset();
+
+		/* Move pipelined data to the front */
+		conn->len -= request_len;
+		memmove(conn->buffer, conn->buffer + request_len, conn->len);
+		conn->head_len = 0;
+		conn->body_len = 0;
+	}
+
+	/* Release memory claimed by large requests */
+	if (!conn->len && conn->size > CONN_BUFFER_SIZE) {
+		zfree(conn->buffer);
+		conn->buffer = (char *)zmalloc(CONN_BUFFER_SIZE);
+		conn->size = CONN_BUFFER_SIZE;
+		if (!conn->buffer)
+			return FALSE;
+	}
+
+	return keepalive && status > 0;
+}
+
+static void push_job(connection_t *conn) {
+	pthread_mutex_lock(&jobs.lock);
+	while (jobs.count == JOB_QUEUE_SIZE)
+		pthread_cond_wait(&jobs.space, &jobs.lock);
+
+	jobs.conn[(jobs.head + jobs.count) % JOB_QUEUE_SIZE] = conn;
+	jobs.count++;
+	pthread_cond_signal(&jobs.ready);
+	pthread_mutex_unlock(&jobs.lock);
+}
+
+static connection_t *pop_job() {
+	pthread_mutex_lock(&jobs.lock);
+	while (!jobs.count && run)
+		pthread_cond_wait(&jobs.ready, &jobs.lock);
+
+	if (!run) {
+		pthread_mutex_unlock(&jobs.lock);
+		return NULL;
+	}
+
+	connection_t *conn = jobs.conn[jobs.head];
+	jobs.head = (jobs.head + 1) % JOB_QUEUE_SIZE;
+	jobs.count--;
+	pthread_cond_signal(&jobs.space);
+	pthread_mutex_unlock(&jobs.lock);
+	return conn;
+}
+
+static int watch_socket(connection_t *conn, int op) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = conn;
+	return epoll_ctl(epollfd, op, conn->sd, &event);
+}
+
+static void *worker(void *arg) {
+	unused(arg);
+
+	/* Request data is allocated from a private arena */
+	zarena_t *arena = zarena_new(API_ARENA_SIZE);
+	if (arena)
+		tree_zarena(arena);
+
+	connection_t *conn = NULL;
+	while ((conn = pop_job())) {
+		if (!serve_connection(conn)) {
+			close_connection(conn);
+			continue;
+		}
+
+		/* Hand connection back to the event loop */
+		pthread_mutex_lock(&connections.lock);
+		conn->busy = FALSE;
+		conn->last_active = get_timestamp();
+		int rs = watch_socket(conn, EPOLL_CTL_MOD);
+		if (rs < 0)
+			unlink_connection(conn);
+		pthread_mutex_unlock(&connections.lock);
+
+		if (rs < 0) {
+			lprint("[erro] Failed to rearm socket\n");
+			free_connection(conn);
+		}
+	}
+
+	tree_zarena(NULL);
+	zarena_free(arena);
 	error_clear();
+	return NULL;
+}
+
+static void accept_clients(int listener) {
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t size = sizeof(struct sockaddr_storage);
+		int nsock = accept(listener, (struct sockaddr*)&addr, &size);
+		if (nsock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				lprint("[erro] Failed to acccept connection\n");
+			return;
+		}
+
+		connection_t *conn = open_connection(nsock, &addr);
+		if (!conn) {
+			close(nsock);
+			continue;
+		}
+
+		if (watch_socket(conn, EPOLL_CTL_ADD) < 0) {
+			lprint("[erro] Failed to watch socket\n");
+			close_connection(conn);
+		}
+	}
+}
+
+static void dispatch_connection(connection_t *conn) {
+	pthread_mutex_lock(&connections.lock);
+	conn->busy = TRUE;
+	pthread_mutex_unlock(&connections.lock);
+
+	push_job(conn);
+}
+
+/* Close connections idle for longer than the keep-alive timeout */
+static void expire_connections() {
+	long long now = get_timestamp();
+
+	pthread_mutex_lock(&connections.lock);
+	connection_t *conn = connections.head;
+	while (conn) {
+		connection_t *next = conn->next;
+		if (!conn->busy && (now - conn->last_active) >= API_KEEPALIVE_TIMEOUT) {
+			unlink_connection(conn);
+			epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sd, NULL);
+			free_connection(conn);
+		}
+		conn = next;
+	}
+	pthread_mutex_unlock(&connections.lock);
+}
+
+static void stop_workers(pthread_t *threads, unsigned int count) {
+	pthread_mutex_lock(&jobs.lock);
+	run = 0;
+	pthread_cond_broadcast(&jobs.ready);
+	pthread_mutex_unlock(&jobs.lock);
+
+	for (unsigned int i = 0; i < count; ++i)
+		pthread_join(threads[i], NULL);
 
-	if (socket_stream) {
-		fclose(socket_stream);
-		socket_stream = NULL;
+	/* Drop all remaining connections */
+	jobs.count = 0;
+	pthread_mutex_lock(&connections.lock);
+	while (connections.head) {
+		connection_t *conn = connections.head;
+		unlink_connection(conn);
+		free_connection(conn);
 	}
-	shutdown(sd, SHUT_RDWR);
-	FD_CLR(sd, set);
+	pthread_mutex_unlock(&connections.lock);
 }
 
 int start_webapi() {
@@ -1746,52 +2641,87 @@ int start_webapi() {
 	lprintf("[info] Server agent " PROGNAME "/%s " VERSION_STRING "\n", get_version_string());
 
 	signal(SIGINT, handle_shutdown);
+	init_static_headers();
 
-	FD_ZERO(&readfds);
-	FD_SET(serversock4, &readfds);
-	FD_SET(serversock6, &readfds);
-	max_sd = serversock4;
-	if (serversock6 > max_sd)
-		max_sd = serversock6;
-
-	while (run) {
-		int sd;
-		readsock = readfds;
-select_restart:
-		if (select(max_sd + 1, &readsock, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR) {
-				goto select_restart;
-			}
-			lprint("[erro] Failed to select socket\n");
+	epollfd = epoll_create1(0);
+	wakefd = eventfd(0, EFD_NONBLOCK);
+	if (epollfd < 0 || wakefd < 0) {
+		lprint("[erro] Failed to create event loop\n");
+		detach_core();
+		close(serversock4);
+		close(serversock6);
+		return 1;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	int *listeners[] = {&serversock4, &serversock6, &wakefd};
+	for (unsigned int i = 0; i < RSIZE(listeners); ++i) {
+		if (!*listeners[i])
+			continue;
+
+		event.data.ptr = listeners[i];
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, *listeners[i], &event) < 0) {
+			lprint("[erro] Failed to watch socket\n");
 			detach_core();
 			close(serversock4);
 			close(serversock6);
 			return 1;
 		}
-		for (sd = 0; sd <= max_sd; ++sd) {
-			if (FD_ISSET(sd, &readsock)) {
-				if (sd == serversock4 || sd == serversock6) {
-					struct sockaddr_storage addr;
-					socklen_t size = sizeof(struct sockaddr_storage);
-					int nsock = accept(sd, (struct sockaddr*)&addr, &size);
-					if (nsock == -1) {
-						lprint("[erro] Failed to acccept connection\n");
-						detach_core();
-						close(serversock4);
-						close(serversock6);
-						return 1;
-					}
-					FD_SET(nsock, &readfds);
-					if (nsock > max_sd) {
-						max_sd = nsock;
-					}
-				} else {
-					handle_request(sd, &readfds);
-				}
+	}
+
+	/* Signals are handled by the event loop only */
+	sigset_t sigset, oldset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	unsigned int nworkers = 0;
+	pthread_t threads[API_WORKERS];
+	for (; nworkers < API_WORKERS; ++nworkers) {
+		if (pthread_create(&threads[nworkers], NULL, worker, NULL) != 0) {
+			lprint("[erro] Failed to start worker\n");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	lprintf("[info] Started %u workers\n", nworkers);
+
+	struct epoll_event events[EPOLL_EVENTS];
+	long long last_expire = get_timestamp();
+	while (run && nworkers) {
+		int nfds = epoll_wait(epollfd, events, EPOLL_EVENTS, 1000);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+
+			lprint("[erro] Failed to wait for events\n");
+			break;
+		}
+
+		for (int i = 0; i < nfds; ++i) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &serversock4 || ptr == &serversock6) {
+				accept_clients(*(int *)ptr);
+			} else if (ptr == &wakefd) {
+				goto stop;
+			} else {
+				dispatch_connection((connection_t *)ptr);
 			}
 		}
+
+		if (get_timestamp() != last_expire) {
+			expire_connections();
+			last_expire = get_timestamp();
+		}
 	}
 
+stop:
+	stop_workers(threads, nworkers);
+
+	close(wakefd);
+	close(epollfd);
 	close(serversock4);
 	close(serversock6);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <common.h>
@@ -7,6 +8,8 @@
 #include "zmalloc.h"
 
 #define HEADER_SIZE (sizeof(void*) * 3)
+#define ARENA_ALIGN	16
+#define ARENA_HEADER_SIZE (HEADER_SIZE + sizeof(size_t))
 
 #define  raw2usr(mem) (void*)((void**)(mem) + 3)
 #define  usr2raw(mem) (void*)((void**)(mem) - 3)
@@ -17,6 +20,159 @@
 #define  is_root(mem) (!prev(mem))
 #define is_first(mem) (next(prev(mem)) != (mem))
 
+#define align_up(n) (((n) + (ARENA_ALIGN - 1)) & ~(uintptr_t)(ARENA_ALIGN - 1))
+#define   capacity(mem) (((size_t *)usr2raw(mem))[-1])
+
+struct zarena_chunk {
+	struct zarena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct zarena {
+	struct zarena_chunk *chunk;
+	size_t size;
+};
+
+/* Arena serving tree allocations without parent on this thread */
+static _Thread_local zarena_t *current_arena = NULL;
+
+static struct zarena_chunk *zarena_chunk(size_t size) {
+	struct zarena_chunk *chunk = (struct zarena_chunk *)zmalloc(sizeof(struct zarena_chunk) + size);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+zarena_t *zarena_new(size_t size) {
+	zarena_t *arena = (zarena_t *)zmalloc(sizeof(zarena_t));
+	if (!arena)
+		return NULL;
+
+	arena->size = size;
+	arena->chunk = zarena_chunk(size);
+	if (!arena->chunk) {
+		zfree(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+/*
+ * Release everything allocated from the arena at once. When the last round
+ * did not fit in a single chunk, the chunks are replaced by one chunk large
+ * enough to hold it all so the next round does not have to chain.
+ */
+void zarena_reset(zarena_t *arena) {
+	if (!arena)
+		return;
+
+	if (!arena->chunk->next) {
+		arena->chunk->used = 0;
+		return;
+	}
+
+	size_t total = 0;
+	struct zarena_chunk *chunk = arena->chunk;
+	while (chunk) {
+		struct zarena_chunk *next = chunk->next;
+		total += chunk->size;
+		zfree(chunk);
+		chunk = next;
+	}
+
+	arena->chunk = zarena_chunk(total);
+	if (!arena->chunk)
+		arena->chunk = zarena_chunk(arena->size);
+}
+
+void zarena_free(zarena_t *arena) {
+	if (!arena)
+		return;
+
+	if (current_arena == arena)
+		current_arena = NULL;
+
+	struct zarena_chunk *chunk = arena->chunk;
+	while (chunk) {
+		struct zarena_chunk *next = chunk->next;
+		zfree(chunk);
+		chunk = next;
+	}
+	zfree(arena);
+}
+
+static bool zarena_owns(const zarena_t *arena, const void *mem) {
+	if (!arena)
+		return FALSE;
+
+	for (struct zarena_chunk *chunk = arena->chunk; chunk; chunk = chunk->next) {
+		if ((const char *)mem >= chunk->data && (const char *)mem < chunk->data + chunk->size)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Bump allocate raw tree memory from the arena. The usable size is stored in
+ * front of the tree header so the block can be grown later on.
+ */
+static void *zarena_alloc(zarena_t *arena, size_t size) {
+	size_t need = align_up(ARENA_HEADER_SIZE + size);
+
+	struct zarena_chunk *chunk = arena->chunk;
+	uintptr_t start = align_up((uintptr_t)(chunk->data + chunk->used));
+	if (start + need > (uintptr_t)(chunk->data + chunk->size)) {
+		size_t nsz = chunk->size * 2;
+		if (nsz < need + ARENA_ALIGN)
+			nsz = need + ARENA_ALIGN;
+
+		chunk = zarena_chunk(nsz);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+		start = align_up((uintptr_t)chunk->data);
+	}
+
+	chunk->used = (start + need) - (uintptr_t)chunk->data;
+	*(size_t *)start = size;
+	return (void *)(start + sizeof(size_t));
+}
+
+/*
+ * Select the arena for the thread, tree allocations without a parent and all
+ * their descendants are served from it. Passing NULL returns to the heap.
+ * The previous arena is returned.
+ */
+zarena_t *tree_zarena(zarena_t *arena) {
+	zarena_t *prev_arena = current_arena;
+	current_arena = arena;
+	return prev_arena;
+}
+
+/* Reset the arena of this thread, all tree memory from it is released */
+void tree_zarena_reset(void) {
+	zarena_reset(current_arena);
+}
+
+/* Arena to allocate from given the parent, NULL for the heap */
+static zarena_t *tree_zarena_select(void *parent) {
+	if (!current_arena)
+		return NULL;
+
+	if (!parent || zarena_owns(current_arena, parent))
+		return current_arena;
+
+	return NULL;
+}
+
 static void *tree_zmalloc_init(void *mem, void *parent) {
 	if (!mem)
 		return NULL;
@@ -29,37 +185,70 @@ static void *tree_zmalloc_init(void *mem, void *parent) {
 }
 
 void *tree_zmalloc(size_t size, void *parent) {
+	zarena_t *arena = tree_zarena_select(parent);
+	if (arena)
+		return tree_zmalloc_init(zarena_alloc(arena, size), parent);
+
 	return tree_zmalloc_init(zmalloc(size + HEADER_SIZE), parent);
 }
 
 void *tree_zcalloc(size_t num, size_t size, void *parent) {
+	zarena_t *arena = tree_zarena_select(parent);
+	if (arena) {
+		void *mem = tree_zmalloc_init(zarena_alloc(arena, num * size), parent);
+		if (mem)
+			memset(mem, 0, num * size);
+		return mem;
+	}
+
 	return tree_zmalloc_init(zcalloc(num, size + HEADER_SIZE), parent);
 }
 
-void *tree_zrealloc(void *usr, size_t size) {
-	void *mem = zrealloc(usr ? usr2raw(usr) : NULL, size + HEADER_SIZE);
-
-	if (!usr || !mem)
-		return tree_zmalloc_init(mem, NULL);
+/* Point all references to the moved block at its new address */
+static void tree_relink(void *mem, void *usr) {
+	if (child(mem))
+		parent(child(mem)) = mem;
 
-	mem = raw2usr(mem);
-	/* If the buffer starting address changed, update all references. */
-	if (mem != usr) {
-		if (child(mem))
-			parent(child(mem)) = mem;
+	if (!is_root(mem)) {
+		if (next(mem))
+			prev(next(mem)) = mem;
 
-		if (!is_root(mem)) {
-			if (next(mem))
-				prev(next(mem)) = mem;
+		if (next(prev(mem)) == usr)
+			next(prev(mem)) = mem;
 
-			if (next(prev(mem)) == usr)
-				next(prev(mem)) = mem;
+		if (child(parent(mem)) == usr)
+			child(parent(mem)) = mem;
+	}
+}
 
-			if (child(parent(mem)) == usr)
-				child(parent(mem)) = mem;
-		}
+void *tree_zrealloc(void *usr, size_t size) {
+	if (!usr)
+		return tree_zmalloc(size, NULL);
+
+	if (zarena_owns(current_arena, usr)) {
+		size_t old_size = capacity(usr);
+		if (size <= old_size)
+			return usr;
+
+		void *mem = zarena_alloc(current_arena, size);
+		if (!mem)
+			return NULL;
+
+		memcpy(mem, usr2raw(usr), HEADER_SIZE + old_size);
+		mem = raw2usr(mem);
+		tree_relink(mem, usr);
+		return mem;
 	}
 
+	void *mem = zrealloc(usr2raw(usr), size + HEADER_SIZE);
+	if (!mem)
+		return NULL;
+
+	mem = raw2usr(mem);
+	/* If the buffer starting address changed, update all references. */
+	if (mem != usr)
+		tree_relink(mem, usr);
+
 	return mem;
 }
 
@@ -134,7 +323,8 @@ static void __zfree(void *mem) {
 
 	__zfree(child(mem));
 	__zfree(next(mem));
-	zfree(usr2raw(mem));
+	if (!zarena_owns(current_arena, mem))
+		zfree(usr2raw(mem));
 }
 
 void *tree_zfree(void *mem) {
@@ -143,6 +333,10 @@ void *tree_zfree(void *mem) {
 
 	tree_set_parent(mem, NULL);
 
+	/* Arena memory is released on reset */
+	if (zarena_owns(current_arena, mem))
+		return NULL;
+
 	__zfree(child(mem));
 	zfree(usr2raw(mem));
 
@@ -9,6 +9,15 @@
 #define zstrndup(str, sz) strndup(str, sz)
 #define zfree(sz) free(sz)
 
+typedef struct zarena zarena_t;
+
+zarena_t *zarena_new(size_t size);
+void zarena_reset(zarena_t *arena);
+void zarena_free(zarena_t *arena);
+
+zarena_t *tree_zarena(zarena_t *arena);
+void tree_zarena_reset(void);
+
 void *tree_zmalloc(size_t size, void *parent);
 void *tree_zcalloc(size_t num, size_t size, void *parent);
 void *tree_zrealloc(void *mem, size_t size);
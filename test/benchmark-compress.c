@@ -0,0 +1,160 @@
+#ifdef LINUX
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 700
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+#endif // LINUX
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifdef __MACH__
+#include <mach/clock.h>
+#include <mach/mach.h>
+#endif
+
+#include "test.h"
+#include "../src/zmalloc.h"
+#include "../src/arc4random.h"
+#include "../src/lz4.h"
+
+#define NUM			20000
+#define DOCSIZE		2048
+#define FNAME		"bmark_compress.db"
+
+static struct timespec timer_start;
+static char *doc[NUM];
+static size_t doc_len[NUM];
+static size_t block_len[NUM];
+static char block[DOCSIZE];
+
+static void start_timer() {
+#ifdef __MACH__
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	timer_start.tv_sec = mts.tv_sec;
+	timer_start.tv_nsec = mts.tv_nsec;
+#else
+	clock_gettime(CLOCK_MONOTONIC, &timer_start);
+#endif
+}
+
+static double get_timer() {
+	struct timespec end;
+#ifdef __MACH__
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	end.tv_sec = mts.tv_sec;
+	end.tv_nsec = mts.tv_nsec;
+#else
+	clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+	long seconds  = end.tv_sec - timer_start.tv_sec;
+	long nseconds = end.tv_nsec - timer_start.tv_nsec;
+	return seconds + (double)nseconds / 1.0e9;
+}
+
+/* JSON documents of repeating fields with random values */
+static void generate_docs() {
+	for (int i = 0; i < NUM; ++i) {
+		doc[i] = zmalloc(DOCSIZE);
+		size_t len = snprintf(doc[i], DOCSIZE, "{\"id\":%d,\"items\":[", i);
+		while (len < DOCSIZE - 128) {
+			len += snprintf(doc[i] + len, DOCSIZE - len, "{\"sku\":\"item-%u\",\"qty\":%u,\"price\":\"%u.99\",\"state\":\"available\"},"
+			                , arc4random() % 1000, arc4random() % 10, arc4random() % 100);
+		}
+		len += snprintf(doc[i] + len - 1, DOCSIZE - len + 1, "]}") - 1;
+		doc_len[i] = len;
+	}
+}
+
+static void print_header() {
+	LOGF("Documents:\t%d\n", NUM);
+	LOGF("Size:\t\t%d bytes each\n", DOCSIZE);
+}
+
+static void print_result(const char *name, double cost, size_t bytes) {
+	LOGF("|%s	(docs:%d): %.6f sec/op; %.1f MB/s; stored:%zu bytes; cost:%.6f(sec)\n"
+	     , name
+	     , NUM
+	     , (double)(cost / NUM)
+	     , (double)(NUM * DOCSIZE) / cost / 1048576.0
+	     , bytes
+	     , cost);
+}
+
+static void store_test(int fd, bool compress) {
+	size_t offset = 0;
+	start_timer();
+	for (int i = 0; i < NUM; ++i) {
+		const char *data = doc[i];
+		block_len[i] = doc_len[i];
+		if (compress) {
+			block_len[i] = lz4_compress(doc[i], doc_len[i], block, DOCSIZE);
+			if (!block_len[i])
+				FATAL("lz4_compress");
+			data = block;
+		}
+
+		if (pwrite(fd, data, block_len[i], offset) != (ssize_t)block_len[i])
+			FATAL("pwrite");
+		offset += block_len[i];
+	}
+	if (fsync(fd) < 0)
+		FATAL("fsync");
+	LINE();
+	print_result(compress ? "write lz4" : "write raw", get_timer(), offset);
+}
+
+static void load_test(int fd, bool compress) {
+	char data[DOCSIZE];
+	size_t offset = 0;
+	start_timer();
+	for (int i = 0; i < NUM; ++i) {
+		if (pread(fd, compress ? block : data, block_len[i], offset) != (ssize_t)block_len[i])
+			FATAL("pread");
+		offset += block_len[i];
+
+		if (compress && lz4_decompress(block, block_len[i], data, DOCSIZE) != doc_len[i])
+			FATAL("lz4_decompress");
+		if (memcmp(data, doc[i], doc_len[i]))
+			FATAL("Document mismatch");
+	}
+	LINE();
+	print_result(compress ? "read lz4" : "read raw", get_timer(), offset);
+}
+
+BENCHMARK_IMPL(compress) {
+	print_header();
+	generate_docs();
+
+	for (int compress = 0; compress < 2; ++compress) {
+		int fd = open(FNAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			FATAL("open");
+
+		store_test(fd, compress);
+		load_test(fd, compress);
+
+		close(fd);
+		unlink(FNAME);
+	}
+
+	LINE();
+
+	for (int i = 0; i < NUM; ++i)
+		zfree(doc[i]);
+
+	RETURN_OK();
+}
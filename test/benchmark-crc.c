@@ -0,0 +1,127 @@
+#ifdef LINUX
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 700
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+#endif // LINUX
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __MACH__
+#include <mach/clock.h>
+#include <mach/mach.h>
+#endif
+
+#include <common.h>
+
+#include "test.h"
+#include "../src/zmalloc.h"
+#include "../src/arc4random.h"
+#include "../src/crc32.h"
+#include "../src/crc64.h"
+
+#define BUFSIZE		16777216
+#define ROUNDS		16
+
+static struct timespec timer_start;
+static unsigned char *buffer;
+
+static const size_t block_size[] = {64, 512, 4096, 65536, BUFSIZE};
+
+static void start_timer() {
+#ifdef __MACH__
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	timer_start.tv_sec = mts.tv_sec;
+	timer_start.tv_nsec = mts.tv_nsec;
+#else
+	clock_gettime(CLOCK_MONOTONIC, &timer_start);
+#endif
+}
+
+static double get_timer() {
+	struct timespec end;
+#ifdef __MACH__
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	end.tv_sec = mts.tv_sec;
+	end.tv_nsec = mts.tv_nsec;
+#else
+	clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+	long seconds  = end.tv_sec - timer_start.tv_sec;
+	long nseconds = end.tv_nsec - timer_start.tv_nsec;
+	return seconds + (double)nseconds / 1.0e9;
+}
+
+static void print_header() {
+	LOGF("Buffer:\t\t%d bytes\n", BUFSIZE);
+	LOGF("Rounds:\t\t%d\n", ROUNDS);
+}
+
+static void print_result(const char *name, size_t block, double cost) {
+	LOGF("|%s	(block:%zu): %.3f GB/s; cost:%.6f(sec)\n"
+	     , name
+	     , block
+	     , (double)BUFSIZE * ROUNDS / cost / 1.0e9
+	     , cost);
+}
+
+/* Chained block CRCs must match the CRC of the whole buffer */
+static void crc64_test(size_t block) {
+	uint64_t whole = crc64(0, buffer, BUFSIZE);
+	uint64_t crc = 0;
+	start_timer();
+	for (int r = 0; r < ROUNDS; ++r) {
+		crc = 0;
+		for (size_t i = 0; i < BUFSIZE; i += block)
+			crc = crc64(crc, buffer + i, block);
+	}
+	double cost = get_timer();
+	if (crc != whole)
+		FATAL("CRC64 mismatch");
+	print_result("crc64", block, cost);
+}
+
+static void crc32_test(size_t block) {
+	unsigned long whole = crc32_calculate(0, buffer, BUFSIZE);
+	unsigned long crc = 0;
+	start_timer();
+	for (int r = 0; r < ROUNDS; ++r) {
+		crc = 0;
+		for (size_t i = 0; i < BUFSIZE; i += block)
+			crc = crc32_calculate(crc, buffer + i, block);
+	}
+	double cost = get_timer();
+	if (crc != whole)
+		FATAL("CRC32 mismatch");
+	print_result("crc32", block, cost);
+}
+
+BENCHMARK_IMPL(crc) {
+	print_header();
+
+	buffer = zmalloc(BUFSIZE);
+	for (size_t i = 0; i < BUFSIZE; i += sizeof(uint32_t))
+		*(uint32_t *)(buffer + i) = arc4random();
+
+	LINE();
+	for (size_t i = 0; i < ARRAY_SIZE(block_size); ++i)
+		crc64_test(block_size[i]);
+	LINE();
+	for (size_t i = 0; i < ARRAY_SIZE(block_size); ++i)
+		crc32_test(block_size[i]);
+	LINE();
+
+	zfree(buffer);
+
+	RETURN_OK();
+}
@@ -21,6 +21,11 @@ int main(int argc, char *argv[], char *envp[]) {
 	CALL_TEST(aes);
 	CALL_TEST(base64);
 	CALL_TEST(crc32);
+	CALL_TEST(lz4);
+	CALL_TEST(keysearch);
+	CALL_TEST(wal);
+	CALL_TEST(memtable);
+	CALL_TEST(history);
 	CALL_TEST(sha1);
 	CALL_TEST(sha2);
 	CALL_TEST(md5);
@@ -29,6 +34,8 @@ int main(int argc, char *argv[], char *envp[]) {
 	LOG("All tests passed\n");
 	CALL_BENCHMARK(engine);
 	CALL_BENCHMARK(quid);
+	CALL_BENCHMARK(compress);
+	CALL_BENCHMARK(crc);
 	LOG("Benchmarks finished\n");
 
 	return 0;
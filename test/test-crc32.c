@@ -27,6 +27,23 @@ static void crc32_3() {
 	ASSERT(expected == output);
 }
 
+/* Long enough to take the wide kernels */
+static void crc32_4() {
+	unsigned char input[1000];
+	for (size_t i = 0; i < sizeof(input); ++i)
+		input[i] = (unsigned char)(i * 7 + 3);
+
+	unsigned long output = 0;
+	unsigned long expected = 398207558;
+	output = crc32_calculate(output, input, sizeof(input));
+	ASSERT(expected == output);
+
+	/* Same result when fed in parts */
+	output = crc32_calculate(0, input, 333);
+	output = crc32_calculate(output, input + 333, sizeof(input) - 333);
+	ASSERT(expected == output);
+}
+
 TEST_IMPL(crc32) {
 
 	TESTCASE("crc32");
@@ -35,6 +52,7 @@ TEST_IMPL(crc32) {
 	crc32_1();
 	crc32_2();
 	crc32_3();
+	crc32_4();
 
 	RETURN_OK();
 }
@@ -0,0 +1,164 @@
+#include <stdver.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <error.h>
+#include "test.h"
+#include "../src/zmalloc.h"
+#include "../src/quid.h"
+#include "../src/marshall.h"
+#include "../src/base.h"
+#include "../src/wal.h"
+#include "../src/pager.h"
+#include "../src/engine.h"
+#include "../src/history.h"
+
+#define HISTORY_EXTRA	10
+
+/* Neighbouring versions share most of their bytes */
+static size_t version_data(char *buf, size_t size, int version) {
+	if (version % 50 == 49)
+		return snprintf(buf, size, "[%d]", version);
+
+	return snprintf(buf, size, "{\"name\":\"record\",\"version\":%d,\"tags\":[\"a\",\"b\",\"c\"],\"counter\":%d,\"padding\":\"%0*d\"}", version, version * 7, 1 + version % 120, version);
+}
+
+static void verify_version(base_t *base, const quid_t *quid, int version) {
+	char data[256];
+	size_t len;
+
+	error_clear();
+	char *rdata = history_get_version(base, quid, version, &len);
+	ASSERT(rdata && !iserror());
+	ASSERT(len == version_data(data, sizeof(data), version));
+	ASSERT(!memcmp(rdata, data, len));
+	zfree(rdata);
+}
+
+static void open_database(base_t *base, engine_t *engine) {
+	base_init(base, engine);
+	wal_init(base);
+	pager_init(base);
+	engine_init(base);
+}
+
+static void close_database(base_t *base) {
+	engine_close(base);
+	wal_close(base);
+	pager_close(base);
+	base_close(base);
+}
+
+static void remove_directory(const char *path) {
+	DIR *dir = opendir(path);
+	ASSERT(dir);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		ASSERT(!unlink(name));
+	}
+	closedir(dir);
+	ASSERT(!rmdir(path));
+}
+
+/* Every version restores through the chain of deltas */
+static void history_delta(base_t *base, const quid_t *quid, const quid_t *other) {
+	char data[256];
+
+	for (int version = 0; version < 100; ++version) {
+		size_t len = version_data(data, sizeof(data), version);
+		ASSERT(!history_add(base, quid, data, len));
+
+		/* Versions of another key in between */
+		if (version % 10 == 0) {
+			len = version_data(data, sizeof(data), version / 10);
+			ASSERT(!history_add(base, other, data, len));
+		}
+	}
+
+	ASSERT(history_count(base, quid) == 100);
+	ASSERT(history_count(base, other) == 10);
+	for (int version = 0; version < 100; ++version)
+		verify_version(base, quid, version);
+
+	history_remove(base, quid);
+	ASSERT(!history_count(base, quid));
+	ASSERT(history_count(base, other) == 10);
+	for (int version = 0; version < 10; ++version)
+		verify_version(base, other, version);
+
+	error_clear();
+	size_t len;
+	ASSERT(!history_get_version(base, quid, 0, &len));
+	error_clear();
+}
+
+/* The oldest versions are dropped once the limit is reached */
+static void history_retention(base_t *base, const quid_t *quid) {
+	char data[256];
+	int versions = HISTORY_MAX_VERSIONS ? HISTORY_MAX_VERSIONS + HISTORY_EXTRA : 100;
+
+	for (int version = 0; version < versions; ++version) {
+		size_t len = version_data(data, sizeof(data), version);
+		ASSERT(!history_add(base, quid, data, len));
+	}
+
+	int first = versions - history_count(base, quid);
+	ASSERT(first == (HISTORY_MAX_VERSIONS ? HISTORY_EXTRA : 0));
+
+	for (int version = 0; version < first; ++version) {
+		size_t len;
+		error_clear();
+		ASSERT(!history_get_version(base, quid, version, &len));
+	}
+	error_clear();
+
+	for (int version = first; version < versions; ++version)
+		verify_version(base, quid, version);
+}
+
+static void history_versions() {
+	char cwd[1024];
+	char path[] = "/tmp/quantica_historyXXXXXX";
+	ASSERT(getcwd(cwd, sizeof(cwd)));
+	ASSERT(mkdtemp(path));
+	ASSERT(!chdir(path));
+
+	quid_t quid, other;
+	quid_create(&quid);
+	quid_create(&other);
+
+	base_t base;
+	engine_t engine;
+	open_database(&base, &engine);
+	history_delta(&base, &quid, &other);
+	history_retention(&base, &quid);
+	close_database(&base);
+
+	/* Versions survive a reopen */
+	open_database(&base, &engine);
+	verify_version(&base, &quid, HISTORY_MAX_VERSIONS ? HISTORY_MAX_VERSIONS + HISTORY_EXTRA - 1 : 99);
+	verify_version(&base, &other, 9);
+	close_database(&base);
+
+	error_clear();
+	ASSERT(!chdir(cwd));
+	remove_directory(path);
+}
+
+TEST_IMPL(history) {
+
+	TESTCASE("history");
+
+	/* Run testcase */
+	history_versions();
+
+	RETURN_OK();
+}
@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "test.h"
+#include "../src/endian.h"
+#include "../src/keysearch.h"
+
+#define KEYS_MAX	300
+
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+/* Deterministic keys so failures reproduce */
+static uint64_t noise() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static int keycmp(const void *a, const void *b) {
+	uint64_t ka = *(const uint64_t *)a;
+	uint64_t kb = *(const uint64_t *)b;
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Mix keys that differ only in the low half, have the sign bit set, repeat
+ * or sit at the ends of the range.
+ */
+static uint64_t random_key(int round) {
+	uint64_t key = noise();
+	switch (round % 4) {
+		case 0:
+			return key;
+		case 1:
+			return (key & 0xffffffff00000000ULL) | (key & 0x3);
+		case 2:
+			return key % 16;
+		default:
+			return (key & 0x1) ? UINT64_MAX - (key % 4) : 0x8000000000000000ULL + (key % 4) - 2;
+	}
+}
+
+static void compare(enum keysearch_unit unit, const uint64_t *sorted, const __le64 *keys, size_t n, uint64_t key) {
+	ASSERT(keysearch_select(KEYSEARCH_SCALAR));
+	size_t expected = keysearch_count(keys, n, key);
+
+	size_t count = 0;
+	while (count < n && sorted[count] < key)
+		count++;
+	ASSERT(expected == count);
+
+	ASSERT(keysearch_select(unit));
+	ASSERT(keysearch_count(keys, n, key) == expected);
+}
+
+static void keysearch_unit(enum keysearch_unit unit) {
+	uint64_t sorted[KEYS_MAX];
+	__le64 keys[KEYS_MAX];
+
+	for (int round = 0; round < 200; ++round) {
+		size_t n = round < 100 ? (size_t)round % 34 : noise() % (KEYS_MAX + 1);
+		for (size_t i = 0; i < n; ++i)
+			sorted[i] = random_key(round);
+
+		qsort(sorted, n, sizeof(uint64_t), keycmp);
+		for (size_t i = 0; i < n; ++i)
+			keys[i] = to_le64(sorted[i]);
+
+		for (size_t i = 0; i < n; ++i) {
+			compare(unit, sorted, keys, n, sorted[i]);
+			compare(unit, sorted, keys, n, sorted[i] + 1);
+			compare(unit, sorted, keys, n, sorted[i] - 1);
+		}
+		compare(unit, sorted, keys, n, 0);
+		compare(unit, sorted, keys, n, UINT64_MAX);
+		compare(unit, sorted, keys, n, random_key(round));
+	}
+}
+
+TEST_IMPL(keysearch) {
+
+	TESTCASE("keysearch");
+
+	/* Run testcase */
+	if (keysearch_select(KEYSEARCH_SSE2))
+		keysearch_unit(KEYSEARCH_SSE2);
+	if (keysearch_select(KEYSEARCH_AVX2))
+		keysearch_unit(KEYSEARCH_AVX2);
+
+	keysearch_select(KEYSEARCH_SCALAR);
+
+	RETURN_OK();
+}
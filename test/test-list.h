@@ -11,6 +11,11 @@ TEST_IMPL(quid);
 TEST_IMPL(aes);
 TEST_IMPL(base64);
 TEST_IMPL(crc32);
+TEST_IMPL(lz4);
+TEST_IMPL(keysearch);
+TEST_IMPL(wal);
+TEST_IMPL(memtable);
+TEST_IMPL(history);
 TEST_IMPL(sha1);
 TEST_IMPL(sha2);
 TEST_IMPL(md5);
@@ -18,5 +23,7 @@ TEST_IMPL(bootstrap);
 TEST_IMPL(json_check);
 BENCHMARK_IMPL(engine);
 BENCHMARK_IMPL(quid);
+BENCHMARK_IMPL(compress);
+BENCHMARK_IMPL(crc);
 
 #endif // TEST-LIST_H_INCLUDED
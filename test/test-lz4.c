@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "test.h"
+#include "../src/zmalloc.h"
+#include "../src/lz4.h"
+
+static unsigned int seed = 0x2545f491;
+
+/* Deterministic noise so failures reproduce */
+static unsigned char noise() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (unsigned char)seed;
+}
+
+static void roundtrip(const unsigned char *input, size_t len) {
+	size_t bound = lz4_bound(len);
+	unsigned char *packed = zmalloc(bound);
+	unsigned char *output = zmalloc(len + 1);
+
+	size_t packed_len = lz4_compress(input, len, packed, bound);
+	ASSERT(packed_len > 0);
+	ASSERT(packed_len <= bound);
+	ASSERT(lz4_decompress(packed, packed_len, output, len) == len);
+	ASSERT(!memcmp(input, output, len));
+
+	/* Output must not run past the capacity */
+	if (len > 0)
+		ASSERT(lz4_decompress(packed, packed_len, output, len - 1) == 0);
+
+	zfree(packed);
+	zfree(output);
+}
+
+static void lz4_1() {
+	char input[] = "ygd5i7f%Fd&weDif8i^fikf6d6ikf6ifikUFf57r&DFC%&F%ydyt";
+	roundtrip((unsigned char *)input, strlen(input));
+}
+
+/* Repetitive data must shrink */
+static void lz4_2() {
+	unsigned char input[4096];
+	for (size_t i = 0; i < sizeof(input); ++i)
+		input[i] = "{\"name\":\"quantica\",\"value\":42}"[i % 30];
+
+	unsigned char packed[4096];
+	size_t packed_len = lz4_compress(input, sizeof(input), packed, sizeof(packed));
+	ASSERT(packed_len > 0);
+	ASSERT(packed_len < sizeof(input) / 8);
+	roundtrip(input, sizeof(input));
+}
+
+/* Incompressible data only fits within the bound */
+static void lz4_3() {
+	unsigned char input[4096];
+	for (size_t i = 0; i < sizeof(input); ++i)
+		input[i] = noise();
+
+	unsigned char packed[4096];
+	ASSERT(lz4_compress(input, sizeof(input), packed, sizeof(input) - sizeof(input) / 8) == 0);
+	roundtrip(input, sizeof(input));
+}
+
+/* Lengths around the literal and match limits at the end of a block */
+static void lz4_4() {
+	unsigned char input[80];
+	for (size_t len = 0; len <= sizeof(input); ++len) {
+		memset(input, 'a', len);
+		roundtrip(input, len);
+
+		for (size_t i = 0; i < len; ++i)
+			input[i] = noise();
+		roundtrip(input, len);
+	}
+}
+
+/* Larger than the 64K match window */
+static void lz4_5() {
+	size_t len = 3 * 65536 + 17;
+	unsigned char *input = zmalloc(len);
+	for (size_t i = 0; i < len; ++i)
+		input[i] = (i % 1000 < 500) ? noise() : (unsigned char)(i % 251);
+
+	roundtrip(input, len);
+	zfree(input);
+}
+
+/* Corrupt blocks are rejected */
+static void lz4_6() {
+	unsigned char input[1024];
+	for (size_t i = 0; i < sizeof(input); ++i)
+		input[i] = (unsigned char)(i % 13);
+
+	unsigned char packed[2048];
+	unsigned char output[1024];
+	size_t packed_len = lz4_compress(input, sizeof(input), packed, sizeof(packed));
+	ASSERT(packed_len > 0);
+	ASSERT(lz4_decompress(packed, packed_len - 1, output, sizeof(output)) == 0);
+	ASSERT(lz4_decompress(packed, 0, output, sizeof(output)) == 0);
+}
+
+/* Delta against a prefix as used by the history */
+static void lz4_7() {
+	size_t len = 2048;
+	unsigned char *window = zmalloc(2 * len);
+	for (size_t i = 0; i < len; ++i)
+		window[i] = noise();
+	memcpy(window + len, window, len);
+	window[len + 100] ^= 0xff;
+	window[len + 1500] ^= 0xff;
+
+	size_t bound = lz4_bound(len);
+	unsigned char *packed = zmalloc(bound);
+	size_t packed_len = lz4_compress_prefix(window, len, len, packed, bound);
+	ASSERT(packed_len > 0);
+	ASSERT(packed_len < len / 8);
+
+	unsigned char *output = zmalloc(2 * len);
+	memcpy(output, window, len);
+	ASSERT(lz4_decompress_prefix(packed, packed_len, output, len, len) == len);
+	ASSERT(!memcmp(output + len, window + len, len));
+
+	zfree(window);
+	zfree(packed);
+	zfree(output);
+}
+
+TEST_IMPL(lz4) {
+
+	TESTCASE("lz4");
+
+	/* Run testcase */
+	lz4_1();
+	lz4_2();
+	lz4_3();
+	lz4_4();
+	lz4_5();
+	lz4_6();
+	lz4_7();
+
+	RETURN_OK();
+}
@@ -0,0 +1,225 @@
+#include <stdver.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <error.h>
+#include "test.h"
+#include "../src/quid.h"
+#include "../src/base.h"
+#include "../src/wal.h"
+#include "../src/pager.h"
+#include "../src/engine.h"
+#include "../src/memtable.h"
+
+#define MEMTABLE_KEYS	512
+
+static quid_t keys[MEMTABLE_KEYS];
+static bool present[MEMTABLE_KEYS];
+
+static unsigned int seed = 0x6b8b4567;
+
+/* Deterministic order so failures reproduce */
+static unsigned int noise() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* Keys are created in order, hand them out shuffled */
+static void create_keys() {
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		quid_create(&keys[i]);
+		present[i] = FALSE;
+	}
+
+	for (int i = MEMTABLE_KEYS - 1; i > 0; --i) {
+		int j = noise() % (i + 1);
+		quid_t tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+static size_t count_smaller(const quid_t *quid) {
+	size_t count = 0;
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		if (present[i] && quidcmp(&keys[i], quid) < 0)
+			count++;
+	}
+	return count;
+}
+
+static void verify_memtable(const memtable_t *memtable) {
+	size_t size = 0;
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		if (present[i]) {
+			size++;
+			ASSERT(memtable_find(memtable, &keys[i]));
+		} else {
+			ASSERT(!memtable_find(memtable, &keys[i]));
+		}
+		ASSERT(memtable_lower_bound(memtable, &keys[i]) == count_smaller(&keys[i]));
+	}
+	ASSERT(memtable->size == size);
+
+	for (size_t i = 1; i < memtable->size; ++i)
+		ASSERT(quidcmp(&memtable->items[i - 1].quid, &memtable->items[i].quid) < 0);
+}
+
+/* Items stay sorted under inserts and removes in any order */
+static void memtable_order() {
+	create_keys();
+
+	memtable_t *memtable = memtable_new(MEMTABLE_KEYS);
+	ASSERT(memtable);
+
+	for (int round = 0; round < 4 * MEMTABLE_KEYS; ++round) {
+		int i = noise() % MEMTABLE_KEYS;
+		if (present[i]) {
+			memtable_remove(memtable, &keys[i]);
+			present[i] = FALSE;
+		} else {
+			struct memtable_item *item = memtable_insert(memtable, &keys[i]);
+			ASSERT(item && !quidcmp(&item->quid, &keys[i]));
+			item->offset = i + 1;
+			present[i] = TRUE;
+		}
+
+		if (round % 64 == 0)
+			verify_memtable(memtable);
+	}
+	verify_memtable(memtable);
+
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		struct memtable_item *item = memtable_find(memtable, &keys[i]);
+		if (item)
+			ASSERT(item->offset == (unsigned long long)i + 1);
+	}
+
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		if (!present[i]) {
+			memtable_insert(memtable, &keys[i]);
+			present[i] = TRUE;
+		}
+	}
+	ASSERT(memtable_full(memtable));
+	verify_memtable(memtable);
+
+	memtable_clear(memtable);
+	ASSERT(!memtable->size);
+	memtable_free(memtable);
+}
+
+static void open_database(base_t *base, engine_t *engine) {
+	base_init(base, engine);
+	wal_init(base);
+	pager_init(base);
+	engine_init(base);
+}
+
+static void close_database(base_t *base) {
+	engine_close(base);
+	wal_close(base);
+	pager_close(base);
+	base_close(base);
+}
+
+/* The cursor returns buffered keys and tree keys as one ordered sequence */
+static void verify_cursor(const base_t *base) {
+	engine_cursor_t cursor;
+	quid_t quid, last;
+	struct metadata meta;
+	size_t count = 0;
+
+	memset(&last, 0, sizeof(quid_t));
+
+	engine_cursor_open(base, &cursor);
+	while (engine_cursor_next(base, &cursor, &quid, &meta)) {
+		if (count)
+			ASSERT(quidcmp(&last, &quid) < 0);
+		ASSERT(count_smaller(&quid) == count);
+		last = quid;
+		count++;
+	}
+	engine_cursor_close(&cursor);
+
+	size_t expected = 0;
+	for (int i = 0; i < MEMTABLE_KEYS; ++i)
+		expected += present[i];
+	ASSERT(count == expected);
+}
+
+static void remove_directory(const char *path) {
+	DIR *dir = opendir(path);
+	ASSERT(dir);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		ASSERT(!unlink(name));
+	}
+	closedir(dir);
+	ASSERT(!rmdir(path));
+}
+
+/* Keys inserted out of order and merged into the tree in between */
+static void memtable_merge() {
+	char cwd[1024];
+	char path[] = "/tmp/quantica_memtableXXXXXX";
+	ASSERT(getcwd(cwd, sizeof(cwd)));
+	ASSERT(mkdtemp(path));
+	ASSERT(!chdir(path));
+
+	base_t base;
+	engine_t engine;
+	open_database(&base, &engine);
+	create_keys();
+
+	for (int i = 0; i < MEMTABLE_KEYS; ++i) {
+		error_clear();
+		ASSERT(!engine_insert(&base, &keys[i]));
+		present[i] = TRUE;
+
+		if (i % 100 == 99) {
+			verify_cursor(&base);
+			engine_flush(&base);
+		}
+	}
+	verify_cursor(&base);
+
+	for (int i = 0; i < MEMTABLE_KEYS; i += 3) {
+		error_clear();
+		ASSERT(!engine_delete(&base, &keys[i]));
+		present[i] = FALSE;
+	}
+	verify_cursor(&base);
+	engine_flush(&base);
+	verify_cursor(&base);
+	close_database(&base);
+
+	open_database(&base, &engine);
+	verify_cursor(&base);
+	close_database(&base);
+
+	error_clear();
+	ASSERT(!chdir(cwd));
+	remove_directory(path);
+}
+
+TEST_IMPL(memtable) {
+
+	TESTCASE("memtable");
+
+	/* Run testcase */
+	memtable_order();
+	memtable_merge();
+
+	RETURN_OK();
+}
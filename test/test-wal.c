@@ -0,0 +1,150 @@
+#include <stdver.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include <error.h>
+#include "test.h"
+#include "../src/zmalloc.h"
+#include "../src/quid.h"
+#include "../src/base.h"
+#include "../src/wal.h"
+#include "../src/pager.h"
+#include "../src/engine.h"
+
+#define WAL_KEYS	200
+
+static quid_t keys[2 * WAL_KEYS];
+
+static void open_database(base_t *base, engine_t *engine) {
+	base_init(base, engine);
+	wal_init(base);
+	pager_init(base);
+	engine_init(base);
+}
+
+static void close_database(base_t *base) {
+	engine_close(base);
+	wal_close(base);
+	pager_close(base);
+	base_close(base);
+}
+
+static size_t record(char *buf, size_t size, int i) {
+	return snprintf(buf, size, "{\"record\":%d,\"padding\":\"%0*d\"}", i, 1 + (i * 37) % 400, i);
+}
+
+/* Commit the first half, leave the second half in flight and crash */
+static void write_and_crash() {
+	base_t base;
+	engine_t engine;
+	char data[512];
+
+	open_database(&base, &engine);
+	for (int i = 0; i < WAL_KEYS; ++i) {
+		size_t len = record(data, sizeof(data), i);
+		if (engine_insert_data(&base, &keys[i], data, len) < 0)
+			_exit(1);
+	}
+
+	uint64_t lsn = wal_commit(&base);
+	wal_sync(base.wal, lsn);
+
+	for (int i = WAL_KEYS; i < 2 * WAL_KEYS; ++i) {
+		size_t len = record(data, sizeof(data), i);
+		if (engine_insert_data(&base, &keys[i], data, len) < 0)
+			_exit(1);
+	}
+
+	_exit(0);
+}
+
+static void verify(base_t *base) {
+	char data[512];
+	struct metadata meta;
+
+	for (int i = 0; i < WAL_KEYS; ++i) {
+		error_clear();
+		unsigned long long offset = engine_get(base, &keys[i], &meta);
+		ASSERT(offset && !iserror());
+
+		size_t len;
+		void *rdata = get_data_block(base, offset, &len);
+		ASSERT(rdata);
+		ASSERT(len == record(data, sizeof(data), i));
+		ASSERT(!memcmp(rdata, data, len));
+		zfree(rdata);
+	}
+
+	for (int i = WAL_KEYS; i < 2 * WAL_KEYS; ++i) {
+		error_clear();
+		ASSERT(!engine_get(base, &keys[i], &meta));
+	}
+	error_clear();
+}
+
+static void remove_directory(const char *path) {
+	DIR *dir = opendir(path);
+	ASSERT(dir);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		ASSERT(!unlink(name));
+	}
+	closedir(dir);
+	ASSERT(!rmdir(path));
+}
+
+/* Committed groups survive a crash, the uncommitted tail is lost */
+static void wal_replay() {
+	char cwd[1024];
+	char path[] = "/tmp/quantica_walXXXXXX";
+	ASSERT(getcwd(cwd, sizeof(cwd)));
+	ASSERT(mkdtemp(path));
+	ASSERT(!chdir(path));
+
+	for (int i = 0; i < 2 * WAL_KEYS; ++i)
+		quid_create(&keys[i]);
+
+	pid_t pid = fork();
+	ASSERT(pid >= 0);
+	if (!pid)
+		write_and_crash();
+
+	int status;
+	ASSERT(waitpid(pid, &status, 0) == pid);
+	ASSERT(WIFEXITED(status) && !WEXITSTATUS(status));
+	ASSERT(file_exists(WALFILE));
+
+	base_t base;
+	engine_t engine;
+	open_database(&base, &engine);
+	verify(&base);
+	close_database(&base);
+
+	/* Recovered state was checkpointed */
+	ASSERT(!file_exists(WALFILE));
+	open_database(&base, &engine);
+	verify(&base);
+	close_database(&base);
+
+	ASSERT(!chdir(cwd));
+	remove_directory(path);
+}
+
+TEST_IMPL(wal) {
+
+	TESTCASE("wal");
+
+	/* Run testcase */
+	wal_replay();
+
+	RETURN_OK();
+}
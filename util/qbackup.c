@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2015 Quantica, Quenza
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Quenza nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Fetch a backup archive from a running daemon and restore it into an
+ * empty directory. The restored database recovers to the point in time of
+ * the backup on first start.
+ */
+
+#include <stdver.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include <config.h>
+#include <common.h>
+#include "../src/crc64.h"
+#include "../src/backup.h"
+
+#define IO_BUFFER_SIZE	(8 * 1024 * 1024)	/* 8 MB */
+#define BLOCK_SIZE		4096
+#define DEF_HOST		"localhost"
+
+struct reader {
+	int fd;
+	char *buffer;
+	size_t pos;
+	size_t len;
+};
+
+static void usage(const char *prog) {
+	fprintf(stderr, "%s dump ARCHIVE [HOST] [PORT]\n", prog);
+	fprintf(stderr, "%s restore ARCHIVE DIRECTORY\n", prog);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t rs = write(fd, data, len);
+		if (rs < 0 && errno == EINTR)
+			continue;
+		if (rs <= 0)
+			return FALSE;
+
+		data += rs;
+		len -= rs;
+	}
+	return TRUE;
+}
+
+/* Bytes available in the reader, refilled with one large read */
+static size_t fill(struct reader *rd) {
+	if (rd->pos < rd->len)
+		return rd->len - rd->pos;
+
+	ssize_t rs;
+	do {
+		rs = read(rd->fd, rd->buffer, IO_BUFFER_SIZE);
+	} while (rs < 0 && errno == EINTR);
+
+	rd->pos = 0;
+	rd->len = rs > 0 ? rs : 0;
+	return rd->len;
+}
+
+static bool read_exact(struct reader *rd, void *data, size_t len) {
+	char *p = (char *)data;
+	while (len > 0) {
+		size_t avail = fill(rd);
+		if (!avail)
+			return FALSE;
+		if (avail > len)
+			avail = len;
+
+		memcpy(p, rd->buffer + rd->pos, avail);
+		rd->pos += avail;
+		p += avail;
+		len -= avail;
+	}
+	return TRUE;
+}
+
+/* Read one line of the response header, without the line ending */
+static bool read_line(struct reader *rd, char *line, size_t size) {
+	size_t i = 0;
+	for (;;) {
+		char c;
+		if (!read_exact(rd, &c, 1))
+			return FALSE;
+		if (c == '\n')
+			break;
+		if (c != '\r' && i < size - 1)
+			line[i++] = c;
+	}
+	line[i] = '\0';
+	return TRUE;
+}
+
+static int connect_host(const char *host, const char *port) {
+	struct addrinfo hints, *res, *rp;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int rs = getaddrinfo(host, port, &hints, &res);
+	if (rs) {
+		fprintf(stderr, "error: %s\n", gai_strerror(rs));
+		return -1;
+	}
+
+	int sd = -1;
+	for (rp = res; rp; rp = rp->ai_next) {
+		sd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sd < 0)
+			continue;
+		if (!connect(sd, rp->ai_addr, rp->ai_addrlen))
+			break;
+
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sd < 0)
+		fprintf(stderr, "error: cannot connect to %s:%s\n", host, port);
+	return sd;
+}
+
+/*
+ * Request the archive and write the chunked body to the archive file as
+ * it comes in
+ */
+static int dump(const char *archive, const char *host, const char *port) {
+	char line[1024];
+	int sd = connect_host(host, port);
+	if (sd < 0)
+		return 1;
+
+	snprintf(line, sizeof(line),
+	         "GET /snapshot HTTP/1.1\r\n"
+	         "Host: %s\r\n"
+	         "User-Agent: Quantica Backup\r\n"
+	         "Connection: close\r\n\r\n", host);
+	if (!write_all(sd, line, strlen(line))) {
+		fprintf(stderr, "error: failed to send request\n");
+		close(sd);
+		return 1;
+	}
+
+	struct reader rd = {.fd = sd, .pos = 0, .len = 0};
+	rd.buffer = (char *)malloc(IO_BUFFER_SIZE);
+	if (!rd.buffer) {
+		close(sd);
+		return 1;
+	}
+
+	bool chunked = FALSE;
+	unsigned int status = 0;
+	if (!read_line(&rd, line, sizeof(line)) || sscanf(line, "HTTP/%*s %u", &status) != 1)
+		goto error;
+
+	while (read_line(&rd, line, sizeof(line)) && line[0] != '\0') {
+		if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked"))
+			chunked = TRUE;
+	}
+
+	if (status != 200 || !chunked) {
+		size_t avail;
+		fprintf(stderr, "error: server responded with code %u\n", status);
+		while ((avail = fill(&rd))) {
+			fwrite(rd.buffer + rd.pos, 1, avail, stderr);
+			rd.pos += avail;
+		}
+		fprintf(stderr, "\n");
+		goto error;
+	}
+
+	int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "error: cannot create %s\n", archive);
+		goto error;
+	}
+
+	unsigned long long total = 0;
+	for (;;) {
+		if (!read_line(&rd, line, sizeof(line)))
+			goto incomplete;
+
+		size_t len = strtoul(line, NULL, 16);
+		if (!len)
+			break;
+
+		/* Pass the chunk on straight from the receive buffer */
+		while (len > 0) {
+			size_t avail = fill(&rd);
+			if (!avail)
+				goto incomplete;
+			if (avail > len)
+				avail = len;
+
+			if (!write_all(fd, rd.buffer + rd.pos, avail)) {
+				fprintf(stderr, "error: failed to write %s\n", archive);
+				goto incomplete;
+			}
+			rd.pos += avail;
+			len -= avail;
+			total += avail;
+		}
+
+		if (!read_line(&rd, line, sizeof(line)))
+			goto incomplete;
+	}
+
+	if (fsync(fd) < 0) {
+		fprintf(stderr, "error: failed to write %s\n", archive);
+		goto incomplete;
+	}
+
+	close(fd);
+	close(sd);
+	free(rd.buffer);
+	printf("%llu bytes written to %s\n", total, archive);
+	return 0;
+
+incomplete:
+	fprintf(stderr, "error: archive incomplete\n");
+	close(fd);
+	unlink(archive);
+error:
+	close(sd);
+	free(rd.buffer);
+	return 1;
+}
+
+/* Entry names are plain file names */
+static bool valid_name(const char *name) {
+	if (name[0] == '\0' || name[0] == '.')
+		return FALSE;
+	return !strchr(name, '/');
+}
+
+/*
+ * Copy the entry data into the file. Data is written in large sequential
+ * runs straight from the read buffer, blocks of zeros are skipped so page
+ * regions that were released stay sparse.
+ */
+static bool restore_file(struct reader *rd, int fd, uint64_t size, uint64_t *crc_sum) {
+	if (ftruncate(fd, size) < 0)
+		return FALSE;
+
+	static const char zero[BLOCK_SIZE];
+	uint64_t offset = 0;
+	while (offset < size) {
+		size_t avail = fill(rd);
+		if (!avail)
+			return FALSE;
+		if (avail > size - offset)
+			avail = size - offset;
+
+		const char *data = rd->buffer + rd->pos;
+		*crc_sum = crc64(*crc_sum, (void *)data, avail);
+
+		size_t run = 0, pos = 0;
+		while (pos < avail) {
+			size_t count = avail - pos < BLOCK_SIZE ? avail - pos : BLOCK_SIZE;
+			bool hole = count == BLOCK_SIZE && !memcmp(data + pos, zero, BLOCK_SIZE);
+			if (!hole) {
+				pos += count;
+				continue;
+			}
+
+			if (pos > run && pwrite(fd, data + run, pos - run, offset + run) != (ssize_t)(pos - run))
+				return FALSE;
+			pos += count;
+			run = pos;
+		}
+		if (pos > run && pwrite(fd, data + run, pos - run, offset + run) != (ssize_t)(pos - run))
+			return FALSE;
+
+		rd->pos += avail;
+		offset += avail;
+	}
+
+	return fsync(fd) == 0;
+}
+
+static int restore(const char *archive, const char *directory) {
+	struct reader rd = {.pos = 0, .len = 0};
+	rd.fd = open(archive, O_RDONLY);
+	if (rd.fd < 0) {
+		fprintf(stderr, "error: cannot open %s\n", archive);
+		return 1;
+	}
+
+	rd.buffer = (char *)malloc(IO_BUFFER_SIZE);
+	if (!rd.buffer) {
+		close(rd.fd);
+		return 1;
+	}
+
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "error: cannot create %s\n", directory);
+		goto error;
+	}
+
+	int dirfd = open(directory, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		fprintf(stderr, "error: cannot open %s\n", directory);
+		goto error;
+	}
+
+	struct _backup head;
+	if (!read_exact(&rd, &head, sizeof(struct _backup)) || strncmp((char *)head.magic, BACKUP_MAGIC, MAGIC_LENGTH)) {
+		fprintf(stderr, "error: %s is not a backup archive\n", archive);
+		goto error_dir;
+	}
+	if (from_be16(head.version) != BACKUP_VERSION) {
+		fprintf(stderr, "error: unsupported archive version %u\n", from_be16(head.version));
+		goto error_dir;
+	}
+
+	unsigned int files = 0;
+	unsigned long long total = 0;
+	for (;;) {
+		struct _backup_entry entry;
+		if (!read_exact(&rd, &entry, sizeof(struct _backup_entry))) {
+			fprintf(stderr, "error: archive incomplete\n");
+			goto error_dir;
+		}
+
+		uint64_t crc_sum = 0;
+		__be64 archive_crc_sum;
+		uint64_t size = from_be64(entry.size);
+		entry.name[BACKUP_NAME_LENGTH - 1] = '\0';
+		if (entry.type == BACKUP_END) {
+			if (!read_exact(&rd, &archive_crc_sum, sizeof(__be64))) {
+				fprintf(stderr, "error: archive incomplete\n");
+				goto error_dir;
+			}
+			break;
+		}
+
+		if (!valid_name(entry.name)) {
+			fprintf(stderr, "error: invalid entry in archive\n");
+			goto error_dir;
+		}
+
+		/* Never overwrite an existing database */
+		int fd = openat(dirfd, entry.name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "error: cannot create %s/%s\n", directory, entry.name);
+			goto error_dir;
+		}
+
+		if (!restore_file(&rd, fd, size, &crc_sum)) {
+			fprintf(stderr, "error: failed to restore %s\n", entry.name);
+			close(fd);
+			goto error_dir;
+		}
+		close(fd);
+
+		if (!read_exact(&rd, &archive_crc_sum, sizeof(__be64)) || from_be64(archive_crc_sum) != crc_sum) {
+			fprintf(stderr, "error: checksum mismatch on %s\n", entry.name);
+			goto error_dir;
+		}
+
+		files++;
+		total += size;
+	}
+
+	fsync(dirfd);
+	close(dirfd);
+	close(rd.fd);
+	free(rd.buffer);
+	printf("%u files, %llu bytes restored to %s\n", files, total, directory);
+	return 0;
+
+error_dir:
+	close(dirfd);
+error:
+	close(rd.fd);
+	free(rd.buffer);
+	return 1;
+}
+
+int main(int argc, const char *argv[]) {
+	char port[8];
+	snprintf(port, sizeof(port), "%d", API_PORT);
+
+	if (argc >= 3 && !strcmp(argv[1], "dump"))
+		return dump(argv[2], argc > 3 ? argv[3] : DEF_HOST, argc > 4 ? argv[4] : port);
+	if (argc == 4 && !strcmp(argv[1], "restore"))
+		return restore(argv[2], argv[3]);
+
+	usage(argv[0]);
+	return 1;
+}